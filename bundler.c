@@ -0,0 +1,339 @@
+#include "http_bundle.h"
+#include "utils.h"
+#include <ftw.h>
+#include <zlib.h>
+
+/*
+    Packs a directory into C source for the embedded asset bundle,
+    see http_bundle.c. Used by "make bundle":
+
+        ./bundler www > http_bundle_data.c
+
+    Every regular file below the directory becomes an entry with
+    its route ("/www/index.html"), a precomputed header with
+    Content-Type, Content-Length and ETag, and a gzip variant if
+    the file is text and compresses well. Entries are placed with
+    hash and displace so a lookup is two hashes and one compare.
+*/
+
+#define BUNDLER_MAX_FILES 4096
+#define BUNDLER_GZIP_MIN 256 // smaller files are not worth compressing
+
+struct bundler_file
+{
+    char path[PATH_MAX];
+    char* data;
+    size_t length;
+    char* gzip;
+    size_t gzip_length;
+    char type[64];
+    char etag[24];
+};
+
+static struct bundler_file files[BUNDLER_MAX_FILES];
+static int filecount = 0;
+
+
+/**************************************************************
+    Summery:
+
+    Compresses data into a gzip stream.
+
+    @PARAMS: file
+    @returns: 0 on success, -1 if not compressed.
+**************************************************************/
+static int bundler_gzip(struct bundler_file* file){
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // window bits 15 + 16 writes a gzip header instead of zlib
+    if(deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15+16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+
+    size_t bound = deflateBound(&stream, file->length);
+    file->gzip = malloc(bound);
+    if(file->gzip == NULL){
+        deflateEnd(&stream);
+        return -1;
+    }
+
+    stream.next_in = (unsigned char*)file->data;
+    stream.avail_in = file->length;
+    stream.next_out = (unsigned char*)file->gzip;
+    stream.avail_out = bound;
+
+    int ret = deflate(&stream, Z_FINISH);
+    file->gzip_length = stream.total_out;
+    deflateEnd(&stream);
+
+    // keep it only if it saves at least 10%
+    if(ret != Z_STREAM_END || file->gzip_length*10 >= file->length*9){
+        free(file->gzip);
+        file->gzip = NULL;
+        file->gzip_length = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Reads one file into the bundle, called by nftw.
+
+    @PARAMS: see nftw
+    @returns: 0 to continue, -1 to stop the walk.
+**************************************************************/
+static int bundler_add(const char* path, const struct stat* info, int flag, struct FTW* ftw){
+    (void)ftw;
+
+    if(flag != FTW_F || !S_ISREG(info->st_mode))
+        return 0;
+
+    if(filecount == BUNDLER_MAX_FILES){
+        fprintf(stderr, "[ERROR] Too many files, max is %d\n", BUNDLER_MAX_FILES);
+        return -1;
+    }
+
+    struct bundler_file* file = &files[filecount];
+    snprintf(file->path, sizeof(file->path), "/%s", path[0] == '.' && path[1] == '/' ? path+2 : path);
+
+    FILE* fp = fopen(path, "rb");
+    if(fp == NULL){
+        fprintf(stderr, "[ERROR] Could not open %s\n", path);
+        return -1;
+    }
+
+    file->length = info->st_size;
+    file->data = malloc(file->length+1);
+    if(file->data == NULL || fread(file->data, 1, file->length, fp) != file->length){
+        fprintf(stderr, "[ERROR] Could not read %s\n", path);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    char* extension = strrchr(path, '.');
+    char* slash = strrchr(path, '/');
+    char* type = find_content_type(extension != NULL && (slash == NULL || extension > slash) ? extension+1 : "");
+    snprintf(file->type, sizeof(file->type), "%s", type);
+
+    // 64 bit FNV-1a of the content
+    unsigned long long hash = 14695981039346656037ull;
+    for (size_t i = 0; i < file->length; ++i)
+    {
+        hash ^= (unsigned char)file->data[i];
+        hash *= 1099511628211ull;
+    }
+    snprintf(file->etag, sizeof(file->etag), "\"%016llx\"", hash);
+
+    if(strncmp(file->type, "text/", 5) == 0 && file->length >= BUNDLER_GZIP_MIN)
+        bundler_gzip(file);
+
+    filecount++;
+    return 0;
+}
+
+/**************************************************************
+    Orders buckets by number of paths, largest first
+**************************************************************/
+static int* bucket_sizes;
+static int bundler_compare(const void* a, const void* b){
+    return bucket_sizes[*(const int*)b] - bucket_sizes[*(const int*)a];
+}
+
+/**************************************************************
+    Summery:
+
+    Builds the perfect hash. Paths are grouped into buckets by
+    seed 0, then starting with the largest bucket each bucket
+    gets the first seed that moves all its paths to free slots.
+
+    @PARAMS: bucket count, slot count, displacements (out), slots (out)
+    @returns: 0 on success, -1 if no displacement was found.
+**************************************************************/
+static int bundler_index(unsigned int buckets, unsigned int slots, unsigned int* displacements, int* slot_files){
+
+    int* bucket_of = malloc(sizeof(int)*filecount);
+    int* order = malloc(sizeof(int)*buckets);
+    int* targets = malloc(sizeof(int)*filecount);
+    bucket_sizes = calloc(buckets, sizeof(int));
+
+    for (int i = 0; i < filecount; ++i)
+    {
+        bucket_of[i] = http_bundle_hash(files[i].path, strlen(files[i].path), 0) % buckets;
+        bucket_sizes[bucket_of[i]]++;
+    }
+    for (unsigned int b = 0; b < buckets; ++b)
+        order[b] = b;
+    qsort(order, buckets, sizeof(int), bundler_compare);
+
+    for (unsigned int s = 0; s < slots; ++s)
+        slot_files[s] = -1;
+
+    for (unsigned int o = 0; o < buckets; ++o)
+    {
+        int bucket = order[o];
+        if(bucket_sizes[bucket] == 0)
+            break;
+
+        unsigned int seed;
+        for (seed = 1; seed < 100000000; ++seed)
+        {
+            int placed = 0;
+            for (int i = 0; i < filecount; ++i)
+            {
+                if(bucket_of[i] != bucket)
+                    continue;
+                int slot = http_bundle_hash(files[i].path, strlen(files[i].path), seed) % slots;
+                int taken = slot_files[slot] != -1;
+                for (int j = 0; j < placed && !taken; ++j)
+                    taken = targets[j] == slot;
+                if(taken)
+                    break;
+                targets[placed++] = slot;
+            }
+            if(placed == bucket_sizes[bucket])
+                break;
+        }
+        if(seed == 100000000)
+            return -1;
+
+        displacements[bucket] = seed;
+        int placed = 0;
+        for (int i = 0; i < filecount; ++i)
+            if(bucket_of[i] == bucket)
+                slot_files[targets[placed++]] = i;
+    }
+
+    free(bucket_of);
+    free(order);
+    free(targets);
+    free(bucket_sizes);
+    return 0;
+}
+
+/**************************************************************
+    Writes a string as a C string literal
+**************************************************************/
+static void bundler_string(const char* string){
+    putchar('"');
+    for (; *string; ++string)
+    {
+        if(*string == '\n')
+            printf("\\n");
+        else if(*string == '"' || *string == '\\')
+            printf("\\%c", *string);
+        else
+            putchar(*string);
+    }
+    putchar('"');
+}
+
+/**************************************************************
+    Writes data as a C char array
+**************************************************************/
+static void bundler_array(const char* name, int index, const char* data, size_t length){
+    printf("static const char %s_%d[] = {", name, index);
+    for (size_t i = 0; i < length; ++i)
+        printf("%s%d,", i % 24 == 0 ? "\n    " : "", (signed char)data[i]);
+    printf("\n    0\n};\n\n");
+}
+
+int main(int argc, char* argv[]){
+
+    if(argc != 2){
+        fprintf(stderr, "Usage: %s <folder> > http_bundle_data.c\n", argv[0]);
+        return 1;
+    }
+
+    char root[PATH_MAX];
+    char* folder = argv[1];
+    if(strncmp(folder, "./", 2) == 0)
+        folder += 2;
+    snprintf(root, sizeof(root), "/%s", folder);
+    while(strlen(root) > 1 && root[strlen(root)-1] == '/')
+        root[strlen(root)-1] = 0;
+
+    if(nftw(root+1, bundler_add, 16, FTW_PHYS) != 0){
+        fprintf(stderr, "[ERROR] Could not bundle %s\n", argv[1]);
+        return 1;
+    }
+
+    // about four paths per bucket, a quarter of the slots stay empty. The low bits
+    // of FNV-1a only depend on the low bits of the seed, an odd count uses all of them
+    unsigned int buckets = filecount/4+1;
+    unsigned int slots = (filecount+filecount/4+1) | 1;
+    unsigned int* displacements = calloc(buckets, sizeof(unsigned int));
+    int* slot_files = malloc(sizeof(int)*slots);
+
+    if(bundler_index(buckets, slots, displacements, slot_files) < 0){
+        fprintf(stderr, "[ERROR] Could not build path index\n");
+        return 1;
+    }
+
+    printf("/* Generated by bundler from %s, do not edit. */\n", root+1);
+    printf("#include \"http_bundle.h\"\n\n");
+
+    for (int i = 0; i < filecount; ++i)
+    {
+        bundler_array("http_bundle_body", i, files[i].data, files[i].length);
+        if(files[i].gzip != NULL)
+            bundler_array("http_bundle_gzip", i, files[i].gzip, files[i].gzip_length);
+    }
+
+    printf("static const unsigned int http_bundle_displacements[] = {");
+    for (unsigned int b = 0; b < buckets; ++b)
+        printf("%s%u,", b % 12 == 0 ? "\n    " : "", displacements[b]);
+    printf("\n};\n\n");
+
+    printf("static const struct http_bundle_entry http_bundle_entries[] = {\n");
+    for (unsigned int s = 0; s < slots; ++s)
+    {
+        if(slot_files[s] == -1){
+            printf("    { 0 },\n");
+            continue;
+        }
+
+        int i = slot_files[s];
+        struct bundler_file* file = &files[i];
+        // strong validators differ between content codings, RFC 7232
+        char gzip_etag[32];
+        snprintf(gzip_etag, sizeof(gzip_etag), "%.*s-gz\"", (int)strlen(file->etag)-1, file->etag);
+        // clients may get either variant, so both vary on Accept-Encoding
+        const char* vary = file->gzip != NULL ? "Vary: Accept-Encoding\n" : "";
+        char header[256];
+        snprintf(header, sizeof(header), "Content-Type: %s\nContent-Length: %zu\nETag: %s\n%s", file->type, file->length, file->etag, vary);
+
+        printf("    { ");
+        bundler_string(file->path);
+        printf(", %zu,\n      ", strlen(file->path));
+        bundler_string(header);
+        printf(", %zu, http_bundle_body_%d, %zu,\n      ", strlen(header), i, file->length);
+
+        if(file->gzip != NULL){
+            snprintf(header, sizeof(header), "Content-Type: %s\nContent-Encoding: gzip\nContent-Length: %zu\nETag: %s\n%s", file->type, file->gzip_length, gzip_etag, vary);
+            bundler_string(header);
+            printf(", %zu, http_bundle_gzip_%d, %zu, ", strlen(header), i, file->gzip_length);
+            bundler_string(gzip_etag);
+            printf(",\n      ");
+        } else {
+            printf("NULL, 0, NULL, 0, NULL,\n      ");
+        }
+        bundler_string(file->etag);
+        printf(" },\n");
+    }
+    printf("};\n\n");
+
+    printf("const struct http_bundle http_bundle_data = {\n");
+    printf("    ");
+    bundler_string(root);
+    printf(", %u, %u,\n", buckets, slots);
+    printf("    http_bundle_displacements,\n");
+    printf("    http_bundle_entries,\n");
+    printf("    %d\n", filecount);
+    printf("};\n");
+
+    fprintf(stderr, "[BUNDLE] %s: %d files, %u buckets, %u slots\n", root, filecount, buckets, slots);
+    return 0;
+}
@@ -0,0 +1,534 @@
+#include "hpack.h"
+
+/*
+    HPACK: Header Compression for HTTP/2
+    https://datatracker.ietf.org/doc/html/rfc7541
+
+    The decoder handles indexed fields, all literal forms, dynamic
+    table size updates and Huffman coded strings. The encoder emits
+    indexed fields where the static or dynamic table has a match and
+    plain (non Huffman) literals otherwise.
+*/
+
+static const char* hpack_static_table[HPACK_STATIC_ENTRIES][2] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"},
+    {":path", "/index.html"}, {":scheme", "http"}, {":scheme", "https"}, {":status", "200"},
+    {":status", "204"}, {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""}, {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""}, {"access-control-allow-origin", ""},
+    {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""},
+    {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""},
+    {"from", ""}, {"host", ""}, {"if-match", ""}, {"if-modified-since", ""},
+    {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""},
+    {"link", ""}, {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""},
+    {"retry-after", ""}, {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""},
+    {"www-authenticate", ""}
+};
+
+/*
+    Huffman code lengths of symbols 0-255 and EOS (Appendix B).
+    The code is canonical, codes are assigned in order of length
+    and symbol, so the lengths are enough to decode.
+*/
+static const unsigned char hpack_huffman_length[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+static int hpack_huffman_ready = 0;
+static unsigned int hpack_first_code[31]; // first code of each length
+static int hpack_first_symbol[31]; // index into hpack_symbols of that code
+static int hpack_length_count[31];
+static unsigned short hpack_symbols[257]; // symbols sorted by code
+
+
+/**************************************************************
+    Builds the canonical decoding tables
+**************************************************************/
+static void hpack_huffman_init(){
+
+    int position = 0;
+    unsigned int code = 0;
+
+    for (int length = 1; length <= 30; ++length)
+    {
+        hpack_first_code[length] = code;
+        hpack_first_symbol[length] = position;
+        hpack_length_count[length] = 0;
+
+        for (int symbol = 0; symbol < 257; ++symbol)
+        {
+            if(hpack_huffman_length[symbol] == length){
+                hpack_symbols[position] = symbol;
+                position++;
+                hpack_length_count[length]++;
+            }
+        }
+        code = (code+hpack_length_count[length]) << 1;
+    }
+    hpack_huffman_ready = 1;
+}
+
+/**************************************************************
+    Summery:
+
+    Decodes a Huffman coded string.
+
+    @PARAMS: input, input length, output, output size
+    @returns: decoded length, -1 on error.
+**************************************************************/
+static int hpack_huffman_decode(const unsigned char* in, size_t length, char* out, size_t out_size){
+
+    if(!hpack_huffman_ready)
+        hpack_huffman_init();
+
+    size_t written = 0;
+    unsigned int code = 0;
+    int code_length = 0;
+
+    for (size_t i = 0; i < length; ++i)
+    {
+        for (int bit = 7; bit >= 0; --bit)
+        {
+            code = (code << 1) | ((in[i] >> bit) & 1);
+            code_length++;
+
+            if(code_length > 30)
+                return -1;
+
+            unsigned int offset = code-hpack_first_code[code_length];
+            if(code >= hpack_first_code[code_length] && offset < (unsigned int)hpack_length_count[code_length]){
+                int symbol = hpack_symbols[hpack_first_symbol[code_length]+offset];
+                if(symbol == 256 || written == out_size)
+                    return -1;
+                out[written] = symbol;
+                written++;
+                code = 0;
+                code_length = 0;
+            }
+        }
+    }
+
+    // padding must be a prefix of EOS, all ones and shorter than a byte
+    if(code_length > 7 || code != (1u << code_length)-1)
+        return -1;
+
+    return written;
+}
+
+/**************************************************************
+    Summery:
+
+    Decodes an integer with an N bit prefix (RFC 7541 5.1).
+
+    @PARAMS: position, end of input, prefix bits, result
+    @returns: bytes consumed, -1 on error.
+**************************************************************/
+static int hpack_decode_integer(const unsigned char* in, const unsigned char* end, int prefix, size_t* value){
+
+    if(in >= end)
+        return -1;
+
+    size_t max = (1 << prefix)-1;
+    *value = in[0] & max;
+    if(*value < max)
+        return 1;
+
+    int consumed = 1;
+    int shift = 0;
+    while(1){
+        if(in+consumed >= end || shift > 28)
+            return -1;
+        unsigned char b = in[consumed];
+        consumed++;
+        *value += (size_t)(b & 0x7f) << shift;
+        shift += 7;
+        if((b & 0x80) == 0)
+            return consumed;
+    }
+}
+
+/**************************************************************
+    Summery:
+
+    Decodes a string literal into scratch memory, zero terminated.
+
+    @PARAMS: position, end of input, result, result length, scratch cursor, scratch end
+    @returns: bytes consumed, -1 on error.
+**************************************************************/
+static int hpack_decode_string(const unsigned char* in, const unsigned char* end, char** result, size_t* result_length, char** scratch, char* scratch_end){
+
+    size_t length;
+    int consumed = hpack_decode_integer(in, end, 7, &length);
+    if(consumed < 0 || length > (size_t)(end-in-consumed))
+        return -1;
+
+    int huffman = in[0] & 0x80;
+    size_t room = scratch_end-*scratch;
+    if(room == 0)
+        return -1;
+
+    if(huffman){
+        int decoded = hpack_huffman_decode(in+consumed, length, *scratch, room-1);
+        if(decoded < 0)
+            return -1;
+        *result_length = decoded;
+    } else {
+        if(length >= room)
+            return -1;
+        memcpy(*scratch, in+consumed, length);
+        *result_length = length;
+    }
+
+    *result = *scratch;
+    (*scratch)[*result_length] = 0;
+    *scratch += *result_length+1;
+
+    return consumed+length;
+}
+
+/**************************************************************
+    Creates a dynamic table with given maximum size
+**************************************************************/
+void hpack_table_init(struct hpack_table* table, size_t max_size){
+    memset(table, 0, sizeof(struct hpack_table));
+    table->max_size = max_size;
+    table->capacity = max_size/32+1;
+    table->entries = calloc(table->capacity, sizeof(struct hpack_entry));
+}
+
+/**************************************************************
+    Removes the oldest entry of the dynamic table
+**************************************************************/
+static void hpack_table_evict(struct hpack_table* table){
+    struct hpack_entry* entry = &table->entries[table->first];
+    table->size -= entry->name_length+entry->value_length+32;
+    free(entry->name);
+    table->first = (table->first+1)%table->capacity;
+    table->count--;
+}
+
+/**************************************************************
+    Frees all entries of the dynamic table
+**************************************************************/
+void hpack_table_free(struct hpack_table* table){
+    while(table->count > 0)
+        hpack_table_evict(table);
+    free(table->entries);
+    table->entries = NULL;
+}
+
+/**************************************************************
+    Changes maximum size, evicting entries that no longer fit
+**************************************************************/
+void hpack_table_resize(struct hpack_table* table, size_t max_size){
+
+    while(table->count > 0 && table->size > max_size)
+        hpack_table_evict(table);
+
+    // the ring can hold at most max_size/32 entries
+    int capacity = max_size/32+1;
+    if(capacity > table->capacity){
+        struct hpack_entry* entries = calloc(capacity, sizeof(struct hpack_entry));
+        for (int i = 0; i < table->count; ++i)
+            entries[i] = table->entries[(table->first+i)%table->capacity];
+        free(table->entries);
+        table->entries = entries;
+        table->capacity = capacity;
+        table->first = 0;
+    }
+    table->max_size = max_size;
+}
+
+/**************************************************************
+    Summery:
+
+    Adds an entry to the dynamic table, evicting old entries.
+    Name and value share one allocation.
+
+    @PARAMS: table, name, name length, value, value length
+    @returns: void
+**************************************************************/
+static void hpack_table_add(struct hpack_table* table, const char* name, size_t name_length, const char* value, size_t value_length){
+
+    size_t size = name_length+value_length+32;
+
+    while(table->count > 0 && table->size+size > table->max_size)
+        hpack_table_evict(table);
+
+    // an entry larger than the table empties it
+    if(size > table->max_size)
+        return;
+
+    struct hpack_entry* entry = &table->entries[(table->first+table->count)%table->capacity];
+    entry->name = malloc(name_length+value_length+2);
+    entry->value = entry->name+name_length+1;
+    memcpy(entry->name, name, name_length);
+    entry->name[name_length] = 0;
+    memcpy(entry->value, value, value_length);
+    entry->value[value_length] = 0;
+    entry->name_length = name_length;
+    entry->value_length = value_length;
+
+    table->count++;
+    table->size += size;
+}
+
+/**************************************************************
+    Summery:
+
+    Looks up an index of the combined static and dynamic table.
+
+    @PARAMS: table, index, name result, value result
+    @returns: 0 on success, -1 if index is invalid.
+**************************************************************/
+static int hpack_lookup(struct hpack_table* table, size_t index, const char** name, size_t* name_length, const char** value, size_t* value_length){
+
+    if(index == 0)
+        return -1;
+
+    if(index <= HPACK_STATIC_ENTRIES){
+        *name = hpack_static_table[index-1][0];
+        *value = hpack_static_table[index-1][1];
+        *name_length = strlen(*name);
+        *value_length = strlen(*value);
+        return 0;
+    }
+
+    index -= HPACK_STATIC_ENTRIES;
+    if(index > (size_t)table->count)
+        return -1;
+
+    struct hpack_entry* entry = &table->entries[(table->first+table->count-index)%table->capacity];
+    *name = entry->name;
+    *value = entry->value;
+    *name_length = entry->name_length;
+    *value_length = entry->value_length;
+    return 0;
+}
+
+/**************************************************************
+    Copies a string into scratch memory, zero terminated
+**************************************************************/
+static char* hpack_scratch_copy(const char* string, size_t length, char** scratch, char* scratch_end){
+    if((size_t)(scratch_end-*scratch) < length+1)
+        return NULL;
+    char* copy = *scratch;
+    memcpy(copy, string, length);
+    copy[length] = 0;
+    *scratch += length+1;
+    return copy;
+}
+
+/**************************************************************
+    Summery:
+
+    Decodes a header block. Names and values are written zero
+    terminated into scratch memory, which must outlive headers.
+
+    @PARAMS: dynamic table, header block, block length, headers result,
+             max headers, scratch memory, scratch size
+    @returns: number of headers, -1 on a compression error.
+**************************************************************/
+int hpack_decode(struct hpack_table* table, const unsigned char* block, size_t length, struct hpack_header* headers, int max_headers, char* scratch, size_t scratch_size){
+
+    const unsigned char* in = block;
+    const unsigned char* end = block+length;
+    char* scratch_end = scratch+scratch_size;
+    int total = 0;
+
+    while(in < end){
+
+        size_t index;
+        int consumed;
+
+        // dynamic table size update
+        if((in[0] & 0xe0) == 0x20){
+            consumed = hpack_decode_integer(in, end, 5, &index);
+            if(consumed < 0 || index > HPACK_TABLE_SIZE)
+                return -1;
+            hpack_table_resize(table, index);
+            in += consumed;
+            continue;
+        }
+
+        if(total == max_headers)
+            return -1;
+        struct hpack_header* header = &headers[total];
+
+        const char* name;
+        const char* value;
+        size_t name_length, value_length;
+
+        // indexed header field
+        if(in[0] & 0x80){
+            consumed = hpack_decode_integer(in, end, 7, &index);
+            if(consumed < 0 || hpack_lookup(table, index, &name, &name_length, &value, &value_length) < 0)
+                return -1;
+            in += consumed;
+
+            header->name = hpack_scratch_copy(name, name_length, &scratch, scratch_end);
+            header->value = hpack_scratch_copy(value, value_length, &scratch, scratch_end);
+            if(header->name == NULL || header->value == NULL)
+                return -1;
+            header->name_length = name_length;
+            header->value_length = value_length;
+            total++;
+            continue;
+        }
+
+        // literal header field, with incremental indexing (6 bit prefix) or without (4 bit prefix)
+        int indexing = (in[0] & 0xc0) == 0x40;
+        consumed = hpack_decode_integer(in, end, indexing ? 6 : 4, &index);
+        if(consumed < 0)
+            return -1;
+        in += consumed;
+
+        if(index > 0){
+            if(hpack_lookup(table, index, &name, &name_length, &value, &value_length) < 0)
+                return -1;
+            header->name = hpack_scratch_copy(name, name_length, &scratch, scratch_end);
+            if(header->name == NULL)
+                return -1;
+            header->name_length = name_length;
+        } else {
+            consumed = hpack_decode_string(in, end, &header->name, &header->name_length, &scratch, scratch_end);
+            if(consumed < 0)
+                return -1;
+            in += consumed;
+        }
+
+        consumed = hpack_decode_string(in, end, &header->value, &header->value_length, &scratch, scratch_end);
+        if(consumed < 0)
+            return -1;
+        in += consumed;
+
+        if(indexing)
+            hpack_table_add(table, header->name, header->name_length, header->value, header->value_length);
+        total++;
+    }
+
+    return total;
+}
+
+/**************************************************************
+    Summery:
+
+    Encodes an integer with an N bit prefix, keeping the flag
+    bits already set in the first byte.
+
+    @PARAMS: output, value, prefix bits, flag bits of first byte
+    @returns: bytes written.
+**************************************************************/
+static int hpack_encode_integer(unsigned char* out, size_t value, int prefix, unsigned char flags){
+
+    size_t max = (1 << prefix)-1;
+    if(value < max){
+        out[0] = flags | value;
+        return 1;
+    }
+
+    out[0] = flags | max;
+    value -= max;
+    int written = 1;
+    while(value >= 128){
+        out[written] = (value & 0x7f) | 0x80;
+        value >>= 7;
+        written++;
+    }
+    out[written] = value;
+    return written+1;
+}
+
+/**************************************************************
+    Encodes a plain string literal
+**************************************************************/
+static int hpack_encode_string(unsigned char* out, const char* string, size_t length){
+    int written = hpack_encode_integer(out, length, 7, 0);
+    memcpy(out+written, string, length);
+    return written+length;
+}
+
+/**************************************************************
+    Summery:
+
+    Encodes one header field. Fields found in the static or
+    dynamic table are sent as an index, otherwise the name is
+    referenced if known and the value sent as a literal.
+    Output must have room for name and value plus 16 bytes.
+
+    @PARAMS: encoder table, output, name, name length, value, value length,
+             HPACK_INDEX, HPACK_NO_INDEX or HPACK_NEVER_INDEX
+    @returns: bytes written.
+**************************************************************/
+int hpack_encode_header(struct hpack_table* table, unsigned char* out, const char* name, size_t name_length, const char* value, size_t value_length, int mode){
+
+    size_t name_index = 0;
+
+    for (int i = 0; i < HPACK_STATIC_ENTRIES; ++i)
+    {
+        const char* static_name = hpack_static_table[i][0];
+        if(strlen(static_name) != name_length || memcmp(static_name, name, name_length) != 0)
+            continue;
+
+        if(name_index == 0)
+            name_index = i+1;
+        if(mode != HPACK_NEVER_INDEX && strlen(hpack_static_table[i][1]) == value_length && memcmp(hpack_static_table[i][1], value, value_length) == 0)
+            return hpack_encode_integer(out, i+1, 7, 0x80);
+    }
+
+    for (int i = 1; i <= table->count; ++i)
+    {
+        struct hpack_entry* entry = &table->entries[(table->first+table->count-i)%table->capacity];
+        if(entry->name_length != name_length || memcmp(entry->name, name, name_length) != 0)
+            continue;
+
+        if(name_index == 0)
+            name_index = HPACK_STATIC_ENTRIES+i;
+        if(mode != HPACK_NEVER_INDEX && entry->value_length == value_length && memcmp(entry->value, value, value_length) == 0)
+            return hpack_encode_integer(out, HPACK_STATIC_ENTRIES+i, 7, 0x80);
+    }
+
+    int written;
+    if(mode == HPACK_INDEX)
+        written = hpack_encode_integer(out, name_index, 6, 0x40);
+    else if(mode == HPACK_NEVER_INDEX)
+        written = hpack_encode_integer(out, name_index, 4, 0x10);
+    else
+        written = hpack_encode_integer(out, name_index, 4, 0x00);
+
+    if(name_index == 0)
+        written += hpack_encode_string(out+written, name, name_length);
+    written += hpack_encode_string(out+written, value, value_length);
+
+    if(mode == HPACK_INDEX)
+        hpack_table_add(table, name, name_length, value, value_length);
+
+    return written;
+}
+
+/**************************************************************
+    Encodes a dynamic table size update
+**************************************************************/
+int hpack_encode_table_size(unsigned char* out, size_t size){
+    return hpack_encode_integer(out, size, 5, 0x20);
+}
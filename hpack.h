@@ -0,0 +1,51 @@
+#ifndef __HPACK_H
+#define __HPACK_H
+
+#include "syshead.h"
+
+#define HPACK_TABLE_SIZE 4096 // default SETTINGS_HEADER_TABLE_SIZE
+#define HPACK_STATIC_ENTRIES 61
+
+#define HPACK_INDEX 0 // literal with incremental indexing
+#define HPACK_NO_INDEX 1 // literal without indexing
+#define HPACK_NEVER_INDEX 2 // literal never indexed, for sensitive values
+
+struct hpack_entry
+{
+	char* name;
+	char* value;
+	size_t name_length;
+	size_t value_length;
+};
+
+/*
+    Dynamic table, a ring of entries where the newest entry has
+    the lowest index. Size is counted as defined in RFC 7541 4.1.
+*/
+struct hpack_table
+{
+	struct hpack_entry* entries;
+	int capacity;
+	int first; // oldest entry
+	int count;
+	size_t size;
+	size_t max_size;
+};
+
+struct hpack_header
+{
+	char* name;
+	char* value;
+	size_t name_length;
+	size_t value_length;
+};
+
+void hpack_table_init(struct hpack_table* table, size_t max_size);
+void hpack_table_free(struct hpack_table* table);
+void hpack_table_resize(struct hpack_table* table, size_t max_size);
+
+int hpack_decode(struct hpack_table* table, const unsigned char* block, size_t length, struct hpack_header* headers, int max_headers, char* scratch, size_t scratch_size);
+int hpack_encode_header(struct hpack_table* table, unsigned char* out, const char* name, size_t name_length, const char* value, size_t value_length, int mode);
+int hpack_encode_table_size(unsigned char* out, size_t size);
+
+#endif
@@ -0,0 +1,1058 @@
+#include "http_server.h"
+
+/*
+    Cleartext HTTP/2 (h2c)
+    https://datatracker.ietf.org/doc/html/rfc9113
+
+    Connections start HTTP/2 with prior knowledge (the client preface)
+    or by upgrading an HTTP/1.1 request with "Upgrade: h2c".
+
+    Every stream is turned into an HTTP/1.1 request and handed to the
+    regular parser and route handlers. Their output is captured instead
+    of sent, then translated into a HEADERS frame and a body that is
+    sent as DATA frames. File bodies stay file segments, so DATA frames
+    of a file are still sent with sendfile(). Streams with pending
+    bodies are served round robin, one frame each, within the flow
+    control windows of the client.
+*/
+
+#define HTTP2_INTERNAL_ERROR 0x2
+#define HTTP2_CANCEL 0x8
+
+// settings identifiers
+#define HTTP2_SETTINGS_HEADER_TABLE_SIZE 0x1
+#define HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define HTTP2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define HTTP2_SETTINGS_MAX_FRAME_SIZE 0x5
+
+
+/**************************************************************
+    Summery:
+
+    Queues a frame on the connection.
+
+    @PARAMS: connection, type, flags, stream id, payload, payload length
+    @returns: void
+**************************************************************/
+static void http2_queue_frame(struct http_conn* conn, int type, int flags, unsigned int stream, const void* payload, size_t length){
+
+    unsigned char frame[9];
+    frame[0] = (length >> 16) & 0xff;
+    frame[1] = (length >> 8) & 0xff;
+    frame[2] = length & 0xff;
+    frame[3] = type;
+    frame[4] = flags;
+    frame[5] = (stream >> 24) & 0x7f;
+    frame[6] = (stream >> 16) & 0xff;
+    frame[7] = (stream >> 8) & 0xff;
+    frame[8] = stream & 0xff;
+
+    http_conn_queue_buffer(conn, (char*)frame, 9);
+    if(length > 0)
+        http_conn_queue_buffer(conn, payload, length);
+}
+
+/**************************************************************
+    Reads a 32 bit big endian value
+**************************************************************/
+static unsigned int http2_read32(const unsigned char* in){
+    return ((unsigned int)in[0] << 24) | (in[1] << 16) | (in[2] << 8) | in[3];
+}
+
+/**************************************************************
+    Writes a 32 bit big endian value
+**************************************************************/
+static void http2_write32(unsigned char* out, unsigned int value){
+    out[0] = (value >> 24) & 0xff;
+    out[1] = (value >> 16) & 0xff;
+    out[2] = (value >> 8) & 0xff;
+    out[3] = value & 0xff;
+}
+
+/**************************************************************
+    Sends GOAWAY and closes the connection once it is flushed
+**************************************************************/
+static void http2_goaway(struct http_conn* conn, unsigned int error){
+    unsigned char payload[8];
+    http2_write32(payload, conn->h2->last_stream);
+    http2_write32(payload+4, error);
+    http2_queue_frame(conn, HTTP2_GOAWAY, 0, 0, payload, 8);
+    conn->h2->goaway = 1;
+    conn->closing = 1;
+
+    if(error != HTTP2_NO_ERROR)
+        printf(KRED "%s %u\n" KWHT, "[ERROR] HTTP/2 connection error", error);
+}
+
+/**************************************************************
+    Sends RST_STREAM for given stream
+**************************************************************/
+static void http2_rst_stream(struct http_conn* conn, unsigned int stream, unsigned int error){
+    unsigned char payload[4];
+    http2_write32(payload, error);
+    http2_queue_frame(conn, HTTP2_RST_STREAM, 0, stream, payload, 4);
+}
+
+/**************************************************************
+    Sends WINDOW_UPDATE for given stream, 0 for the connection
+**************************************************************/
+static void http2_window_update(struct http_conn* conn, unsigned int stream, unsigned int increment){
+    unsigned char payload[4];
+    http2_write32(payload, increment & 0x7fffffff);
+    http2_queue_frame(conn, HTTP2_WINDOW_UPDATE, 0, stream, payload, 4);
+}
+
+/**************************************************************
+    Returns stream with given id, NULL if not open
+**************************************************************/
+static struct http2_stream* http2_find_stream(struct http2_session* session, unsigned int id){
+    for (struct http2_stream* stream = session->streams; stream != NULL; stream = stream->next)
+    {
+        if(stream->id == id)
+            return stream;
+    }
+    return NULL;
+}
+
+/**************************************************************
+    Opens a new stream
+**************************************************************/
+static struct http2_stream* http2_new_stream(struct http2_session* session, unsigned int id){
+
+    struct http2_stream* stream = calloc(1, sizeof(struct http2_stream));
+    stream->id = id;
+    stream->send_window = session->initial_window;
+
+    stream->next = session->streams;
+    session->streams = stream;
+    session->open_streams++;
+
+    if(id > session->last_stream)
+        session->last_stream = id;
+
+    return stream;
+}
+
+/**************************************************************
+    Closes a stream and frees its request and unsent body
+**************************************************************/
+static void http2_free_stream(struct http_conn* conn, struct http2_stream* stream){
+
+    struct http2_session* session = conn->h2;
+    struct http2_stream** link = &session->streams;
+    while(*link != NULL && *link != stream)
+        link = &(*link)->next;
+    if(*link != NULL)
+        *link = stream->next;
+
+    session->open_streams--;
+    http_segments_free(stream->body);
+    free(stream->request);
+    free(stream);
+
+    // client asked to stop, close once the remaining streams are done
+    if(session->goaway && session->open_streams == 0)
+        conn->closing = 1;
+}
+
+/**************************************************************
+    Summery:
+
+    Appends bytes to the request text of a stream.
+
+    @PARAMS: stream, data, length
+    @returns: 0 on success, -1 if request is too large.
+**************************************************************/
+static int http2_append(struct http2_stream* stream, const char* data, size_t length){
+
+    if(stream->request_length+length > HTTP_MAX_REQUEST_SIZE)
+        return -1;
+
+    // keep room for the terminating zero byte
+    if(stream->request_length+length+1 > stream->request_capacity){
+        size_t capacity = stream->request_capacity == 0 ? 1024 : stream->request_capacity;
+        while(capacity < stream->request_length+length+1)
+            capacity *= 2;
+        stream->request = realloc(stream->request, capacity);
+        stream->request_capacity = capacity;
+    }
+
+    memcpy(stream->request+stream->request_length, data, length);
+    stream->request_length += length;
+    stream->request[stream->request_length] = 0;
+    return 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Appends a header line with an HTTP/1.1 style name, the parser
+    matches names such as "Content-Type:" case sensitive.
+
+    @PARAMS: stream, lower case name, value
+    @returns: 0 on success, -1 if request is too large.
+**************************************************************/
+static int http2_append_header(struct http2_stream* stream, const char* name, size_t name_length, const char* value, size_t value_length){
+
+    char canonical[name_length+1];
+    for (size_t i = 0; i < name_length; ++i)
+    {
+        char c = name[i];
+        if((i == 0 || name[i-1] == '-') && c >= 'a' && c <= 'z')
+            c -= 32;
+        canonical[i] = c;
+    }
+
+    if(http2_append(stream, canonical, name_length) < 0 || http2_append(stream, ": ", 2) < 0)
+        return -1;
+    if(http2_append(stream, value, value_length) < 0 || http2_append(stream, "\r\n", 2) < 0)
+        return -1;
+    return 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Builds the HTTP/1.1 request line and header of a stream from
+    the decoded header list. Cookie fields, which HTTP/2 may send
+    one per cookie, are joined into one header.
+
+    @PARAMS: stream, headers, number of headers
+    @returns: 0 on success, -1 on a malformed request.
+**************************************************************/
+static int http2_build_request(struct http2_stream* stream, struct hpack_header* headers, int total){
+
+    struct hpack_header* method = NULL;
+    struct hpack_header* path = NULL;
+    struct hpack_header* authority = NULL;
+
+    for (int i = 0; i < total; ++i)
+    {
+        if(strcmp(headers[i].name, ":method") == 0)
+            method = &headers[i];
+        else if(strcmp(headers[i].name, ":path") == 0)
+            path = &headers[i];
+        else if(strcmp(headers[i].name, ":authority") == 0)
+            authority = &headers[i];
+    }
+
+    if(method == NULL || path == NULL)
+        return -1;
+
+    if(http2_append(stream, method->value, method->value_length) < 0 || http2_append(stream, " ", 1) < 0
+        || http2_append(stream, path->value, path->value_length) < 0 || http2_append(stream, " HTTP/1.1\r\n", 11) < 0)
+        return -1;
+
+    if(authority != NULL && http2_append_header(stream, "host", 4, authority->value, authority->value_length) < 0)
+        return -1;
+
+    int cookies = 0;
+    for (int i = 0; i < total; ++i)
+    {
+        struct hpack_header* header = &headers[i];
+        if(header->name[0] == ':' || (authority != NULL && strcmp(header->name, "host") == 0))
+            continue;
+
+        if(strcmp(header->name, "cookie") == 0){
+            if(cookies == 0 && http2_append(stream, "Cookie: ", 8) < 0)
+                return -1;
+            if(cookies > 0 && http2_append(stream, "; ", 2) < 0)
+                return -1;
+            if(http2_append(stream, header->value, header->value_length) < 0)
+                return -1;
+            cookies++;
+            continue;
+        }
+
+        if(http2_append_header(stream, header->name, header->name_length, header->value, header->value_length) < 0)
+            return -1;
+    }
+
+    if(cookies > 0 && http2_append(stream, "\r\n", 2) < 0)
+        return -1;
+
+    return http2_append(stream, "\r\n", 2);
+}
+
+/**************************************************************
+    Summery:
+
+    Returns the HPACK indexing mode for a response header. Values
+    that change with every response are not indexed.
+
+    @PARAMS: lower case header name
+    @returns: HPACK_INDEX, HPACK_NO_INDEX or HPACK_NEVER_INDEX
+**************************************************************/
+static int http2_index_mode(const char* name){
+    if(strcmp(name, "set-cookie") == 0)
+        return HPACK_NEVER_INDEX;
+    if(strcmp(name, "content-length") == 0 || strcmp(name, "location") == 0 || strcmp(name, "date") == 0 || strcmp(name, "retry-after") == 0 || strcmp(name, "etag") == 0)
+        return HPACK_NO_INDEX;
+    return HPACK_INDEX;
+}
+
+/**************************************************************
+    Summery:
+
+    Sends a response header block as HEADERS and, if larger than
+    the client frame size, CONTINUATION frames.
+
+    @PARAMS: connection, stream id, header block, length, end of stream
+    @returns: void
+**************************************************************/
+static void http2_queue_headers(struct http_conn* conn, unsigned int stream, unsigned char* block, size_t length, int end_stream){
+
+    size_t max = conn->h2->max_frame;
+    size_t offset = 0;
+    int type = HTTP2_HEADERS;
+
+    do {
+        size_t part = length-offset > max ? max : length-offset;
+        int flags = 0;
+        if(type == HTTP2_HEADERS && end_stream)
+            flags |= HTTP2_END_STREAM;
+        if(offset+part == length)
+            flags |= HTTP2_END_HEADERS;
+
+        http2_queue_frame(conn, type, flags, stream, block+offset, part);
+        offset += part;
+        type = HTTP2_CONTINUATION;
+    } while(offset < length);
+}
+
+/**************************************************************
+    Summery:
+
+    Translates a captured HTTP/1.1 response into a header block
+    and DATA body for the stream. The header is sent right away,
+    the body is left on the stream for http2_send_data.
+
+    @PARAMS: connection, stream, captured segments
+    @returns: void
+**************************************************************/
+static void http2_respond(struct http_conn* conn, struct http2_stream* stream, struct http_segment* segments){
+
+    struct http2_session* session = conn->h2;
+
+    // collect leading buffer segments until the end of the response header
+    size_t text_length = 0;
+    size_t header_end = 0;
+    for (struct http_segment* segment = segments; segment != NULL && segment->type == HTTP_SEGMENT_BUFFER; segment = segment->next)
+        text_length += segment->length-segment->offset;
+
+    char* text = malloc(text_length+1);
+    size_t position = 0;
+    for (struct http_segment* segment = segments; segment != NULL && segment->type == HTTP_SEGMENT_BUFFER; segment = segment->next)
+    {
+        memcpy(text+position, segment->data+segment->offset, segment->length-segment->offset);
+        position += segment->length-segment->offset;
+    }
+    text[text_length] = 0;
+
+    for (size_t i = 0; i+1 < text_length; ++i)
+    {
+        if(text[i] == '\n' && text[i+1] == '\n'){
+            header_end = i+2;
+            break;
+        }
+        if(text[i] == '\n' && text[i+1] == '\r' && i+2 < text_length && text[i+2] == '\n'){
+            header_end = i+3;
+            break;
+        }
+    }
+
+    if(header_end == 0 || strncmp(text, "HTTP/1.", 7) != 0 || text_length < 12){
+        // handler did not respond
+        free(text);
+        http_segments_free(segments);
+        http2_rst_stream(conn, stream->id, HTTP2_INTERNAL_ERROR);
+        http2_free_stream(conn, stream);
+        return;
+    }
+
+    // body starts after the header, inside the buffer segments or at the first file
+    struct http_segment* body = NULL;
+    struct http_segment** body_tail = &body;
+    size_t skipped = 0;
+    struct http_segment* segment = segments;
+    while(segment != NULL){
+        struct http_segment* next = segment->next;
+        segment->next = NULL;
+
+        if(segment->type == HTTP_SEGMENT_BUFFER && skipped < header_end){
+            size_t available = segment->length-segment->offset;
+            size_t skip = header_end-skipped < available ? header_end-skipped : available;
+            segment->offset += skip;
+            skipped += skip;
+        }
+
+        if(segment->type == HTTP_SEGMENT_BUFFER && segment->offset == segment->length){
+            http_segments_free(segment);
+        } else {
+            *body_tail = segment;
+            body_tail = &segment->next;
+        }
+        segment = next;
+    }
+
+    // header block, status first
+    unsigned char* block = malloc(header_end*2+64);
+    size_t block_length = 0;
+
+    if(session->encoder_update){
+        block_length += hpack_encode_table_size(block, session->encoder_limit);
+        session->encoder_update = 0;
+    }
+    block_length += hpack_encode_header(&session->encoder, block+block_length, ":status", 7, text+9, 3, HPACK_INDEX);
+
+    char* line = strchr(text, '\n')+1;
+    while(line < text+header_end){
+        char* line_end = strchr(line, '\n');
+        size_t length = line_end-line;
+        if(length > 0 && line[length-1] == '\r')
+            length--;
+        if(length == 0)
+            break;
+
+        char* colon = memchr(line, ':', length);
+        if(colon != NULL){
+            size_t name_length = colon-line;
+            for (size_t i = 0; i < name_length; ++i)
+            {
+                if(line[i] >= 'A' && line[i] <= 'Z')
+                    line[i] += 32;
+            }
+            char* value = colon+1;
+            while(value < line+length && *value == ' ')
+                value++;
+            *colon = 0;
+
+            // connection specific headers are not allowed in HTTP/2
+            if(strcmp(line, "connection") != 0 && strcmp(line, "keep-alive") != 0 && strcmp(line, "transfer-encoding") != 0
+                && strcmp(line, "upgrade") != 0 && strcmp(line, "proxy-connection") != 0)
+                block_length += hpack_encode_header(&session->encoder, block+block_length, line, name_length, value, line+length-value, http2_index_mode(line));
+        }
+        line = line_end+1;
+    }
+
+    http2_queue_headers(conn, stream->id, block, block_length, body == NULL);
+    free(block);
+    free(text);
+
+    stream->responded = 1;
+    stream->body = body;
+    if(body == NULL)
+        http2_free_stream(conn, stream);
+}
+
+/**************************************************************
+    Summery:
+
+    Runs the request of a stream through the parser and route
+    handlers. Output is captured and translated by http2_respond.
+    Proxy routes are not served over HTTP/2, they are answered with
+    421 so the client retries them over HTTP/1.1.
+
+    @PARAMS: connection, stream
+    @returns: void
+**************************************************************/
+static void http2_dispatch(struct http_conn* conn, struct http2_stream* stream){
+
+    conn->requests++;
+
+    if(http_proxy_match(stream->request) != NULL){
+        unsigned char block[16];
+        int length = hpack_encode_header(&conn->h2->encoder, block, ":status", 7, "421", 3, HPACK_INDEX);
+        http2_queue_headers(conn, stream->id, block, length, 1);
+        http2_free_stream(conn, stream);
+        return;
+    }
+
+    struct http_conn capture;
+    memset(&capture, 0, sizeof(capture));
+    capture.fd = conn->fd;
+    capture.kind = HTTP_CONN_CLIENT;
+    capture.port = conn->port;
+    memcpy(capture.addr, conn->addr, 16);
+    capture.traced = conn->traced;
+
+    http_conn_set_capture(&capture);
+
+    int retry_after = http_admit_request(conn->addr);
+    if(retry_after > 0)
+        http_503(conn->fd, retry_after);
+    else
+        http_handle_request(&capture, stream->request);
+
+    http_conn_set_capture(NULL);
+    http_current = conn;
+
+    http2_respond(conn, stream, http_conn_detach(&capture));
+}
+
+/**************************************************************
+    Summery:
+
+    Sends one DATA frame of the stream body, as large as the
+    flow control windows and the client frame size allow.
+
+    @PARAMS: connection, stream
+    @returns: 1 if the stream is finished, else 0.
+**************************************************************/
+static int http2_send_frame(struct http_conn* conn, struct http2_stream* stream){
+
+    struct http2_session* session = conn->h2;
+    struct http_segment* segment = stream->body;
+
+    long length = session->max_frame;
+    if(length > stream->send_window)
+        length = stream->send_window;
+    if(length > session->send_window)
+        length = session->send_window;
+
+    long available = segment->type != HTTP_SEGMENT_FILE ? (long)(segment->length-segment->offset) : (long)segment->length;
+    if(length > available)
+        length = available;
+
+    int last = length == available && segment->next == NULL;
+
+    unsigned char frame[9];
+    frame[0] = (length >> 16) & 0xff;
+    frame[1] = (length >> 8) & 0xff;
+    frame[2] = length & 0xff;
+    frame[3] = HTTP2_DATA;
+    frame[4] = last ? HTTP2_END_STREAM : 0;
+    http2_write32(frame+5, stream->id);
+    http_conn_queue_buffer(conn, (char*)frame, 9);
+
+    if(segment->type == HTTP_SEGMENT_STATIC){
+        http_conn_queue_static(conn, segment->data+segment->offset, length);
+        segment->offset += length;
+    } else if(segment->type != HTTP_SEGMENT_FILE){
+        http_conn_queue_buffer(conn, segment->data+segment->offset, length);
+        segment->offset += length;
+    } else {
+        // read ahead once for the whole body, frames inherit the watermark
+        http_files_prefetch(segment);
+
+        // each frame gets its own descriptor, the queue closes it once sent
+        if(http_conn_queue_file(conn, dup(segment->fd), segment->file_offset, length) > 0)
+            conn->out_tail->prefetched = segment->prefetched;
+        segment->file_offset += length;
+        segment->length -= length;
+    }
+
+    stream->send_window -= length;
+    session->send_window -= length;
+
+    if(length == available){
+        stream->body = segment->next;
+        segment->next = NULL;
+        http_segments_free(segment);
+    }
+
+    if(last){
+        http2_free_stream(conn, stream);
+        return 1;
+    }
+    return 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Sends DATA frames of all streams with a pending body, one
+    frame per stream in turn, until the connection window is
+    used up or the output queue reaches the high-water mark.
+
+    @PARAMS: connection
+    @returns: number of frames queued.
+**************************************************************/
+int http2_send_data(struct http_conn* conn){
+
+    struct http2_session* session = conn->h2;
+    int frames = 0;
+    int progress = 1;
+
+    while(progress && session->send_window > 0 && conn->out_queued < http_get_highwater()){
+        progress = 0;
+
+        struct http2_stream* stream = session->streams;
+        while(stream != NULL && session->send_window > 0){
+            struct http2_stream* next = stream->next;
+            if(stream->responded && stream->body != NULL && stream->send_window > 0){
+                http2_send_frame(conn, stream);
+                frames++;
+                progress = 1;
+            }
+            stream = next;
+        }
+    }
+    return frames;
+}
+
+/**************************************************************
+    Summery:
+
+    Applies a SETTINGS payload of the client.
+
+    @PARAMS: connection, payload, payload length
+    @returns: 0 on success, -1 on a connection error.
+**************************************************************/
+static int http2_apply_settings(struct http_conn* conn, const unsigned char* payload, size_t length){
+
+    struct http2_session* session = conn->h2;
+
+    for (size_t i = 0; i+6 <= length; i += 6)
+    {
+        int id = (payload[i] << 8) | payload[i+1];
+        unsigned int value = http2_read32(payload+i+2);
+
+        if(id == HTTP2_SETTINGS_HEADER_TABLE_SIZE){
+            session->encoder_limit = value < HPACK_TABLE_SIZE ? value : HPACK_TABLE_SIZE;
+            hpack_table_resize(&session->encoder, session->encoder_limit);
+            session->encoder_update = 1;
+        } else if(id == HTTP2_SETTINGS_INITIAL_WINDOW_SIZE){
+            if(value > 0x7fffffff)
+                return -1;
+            long delta = (long)value-session->initial_window;
+            for (struct http2_stream* stream = session->streams; stream != NULL; stream = stream->next)
+                stream->send_window += delta;
+            session->initial_window = value;
+        } else if(id == HTTP2_SETTINGS_MAX_FRAME_SIZE){
+            if(value < 16384 || value > 16777215)
+                return -1;
+            session->max_frame = value;
+        }
+    }
+    return 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Handles a complete header block. New streams are opened and
+    dispatched once the request has no body, trailers of open
+    streams are ignored. The block is always decoded to keep the
+    HPACK state in sync, even for refused streams.
+
+    @PARAMS: connection
+    @returns: 0 on success, -1 on a connection error.
+**************************************************************/
+static int http2_headers_complete(struct http_conn* conn){
+
+    struct http2_session* session = conn->h2;
+    unsigned int id = session->block_stream;
+    session->block_stream = 0;
+
+    struct hpack_header headers[HTTP2_MAX_HEADERS];
+    char* scratch = malloc(HTTP2_SCRATCH_SIZE);
+    int total = hpack_decode(&session->decoder, session->block, session->block_length, headers, HTTP2_MAX_HEADERS, scratch, HTTP2_SCRATCH_SIZE);
+    session->block_length = 0;
+
+    if(total < 0){
+        free(scratch);
+        http2_goaway(conn, HTTP2_COMPRESSION_ERROR);
+        return -1;
+    }
+
+    struct http2_stream* stream = http2_find_stream(session, id);
+    if(stream != NULL){
+        // trailers
+        free(scratch);
+        if(session->block_end_stream && !stream->request_done){
+            stream->request_done = 1;
+            http2_dispatch(conn, stream);
+        }
+        return 0;
+    }
+
+    if(id <= session->last_stream || (id & 1) == 0){
+        free(scratch);
+        http2_goaway(conn, HTTP2_PROTOCOL_ERROR);
+        return -1;
+    }
+
+    if(session->open_streams >= HTTP2_MAX_STREAMS || session->goaway){
+        free(scratch);
+        session->last_stream = id;
+        http2_rst_stream(conn, id, HTTP2_REFUSED_STREAM);
+        return 0;
+    }
+
+    stream = http2_new_stream(session, id);
+    if(http2_build_request(stream, headers, total) < 0){
+        free(scratch);
+        http2_rst_stream(conn, id, HTTP2_PROTOCOL_ERROR);
+        http2_free_stream(conn, stream);
+        return 0;
+    }
+    free(scratch);
+
+    if(session->block_end_stream){
+        stream->request_done = 1;
+        http2_dispatch(conn, stream);
+    }
+    return 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Appends a header block fragment, completing the block on
+    END_HEADERS.
+
+    @PARAMS: connection, fragment, fragment length, frame flags
+    @returns: 0 on success, -1 on a connection error.
+**************************************************************/
+static int http2_header_fragment(struct http_conn* conn, const unsigned char* fragment, size_t length, int flags){
+
+    struct http2_session* session = conn->h2;
+
+    if(session->block_length+length > HTTP2_SCRATCH_SIZE){
+        http2_goaway(conn, HTTP2_PROTOCOL_ERROR);
+        return -1;
+    }
+
+    session->block = realloc(session->block, session->block_length+length+1);
+    memcpy(session->block+session->block_length, fragment, length);
+    session->block_length += length;
+
+    if(flags & HTTP2_END_HEADERS)
+        return http2_headers_complete(conn);
+    return 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Handles one frame.
+
+    @PARAMS: connection, type, flags, stream id, payload, payload length
+    @returns: 0 on success, -1 on a connection error.
+**************************************************************/
+static int http2_frame(struct http_conn* conn, int type, int flags, unsigned int id, const unsigned char* payload, size_t length){
+
+    struct http2_session* session = conn->h2;
+
+    // a header block must not be interrupted
+    if(session->block_stream != 0 && (type != HTTP2_CONTINUATION || id != session->block_stream)){
+        http2_goaway(conn, HTTP2_PROTOCOL_ERROR);
+        return -1;
+    }
+
+    // flow control counts the whole payload, padding included
+    size_t received = length;
+
+    // strip padding
+    if((type == HTTP2_DATA || type == HTTP2_HEADERS) && (flags & HTTP2_PADDED)){
+        if(length < 1 || payload[0] >= length){
+            http2_goaway(conn, HTTP2_PROTOCOL_ERROR);
+            return -1;
+        }
+        length -= payload[0]+1;
+        payload++;
+    }
+
+    switch(type){
+
+        case HTTP2_SETTINGS: {
+            if(flags & HTTP2_ACK)
+                return 0;
+            if(id != 0 || length % 6 != 0 || http2_apply_settings(conn, payload, length) < 0){
+                http2_goaway(conn, HTTP2_PROTOCOL_ERROR);
+                return -1;
+            }
+            http2_queue_frame(conn, HTTP2_SETTINGS, HTTP2_ACK, 0, NULL, 0);
+            return 0;
+        }
+
+        case HTTP2_PING: {
+            if(length != 8){
+                http2_goaway(conn, HTTP2_FRAME_SIZE_ERROR);
+                return -1;
+            }
+            if(!(flags & HTTP2_ACK))
+                http2_queue_frame(conn, HTTP2_PING, HTTP2_ACK, 0, payload, 8);
+            return 0;
+        }
+
+        case HTTP2_WINDOW_UPDATE: {
+            if(length != 4){
+                http2_goaway(conn, HTTP2_FRAME_SIZE_ERROR);
+                return -1;
+            }
+            long increment = http2_read32(payload) & 0x7fffffff;
+            if(id == 0){
+                session->send_window += increment;
+                if(session->send_window > 0x7fffffff){
+                    http2_goaway(conn, HTTP2_FLOW_CONTROL_ERROR);
+                    return -1;
+                }
+            } else {
+                struct http2_stream* stream = http2_find_stream(session, id);
+                if(stream != NULL){
+                    stream->send_window += increment;
+                    if(stream->send_window > 0x7fffffff){
+                        http2_rst_stream(conn, id, HTTP2_FLOW_CONTROL_ERROR);
+                        http2_free_stream(conn, stream);
+                    }
+                }
+            }
+            return 0;
+        }
+
+        case HTTP2_HEADERS: {
+            if(id == 0){
+                http2_goaway(conn, HTTP2_PROTOCOL_ERROR);
+                return -1;
+            }
+            if(flags & HTTP2_PRIORITY_FLAG){
+                if(length < 5){
+                    http2_goaway(conn, HTTP2_PROTOCOL_ERROR);
+                    return -1;
+                }
+                payload += 5;
+                length -= 5;
+            }
+            session->block_stream = id;
+            session->block_end_stream = flags & HTTP2_END_STREAM;
+            return http2_header_fragment(conn, payload, length, flags);
+        }
+
+        case HTTP2_CONTINUATION: {
+            if(session->block_stream == 0){
+                http2_goaway(conn, HTTP2_PROTOCOL_ERROR);
+                return -1;
+            }
+            return http2_header_fragment(conn, payload, length, flags);
+        }
+
+        case HTTP2_DATA: {
+            // everything received is consumed right away, give the window back
+            if(received > 0)
+                http2_window_update(conn, 0, received);
+
+            struct http2_stream* stream = http2_find_stream(session, id);
+            if(stream == NULL || stream->request_done)
+                return 0;
+
+            if(http2_append(stream, (const char*)payload, length) < 0){
+                http2_rst_stream(conn, id, HTTP2_CANCEL);
+                http2_free_stream(conn, stream);
+                return 0;
+            }
+
+            if(flags & HTTP2_END_STREAM){
+                stream->request_done = 1;
+                http2_dispatch(conn, stream);
+            } else if(received > 0){
+                http2_window_update(conn, id, received);
+            }
+            return 0;
+        }
+
+        case HTTP2_RST_STREAM: {
+            struct http2_stream* stream = http2_find_stream(session, id);
+            if(stream != NULL)
+                http2_free_stream(conn, stream);
+            return 0;
+        }
+
+        case HTTP2_GOAWAY: {
+            session->goaway = 1;
+            if(session->open_streams == 0)
+                conn->closing = 1;
+            return 0;
+        }
+
+        case HTTP2_PUSH_PROMISE: {
+            http2_goaway(conn, HTTP2_PROTOCOL_ERROR);
+            return -1;
+        }
+
+        default:
+            // PRIORITY and unknown frame types are ignored
+            return 0;
+    }
+}
+
+/**************************************************************
+    Summery:
+
+    Checks if the connection buffer starts with the client preface.
+
+    @PARAMS: connection
+    @returns: 1 if it does, 0 if not, -1 if more bytes are needed.
+**************************************************************/
+int http2_is_preface(struct http_conn* conn){
+    size_t length = conn->in_length < HTTP2_PREFACE_LENGTH ? conn->in_length : HTTP2_PREFACE_LENGTH;
+    if(memcmp(conn->in, HTTP2_PREFACE, length) != 0)
+        return 0;
+    return length == HTTP2_PREFACE_LENGTH ? 1 : -1;
+}
+
+/**************************************************************
+    Summery:
+
+    Switches the connection to HTTP/2 and sends the server
+    preface, a SETTINGS frame.
+
+    @PARAMS: connection
+    @returns: 0 on success, -1 on error.
+**************************************************************/
+int http2_start(struct http_conn* conn){
+
+    struct http2_session* session = calloc(1, sizeof(struct http2_session));
+    if(session == NULL)
+        return -1;
+
+    session->preface_pending = 1;
+    hpack_table_init(&session->decoder, HPACK_TABLE_SIZE);
+    hpack_table_init(&session->encoder, HPACK_TABLE_SIZE);
+    session->encoder_limit = HPACK_TABLE_SIZE;
+    session->send_window = HTTP2_DEFAULT_WINDOW;
+    session->initial_window = HTTP2_DEFAULT_WINDOW;
+    session->max_frame = HTTP2_MAX_FRAME_SIZE;
+    conn->h2 = session;
+
+    // frames are small and interleaved, they must not wait for acknowledgements
+    int nodelay = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    unsigned char settings[6];
+    settings[0] = 0;
+    settings[1] = HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    http2_write32(settings+2, HTTP2_MAX_STREAMS);
+    http2_queue_frame(conn, HTTP2_SETTINGS, 0, 0, settings, 6);
+
+    if(debug)
+        printf(KMAG "%s FD: %d\n" KWHT, "[DEBUG] Connection switched to HTTP/2", conn->fd);
+    return 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Upgrades the connection if the request at the start of the
+    buffer carries "Upgrade: h2c" and HTTP2-Settings. The request
+    becomes stream 1 and is answered over HTTP/2.
+
+    @PARAMS: connection, length of request header
+    @returns: 1 if upgraded, else 0.
+**************************************************************/
+int http2_upgrade(struct http_conn* conn, long header_length){
+
+    char* end = conn->in+header_length-2;
+    *end = 0;
+
+    char* upgrade = strcasestr(conn->in, "\nUpgrade:");
+    char* settings = strcasestr(conn->in, "\nHTTP2-Settings:");
+    int h2c = upgrade != NULL && settings != NULL && strncasecmp(upgrade+9+strspn(upgrade+9, " "), "h2c", 3) == 0;
+
+    unsigned char payload[256];
+    int payload_length = -1;
+    if(h2c){
+        char* value = settings+16+strspn(settings+16, " ");
+        size_t value_length = strcspn(value, "\r\n");
+        if(value_length*3/4 < sizeof(payload))
+            payload_length = base64_decode(value, value_length, payload);
+    }
+    *end = '\r';
+
+    if(!h2c || payload_length < 0 || payload_length % 6 != 0)
+        return 0;
+
+    char* switching = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    http_conn_queue_buffer(conn, switching, strlen(switching));
+
+    if(http2_start(conn) < 0){
+        conn->closing = 1;
+        return 1;
+    }
+    http2_apply_settings(conn, payload, payload_length);
+
+    struct http2_stream* stream = http2_new_stream(conn->h2, 1);
+    http2_append(stream, conn->in, header_length);
+    stream->request_done = 1;
+
+    conn->in_length -= header_length;
+    memmove(conn->in, conn->in+header_length, conn->in_length);
+
+    http2_dispatch(conn, stream);
+    http2_process(conn);
+    return 1;
+}
+
+/**************************************************************
+    Summery:
+
+    Handles all complete frames buffered on the connection, then
+    sends as much response data as flow control allows.
+
+    @PARAMS: connection
+    @returns: void
+**************************************************************/
+void http2_process(struct http_conn* conn){
+
+    struct http2_session* session = conn->h2;
+
+    if(session->preface_pending){
+        int preface = http2_is_preface(conn);
+        if(preface < 0)
+            return;
+        if(preface == 0){
+            http2_goaway(conn, HTTP2_PROTOCOL_ERROR);
+            return;
+        }
+        conn->in_length -= HTTP2_PREFACE_LENGTH;
+        memmove(conn->in, conn->in+HTTP2_PREFACE_LENGTH, conn->in_length);
+        session->preface_pending = 0;
+    }
+
+    size_t offset = 0;
+    while(!conn->closing && conn->in_length-offset >= 9){
+
+        unsigned char* frame = (unsigned char*)conn->in+offset;
+        size_t length = (frame[0] << 16) | (frame[1] << 8) | frame[2];
+        unsigned int id = http2_read32(frame+5) & 0x7fffffff;
+
+        if(length > HTTP2_MAX_FRAME_SIZE){
+            http2_goaway(conn, HTTP2_FRAME_SIZE_ERROR);
+            break;
+        }
+        if(conn->in_length-offset < 9+length)
+            break;
+
+        if(http2_frame(conn, frame[3], frame[4], id, frame+9, length) < 0)
+            break;
+        offset += 9+length;
+    }
+
+    conn->in_length -= offset;
+    memmove(conn->in, conn->in+offset, conn->in_length);
+
+    http2_send_data(conn);
+    conn->reading_paused = conn->out_queued >= http_get_highwater();
+}
+
+/**************************************************************
+    Frees the HTTP/2 state of a connection
+**************************************************************/
+void http2_free(struct http_conn* conn){
+
+    struct http2_session* session = conn->h2;
+    while(session->streams != NULL){
+        struct http2_stream* stream = session->streams;
+        session->streams = stream->next;
+        http_segments_free(stream->body);
+        free(stream->request);
+        free(stream);
+    }
+
+    hpack_table_free(&session->decoder);
+    hpack_table_free(&session->encoder);
+    free(session->block);
+    free(session);
+    conn->h2 = NULL;
+}
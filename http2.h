@@ -0,0 +1,95 @@
+#ifndef __HTTP2_H
+#define __HTTP2_H
+
+#include "syshead.h"
+#include "http_conn.h"
+#include "hpack.h"
+
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_LENGTH 24
+
+#define HTTP2_MAX_STREAMS 100 // SETTINGS_MAX_CONCURRENT_STREAMS
+#define HTTP2_MAX_FRAME_SIZE 16384 // largest frame accepted, the protocol default
+#define HTTP2_DEFAULT_WINDOW 65535
+#define HTTP2_MAX_HEADERS 100 // header fields per request
+#define HTTP2_SCRATCH_SIZE (64*1024) // decoded header memory per request
+
+// frame types
+#define HTTP2_DATA 0x0
+#define HTTP2_HEADERS 0x1
+#define HTTP2_PRIORITY 0x2
+#define HTTP2_RST_STREAM 0x3
+#define HTTP2_SETTINGS 0x4
+#define HTTP2_PUSH_PROMISE 0x5
+#define HTTP2_PING 0x6
+#define HTTP2_GOAWAY 0x7
+#define HTTP2_WINDOW_UPDATE 0x8
+#define HTTP2_CONTINUATION 0x9
+
+// frame flags
+#define HTTP2_END_STREAM 0x1
+#define HTTP2_ACK 0x1
+#define HTTP2_END_HEADERS 0x4
+#define HTTP2_PADDED 0x8
+#define HTTP2_PRIORITY_FLAG 0x20
+
+// error codes
+#define HTTP2_NO_ERROR 0x0
+#define HTTP2_PROTOCOL_ERROR 0x1
+#define HTTP2_FLOW_CONTROL_ERROR 0x3
+#define HTTP2_FRAME_SIZE_ERROR 0x6
+#define HTTP2_REFUSED_STREAM 0x7
+#define HTTP2_COMPRESSION_ERROR 0x9
+
+struct http2_stream
+{
+	unsigned int id;
+
+	// request as HTTP/1.1 text, body appended as DATA arrives
+	char* request;
+	size_t request_length;
+	size_t request_capacity;
+	int request_done;
+
+	// response body still to send as DATA frames
+	struct http_segment* body;
+	int responded;
+	long send_window;
+
+	struct http2_stream* next;
+};
+
+struct http2_session
+{
+	int preface_pending; // client preface not received yet
+
+	struct hpack_table decoder;
+	struct hpack_table encoder;
+	size_t encoder_limit; // SETTINGS_HEADER_TABLE_SIZE of the client
+	int encoder_update; // table size update due in next header block
+
+	long send_window; // connection flow control window
+	long initial_window; // SETTINGS_INITIAL_WINDOW_SIZE of the client
+	unsigned int max_frame; // SETTINGS_MAX_FRAME_SIZE of the client
+
+	unsigned int last_stream;
+	int open_streams;
+	struct http2_stream* streams;
+
+	// header block spread over HEADERS and CONTINUATION frames
+	unsigned int block_stream;
+	int block_end_stream;
+	unsigned char* block;
+	size_t block_length;
+
+	int goaway;
+};
+
+int http2_is_preface(struct http_conn* conn);
+int http2_start(struct http_conn* conn);
+int http2_upgrade(struct http_conn* conn, long request_length);
+void http2_process(struct http_conn* conn);
+int http2_send_data(struct http_conn* conn);
+void http2_free(struct http_conn* conn);
+
+#endif
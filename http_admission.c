@@ -0,0 +1,303 @@
+#include "http_admission.h"
+#include "http_conn.h"
+#include "utils.h"
+
+/*
+    Admission control.
+
+    Connections are admitted against a global connection limit and
+    a per client IP connection limit, requests against a per client IP
+    token bucket. Client state lives in a fixed size open addressing
+    table with linear probing, entries are removed again by the
+    sweep once a client has no connections and a full bucket.
+
+    Everything over a limit is answered with 503 and Retry-After
+    before any handler runs.
+*/
+
+int http_backlog = HTTP_DEFAULT_BACKLOG;
+int http_max_connections = HTTP_DEFAULT_MAX_CONNECTIONS;
+
+int http_client_max_connections = 0; // 0 = unlimited
+float http_client_rate = 0; // tokens per second, 0 = unlimited
+float http_client_burst = 0;
+
+struct http_client_entry http_clients[HTTP_CLIENT_TABLE_SIZE];
+int http_client_entries = 0;
+
+long http_shed_counter = 0; // for stats
+
+
+/**************************************************************
+    Summery:
+
+    Sets the listen backlog used by http_start.
+
+    @PARAMS: backlog
+    @returns: void
+**************************************************************/
+void http_set_backlog(int backlog){
+    http_backlog = backlog;
+}
+
+int http_get_backlog(){
+    return http_backlog;
+}
+
+/**************************************************************
+    Summery:
+
+    Sets the maximum number of concurrently open connections.
+    Connections above the limit are answered with 503.
+
+    @PARAMS: connections, 0 for unlimited
+    @returns: void
+**************************************************************/
+void http_set_max_connections(int connections){
+    http_max_connections = connections;
+}
+
+/**************************************************************
+    Summery:
+
+    Sets the per client IP limits. A client may hold at most
+    connections open connections and send rate requests per second
+    with bursts of up to burst requests.
+
+    @PARAMS: connections, rate, burst. 0 disables a limit.
+    @returns: void
+**************************************************************/
+void http_set_client_limits(int connections, int rate, int burst){
+    http_client_max_connections = connections;
+    http_client_rate = rate;
+    http_client_burst = burst > 0 ? burst : rate;
+}
+
+/**************************************************************
+    Converts a socket address to a 16 byte table key
+**************************************************************/
+void http_addr_key(struct sockaddr* address, unsigned char key[16]){
+
+    memset(key, 0, 16);
+
+    if(address->sa_family == AF_INET6){
+        memcpy(key, &((struct sockaddr_in6*)address)->sin6_addr, 16);
+    } else if(address->sa_family == AF_INET){
+        key[10] = 0xff;
+        key[11] = 0xff;
+        memcpy(key+12, &((struct sockaddr_in*)address)->sin_addr, 4);
+    }
+}
+
+/**************************************************************
+    Monotonic clock in milliseconds
+**************************************************************/
+static unsigned int http_now_ms(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned int)(now.tv_sec*1000+now.tv_nsec/1000000);
+}
+
+/**************************************************************
+    FNV-1a hash of an address key
+**************************************************************/
+static unsigned int http_addr_hash(unsigned char addr[16]){
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < 16; ++i)
+    {
+        hash ^= addr[i];
+        hash *= 16777619u;
+    }
+    return hash & (HTTP_CLIENT_TABLE_SIZE-1);
+}
+
+/**************************************************************
+    Summery:
+
+    Looks up the entry of a client, optionally inserting it.
+
+    @PARAMS: address key, insert if missing
+    @returns: entry, NULL if not found or table is full.
+**************************************************************/
+static struct http_client_entry* http_client_lookup(unsigned char addr[16], int insert){
+
+    unsigned int slot = http_addr_hash(addr);
+
+    for (int i = 0; i < HTTP_CLIENT_TABLE_SIZE; ++i)
+    {
+        struct http_client_entry* entry = &http_clients[slot];
+
+        if(!entry->used){
+            if(!insert || http_client_entries >= HTTP_CLIENT_TABLE_SIZE*3/4)
+                return NULL;
+
+            memcpy(entry->addr, addr, 16);
+            entry->used = 1;
+            entry->connections = 0;
+            entry->tokens = http_client_burst;
+            entry->last = http_now_ms();
+            http_client_entries++;
+            return entry;
+        }
+
+        if(memcmp(entry->addr, addr, 16) == 0)
+            return entry;
+
+        slot = (slot+1) & (HTTP_CLIENT_TABLE_SIZE-1);
+    }
+    return NULL;
+}
+
+/**************************************************************
+    Summery:
+
+    Removes entry at slot, shifting back following entries of
+    the same probe sequence so lookups stay correct.
+
+    @PARAMS: slot
+    @returns: void
+**************************************************************/
+static void http_client_remove(unsigned int slot){
+
+    unsigned int mask = HTTP_CLIENT_TABLE_SIZE-1;
+    unsigned int next = (slot+1) & mask;
+
+    while(http_clients[next].used){
+        unsigned int home = http_addr_hash(http_clients[next].addr);
+        // move entry if its home slot is not within (slot, next]
+        if(((next-home) & mask) >= ((next-slot) & mask)){
+            http_clients[slot] = http_clients[next];
+            slot = next;
+        }
+        next = (next+1) & mask;
+    }
+
+    http_clients[slot].used = 0;
+    http_client_entries--;
+}
+
+/**************************************************************
+    Refills the token bucket of an entry
+**************************************************************/
+static void http_client_refill(struct http_client_entry* entry, unsigned int now){
+    entry->tokens += (now-entry->last)*http_client_rate/1000;
+    if(entry->tokens > http_client_burst)
+        entry->tokens = http_client_burst;
+    entry->last = now;
+}
+
+/**************************************************************
+    Summery:
+
+    Decides if a newly accepted connection may be served.
+    Admitted connections must be released with
+    http_release_connection when they close.
+
+    @PARAMS: client address key
+    @returns: 0 if admitted, else seconds for Retry-After.
+**************************************************************/
+int http_admit_connection(unsigned char addr[16]){
+
+    if(http_max_connections > 0 && http_conn_count() >= http_max_connections){
+        http_shed_counter++;
+        return 1;
+    }
+
+    if(http_client_max_connections == 0 && http_client_rate == 0)
+        return 0;
+
+    // fail open when the table is full
+    struct http_client_entry* entry = http_client_lookup(addr, 1);
+    if(entry == NULL)
+        return 0;
+
+    if(http_client_max_connections > 0 && entry->connections >= http_client_max_connections){
+        http_shed_counter++;
+        return 1;
+    }
+
+    entry->connections++;
+    return 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Takes a token from the client bucket for a request.
+
+    @PARAMS: client address key
+    @returns: 0 if admitted, else seconds for Retry-After.
+**************************************************************/
+int http_admit_request(unsigned char addr[16]){
+
+    if(http_client_rate == 0)
+        return 0;
+
+    struct http_client_entry* entry = http_client_lookup(addr, 1);
+    if(entry == NULL)
+        return 0;
+
+    http_client_refill(entry, http_now_ms());
+
+    if(entry->tokens < 1){
+        http_shed_counter++;
+        return (int)ceil((1-entry->tokens)/http_client_rate);
+    }
+
+    entry->tokens -= 1;
+    return 0;
+}
+
+/**************************************************************
+    Releases a connection admitted by http_admit_connection
+**************************************************************/
+void http_release_connection(unsigned char addr[16]){
+
+    if(http_client_max_connections == 0 && http_client_rate == 0)
+        return;
+
+    struct http_client_entry* entry = http_client_lookup(addr, 0);
+    if(entry != NULL && entry->connections > 0)
+        entry->connections--;
+}
+
+/**************************************************************
+    Summery:
+
+    Removes clients without connections whose bucket has been
+    refilled, they behave the same as a new entry. Called on
+    every turn of the event loop, scans the table once a second.
+
+    @PARAMS: void
+    @returns: void
+**************************************************************/
+void http_admission_sweep(){
+
+    static time_t last = 0;
+    if(http_client_entries == 0 || time(NULL) == last)
+        return;
+    last = time(NULL);
+
+    unsigned int now = http_now_ms();
+
+    for (unsigned int i = 0; i < HTTP_CLIENT_TABLE_SIZE; ++i)
+    {
+        struct http_client_entry* entry = &http_clients[i];
+        if(!entry->used || entry->connections > 0)
+            continue;
+
+        http_client_refill(entry, now);
+        if(entry->tokens >= http_client_burst){
+            http_client_remove(i);
+            // an entry may have been shifted into this slot
+            i--;
+        }
+    }
+}
+
+/**************************************************************
+    Returns the number of connections and requests answered with 503
+**************************************************************/
+long http_shed_count(){
+    return http_shed_counter;
+}
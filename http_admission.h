@@ -0,0 +1,36 @@
+#ifndef __HTTP_ADMISSION_H
+#define __HTTP_ADMISSION_H
+
+#include "syshead.h"
+
+#define HTTP_DEFAULT_BACKLOG 511
+#define HTTP_DEFAULT_MAX_CONNECTIONS 4096
+#define HTTP_ACCEPT_BATCH 256 // max connections accepted per loop iteration
+#define HTTP_CLIENT_TABLE_SIZE 4096 // must be a power of two
+
+/*
+    Per client IP state. Addresses are stored as 16 bytes,
+    IPv4 addresses in their IPv4-mapped IPv6 form.
+*/
+struct http_client_entry
+{
+	unsigned char addr[16];
+	unsigned int last; // ms timestamp of last refill
+	float tokens;
+	unsigned short connections;
+	unsigned char used;
+};
+
+void http_set_backlog(int backlog);
+int http_get_backlog();
+void http_set_max_connections(int connections);
+void http_set_client_limits(int connections, int rate, int burst);
+
+void http_addr_key(struct sockaddr* address, unsigned char key[16]);
+int http_admit_connection(unsigned char addr[16]);
+int http_admit_request(unsigned char addr[16]);
+void http_release_connection(unsigned char addr[16]);
+void http_admission_sweep();
+long http_shed_count();
+
+#endif
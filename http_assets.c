@@ -0,0 +1,246 @@
+#include "http_server.h"
+#include <ftw.h>
+#include <sys/mman.h>
+
+/*
+    Fingerprinted assets
+
+    Before workers are forked every file of the folders given to
+    http_set_assets is hashed, bundled files use the hash of their
+    ETag. The folders have to be served with http_addfolder. The
+    hash is put into the file name, so the URL changes whenever
+    the content does and can be cached forever.
+
+    Handlers and templates link to http_asset_url("/www/app.js"),
+    which returns "/www/app.3f9a1c2b.js". Folder requests for a
+    fingerprinted URL are served from the plain path with
+    HTTP_ASSET_IMMUTABLE, requests for the plain path get
+    HTTP_ASSET_REVALIDATE. Other files, and old fingerprints which
+    are not found, get no Cache-Control.
+
+    Fingerprints are taken once, like the bundle: restart the
+    server after changing files on disk. Hidden files and files
+    above HTTP_ASSET_MAX_SIZE are left out.
+*/
+
+static char* http_asset_folders[HTTP_ASSET_FOLDERS];
+static int http_asset_foldercount = 0;
+
+static struct http_asset http_assets[HTTP_ASSET_MAX];
+static int http_assetcount = 0;
+
+// open addressing, index+1 of the asset, 0 is an empty slot
+static unsigned short http_asset_paths[HTTP_ASSET_SLOTS];
+static unsigned short http_asset_urls[HTTP_ASSET_SLOTS];
+
+
+/**************************************************************
+    Summery:
+
+    Fingerprints the files of a folder at startup, such as
+    "/www". Must be called before http_start.
+
+    @PARAMS: folder also given to http_addfolder
+    @returns: number of asset folders, -1 on error.
+**************************************************************/
+int http_set_assets(char* folder){
+
+    if(http_asset_foldercount == HTTP_ASSET_FOLDERS)
+        return -1;
+
+    http_asset_folders[http_asset_foldercount++] = folder;
+    return http_asset_foldercount;
+}
+
+/**************************************************************
+    Summery:
+
+    Checks if path lies in one of the asset folders.
+
+    @PARAMS: path such as "/www/app.js"
+    @returns: 1 if it does, 0 otherwise.
+**************************************************************/
+static int http_asset_folder(const char* path){
+    for (int i = 0; i < http_asset_foldercount; ++i)
+    {
+        const char* folder = http_asset_folders[i];
+        size_t length = strlen(folder);
+        while(length > 0 && folder[length-1] == '/')
+            length--;
+        if(strncmp(path, folder, length) == 0 && (path[length] == '/' || length == 0))
+            return 1;
+    }
+    return 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Finds an asset in one of the indexes.
+
+    @PARAMS: index, path or url, 1 to compare urls
+    @returns: slot holding the asset or the empty slot to add it.
+**************************************************************/
+static unsigned int http_asset_slot(unsigned short* index, const char* key, int url){
+    unsigned int slot = http_bundle_hash(key, strlen(key), 0) & (HTTP_ASSET_SLOTS-1);
+    while(index[slot] != 0){
+        struct http_asset* asset = &http_assets[index[slot]-1];
+        if(strcmp(url ? asset->url : asset->path, key) == 0)
+            break;
+        slot = (slot+1) & (HTTP_ASSET_SLOTS-1);
+    }
+    return slot;
+}
+
+/**************************************************************
+    Summery:
+
+    Adds a file, the hash is inserted before the extension of
+    the file name.
+
+    @PARAMS: path as requested, hex digits of the content hash
+    @returns: VOID
+**************************************************************/
+static void http_asset_add(const char* path, const char* hash){
+
+    if(http_assetcount == HTTP_ASSET_MAX)
+        return;
+
+    unsigned int path_slot = http_asset_slot(http_asset_paths, path, 0);
+    if(http_asset_paths[path_slot] != 0)
+        return;
+
+    const char* name = strrchr(path, '/');
+    const char* extension = strrchr(name != NULL ? name : path, '.');
+    if(extension == NULL || extension == name+1)
+        extension = path+strlen(path);
+
+    size_t length = strlen(path)+HTTP_ASSET_HASH_LENGTH+2;
+    char* url = malloc(length);
+    snprintf(url, length, "%.*s.%.*s%s", (int)(extension-path), path, HTTP_ASSET_HASH_LENGTH, hash, extension);
+
+    struct http_asset* asset = &http_assets[http_assetcount++];
+    asset->path = strdup(path);
+    asset->url = url;
+    http_asset_paths[path_slot] = http_assetcount;
+    http_asset_urls[http_asset_slot(http_asset_urls, url, 1)] = http_assetcount;
+}
+
+/**************************************************************
+    Summery:
+
+    Hashes one file found in a folder, the same FNV-1a as the
+    ETags of bundler.c so both give a file the same URL.
+
+    @PARAMS: see nftw
+    @returns: FTW_SKIP_SUBTREE for hidden directories, FTW_CONTINUE otherwise.
+**************************************************************/
+static int http_asset_file(const char* file, const struct stat* info, int type, struct FTW* ftw){
+
+    if(ftw->level > 0 && file[ftw->base] == '.')
+        return type == FTW_D ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+    if(type != FTW_F || !S_ISREG(info->st_mode) || info->st_size > HTTP_ASSET_MAX_SIZE)
+        return FTW_CONTINUE;
+    if(http_assetcount == HTTP_ASSET_MAX)
+        return FTW_STOP;
+
+    int fd = open(file, O_RDONLY);
+    if(fd < 0)
+        return FTW_CONTINUE;
+
+    unsigned long long hash = 14695981039346656037ull;
+    if(info->st_size > 0){
+        unsigned char* data = mmap(NULL, info->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data == MAP_FAILED){
+            close(fd);
+            return FTW_CONTINUE;
+        }
+        for (off_t i = 0; i < info->st_size; ++i)
+        {
+            hash ^= data[i];
+            hash *= 1099511628211ull;
+        }
+        munmap(data, info->st_size);
+    }
+    close(fd);
+
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", hash);
+    // ./www/app.js is requested as /www/app.js
+    http_asset_add(file+1, hex);
+    return FTW_CONTINUE;
+}
+
+/**************************************************************
+    Fingerprints the asset folders, called by http_start
+**************************************************************/
+void http_assets_start(){
+
+    // bundled files are served instead of the disk, their ETag is the hash
+    const struct http_bundle* bundle = http_bundle_mounted;
+    for (unsigned int i = 0; bundle != NULL && i < bundle->slots; ++i)
+    {
+        if(bundle->entries[i].path != NULL && http_asset_folder(bundle->entries[i].path))
+            http_asset_add(bundle->entries[i].path, bundle->entries[i].etag+1);
+    }
+
+    for (int i = 0; i < http_asset_foldercount; ++i)
+    {
+        // "/www" is ./www, "/" is .
+        char folder[PATH_MAX];
+        snprintf(folder, sizeof(folder), ".%s%s", http_asset_folders[i][0] == '/' ? "" : "/", http_asset_folders[i]);
+        size_t length = strlen(folder);
+        while(length > 1 && folder[length-1] == '/')
+            folder[--length] = 0;
+        nftw(folder, http_asset_file, 16, FTW_PHYS | FTW_ACTIONRETVAL);
+    }
+
+    if(http_assetcount > 0)
+        printf(KBLU "[STARTUP] Fingerprinted %d assets.\n" KWHT, http_assetcount);
+    if(http_assetcount == HTTP_ASSET_MAX)
+        printf(KRED "[ERROR] More than %d assets, the rest is served without fingerprint.\n" KWHT, HTTP_ASSET_MAX);
+}
+
+/**************************************************************
+    Summery:
+
+    Returns the fingerprinted URL of a folder file, to be used
+    in links so clients can cache it forever.
+
+    @PARAMS: path such as "/www/app.js"
+    @returns: URL such as "/www/app.3f9a1c2b.js", path if unknown.
+**************************************************************/
+char* http_asset_url(char* path){
+    unsigned int slot = http_asset_slot(http_asset_paths, path, 0);
+    return http_asset_paths[slot] != 0 ? http_assets[http_asset_paths[slot]-1].url : path;
+}
+
+/**************************************************************
+    Summery:
+
+    Maps a folder request to the file it is served from.
+
+    @PARAMS: requested route
+    @returns: plain path of a fingerprinted URL, route otherwise.
+**************************************************************/
+char* http_asset_resolve(char* route){
+    if(http_assetcount == 0)
+        return route;
+    unsigned int slot = http_asset_slot(http_asset_urls, route, 1);
+    return http_asset_urls[slot] != 0 ? http_assets[http_asset_urls[slot]-1].path : route;
+}
+
+/**************************************************************
+    Summery:
+
+    Returns the Cache-Control header of a folder request, only
+    fingerprinted files are known to exist.
+
+    @PARAMS: requested route, route resolved by http_asset_resolve
+    @returns: header, NULL if the file is not an asset.
+**************************************************************/
+char* http_asset_cache(char* requested, char* route){
+    if(route != requested)
+        return HTTP_ASSET_IMMUTABLE;
+    return http_asset_url(route) != route ? HTTP_ASSET_REVALIDATE : NULL;
+}
@@ -0,0 +1,31 @@
+#ifndef __HTTP_ASSETS_H
+#define __HTTP_ASSETS_H
+
+#include "syshead.h"
+
+#define HTTP_ASSET_FOLDERS 8
+#define HTTP_ASSET_MAX 4096 // files fingerprinted at startup
+#define HTTP_ASSET_SLOTS (2*HTTP_ASSET_MAX) // power of 2
+#define HTTP_ASSET_MAX_SIZE (16*1024*1024) // larger files are only served by their path
+#define HTTP_ASSET_HASH_LENGTH 8 // hex digits in a fingerprinted URL
+
+#define HTTP_ASSET_IMMUTABLE "Cache-Control: public, max-age=31536000, immutable"
+#define HTTP_ASSET_REVALIDATE "Cache-Control: public, max-age=60"
+
+/*
+    One file of a folder, url is path with the content hash
+    before the extension: /www/app.js is /www/app.3f9a1c2b.js
+*/
+struct http_asset
+{
+	char* path;
+	char* url;
+};
+
+int http_set_assets(char* folder);
+void http_assets_start();
+char* http_asset_url(char* path);
+char* http_asset_resolve(char* route);
+char* http_asset_cache(char* requested, char* route);
+
+#endif
@@ -0,0 +1,160 @@
+#include "http_server.h"
+
+/*
+    Embedded asset bundle
+
+    "make bundle" packs a directory into http_bundle_data.c, which
+    is linked into the server. The bundle is a weak symbol, without
+    it the server serves folders from the filesystem as before.
+
+    Once a folder is mounted, requests below the bundle root are
+    answered from memory: the path is found through the perfect hash
+    index, the precomputed header is appended to the response header
+    and the body is queued as a static segment. No open, fstat or
+    read is needed and nothing is copied.
+*/
+
+extern const struct http_bundle http_bundle_data __attribute__((weak));
+
+const struct http_bundle* http_bundle_mounted = NULL;
+
+
+/**************************************************************
+    Summery:
+
+    Mounts the linked bundle if its root is served by folder,
+    using the same match as folder routes.
+
+    @PARAMS: folder given to http_addfolder
+    @returns: 1 if mounted, 0 if no bundle matches.
+**************************************************************/
+int http_bundle_mount(char* folder){
+
+    if(&http_bundle_data == NULL || strstr(http_bundle_data.root, folder) == NULL)
+        return 0;
+
+    http_bundle_mounted = &http_bundle_data;
+    printf(KBLU "[STARTUP] Mounted bundle %s, %u files.\n" KWHT, http_bundle_data.root, http_bundle_data.total);
+    return 1;
+}
+
+/**************************************************************
+    Summery:
+
+    Looks up a path in the mounted bundle.
+
+    @PARAMS: path, length of path
+    @returns: entry, NULL if path is not in the bundle.
+**************************************************************/
+const struct http_bundle_entry* http_bundle_find(const char* path, size_t length){
+
+    const struct http_bundle* bundle = http_bundle_mounted;
+    if(bundle == NULL || bundle->total == 0)
+        return NULL;
+
+    unsigned int bucket = http_bundle_hash(path, length, 0) % bundle->buckets;
+    unsigned int slot = http_bundle_hash(path, length, bundle->displacements[bucket]) % bundle->slots;
+
+    // paths outside the bundle hash to any slot, compare to be sure
+    const struct http_bundle_entry* entry = &bundle->entries[slot];
+    if(entry->path == NULL || entry->path_length != length || memcmp(entry->path, path, length) != 0)
+        return NULL;
+    return entry;
+}
+
+/**************************************************************
+    Summery:
+
+    Checks if an Accept-Encoding header allows gzip, "gzip;q=0"
+    refuses it, "*" accepts it unless gzip is listed.
+
+    @PARAMS: value of Accept-Encoding
+    @returns: 1 if gzip is acceptable, 0 otherwise.
+**************************************************************/
+static int http_bundle_accepts_gzip(const char* encoding){
+
+    int any = 0;
+    while(*encoding){
+        while(*encoding == ' ' || *encoding == ',')
+            encoding++;
+        const char* name = encoding;
+        size_t length = strcspn(name, ";, ");
+        const char* end = name+strcspn(name, ",");
+
+        double q = 1;
+        const char* weight = strstr(name, "q=");
+        if(weight != NULL && weight < end)
+            q = atof(weight+2);
+
+        if((length == 4 && strncmp(name, "gzip", 4) == 0) || (length == 6 && strncmp(name, "x-gzip", 6) == 0))
+            return q > 0;
+        if(length == 1 && *name == '*')
+            any = q > 0;
+        encoding = end;
+    }
+    return any;
+}
+
+/**************************************************************
+    Summery:
+
+    Answers a folder request from the bundle. Requests with a
+    matching If-None-Match get 304, clients accepting gzip get
+    the precompressed variant if there is one.
+
+    @PARAMS: connection, route, method, custom response header
+    @returns: 1 if answered, 0 if route is not below the bundle root.
+**************************************************************/
+int http_bundle_send(struct http_conn* conn, char* route, char* method, char* response_header){
+
+    const struct http_bundle* bundle = http_bundle_mounted;
+    if(bundle == NULL)
+        return 0;
+
+    size_t root_length = strlen(bundle->root);
+    if(strncmp(route, bundle->root, root_length) != 0 || route[root_length] != '/')
+        return 0;
+
+    const struct http_bundle_entry* entry = http_bundle_find(route, strlen(route));
+    if(entry == NULL){
+        http_404(conn->fd);
+        return 1;
+    }
+
+    char buff[128+strlen(response_header)+entry->gzip_header_length+entry->header_length];
+
+    const char* entry_header = entry->header;
+    unsigned int entry_header_length = entry->header_length;
+    const char* body = entry->body;
+    unsigned int length = entry->length;
+    const char* etag = entry->etag;
+
+    char* encoding = http_get_request_header("Accept-Encoding:");
+    if(entry->gzip != NULL && encoding != NULL && http_bundle_accepts_gzip(encoding)){
+        entry_header = entry->gzip_header;
+        entry_header_length = entry->gzip_header_length;
+        body = entry->gzip;
+        length = entry->gzip_length;
+        etag = entry->gzip_etag;
+    }
+
+    // only the validator of the variant this client gets matches
+    char* match = http_get_request_header("If-None-Match:");
+    if(match != NULL && strstr(match, etag) != NULL){
+        int header_length = sprintf(buff, "HTTP/1.1 304 Not Modified\n%sETag: %s\n%s\n", response_header, etag,
+            entry->gzip != NULL ? "Vary: Accept-Encoding\n" : "");
+        http_conn_queue_buffer(conn, buff, header_length);
+        return 1;
+    }
+
+    int header_length = sprintf(buff, "HTTP/1.1 200 OK\n%s", response_header);
+    memcpy(buff+header_length, entry_header, entry_header_length);
+    header_length += entry_header_length;
+    buff[header_length++] = '\n';
+
+    http_conn_queue_buffer(conn, buff, header_length);
+    if(strcmp(method, "HEAD") != 0)
+        http_conn_queue_static(conn, body, length);
+
+    return 1;
+}
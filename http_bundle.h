@@ -0,0 +1,63 @@
+#ifndef __HTTP_BUNDLE_H
+#define __HTTP_BUNDLE_H
+
+#include "syshead.h"
+#include "http_conn.h"
+
+/*
+    Asset bundle generated by "make bundle" (see bundler.c).
+    Entries are placed in slots of a perfect hash: a path hashes
+    to a bucket, the bucket displacement selects the slot.
+*/
+struct http_bundle_entry
+{
+	const char* path; // route, NULL for an empty slot
+	unsigned int path_length;
+
+	const char* header; // Content-Type, Content-Length and ETag lines
+	unsigned int header_length;
+	const char* body;
+	unsigned int length;
+
+	// gzip variant, NULL if not worth it
+	const char* gzip_header;
+	unsigned int gzip_header_length;
+	const char* gzip;
+	unsigned int gzip_length;
+	const char* gzip_etag; // quoted, each coding has its own validator
+
+	const char* etag; // quoted
+};
+
+struct http_bundle
+{
+	const char* root; // route prefix of all paths, such as "/www"
+	unsigned int buckets;
+	unsigned int slots;
+	const unsigned int* displacements;
+	const struct http_bundle_entry* entries;
+	unsigned int total;
+};
+
+/*
+    Seeded FNV-1a, shared by the server and bundler.c which builds
+    the index. Seed 0 selects the bucket, the bucket displacement
+    is the seed that selects the slot.
+*/
+static inline unsigned int http_bundle_hash(const char* data, size_t length, unsigned int seed){
+    unsigned int hash = 2166136261u ^ (seed * 16777619u);
+    for (size_t i = 0; i < length; ++i)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+extern const struct http_bundle* http_bundle_mounted;
+
+int http_bundle_mount(char* folder);
+const struct http_bundle_entry* http_bundle_find(const char* path, size_t length);
+int http_bundle_send(struct http_conn* conn, char* route, char* method, char* response_header);
+
+#endif
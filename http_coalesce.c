@@ -0,0 +1,730 @@
+#include "http_server.h"
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+/*
+    Request coalescing
+
+    The handler of a route set up with http_set_coalesce runs once
+    for identical requests that are handled at the same time. A
+    request is identified by method, path and the values of the
+    parameters and headers named in its key. The first request
+    becomes the leader of a flight: its handler runs, the response
+    is collected like an HTTP/2 response and stored in a table in
+    shared memory, created before workers are forked like sessions.
+
+    The response goes to every request with the same key that was
+    received before it was complete. Within a worker these are the
+    requests reported by the same epoll_wait as the leader or found
+    pending right after it. A request of a flight running in
+    another worker is parked: its connection is not read until the
+    leader wakes the worker through its eventfd, and at most for
+    the timeout of the route, after which the request is handled
+    again and runs the handler itself. Each worker copies a
+    response out of shared memory once and queues that one buffer
+    on all its connections.
+
+    The handler of a leader runs without the headers added for its
+    request, such as Connection, so the stored response holds none
+    of them. Every request queues its own status line and headers
+    in front of the shared buffer.
+
+    Only buffered responses of up to HTTP_COALESCE_RESPONSE_SIZE
+    bytes without Set-Cookie are shared, parked requests of any
+    other response run the handler themselves. HTTP/2 streams and
+    requests whose slot is held by another key are not coalesced.
+*/
+
+static struct http_coalesce_store* http_coalesce = NULL;
+static unsigned long long http_coalesce_received = 0; // ns, the requests of this turn arrived after it
+static unsigned long long http_coalesce_reported = 0; // ns, when the events of the last turn were reported
+
+// this worker's copy of each stored response
+static struct http_shared* http_coalesce_local[HTTP_COALESCE_FLIGHTS];
+static char http_coalesce_local_status[HTTP_COALESCE_FLIGHTS][HTTP_COALESCE_STATUS_SIZE];
+static unsigned int http_coalesce_local_generation[HTTP_COALESCE_FLIGHTS];
+
+// eventfd per worker index, created before workers are forked so every leader can wake every worker
+static int http_coalesce_wake[HTTP_MAX_WORKERS];
+static int http_coalesce_wakecount = 0;
+
+// loop only
+static struct http_coalesce_waiter* http_coalesce_waiters = NULL; // parked requests
+static struct http_coalesce_waiter* http_coalesce_ready = NULL; // parked requests being resumed
+static unsigned long long http_coalesce_deadline = ULLONG_MAX; // earliest deadline of a parked request
+static int http_coalesce_resuming = 0; // a parked request is handled again
+
+// copy of the request being handled, see http_coalesce_request
+static char* http_coalesce_raw = NULL;
+static size_t http_coalesce_raw_length = 0;
+static size_t http_coalesce_raw_capacity = 0;
+
+
+/**************************************************************
+    CLOCK_MONOTONIC in ns, the same in all workers
+**************************************************************/
+static unsigned long long http_coalesce_now(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1000000000ull+now.tv_nsec;
+}
+
+/**************************************************************
+    Creates the shared table if a route is coalesced, called by
+    http_start before workers are forked.
+**************************************************************/
+void http_coalesce_start(){
+
+    int routes = 0;
+    for (int i = 0; i < http_routecounter; ++i)
+    {
+        if(http_routes[i]->coalesce != NULL)
+            routes++;
+    }
+    if(routes == 0)
+        return;
+
+    http_coalesce = mmap(NULL, sizeof(struct http_coalesce_store), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(http_coalesce == MAP_FAILED){
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    // a worker that dies holding the lock does not block the others
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&http_coalesce->lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+
+    http_coalesce_wakecount = http_worker_count() > 0 ? http_worker_count() : 1;
+    for (int i = 0; i < http_coalesce_wakecount; ++i)
+    {
+        http_coalesce_wake[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(http_coalesce_wake[i] < 0){
+            perror("eventfd");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf(KBLU "[STARTUP] Coalescing requests of %d routes\n" KWHT, routes);
+}
+
+/**************************************************************
+    Watches the eventfd of this worker, called by http_start
+**************************************************************/
+void http_coalesce_watch(int epoll_fd){
+    if(http_coalesce == NULL)
+        return;
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = http_coalesce_fd();
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event.data.fd, &event);
+}
+
+int http_coalesce_fd(){
+    return http_coalesce != NULL ? http_coalesce_wake[http_worker_index()] : -1;
+}
+
+/**************************************************************
+    1 if a route is coalesced
+**************************************************************/
+int http_coalesce_active(){
+    return http_coalesce != NULL;
+}
+
+/**************************************************************
+    Summery:
+
+    Marks when the requests of this turn were received, called by
+    the event loop after epoll_wait. Events that were pending
+    before epoll_wait was called arrived during the last turn,
+    such as while a handler ran.
+
+    @PARAMS: 1 if epoll_wait returned without waiting
+    @returns: VOID
+**************************************************************/
+void http_coalesce_turn(int pending){
+    if(http_coalesce == NULL)
+        return;
+    unsigned long long now = http_coalesce_now();
+    http_coalesce_received = pending ? http_coalesce_reported : now;
+    http_coalesce_reported = now;
+}
+
+/**************************************************************
+    Summery:
+
+    Shortens the timeout of epoll_wait to the earliest deadline
+    of a parked request.
+
+    @PARAMS: timeout in ms
+    @returns: timeout in ms
+**************************************************************/
+int http_coalesce_wait(int timeout){
+    if(http_coalesce_waiters == NULL)
+        return timeout;
+
+    unsigned long long now = http_coalesce_now();
+    if(http_coalesce_deadline <= now)
+        return 0;
+    unsigned long long ms = (http_coalesce_deadline-now+999999)/1000000;
+    return ms < (unsigned long long)timeout ? (int)ms : timeout;
+}
+
+/**************************************************************
+    Summery:
+
+    Keeps a copy of a request of a coalesced route before it is
+    parsed, called by http_process. A parked request is handled
+    again from it. Other requests are not copied.
+
+    @PARAMS: request, length of request
+    @returns: VOID
+**************************************************************/
+void http_coalesce_request(char* request, size_t length){
+
+    http_coalesce_raw_length = 0;
+
+    int coalesced = 0;
+    for (int i = 0; i < http_routecounter && !coalesced; ++i)
+    {
+        struct http_route* route = http_routes[i];
+        if(route->coalesce == NULL)
+            continue;
+
+        // "GET /path" followed by the end of the path
+        size_t method = strlen(route->method);
+        size_t path = strlen(route->route);
+        if(length <= method+path+1 || strncmp(request, route->method, method) != 0 || request[method] != ' ' || strncmp(request+method+1, route->route, path) != 0)
+            continue;
+        char end = request[method+1+path];
+        coalesced = end == ' ' || end == '?' || end == '#';
+    }
+    if(!coalesced)
+        return;
+
+    if(length+1 > http_coalesce_raw_capacity){
+        char* raw = realloc(http_coalesce_raw, length+1);
+        if(raw == NULL)
+            return;
+        http_coalesce_raw = raw;
+        http_coalesce_raw_capacity = length+1;
+    }
+    memcpy(http_coalesce_raw, request, length);
+    http_coalesce_raw[length] = 0;
+    http_coalesce_raw_length = length;
+}
+
+static void http_coalesce_lock(){
+    // previous owner died, the table is only changed in short steps that leave it valid
+    if(pthread_mutex_lock(&http_coalesce->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&http_coalesce->lock);
+}
+
+static void http_coalesce_unlock(){
+    pthread_mutex_unlock(&http_coalesce->lock);
+}
+
+/**************************************************************
+    1 if the worker that leads a flight still exists
+**************************************************************/
+static int http_coalesce_alive(pid_t leader){
+    return leader != getpid() && (kill(leader, 0) == 0 || errno != ESRCH);
+}
+
+/**************************************************************
+    Headers added for the current request before its handler
+**************************************************************/
+static char* http_coalesce_headers(){
+    return http_response_header+strlen(http_default_header);
+}
+
+/**************************************************************
+    Summery:
+
+    Builds the key of the current request. Values are prefixed
+    with their length so no value can make two keys equal.
+
+    @PARAMS: route, buffer, size of buffer
+    @returns: 0 on success, -1 if the key does not fit.
+**************************************************************/
+static int http_coalesce_key(struct http_route* route, char* key, size_t size){
+
+    size_t length = snprintf(key, size, "%s %s", route->method, route->route);
+
+    char names[strlen(route->coalesce)+1];
+    strcpy(names, route->coalesce);
+
+    char* save;
+    for (char* name = strtok_r(names, ",", &save); name != NULL && length < size; name = strtok_r(NULL, ",", &save))
+    {
+        while(*name == ' ')
+            name++;
+        if(*name == 0)
+            continue;
+
+        // "Accept-Language:" is a header as in http_get_request_header, anything else a parameter
+        char* value = name[strlen(name)-1] == ':' ? http_get_request_header(name) : http_get_parameter(name, 0);
+        if(value == NULL)
+            length += snprintf(key+length, size-length, "\n%s", name);
+        else
+            length += snprintf(key+length, size-length, "\n%s=%zu:%s", name, strlen(value), value);
+    }
+    return length < size ? 0 : -1;
+}
+
+/**************************************************************
+    Summery:
+
+    Copies the collected response of a leader into one buffer,
+    without its status line.
+
+    @PARAMS: segments of the response, buffer for the status line
+    @returns: response, NULL if it can not be shared.
+**************************************************************/
+static struct http_shared* http_coalesce_response(struct http_segment* segments, char* status){
+
+    size_t length = 0;
+    for (struct http_segment* segment = segments; segment != NULL; segment = segment->next)
+    {
+        if(segment->type == HTTP_SEGMENT_FILE)
+            return NULL;
+        length += segment->length-segment->offset;
+    }
+    if(length == 0 || length > HTTP_COALESCE_RESPONSE_SIZE)
+        return NULL;
+
+    struct http_shared* response = http_shared_new(length);
+    if(response == NULL)
+        return NULL;
+
+    char* data = response->data;
+    for (struct http_segment* segment = segments; segment != NULL; segment = segment->next)
+    {
+        memcpy(data, segment->data+segment->offset, segment->length-segment->offset);
+        data += segment->length-segment->offset;
+    }
+
+    // cookies such as the session cookie belong to one client
+    char* end = memmem(response->data, length, "\n\n", 2);
+    char* line = memchr(response->data, '\n', length);
+    size_t status_length = line != NULL ? (size_t)(line+1-response->data) : 0;
+    if(end == NULL || memmem(response->data, end-response->data, "Set-Cookie", 10) != NULL
+        || strncmp(response->data, "HTTP/", 5) != 0 || status_length >= HTTP_COALESCE_STATUS_SIZE){
+        http_shared_release(response);
+        return NULL;
+    }
+
+    memcpy(status, response->data, status_length);
+    status[status_length] = 0;
+    response->length -= status_length;
+    memmove(response->data, response->data+status_length, response->length);
+    return response;
+}
+
+/**************************************************************
+    Summery:
+
+    Queues a response that is not shared with the headers of the
+    request after its status line.
+
+    @PARAMS: connection, segments of the response, headers
+    @returns: VOID
+**************************************************************/
+static void http_coalesce_queue(struct http_conn* conn, struct http_segment* segments, char* headers){
+
+    // responses sent without the queue, such as http_404, are not collected
+    if(segments != NULL && segments->type != HTTP_SEGMENT_FILE){
+        char* line = memchr(segments->data+segments->offset, '\n', segments->length-segments->offset);
+        if(line != NULL){
+            size_t length = line+1-(segments->data+segments->offset);
+            http_conn_queue_buffer(conn, segments->data+segments->offset, length);
+            http_conn_queue_buffer(conn, headers, strlen(headers));
+            segments->offset += length;
+        }
+        if(segments->offset == segments->length){
+            struct http_segment* next = segments->next;
+            segments->next = NULL;
+            http_segments_free(segments);
+            segments = next;
+        }
+    }
+    http_conn_queue_segments(conn, segments);
+}
+
+/**************************************************************
+    Summery:
+
+    Returns this worker's copy of a stored response, copied out
+    of shared memory on first use. Called with the lock held.
+
+    @PARAMS: slot, flight in DONE state
+    @returns: response, NULL on error.
+**************************************************************/
+static struct http_shared* http_coalesce_local_copy(unsigned int slot, struct http_flight* flight){
+
+    if(http_coalesce_local[slot] != NULL && http_coalesce_local_generation[slot] == flight->generation)
+        return http_coalesce_local[slot];
+
+    struct http_shared* response = http_shared_new(flight->length);
+    if(response == NULL)
+        return NULL;
+    memcpy(response->data, flight->response, flight->length);
+
+    if(http_coalesce_local[slot] != NULL)
+        http_shared_release(http_coalesce_local[slot]);
+    http_coalesce_local[slot] = response;
+    strcpy(http_coalesce_local_status[slot], flight->status);
+    http_coalesce_local_generation[slot] = flight->generation;
+    return response;
+}
+
+/**************************************************************
+    Summery:
+
+    Answers a request with a stored response: its status line,
+    the headers of the request, then the shared buffer. Called
+    with the lock held.
+
+    @PARAMS: connection, slot, flight in DONE state, headers of the request
+    @returns: 0 on success, -1 on error.
+**************************************************************/
+static int http_coalesce_answer(struct http_conn* conn, unsigned int slot, struct http_flight* flight, char* headers){
+
+    struct http_shared* response = http_coalesce_local_copy(slot, flight);
+    if(response == NULL)
+        return -1;
+
+    http_conn_queue_buffer(conn, http_coalesce_local_status[slot], strlen(http_coalesce_local_status[slot]));
+    http_conn_queue_buffer(conn, headers, strlen(headers));
+    http_conn_queue_shared(conn, response);
+    return 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Runs the handler of the route with its output collected,
+    queues the response on the connection and stores it in the
+    flight if it can be shared. Wakes the workers with requests
+    parked on the flight.
+
+    @PARAMS: connection, route, slot, generation of the flight
+    @returns: VOID
+**************************************************************/
+static void http_coalesce_lead(struct http_conn* conn, struct http_route* route, unsigned int slot, unsigned int generation){
+
+    struct http_conn capture;
+    memset(&capture, 0, sizeof(capture));
+    capture.fd = conn->fd;
+    capture.kind = HTTP_CONN_CLIENT;
+    capture.port = conn->port;
+    memcpy(capture.addr, conn->addr, 16);
+    capture.traced = conn->traced;
+    capture.keep_alive = conn->keep_alive;
+
+    // the headers of this request are queued in front of the response, see http_coalesce_answer
+    char* request_header = http_response_header;
+    http_setup_header();
+
+    http_conn_set_capture(&capture);
+    http_current = &capture;
+    (*(route->http_routefunction))();
+    http_current = conn;
+    http_conn_set_capture(NULL);
+
+    free(http_response_header);
+    http_response_header = request_header;
+    char* headers = http_coalesce_headers();
+
+    // a handler that closes the connection, such as http_redirect, answers only its own request
+    struct http_segment* segments = http_conn_detach(&capture);
+    struct http_shared* response = NULL;
+    char status[HTTP_COALESCE_STATUS_SIZE];
+    if(capture.keep_alive == conn->keep_alive && !capture.closing)
+        response = http_coalesce_response(segments, status);
+    conn->keep_alive = capture.keep_alive;
+    if(capture.closing)
+        conn->closing = 1;
+
+    if(response != NULL){
+        http_segments_free(segments);
+        http_conn_queue_buffer(conn, status, strlen(status));
+        http_conn_queue_buffer(conn, headers, strlen(headers));
+        http_conn_queue_shared(conn, response);
+    } else {
+        http_coalesce_queue(conn, segments, headers);
+    }
+
+    struct http_flight* flight = &http_coalesce->flights[slot];
+    unsigned long long waiting = 0;
+    http_coalesce_lock();
+    if(flight->generation == generation){
+        if(response != NULL){
+            memcpy(flight->response, response->data, response->length);
+            flight->length = response->length;
+            strcpy(flight->status, status);
+            flight->landed = http_coalesce_now();
+            flight->state = HTTP_FLIGHT_DONE;
+        } else {
+            flight->state = HTTP_FLIGHT_EMPTY;
+            http_coalesce->uncached++;
+        }
+        waiting = flight->waiting;
+        flight->waiting = 0;
+    }
+    http_coalesce_unlock();
+
+    for (int i = 0; i < http_coalesce_wakecount; ++i)
+    {
+        if(waiting & (1ull << i))
+            eventfd_write(http_coalesce_wake[i], 1);
+    }
+
+    // the reference of http_shared_new becomes this worker's copy
+    if(response != NULL){
+        if(http_coalesce_local[slot] != NULL)
+            http_shared_release(http_coalesce_local[slot]);
+        http_coalesce_local[slot] = response;
+        strcpy(http_coalesce_local_status[slot], status);
+        http_coalesce_local_generation[slot] = generation;
+    }
+}
+
+/**************************************************************
+    Summery:
+
+    Parks the current request until the flight in slot ends. The
+    connection is not read until then, see http_coalesce_complete.
+    Called with the lock held.
+
+    @PARAMS: connection, route, slot, key, length of the request copy
+    @returns: 0 on success, -1 on error.
+**************************************************************/
+static int http_coalesce_park(struct http_conn* conn, struct http_route* route, unsigned int slot, char* key, size_t length){
+
+    struct http_coalesce_waiter* waiter = calloc(1, sizeof(struct http_coalesce_waiter));
+    if(waiter == NULL)
+        return -1;
+    waiter->request = malloc(length+1);
+    waiter->headers = strdup(http_coalesce_headers());
+    if(waiter->request == NULL || waiter->headers == NULL){
+        free(waiter->request);
+        free(waiter->headers);
+        free(waiter);
+        return -1;
+    }
+    memcpy(waiter->request, http_coalesce_raw, length+1);
+
+    waiter->conn = conn;
+    waiter->slot = slot;
+    strcpy(waiter->key, key);
+    waiter->deadline = http_coalesce_now()+route->coalesce_timeout*1000000ull;
+    if(waiter->deadline < http_coalesce_deadline)
+        http_coalesce_deadline = waiter->deadline;
+
+    waiter->next = http_coalesce_waiters;
+    http_coalesce_waiters = waiter;
+
+    http_coalesce->flights[slot].waiting |= 1ull << http_worker_index();
+    conn->pending++;
+    return 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Handles a request of a coalesced route: answers it with the
+    response of an identical request, parks it until another
+    worker running one is done, or runs the handler.
+
+    @PARAMS: connection, route matching the request
+    @returns: VOID
+**************************************************************/
+void http_coalesce_handle(struct http_conn* conn, struct http_route* route){
+
+    // the copy belongs to this request only
+    size_t length = http_coalesce_raw_length;
+    http_coalesce_raw_length = 0;
+
+    char key[HTTP_COALESCE_KEY_SIZE];
+    // HTTP/2 streams are handled on a capture connection, see http2_dispatch
+    if(http_coalesce == NULL || http_coalesce_resuming || http_conn_get(conn->fd) != conn || http_coalesce_key(route, key, sizeof(key)) < 0){
+        (*(route->http_routefunction))();
+        return;
+    }
+
+    unsigned int slot = http_bundle_hash(key, strlen(key), 0) % HTTP_COALESCE_FLIGHTS;
+    struct http_flight* flight = &http_coalesce->flights[slot];
+
+    http_coalesce_lock();
+    int same = flight->state != HTTP_FLIGHT_EMPTY && strcmp(flight->key, key) == 0;
+
+    // completed after this request was received
+    if(same && flight->state == HTTP_FLIGHT_DONE && flight->landed >= http_coalesce_received){
+        int answered = http_coalesce_answer(conn, slot, flight, http_coalesce_headers()) == 0;
+        if(answered)
+            http_coalesce->collapsed++;
+        http_coalesce_unlock();
+        if(!answered)
+            (*(route->http_routefunction))();
+        return;
+    }
+
+    int running = flight->state == HTTP_FLIGHT_RUNNING && http_coalesce_alive(flight->leader);
+    if(same && running && length > 0 && http_coalesce_park(conn, route, slot, key, length) == 0){
+        http_coalesce_unlock();
+        return;
+    }
+
+    // slot held by a flight of another key, or the request could not be parked
+    if(running){
+        http_coalesce->busy++;
+        http_coalesce_unlock();
+        (*(route->http_routefunction))();
+        return;
+    }
+
+    flight->state = HTTP_FLIGHT_RUNNING;
+    flight->generation++;
+    flight->leader = getpid();
+    flight->length = 0;
+    strcpy(flight->key, key);
+    unsigned int generation = flight->generation;
+    http_coalesce->leads++;
+    http_coalesce_unlock();
+
+    http_coalesce_lead(conn, route, slot, generation);
+}
+
+/**************************************************************
+    Summery:
+
+    Resumes parked requests whose flight ended or whose deadline
+    passed, called by the event loop every turn. Requests of a
+    stored response are answered with it, the others are handled
+    again and run the handler. Then the connection continues with
+    the requests the client pipelined after it.
+
+    @PARAMS: 1 if the eventfd of this worker is readable
+    @returns: VOID
+**************************************************************/
+void http_coalesce_complete(int woken){
+
+    if(http_coalesce == NULL)
+        return;
+
+    if(woken){
+        eventfd_t count;
+        eventfd_read(http_coalesce_fd(), &count);
+    }
+
+    unsigned long long now = http_coalesce_now();
+    if(http_coalesce_waiters == NULL || (!woken && now < http_coalesce_deadline))
+        return;
+
+    // sort out under one lock, handlers run without it
+    http_coalesce_deadline = ULLONG_MAX;
+    struct http_coalesce_waiter** link = &http_coalesce_waiters;
+    http_coalesce_lock();
+    while(*link != NULL){
+        struct http_coalesce_waiter* waiter = *link;
+        struct http_flight* flight = &http_coalesce->flights[waiter->slot];
+        int same = waiter->conn != NULL && flight->state != HTTP_FLIGHT_EMPTY && strcmp(flight->key, waiter->key) == 0;
+
+        // the leader may already run the key again for a later request, its response is as good
+        if(same && flight->state == HTTP_FLIGHT_RUNNING && now < waiter->deadline && http_coalesce_alive(flight->leader)){
+            flight->waiting |= 1ull << http_worker_index();
+            if(waiter->deadline < http_coalesce_deadline)
+                http_coalesce_deadline = waiter->deadline;
+            link = &waiter->next;
+            continue;
+        }
+
+        if(same && flight->state == HTTP_FLIGHT_DONE && http_coalesce_answer(waiter->conn, waiter->slot, flight, waiter->headers) == 0){
+            waiter->answered = 1;
+            http_coalesce->collapsed++;
+            http_coalesce->waited++;
+        } else if(same && flight->state == HTTP_FLIGHT_RUNNING){
+            http_coalesce->timeouts++;
+        }
+
+        *link = waiter->next;
+        waiter->next = http_coalesce_ready;
+        http_coalesce_ready = waiter;
+    }
+    http_coalesce_unlock();
+
+    // the leader was too slow or its response can not be shared
+    while(http_coalesce_ready != NULL){
+        struct http_coalesce_waiter* waiter = http_coalesce_ready;
+        http_coalesce_ready = waiter->next;
+
+        struct http_conn* conn = waiter->conn;
+        if(conn != NULL){
+            conn->pending--;
+            if(!waiter->answered){
+                http_coalesce_resuming = 1;
+                http_handle_request(conn, waiter->request);
+                http_coalesce_resuming = 0;
+                if(!conn->keep_alive)
+                    conn->closing = 1;
+            }
+            if(conn->pending == 0)
+                http_process(conn);
+            http_write(conn);
+        }
+
+        free(waiter->request);
+        free(waiter->headers);
+        free(waiter);
+    }
+}
+
+/**************************************************************
+    Detaches a closed connection from its parked request
+**************************************************************/
+void http_coalesce_cancel(struct http_conn* conn){
+    for (struct http_coalesce_waiter* waiter = http_coalesce_waiters; waiter != NULL; waiter = waiter->next)
+    {
+        if(waiter->conn == conn)
+            waiter->conn = NULL;
+    }
+    for (struct http_coalesce_waiter* waiter = http_coalesce_ready; waiter != NULL; waiter = waiter->next)
+    {
+        if(waiter->conn == conn)
+            waiter->conn = NULL;
+    }
+}
+
+/**************************************************************
+    Summery:
+
+    Writes the counters of all workers.
+
+    @PARAMS: buffer, size of buffer
+    @returns: length written
+**************************************************************/
+int http_coalesce_stats(char* buffer, size_t size){
+
+    if(http_coalesce == NULL)
+        return snprintf(buffer, size, "no coalesced routes\n");
+
+    int running = 0;
+    int done = 0;
+    http_coalesce_lock();
+    for (int i = 0; i < HTTP_COALESCE_FLIGHTS; ++i)
+    {
+        running += http_coalesce->flights[i].state == HTTP_FLIGHT_RUNNING;
+        done += http_coalesce->flights[i].state == HTTP_FLIGHT_DONE;
+    }
+    size_t length = snprintf(buffer, size, "leads %ld collapsed %ld waited %ld timeouts %ld uncached %ld busy %ld running %d stored %d\n",
+        http_coalesce->leads, http_coalesce->collapsed, http_coalesce->waited, http_coalesce->timeouts,
+        http_coalesce->uncached, http_coalesce->busy, running, done);
+    http_coalesce_unlock();
+
+    return length < size ? length : size-1;
+}
@@ -0,0 +1,82 @@
+#ifndef __HTTP_COALESCE_H
+#define __HTTP_COALESCE_H
+
+#include "syshead.h"
+#include "http_conn.h"
+#include <pthread.h>
+
+#define HTTP_COALESCE_FLIGHTS 64 // direct mapped by key hash
+#define HTTP_COALESCE_KEY_SIZE 512
+#define HTTP_COALESCE_RESPONSE_SIZE (64*1024) // larger responses are not shared
+#define HTTP_COALESCE_STATUS_SIZE 64 // longest status line that is shared
+#define HTTP_COALESCE_TIMEOUT 1000 // ms, default wait for another worker
+
+#define HTTP_FLIGHT_EMPTY 0
+#define HTTP_FLIGHT_RUNNING 1
+#define HTTP_FLIGHT_DONE 2
+
+/*
+    One handler execution and its response, shared by all workers.
+    generation changes whenever the slot is taken by a new flight.
+    The response is stored without its status line and without
+    the headers of the leader's request, such as Connection.
+*/
+struct http_flight
+{
+	int state;
+	unsigned int generation;
+	pid_t leader;
+	unsigned long long waiting; // bit per worker index with parked requests, woken when the flight ends
+	unsigned long long landed; // CLOCK_MONOTONIC ns the response was stored
+	char key[HTTP_COALESCE_KEY_SIZE];
+	char status[HTTP_COALESCE_STATUS_SIZE];
+	size_t length;
+	char response[HTTP_COALESCE_RESPONSE_SIZE];
+};
+
+struct http_coalesce_store
+{
+	pthread_mutex_t lock;
+
+	// for stats
+	long leads;
+	long collapsed; // requests answered with the response of another request
+	long waited; // of collapsed, requests that waited for another worker
+	long timeouts;
+	long uncached; // responses that could not be shared
+	long busy; // requests whose slot was used by another key
+
+	struct http_flight flights[HTTP_COALESCE_FLIGHTS];
+};
+
+/*
+    A request parked until the flight of its key ends in another
+    worker. Its connection is not read meanwhile.
+*/
+struct http_coalesce_waiter
+{
+	struct http_conn* conn; // NULL once the connection closed
+	unsigned int slot;
+	char key[HTTP_COALESCE_KEY_SIZE];
+	unsigned long long deadline; // CLOCK_MONOTONIC ns, the request is handled here after it
+	char* request; // copy of the request, handled again if the response is not shared
+	char* headers; // headers of this request's response, such as Connection
+	int answered; // with a stored response, else handled again
+	struct http_coalesce_waiter* next;
+};
+
+struct http_route;
+
+void http_coalesce_start();
+void http_coalesce_watch(int epoll_fd);
+int http_coalesce_fd();
+int http_coalesce_active();
+void http_coalesce_turn(int pending);
+int http_coalesce_wait(int timeout);
+void http_coalesce_request(char* request, size_t length);
+void http_coalesce_handle(struct http_conn* conn, struct http_route* route);
+void http_coalesce_complete(int woken);
+void http_coalesce_cancel(struct http_conn* conn);
+int http_coalesce_stats(char* buffer, size_t size);
+
+#endif
@@ -0,0 +1,589 @@
+#include "http_conn.h"
+#include "http_tls.h"
+#include "http_pool.h"
+#include "http_files.h"
+
+/*
+    Per connection state for the event loop.
+
+    Responses are never written directly to the socket. Handlers queue
+    buffer and file segments on the connection and the event loop drains
+    the queue whenever the socket is writable. A slow reader therefore
+    only holds its own queued segments, and file content is referenced
+    by descriptor instead of being copied into memory.
+*/
+
+struct http_conn** http_conns = NULL; // connections indexed by fd
+int http_conns_size = 0;
+struct http_conn* http_conn_list = NULL; // all open connections, used for timeouts
+
+size_t http_highwater = HTTP_OUTPUT_HIGHWATER;
+size_t http_total_queued = 0; // for stats
+int http_open_connections = 0; // client connections only
+
+struct http_conn* http_capture = NULL; // receives output sent by fd, see http_conn_set_capture
+
+
+/**************************************************************
+    Summery:
+
+    Allocates connection state for an accepted socket and adds
+    it to the fd table.
+
+    @PARAMS: socket fd, HTTP_CONN_CLIENT or HTTP_CONN_UPSTREAM
+    @returns: connection, NULL on error.
+**************************************************************/
+struct http_conn* http_conn_new(int fd, int kind){
+
+    if(fd >= http_conns_size){
+        int size = http_conns_size == 0 ? 1024 : http_conns_size;
+        while(size <= fd)
+            size *= 2;
+
+        struct http_conn** conns = realloc(http_conns, size*sizeof(struct http_conn*));
+        if(conns == NULL)
+            return NULL;
+        memset(conns+http_conns_size, 0, (size-http_conns_size)*sizeof(struct http_conn*));
+        http_conns = conns;
+        http_conns_size = size;
+    }
+
+    struct http_conn* conn = calloc(1, sizeof(struct http_conn));
+    if(conn == NULL)
+        return NULL;
+
+    conn->fd = fd;
+    conn->kind = kind;
+    conn->last_active = time(NULL);
+
+    conn->next = http_conn_list;
+    if(http_conn_list != NULL)
+        http_conn_list->prev = conn;
+    http_conn_list = conn;
+
+    http_conns[fd] = conn;
+    if(kind == HTTP_CONN_CLIENT)
+        http_open_connections++;
+
+    return conn;
+}
+
+/**************************************************************
+    Frees a list of segments
+**************************************************************/
+void http_segments_free(struct http_segment* segment){
+    while(segment != NULL){
+        struct http_segment* next = segment->next;
+        if(segment->type == HTTP_SEGMENT_FILE){
+            close(segment->fd);
+        } else if(segment->type == HTTP_SEGMENT_SHARED){
+            http_shared_release(segment->shared);
+        } else if(segment->type == HTTP_SEGMENT_BUFFER){
+            http_pool_free(segment->data, segment->capacity);
+        }
+        free(segment);
+        segment = next;
+    }
+}
+
+/**************************************************************
+    Frees all queued segments of a connection
+**************************************************************/
+static void http_conn_free_segments(struct http_conn* conn){
+    http_segments_free(http_conn_detach(conn));
+}
+
+/**************************************************************
+    Summery:
+
+    Removes all queued segments from the connection and returns
+    them to the caller, who becomes responsible for freeing them.
+
+    @PARAMS: connection
+    @returns: list of segments.
+**************************************************************/
+struct http_segment* http_conn_detach(struct http_conn* conn){
+    struct http_segment* segments = conn->out_head;
+
+    http_total_queued -= conn->out_queued;
+    conn->out_head = NULL;
+    conn->out_tail = NULL;
+    conn->out_queued = 0;
+
+    return segments;
+}
+
+/**************************************************************
+    Summery:
+
+    Closes the socket and frees all memory of a connection.
+    Queued output that has not been sent is dropped.
+
+    @PARAMS: connection
+    @returns: void
+**************************************************************/
+void http_conn_free(struct http_conn* conn){
+
+    http_conn_free_segments(conn);
+
+    if(conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        http_conn_list = conn->next;
+    if(conn->next != NULL)
+        conn->next->prev = conn->prev;
+
+    http_conns[conn->fd] = NULL;
+    if(conn->kind == HTTP_CONN_CLIENT)
+        http_open_connections--;
+
+    close(conn->fd);
+    http_pool_free(conn->in, conn->in_capacity);
+    free(conn);
+}
+
+/**************************************************************
+    Returns connection of given fd, NULL if fd is not a client
+**************************************************************/
+struct http_conn* http_conn_get(int fd){
+    if(fd < 0 || fd >= http_conns_size)
+        return NULL;
+    return http_conns[fd];
+}
+
+/**************************************************************
+    Returns first connection in the list of open connections
+**************************************************************/
+struct http_conn* http_conn_first(){
+    return http_conn_list;
+}
+
+/**************************************************************
+    Appends a segment to the output queue
+**************************************************************/
+static void http_conn_append(struct http_conn* conn, struct http_segment* segment){
+    if(conn->out_tail != NULL)
+        conn->out_tail->next = segment;
+    else
+        conn->out_head = segment;
+    conn->out_tail = segment;
+}
+
+/**************************************************************
+    Summery:
+
+    Returns room for length bytes at the end of the output queue,
+    in the last buffer segment if it has space. The bytes are
+    queued by http_conn_commit, so output can be written in place.
+
+    @PARAMS: connection, length
+    @returns: pointer to free space, NULL on error.
+**************************************************************/
+char* http_conn_reserve(struct http_conn* conn, size_t length){
+
+    struct http_segment* tail = conn->out_tail;
+    if(tail != NULL && tail->type == HTTP_SEGMENT_BUFFER && tail->capacity-tail->length >= length)
+        return tail->data+tail->length;
+
+    struct http_segment* segment = calloc(1, sizeof(struct http_segment));
+    if(segment == NULL)
+        return NULL;
+
+    segment->type = HTTP_SEGMENT_BUFFER;
+    segment->data = http_pool_alloc(length > HTTP_SEGMENT_BUFFER_SIZE ? length : HTTP_SEGMENT_BUFFER_SIZE, &segment->capacity);
+    if(segment->data == NULL){
+        free(segment);
+        return NULL;
+    }
+
+    http_conn_append(conn, segment);
+    return segment->data;
+}
+
+/**************************************************************
+    Queues length bytes written to the last http_conn_reserve
+**************************************************************/
+void http_conn_commit(struct http_conn* conn, size_t length){
+    conn->out_tail->length += length;
+    conn->out_queued += length;
+    http_total_queued += length;
+}
+
+/**************************************************************
+    Summery:
+
+    Queues a copy of given data on the connection. Small writes
+    are coalesced into the last buffer segment so a response
+    header and a short body leave in a single send.
+
+    @PARAMS: connection, data, length of data
+    @returns: bytes queued, -1 on error.
+**************************************************************/
+int http_conn_queue_buffer(struct http_conn* conn, const char* data, size_t length){
+
+    if(length == 0)
+        return 0;
+
+    char* space = http_conn_reserve(conn, length);
+    if(space == NULL)
+        return -1;
+
+    memcpy(space, data, length);
+    http_conn_commit(conn, length);
+    return length;
+}
+
+/**************************************************************
+    Summery:
+
+    Queues length bytes of an open file starting at offset.
+    The connection takes ownership of fd and closes it once the
+    segment has been sent.
+
+    @PARAMS: connection, file fd, file offset, length
+    @returns: bytes queued, -1 on error.
+**************************************************************/
+int http_conn_queue_file(struct http_conn* conn, int fd, off_t offset, size_t length){
+
+    if(length == 0){
+        close(fd);
+        return 0;
+    }
+
+    struct http_segment* segment = calloc(1, sizeof(struct http_segment));
+    if(segment == NULL){
+        close(fd);
+        return -1;
+    }
+
+    segment->type = HTTP_SEGMENT_FILE;
+    segment->fd = fd;
+    segment->file_offset = offset;
+    segment->length = length;
+
+    http_conn_append(conn, segment);
+
+    conn->out_queued += length;
+    http_total_queued += length;
+    return length;
+}
+
+/**************************************************************
+    Summery:
+
+    Queues segments taken from another connection with
+    http_conn_detach, the connection takes ownership of them.
+
+    @PARAMS: connection, list of segments
+    @returns: VOID
+**************************************************************/
+void http_conn_queue_segments(struct http_conn* conn, struct http_segment* segments){
+    while(segments != NULL){
+        struct http_segment* next = segments->next;
+        size_t length = segments->type == HTTP_SEGMENT_FILE ? segments->length : segments->length-segments->offset;
+
+        segments->next = NULL;
+        http_conn_append(conn, segments);
+        conn->out_queued += length;
+        http_total_queued += length;
+        segments = next;
+    }
+}
+
+/**************************************************************
+    Summery:
+
+    Allocates a shared buffer of given length with one reference
+    held by the caller.
+
+    @PARAMS: length
+    @returns: shared buffer, NULL on error.
+**************************************************************/
+struct http_shared* http_shared_new(size_t length){
+    struct http_shared* shared = malloc(sizeof(struct http_shared)+length);
+    if(shared == NULL)
+        return NULL;
+    shared->references = 1;
+    shared->length = length;
+    return shared;
+}
+
+/**************************************************************
+    Drops a reference, frees the buffer after the last one
+**************************************************************/
+void http_shared_release(struct http_shared* shared){
+    shared->references--;
+    if(shared->references == 0)
+        free(shared);
+}
+
+/**************************************************************
+    Summery:
+
+    Queues a shared buffer on the connection without copying it.
+    The segment holds its own reference until it has been sent.
+
+    @PARAMS: connection, shared buffer
+    @returns: bytes queued, -1 on error.
+**************************************************************/
+int http_conn_queue_shared(struct http_conn* conn, struct http_shared* shared){
+
+    if(shared->length == 0)
+        return 0;
+
+    struct http_segment* segment = calloc(1, sizeof(struct http_segment));
+    if(segment == NULL)
+        return -1;
+
+    segment->type = HTTP_SEGMENT_SHARED;
+    segment->shared = shared;
+    segment->data = shared->data;
+    segment->length = shared->length;
+    shared->references++;
+
+    http_conn_append(conn, segment);
+
+    conn->out_queued += shared->length;
+    http_total_queued += shared->length;
+    return shared->length;
+}
+
+/**************************************************************
+    Summery:
+
+    Queues read-only memory that outlives the connection, such as
+    the embedded asset bundle, without copying it.
+
+    @PARAMS: connection, data, length of data
+    @returns: bytes queued, -1 on error.
+**************************************************************/
+int http_conn_queue_static(struct http_conn* conn, const char* data, size_t length){
+
+    if(length == 0)
+        return 0;
+
+    struct http_segment* segment = calloc(1, sizeof(struct http_segment));
+    if(segment == NULL)
+        return -1;
+
+    segment->type = HTTP_SEGMENT_STATIC;
+    segment->data = (char*)data;
+    segment->length = length;
+
+    http_conn_append(conn, segment);
+
+    conn->out_queued += length;
+    http_total_queued += length;
+    return length;
+}
+
+/**************************************************************
+    Summery:
+
+    Queues data on the connection belonging to client fd.
+    Used by the predefined status replies.
+
+    @PARAMS: client fd, data, length of data
+    @returns: bytes queued, -1 on error.
+**************************************************************/
+int http_conn_send(int fd, const char* data, size_t length){
+    struct http_conn* conn = http_capture != NULL && http_capture->fd == fd ? http_capture : http_conn_get(fd);
+    if(conn == NULL)
+        return -1;
+    return http_conn_queue_buffer(conn, data, length);
+}
+
+/**************************************************************
+    Summery:
+
+    Redirects output sent by fd to conn, a connection that is not
+    attached to a socket. Used to collect a response and translate
+    it before it is sent, NULL ends the capture.
+
+    @PARAMS: connection
+    @returns: void
+**************************************************************/
+void http_conn_set_capture(struct http_conn* conn){
+    http_capture = conn;
+}
+
+/**************************************************************
+    Removes the head segment after it has been fully sent
+**************************************************************/
+static void http_conn_pop(struct http_conn* conn){
+    struct http_segment* segment = conn->out_head;
+    conn->out_head = segment->next;
+    if(conn->out_head == NULL)
+        conn->out_tail = NULL;
+
+    if(segment->type == HTTP_SEGMENT_FILE)
+        close(segment->fd);
+    else if(segment->type == HTTP_SEGMENT_SHARED)
+        http_shared_release(segment->shared);
+    else if(segment->type == HTTP_SEGMENT_BUFFER)
+        http_pool_free(segment->data, segment->capacity);
+    free(segment);
+}
+
+/**************************************************************
+    Marks bytes as sent and updates queue counters
+**************************************************************/
+static void http_conn_sent(struct http_conn* conn, size_t bytes){
+    conn->out_queued -= bytes;
+    http_total_queued -= bytes;
+}
+
+/**************************************************************
+    Summery:
+
+    Sends as much of the output queue as the socket accepts,
+    or about conn->write_budget bytes if a budget is set.
+    Consecutive memory segments are gathered into one sendmsg,
+    with MSG_MORE if a file follows. MSG_NOSIGNAL is used so a
+    closed peer returns EPIPE instead of raising SIGPIPE.
+
+    @PARAMS: connection
+    @returns: 0 when drained, 1 if output is pending, 2 if the budget is used up, -1 on error.
+**************************************************************/
+int http_conn_flush(struct http_conn* conn){
+
+    // without kernel TLS records are encrypted in user space
+    if(conn->tls != NULL && !conn->tls->kernel_send)
+        return http_tls_flush(conn);
+
+    size_t total = 0;
+    while(conn->out_head != NULL){
+
+        // the rest is sent on the next turn
+        if(conn->write_budget > 0 && total >= conn->write_budget)
+            return 2;
+
+        struct http_segment* segment = conn->out_head;
+
+        if(segment->type == HTTP_SEGMENT_FILE){
+            http_files_prefetch(segment);
+            size_t length = segment->length;
+            if(conn->write_budget > 0 && length > conn->write_budget-total)
+                length = conn->write_budget-total;
+            ssize_t sent = sendfile(conn->fd, segment->fd, &segment->file_offset, length);
+            if(sent < 0){
+                if(errno == EINTR)
+                    continue;
+                if(errno == EAGAIN || errno == EWOULDBLOCK)
+                    return 1;
+                return -1;
+            }
+            if(sent == 0){
+                // file was truncated while queued
+                return -1;
+            }
+            segment->length -= sent;
+            total += sent;
+            http_conn_sent(conn, sent);
+            if(segment->length == 0)
+                http_conn_pop(conn);
+            continue;
+        }
+
+        struct iovec iov[16];
+        int iovcnt = 0;
+        struct http_segment* s = segment;
+        for(; s != NULL && s->type != HTTP_SEGMENT_FILE && iovcnt < 16; s = s->next){
+            iov[iovcnt].iov_base = s->data+s->offset;
+            iov[iovcnt].iov_len = s->length-s->offset;
+            iovcnt++;
+        }
+
+        // a header in front of a file leaves in the same packet as the file data
+        int flags = MSG_NOSIGNAL;
+        if(s != NULL && s->type == HTTP_SEGMENT_FILE)
+            flags |= MSG_MORE;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+
+        ssize_t sent = sendmsg(conn->fd, &msg, flags);
+        if(sent < 0){
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            return -1;
+        }
+
+        total += sent;
+        http_conn_consume(conn, sent);
+    }
+
+    return 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Marks bytes at the head of the output queue as sent and
+    removes segments that have been sent completely.
+
+    @PARAMS: connection, bytes sent
+    @returns: void
+**************************************************************/
+void http_conn_consume(struct http_conn* conn, size_t bytes){
+
+    http_conn_sent(conn, bytes);
+
+    while(bytes > 0){
+        struct http_segment* segment = conn->out_head;
+
+        if(segment->type == HTTP_SEGMENT_FILE){
+            size_t part = bytes < segment->length ? bytes : segment->length;
+            segment->file_offset += part;
+            segment->length -= part;
+            bytes -= part;
+            if(segment->length == 0)
+                http_conn_pop(conn);
+            continue;
+        }
+
+        size_t left = segment->length-segment->offset;
+        if(bytes < left){
+            segment->offset += bytes;
+            break;
+        }
+        bytes -= left;
+        http_conn_pop(conn);
+    }
+}
+
+/**************************************************************
+    Summery:
+
+    Sets the output high-water mark. While more than this many
+    bytes are queued on a connection, no further pipelined
+    requests are read from it.
+
+    @PARAMS: bytes
+    @returns: void
+**************************************************************/
+void http_set_highwater(size_t bytes){
+    http_highwater = bytes;
+}
+
+size_t http_get_highwater(){
+    return http_highwater;
+}
+
+/**************************************************************
+    Returns the number of bytes queued on all connections
+**************************************************************/
+size_t http_queued_bytes(){
+    return http_total_queued;
+}
+
+/**************************************************************
+    Returns the number of open client connections
+**************************************************************/
+int http_conn_count(){
+    return http_open_connections;
+}
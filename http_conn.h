@@ -0,0 +1,125 @@
+#ifndef __HTTP_CONN_H
+#define __HTTP_CONN_H
+
+#include "syshead.h"
+
+#define HTTP_OUTPUT_HIGHWATER (256*1024) // 256KB, default pause point for pipelined input
+#define HTTP_SEGMENT_BUFFER_SIZE 4096 // small writes are coalesced into segments of this size
+#define HTTP_MAX_REQUEST_SIZE (1024*1024) // 1MB, largest request (header + body) that is buffered
+
+#define HTTP_SEGMENT_BUFFER 0
+#define HTTP_SEGMENT_FILE 1
+#define HTTP_SEGMENT_SHARED 2
+#define HTTP_SEGMENT_STATIC 3
+
+#define HTTP_CONN_CLIENT 0
+#define HTTP_CONN_UPSTREAM 1 // connection to a proxy upstream, see http_proxy.c
+
+/*
+    Reference counted output, queued on many connections without
+    being copied, such as a WebSocket broadcast frame.
+*/
+struct http_shared
+{
+	int references;
+	size_t length;
+	char data[];
+};
+
+/*
+    A queued piece of response output. Buffer segments own a copy
+    of the data, file segments own the file descriptor and are sent
+    with sendfile() so file content never passes through user space.
+    Shared segments hold a reference to a http_shared buffer,
+    static segments point at read-only memory that is never freed.
+*/
+struct http_segment
+{
+	int type;
+
+	char* data;
+	size_t length;
+	size_t capacity;
+	size_t offset;
+
+	int fd;
+	off_t file_offset;
+
+	struct http_shared* shared;
+	off_t prefetched; // end of the file range read ahead, see http_files.c
+
+	struct http_segment* next;
+};
+
+struct http_conn
+{
+	int fd;
+	int kind;
+	int port; // 0 for Unix socket clients
+	unsigned char addr[16]; // client address, see http_addr_key
+	struct http_listener* listener; // NULL for upstream connections
+
+	// request bytes received but not yet handled
+	char* in;
+	size_t in_length;
+	size_t in_capacity;
+
+	// response bytes not yet accepted by the kernel
+	struct http_segment* out_head;
+	struct http_segment* out_tail;
+	size_t out_queued;
+
+	int keep_alive;
+	int closing; // close once the output queue has drained
+	int reading_paused; // input is not read while out_queued is above the high-water mark
+	int events; // epoll events currently registered
+
+	time_t last_active;
+	int requests;
+	int traced; // phases are recorded, see http_trace.c
+	unsigned int recorded; // id in the traffic capture, 0 if not recorded, see http_record.c
+	int perf_route; // route of the last profiled request + 1, its writes are counted, see http_perf.c
+	int priority; // class of the last routed request, see http_sched.c
+	size_t write_budget; // bytes a flush may send, 0 for no limit
+	int pending; // responses finished off the loop, by an I/O thread (http_files.c) or another worker (http_coalesce.c)
+
+	// proxied exchange, the other side of the exchange and request body still to forward
+	struct http_conn* peer;
+	long body_remaining;
+	struct http_proxy_state* proxy; // upstream connections only
+
+	struct http2_session* h2; // set once the connection speaks HTTP/2
+	struct websocket* ws; // set once the connection speaks WebSocket
+	struct http_tls* tls; // set on connections of HTTPS listeners
+
+	struct http_conn* prev;
+	struct http_conn* next;
+};
+
+struct http_conn* http_conn_new(int fd, int kind);
+void http_conn_free(struct http_conn* conn);
+struct http_conn* http_conn_get(int fd);
+struct http_conn* http_conn_first();
+
+char* http_conn_reserve(struct http_conn* conn, size_t length);
+void http_conn_commit(struct http_conn* conn, size_t length);
+int http_conn_queue_buffer(struct http_conn* conn, const char* data, size_t length);
+int http_conn_queue_file(struct http_conn* conn, int fd, off_t offset, size_t length);
+int http_conn_queue_shared(struct http_conn* conn, struct http_shared* shared);
+int http_conn_queue_static(struct http_conn* conn, const char* data, size_t length);
+void http_conn_queue_segments(struct http_conn* conn, struct http_segment* segments);
+int http_conn_send(int fd, const char* data, size_t length);
+void http_conn_set_capture(struct http_conn* conn);
+struct http_segment* http_conn_detach(struct http_conn* conn);
+void http_segments_free(struct http_segment* segment);
+struct http_shared* http_shared_new(size_t length);
+void http_shared_release(struct http_shared* shared);
+int http_conn_flush(struct http_conn* conn);
+void http_conn_consume(struct http_conn* conn, size_t bytes);
+
+void http_set_highwater(size_t bytes);
+size_t http_get_highwater();
+size_t http_queued_bytes();
+int http_conn_count();
+
+#endif
@@ -0,0 +1,453 @@
+#include "http_server.h"
+#include <sys/eventfd.h>
+#include <pthread.h>
+
+/*
+    File I/O offload
+
+    With http_set_files, http_sendfile no longer opens files on the
+    event loop. Open, fstat and the first read are done by a small
+    pool of I/O threads, so a file that is not in the page cache
+    only delays its own connection. The thread reads the start of
+    the file ahead (all of it for small files) and waits until it is
+    in the page cache, large files are marked sequential. Once done
+    the loop is woken through an eventfd, queues the response and
+    continues with the requests the client pipelined after it.
+
+    Opened descriptors are kept in a direct mapped cache for
+    HTTP_FILES_TTL seconds, a hit queues a dup() of it without any
+    path lookup. Hits whose first page has left the page cache are
+    found with a RWF_NOWAIT read and go through a thread again.
+    While a file segment is sent, the next HTTP_FILES_WINDOW bytes
+    are read ahead by a thread so sendfile finds them in memory.
+
+    HTTP/2 responses are collected while the stream is handled and
+    use the cache, but open synchronously on a miss.
+*/
+
+static int http_files_threads = 0;
+static int http_files_cached = 0;
+
+static struct http_file_entry* http_files_cache = NULL;
+
+static pthread_t http_files_workers[HTTP_FILES_MAX_THREADS];
+static pthread_mutex_t http_files_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t http_files_wake = PTHREAD_COND_INITIALIZER;
+static struct http_file_job* http_files_queue = NULL; // submitted, oldest first
+static struct http_file_job* http_files_queue_tail = NULL;
+static struct http_file_job* http_files_done = NULL; // opens to answer on the loop
+static int http_files_event = -1;
+
+// loop only
+static struct http_file_job* http_files_pending = NULL; // submitted opens
+static int http_files_pendingcount = 0;
+static long http_files_hits = 0;
+static long http_files_opens = 0;
+static long http_files_reopens = 0; // cached but expired or no longer in the page cache
+static long http_files_prefetches = 0;
+
+
+/**************************************************************
+    Summery:
+
+    Offloads file opens and reads to I/O threads and caches open
+    descriptors. Must be called before http_start.
+
+    @PARAMS: number of I/O threads, 0 opens on the loop, number of cached descriptors, 0 for none
+    @returns: VOID
+**************************************************************/
+void http_set_files(int threads, int cached){
+    http_files_threads = threads < 0 ? 0 : threads > HTTP_FILES_MAX_THREADS ? HTTP_FILES_MAX_THREADS : threads;
+    http_files_cached = cached < 0 ? 0 : cached;
+}
+
+/**************************************************************
+    Summery:
+
+    Opens a file and reads its start into the page cache, called
+    by the I/O threads or on the loop without them.
+
+    @PARAMS: job, wait for the read ahead
+    @returns: VOID, job->fd is the file or -1 with job->error set.
+**************************************************************/
+static void http_files_open(struct http_file_job* job, int warm){
+
+    job->fd = open(job->path, O_RDONLY | O_CLOEXEC);
+    if(job->fd < 0){
+        job->error = errno;
+        return;
+    }
+
+    if(fstat(job->fd, &job->info) == -1 || !S_ISREG(job->info.st_mode)){
+        job->error = EISDIR;
+        close(job->fd);
+        job->fd = -1;
+        return;
+    }
+
+    off_t window = job->info.st_size < HTTP_FILES_WINDOW ? job->info.st_size : HTTP_FILES_WINDOW;
+    if(job->info.st_size > HTTP_FILES_WINDOW)
+        posix_fadvise(job->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    if(!warm || window == 0)
+        return;
+
+    // readahead may return before the reads complete, waiting for the last page waits for the window
+    char byte;
+    readahead(job->fd, 0, window);
+    pread(job->fd, &byte, 1, window-1);
+}
+
+/**************************************************************
+    Runs jobs until the process exits
+**************************************************************/
+static void* http_files_thread(void* arg){
+    (void)arg;
+
+    while(1){
+        pthread_mutex_lock(&http_files_lock);
+        while(http_files_queue == NULL)
+            pthread_cond_wait(&http_files_wake, &http_files_lock);
+        struct http_file_job* job = http_files_queue;
+        http_files_queue = job->next;
+        if(http_files_queue == NULL)
+            http_files_queue_tail = NULL;
+        pthread_mutex_unlock(&http_files_lock);
+
+        if(job->type == HTTP_FILE_PREFETCH){
+            readahead(job->fd, job->offset, job->length);
+            close(job->fd);
+            free(job);
+            continue;
+        }
+
+        http_files_open(job, 1);
+
+        pthread_mutex_lock(&http_files_lock);
+        job->next = http_files_done;
+        http_files_done = job;
+        pthread_mutex_unlock(&http_files_lock);
+        eventfd_write(http_files_event, 1);
+    }
+    return NULL;
+}
+
+/**************************************************************
+    Hands a job to the I/O threads
+**************************************************************/
+static void http_files_submit(struct http_file_job* job){
+    pthread_mutex_lock(&http_files_lock);
+    job->next = NULL;
+    if(http_files_queue_tail != NULL)
+        http_files_queue_tail->next = job;
+    else
+        http_files_queue = job;
+    http_files_queue_tail = job;
+    pthread_cond_signal(&http_files_wake);
+    pthread_mutex_unlock(&http_files_lock);
+}
+
+/**************************************************************
+    Summery:
+
+    Starts the I/O threads of this process and watches their
+    completions, called by http_start after the workers are forked.
+
+    @PARAMS: epoll fd
+    @returns: VOID
+**************************************************************/
+void http_files_start(int epoll_fd){
+
+    if(http_files_cached > 0)
+        http_files_cache = calloc(http_files_cached, sizeof(struct http_file_entry));
+    if(http_files_threads == 0)
+        return;
+
+    http_files_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(http_files_event < 0){
+        perror("eventfd");
+        http_files_threads = 0;
+        return;
+    }
+
+    // signals are left to the loop
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    for (int i = 0; i < http_files_threads; ++i)
+    {
+        if(pthread_create(&http_files_workers[i], NULL, http_files_thread, NULL) != 0){
+            http_files_threads = i;
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = http_files_event;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, http_files_event, &event);
+
+    printf(KBLU "[STARTUP] %d I/O threads, %d cached files\n" KWHT, http_files_threads, http_files_cached);
+}
+
+int http_files_fd(){
+    return http_files_event;
+}
+
+/**************************************************************
+    Summery:
+
+    Queues the header and the file of a response.
+
+    @PARAMS: connection, header without Content-Length, HEAD request, fd owned by the response, size
+    @returns: VOID
+**************************************************************/
+static void http_files_respond(struct http_conn* conn, char* header, int head, int fd, off_t size){
+
+    size_t length = strlen(header);
+    char buff[length+64];
+    memcpy(buff, header, length);
+    if(!head)
+        length += sprintf(buff+length, "Content-Length: %ld", (long)size);
+    memcpy(buff+length, "\n\n", 2);
+    length += 2;
+
+    http_conn_queue_buffer(conn, buff, length);
+
+    // the connection now owns fd
+    if(head || size == 0){
+        close(fd);
+        return;
+    }
+    http_conn_queue_file(conn, fd, 0, size);
+    conn->out_tail->prefetched = size < HTTP_FILES_WINDOW ? size : HTTP_FILES_WINDOW;
+}
+
+/**************************************************************
+    Summery:
+
+    Answers a finished open, the descriptor is added to the cache
+    and the response gets a duplicate of it.
+
+    @PARAMS: connection, finished job
+    @returns: VOID
+**************************************************************/
+static void http_files_answer(struct http_conn* conn, struct http_file_job* job){
+
+    if(job->fd < 0){
+        http_404(conn->fd);
+        return;
+    }
+
+    int fd = job->fd;
+    if(http_files_cache != NULL){
+        struct http_file_entry* entry = &http_files_cache[http_bundle_hash(job->path, strlen(job->path), 0) % http_files_cached];
+        int response = dup(fd);
+        if(response >= 0){
+            if(entry->path != NULL){
+                close(entry->fd);
+                free(entry->path);
+            }
+            entry->path = strdup(job->path);
+            entry->fd = fd;
+            entry->size = job->info.st_size;
+            entry->opened = time(NULL);
+            fd = response;
+        }
+    }
+    http_files_respond(conn, job->header, job->head, fd, job->info.st_size);
+}
+
+/**************************************************************
+    Tests if the first page of a cached file is in the page cache
+**************************************************************/
+static int http_files_warm(struct http_file_entry* entry){
+    if(entry->size == 0 || http_files_threads == 0)
+        return 1;
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    return preadv2(entry->fd, &iov, 1, 0, RWF_NOWAIT) >= 0 || errno != EAGAIN;
+}
+
+/**************************************************************
+    Summery:
+
+    Sends a file with the given header. Served from the cache if
+    it is there, otherwise opened by an I/O thread and answered
+    once it is read: reading further requests of the connection
+    waits until then.
+
+    @PARAMS: connection, path, status line and headers without Content-Length, HEAD request
+    @returns: VOID
+**************************************************************/
+void http_files_send(struct http_conn* conn, char* path, char* header, int head){
+
+    struct http_file_entry* entry = NULL;
+    if(http_files_cache != NULL){
+        entry = &http_files_cache[http_bundle_hash(path, strlen(path), 0) % http_files_cached];
+        if(entry->path == NULL || strcmp(entry->path, path) != 0)
+            entry = NULL;
+    }
+
+    if(entry != NULL && time(NULL)-entry->opened < HTTP_FILES_TTL && http_files_warm(entry)){
+        int fd = dup(entry->fd);
+        if(fd >= 0){
+            http_files_hits++;
+            http_files_respond(conn, header, head, fd, entry->size);
+            return;
+        }
+    }
+
+    // HTTP/2 streams are collected on a connection that is not in the table, they can not wait
+    if(http_files_threads > 0 && http_conn_get(conn->fd) == conn){
+        struct http_file_job* job = calloc(1, sizeof(struct http_file_job));
+        if(job != NULL && (job->path = strdup(path)) != NULL && (job->header = strdup(header)) != NULL){
+            job->type = HTTP_FILE_OPEN;
+            job->conn = conn;
+            job->head = head;
+            job->fd = -1;
+
+            job->pending_next = http_files_pending;
+            if(http_files_pending != NULL)
+                http_files_pending->pending_prev = job;
+            http_files_pending = job;
+            http_files_pendingcount++;
+            conn->pending++;
+
+            if(entry != NULL)
+                http_files_reopens++;
+            else
+                http_files_opens++;
+            http_files_submit(job);
+            return;
+        }
+        if(job != NULL){
+            free(job->path);
+            free(job);
+        }
+    }
+
+    struct http_file_job job;
+    memset(&job, 0, sizeof(job));
+    job.path = path;
+    job.header = header;
+    job.head = head;
+    http_files_open(&job, 0);
+    http_files_opens++;
+    http_files_answer(conn, &job);
+}
+
+/**************************************************************
+    Answers finished opens, called when the eventfd is readable
+**************************************************************/
+void http_files_complete(){
+
+    eventfd_t count;
+    eventfd_read(http_files_event, &count);
+
+    pthread_mutex_lock(&http_files_lock);
+    struct http_file_job* job = http_files_done;
+    http_files_done = NULL;
+    pthread_mutex_unlock(&http_files_lock);
+
+    while(job != NULL){
+        struct http_file_job* next = job->next;
+
+        if(job->pending_prev != NULL)
+            job->pending_prev->pending_next = job->pending_next;
+        else
+            http_files_pending = job->pending_next;
+        if(job->pending_next != NULL)
+            job->pending_next->pending_prev = job->pending_prev;
+        http_files_pendingcount--;
+
+        struct http_conn* conn = job->conn;
+        if(conn == NULL){
+            if(job->fd >= 0)
+                close(job->fd);
+        } else {
+            conn->pending--;
+            http_files_answer(conn, job);
+            // continue with pipelined requests, then send
+            if(conn->pending == 0)
+                http_process(conn);
+            http_write(conn);
+        }
+
+        free(job->path);
+        free(job->header);
+        free(job);
+        job = next;
+    }
+}
+
+/**************************************************************
+    Summery:
+
+    Reads the next window of a file segment ahead, called before
+    every sendfile. Does nothing while the read ahead is more than
+    half a window in front.
+
+    @PARAMS: file segment
+    @returns: VOID
+**************************************************************/
+void http_files_prefetch(struct http_segment* segment){
+
+    if(http_files_threads == 0)
+        return;
+
+    off_t end = segment->file_offset+segment->length;
+    if(segment->prefetched >= end || segment->file_offset+HTTP_FILES_WINDOW/2 < segment->prefetched)
+        return;
+
+    struct http_file_job* job = calloc(1, sizeof(struct http_file_job));
+    if(job == NULL)
+        return;
+    job->fd = dup(segment->fd);
+    if(job->fd < 0){
+        free(job);
+        return;
+    }
+    job->type = HTTP_FILE_PREFETCH;
+    job->offset = segment->prefetched > segment->file_offset ? segment->prefetched : segment->file_offset;
+    job->length = HTTP_FILES_WINDOW;
+    segment->prefetched = job->offset+HTTP_FILES_WINDOW;
+
+    http_files_prefetches++;
+    http_files_submit(job);
+}
+
+/**************************************************************
+    Detaches a closed connection from its unfinished opens
+**************************************************************/
+void http_files_cancel(struct http_conn* conn){
+    for (struct http_file_job* job = http_files_pending; job != NULL; job = job->pending_next)
+    {
+        if(job->conn == conn)
+            job->conn = NULL;
+    }
+    conn->pending = 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Writes cache hits, opens and read aheads of this process.
+
+    @PARAMS: buffer, size of buffer
+    @returns: length written
+**************************************************************/
+int http_files_stats(char* buffer, size_t size){
+
+    int cached = 0;
+    for (int i = 0; i < http_files_cached; ++i)
+    {
+        if(http_files_cache != NULL && http_files_cache[i].path != NULL)
+            cached++;
+    }
+
+    int length = snprintf(buffer, size, "threads %d cached %d/%d hits %ld opens %ld reopens %ld prefetches %ld pending %d\n",
+        http_files_threads, cached, http_files_cached, http_files_hits, http_files_opens, http_files_reopens, http_files_prefetches,
+        http_files_pendingcount);
+    return length < (int)size ? length : (int)size-1;
+}
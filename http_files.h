@@ -0,0 +1,63 @@
+#ifndef __HTTP_FILES_H
+#define __HTTP_FILES_H
+
+#include "syshead.h"
+#include "http_conn.h"
+
+#define HTTP_FILES_MAX_THREADS 16
+#define HTTP_FILES_TTL 2 // seconds a cached descriptor is used before the file is opened again
+#define HTTP_FILES_WINDOW (2*1024*1024) // bytes read ahead of sendfile
+
+#define HTTP_FILE_OPEN 0 // open, fstat and read ahead, answered on the event loop
+#define HTTP_FILE_PREFETCH 1 // read ahead of a queued file segment, no answer
+
+/*
+    Work for the I/O threads. The loop owns conn, pending_prev and
+    pending_next, a thread owns the result until it is done.
+*/
+struct http_file_job
+{
+	int type;
+	char* path;
+	int fd; // prefetch: a duplicate closed by the thread
+	off_t offset;
+	size_t length;
+
+	// response of an open, conn is NULL once the connection closed
+	struct http_conn* conn;
+	char* header; // status line and headers without Content-Length
+	int head;
+
+	// result
+	int error;
+	struct stat info;
+
+	struct http_file_job* next;
+	struct http_file_job* pending_prev;
+	struct http_file_job* pending_next;
+};
+
+/*
+    Open descriptor of a served file, shared by all responses
+    through dup().
+*/
+struct http_file_entry
+{
+	char* path; // NULL for an empty slot
+	int fd;
+	off_t size;
+	time_t opened;
+};
+
+struct http_segment;
+
+void http_set_files(int threads, int cached);
+void http_files_start(int epoll_fd);
+int http_files_fd();
+void http_files_send(struct http_conn* conn, char* path, char* header, int head);
+void http_files_complete();
+void http_files_prefetch(struct http_segment* segment);
+void http_files_cancel(struct http_conn* conn);
+int http_files_stats(char* buffer, size_t size);
+
+#endif
@@ -0,0 +1,461 @@
+#include "http_server.h"
+#include <netdb.h>
+
+/*
+    Listeners
+
+    http_listen adds a listening socket given as an address:
+
+        "8081"              TCP on all IPv4 addresses
+        "127.0.0.1:8081"    TCP on one IPv4 address
+        "[::]:8081"         TCP on all IPv6 addresses (and IPv4 unless IPV6_V6ONLY)
+        "[::1]:8081"        TCP on one IPv6 address
+        "unix:/tmp/s.sock"  Unix domain stream socket
+
+    Every listener has its own backlog and socket options, set
+    with http_listen_option before http_start opens it. Local
+    clients such as a sidecar or a reverse proxy can use a Unix
+    socket and skip the TCP stack.
+
+    With workers the listener of http_start is opened once per
+    worker in a SO_REUSEPORT group, all others are opened once
+    before the fork and shared, registered with EPOLLEXCLUSIVE so
+    a connection wakes only one worker.
+
+    TCP listeners share a tuning profile, chosen with
+    http_set_tuning. All of its options are set on the listener
+    before bind, Linux copies them into every accepted socket so
+    accepting costs no extra system calls. Options of
+    http_listen_option are applied after the profile and override
+    it.
+*/
+
+struct http_listener http_listeners[NUMBER_OF_LISTENERS];
+int http_listenercounter = 0;
+
+/*
+    latency: the first read finds the request, no Nagle delay on
+    split writes, small unsent queues and busy polling.
+    throughput: large send buffers and unsent queues for downloads.
+*/
+static const struct http_tuning http_tunings[] = {
+    { .name = "default" },
+    { .name = "latency", .defer_accept = 3, .fastopen = 256, .nodelay = 1, .busy_poll = 50, .notsent_lowat = 16384 },
+    { .name = "throughput", .defer_accept = 3, .fastopen = 256, .sndbuf = 4*1024*1024, .notsent_lowat = 1024*1024 },
+};
+
+static struct http_tuning http_tuning = { .name = "default" };
+
+
+/**************************************************************
+    Summery:
+
+    Parses a listener address.
+
+    @PARAMS: address, socket address (out), length of socket address (out)
+    @returns: 0 on success, -1 on error.
+**************************************************************/
+static int http_listen_address(char* address, struct sockaddr_storage* addr, socklen_t* length){
+
+    memset(addr, 0, sizeof(struct sockaddr_storage));
+
+    if(strncmp(address, "unix:", 5) == 0){
+        struct sockaddr_un* un = (struct sockaddr_un*)addr;
+        if(strlen(address+5) == 0 || strlen(address+5) >= sizeof(un->sun_path))
+            return -1;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, address+5);
+        *length = sizeof(struct sockaddr_un);
+        return 0;
+    }
+
+    char host[128];
+    char* port = strrchr(address, ':');
+    if(port == NULL){
+        // port only, all IPv4 addresses as before
+        strcpy(host, "0.0.0.0");
+        port = address;
+    } else {
+        size_t host_length = port-address;
+        port++;
+        if(address[0] == '[' && host_length >= 2 && address[host_length-1] == ']'){
+            address++;
+            host_length -= 2;
+        }
+        if(host_length >= sizeof(host))
+            return -1;
+        memcpy(host, address, host_length);
+        host[host_length] = 0;
+        if(host_length == 0)
+            strcpy(host, "0.0.0.0");
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+
+    struct addrinfo* result;
+    if(getaddrinfo(host, port, &hints, &result) != 0)
+        return -1;
+
+    memcpy(addr, result->ai_addr, result->ai_addrlen);
+    *length = result->ai_addrlen;
+    freeaddrinfo(result);
+    return 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Adds a listener, opened by http_start.
+
+    @PARAMS: address (see above), backlog, 0 for the default backlog
+    @returns: listener number, -1 on error.
+**************************************************************/
+int http_listen(char* address, int backlog){
+
+    if(http_listenercounter == NUMBER_OF_LISTENERS || strlen(address) >= sizeof(http_listeners[0].address))
+        return -1;
+
+    struct http_listener* listener = &http_listeners[http_listenercounter];
+    memset(listener, 0, sizeof(struct http_listener));
+
+    if(http_listen_address(address, &listener->addr, &listener->addr_length) < 0){
+        printf(KRED "%s %s\n" KWHT, "[ERROR] Invalid listen address", address);
+        return -1;
+    }
+
+    strcpy(listener->address, address);
+    listener->fd = -1;
+    listener->backlog = backlog;
+
+    return http_listenercounter++;
+}
+
+/**************************************************************
+    Summery:
+
+    Sets an integer socket option on a listener, applied before
+    it is bound. Accepted connections inherit most options.
+
+    @PARAMS: listener number, level, option name, value
+    @returns: 0 on success, -1 on error.
+**************************************************************/
+int http_listen_option(int listener, int level, int name, int value){
+
+    if(listener < 0 || listener >= http_listenercounter)
+        return -1;
+
+    struct http_listener* entry = &http_listeners[listener];
+    if(entry->optioncount == HTTP_LISTEN_MAX_OPTIONS)
+        return -1;
+
+    entry->options[entry->optioncount].level = level;
+    entry->options[entry->optioncount].name = name;
+    entry->options[entry->optioncount].value = value;
+    entry->optioncount++;
+    return 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Selects the tuning profile of TCP listeners: "default" (kernel
+    defaults), "latency" or "throughput". Values can be changed
+    through http_get_tuning before http_start.
+
+    @PARAMS: profile name, NULL keeps the current profile
+    @returns: 0 on success, -1 if the profile is unknown.
+**************************************************************/
+int http_set_tuning(char* profile){
+    if(profile == NULL)
+        return 0;
+
+    for (size_t i = 0; i < sizeof(http_tunings)/sizeof(http_tunings[0]); ++i)
+    {
+        if(strcmp(http_tunings[i].name, profile) == 0){
+            http_tuning = http_tunings[i];
+            return 0;
+        }
+    }
+    printf(KRED "%s %s\n" KWHT, "[ERROR] Unknown tuning profile", profile);
+    return -1;
+}
+
+struct http_tuning* http_get_tuning(){
+    return &http_tuning;
+}
+
+/**************************************************************
+    Sets an integer option if value is not 0, errors are printed
+**************************************************************/
+static int http_tuning_option(int fd, int level, int name, int value, char* label){
+    if(value == 0)
+        return 0;
+    if(setsockopt(fd, level, name, &value, sizeof(int)) < 0){
+        printf(KRED "[ERROR] Tuning %s %d: %s\n" KWHT, label, value, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**************************************************************
+    Reads back an integer option for the startup log
+**************************************************************/
+static int http_tuning_value(int fd, int level, int name){
+    int value = 0;
+    socklen_t length = sizeof(value);
+    getsockopt(fd, level, name, &value, &length);
+    return value;
+}
+
+/**************************************************************
+    Summery:
+
+    Applies the tuning profile to a new TCP listener.
+
+    @PARAMS: fd not yet bound
+    @returns: VOID
+**************************************************************/
+static void http_tuning_apply(int fd){
+
+    http_tuning_option(fd, SOL_SOCKET, SO_RCVBUF, http_tuning.rcvbuf, "SO_RCVBUF");
+    http_tuning_option(fd, SOL_SOCKET, SO_SNDBUF, http_tuning.sndbuf, "SO_SNDBUF");
+    http_tuning_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, http_tuning.defer_accept, "TCP_DEFER_ACCEPT");
+    static int checked = 0;
+    if(http_tuning_option(fd, IPPROTO_TCP, TCP_FASTOPEN, http_tuning.fastopen, "TCP_FASTOPEN") == 0 && http_tuning.fastopen > 0 && !checked){
+        // servers answer Fast Open only with bit 2 of the sysctl
+        checked = 1;
+        FILE* sysctl = fopen("/proc/sys/net/ipv4/tcp_fastopen", "r");
+        int mode = 1;
+        if(sysctl != NULL){
+            if(fscanf(sysctl, "%d", &mode) != 1)
+                mode = 1;
+            fclose(sysctl);
+        }
+        if(!(mode & 2))
+            printf(KRED "[ERROR] TCP Fast Open is off for servers, set net.ipv4.tcp_fastopen to 3\n" KWHT);
+    }
+
+    // accepted sockets inherit these
+    http_tuning_option(fd, IPPROTO_TCP, TCP_NODELAY, http_tuning.nodelay, "TCP_NODELAY");
+    http_tuning_option(fd, SOL_SOCKET, SO_BUSY_POLL, http_tuning.busy_poll, "SO_BUSY_POLL");
+    http_tuning_option(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, http_tuning.notsent_lowat, "TCP_NOTSENT_LOWAT");
+}
+
+/**************************************************************
+    Summery:
+
+    Prints the values the kernel uses for a TCP listener, once
+    the profile and the listener options are set. Buffer sizes
+    are shown doubled as the kernel keeps room for overhead.
+
+    @PARAMS: listener, fd
+    @returns: VOID
+**************************************************************/
+static void http_tuning_log(struct http_listener* listener, int fd){
+    printf(KBLU "[STARTUP] Listener %s tuning %s: defer_accept %d, fastopen %d, nodelay %d, rcvbuf %d, sndbuf %d, busy_poll %d, notsent_lowat %d\n" KWHT,
+        listener->address, http_tuning.name, http_tuning_value(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT), http_tuning_value(fd, IPPROTO_TCP, TCP_FASTOPEN),
+        http_tuning_value(fd, IPPROTO_TCP, TCP_NODELAY), http_tuning_value(fd, SOL_SOCKET, SO_RCVBUF), http_tuning_value(fd, SOL_SOCKET, SO_SNDBUF),
+        http_tuning_value(fd, SOL_SOCKET, SO_BUSY_POLL), http_tuning_value(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT));
+}
+
+struct http_listener* http_listen_get(int listener){
+    if(listener < 0 || listener >= http_listenercounter)
+        return NULL;
+    return &http_listeners[listener];
+}
+
+/**************************************************************
+    Summery:
+
+    Returns the listener spread over workers: the listener of
+    http_start, else the first TCP listener.
+
+    @PARAMS: VOID
+    @returns: listener, NULL if there is no TCP listener.
+**************************************************************/
+struct http_listener* http_listen_main(){
+    for (int i = 0; i < http_listenercounter; ++i)
+    {
+        if(http_listeners[i].steered)
+            return &http_listeners[i];
+    }
+    for (int i = 0; i < http_listenercounter; ++i)
+    {
+        if(http_listeners[i].addr.ss_family != AF_UNIX)
+            return &http_listeners[i];
+    }
+    return NULL;
+}
+
+/**************************************************************
+    Summery:
+
+    Opens a non blocking socket for a listener. Exits the program
+    if the address can not be used.
+
+    @PARAMS: listener, join a SO_REUSEPORT group
+    @returns: listener fd
+**************************************************************/
+int http_listen_socket(struct http_listener* listener, int reuseport){
+
+    int family = listener->addr.ss_family;
+    int fd;
+
+    if ((fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+    {
+        perror("FD socket");
+        exit(EXIT_FAILURE);
+    }
+
+    if(family == AF_UNIX){
+        // a socket file left by an earlier run would fail the bind
+        struct stat info;
+        char* path = ((struct sockaddr_un*)&listener->addr)->sun_path;
+        if(stat(path, &info) == 0 && S_ISSOCK(info.st_mode))
+            unlink(path);
+    } else {
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0)
+            exit(1);
+        if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0)
+            exit(1);
+    }
+
+    if(family != AF_UNIX)
+        http_tuning_apply(fd);
+
+    for (int i = 0; i < listener->optioncount; ++i)
+    {
+        struct http_listen_option* option = &listener->options[i];
+        if(setsockopt(fd, option->level, option->name, &option->value, sizeof(int)) < 0)
+            printf(KRED "[ERROR] Listener %s: socket option %d/%d: %s\n" KWHT, listener->address, option->level, option->name, strerror(errno));
+    }
+    if(family != AF_UNIX && !listener->logged){
+        http_tuning_log(listener, fd);
+        listener->logged = 1;
+    }
+
+    if (bind(fd, (struct sockaddr *)&listener->addr, listener->addr_length) < 0)
+    {
+        perror("Bind");
+        exit(EXIT_FAILURE);
+    }
+
+    if (listen(fd, listener->backlog > 0 ? listener->backlog : http_get_backlog()) < 0)
+    {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+
+    return fd;
+}
+
+/**************************************************************
+    Opens all listeners that are not opened per worker
+**************************************************************/
+void http_listen_open(){
+    for (int i = 0; i < http_listenercounter; ++i)
+    {
+        struct http_listener* listener = &http_listeners[i];
+        if(listener->steered && http_worker_count() > 0)
+            continue;
+
+        listener->fd = http_listen_socket(listener, 0);
+        printf(KBLU "[STARTUP] Listening on %s%s\n" KWHT, listener->address, listener->tls != NULL ? " (HTTPS)" : "");
+    }
+}
+
+/**************************************************************
+    Summery:
+
+    Closes all listeners of this process.
+
+    @PARAMS: remove Unix socket files, not while other workers use them
+    @returns: VOID
+**************************************************************/
+void http_listen_close(int remove){
+    for (int i = 0; i < http_listenercounter; ++i)
+    {
+        struct http_listener* listener = &http_listeners[i];
+        if(listener->fd < 0)
+            continue;
+
+        close(listener->fd);
+        listener->fd = -1;
+        if(listener->addr.ss_family == AF_UNIX && remove)
+            unlink(((struct sockaddr_un*)&listener->addr)->sun_path);
+    }
+}
+
+/**************************************************************
+    Summery:
+
+    Adds all open listeners to the event loop. Listeners shared
+    by workers wake only one of them per connection.
+
+    @PARAMS: epoll fd
+    @returns: VOID
+**************************************************************/
+void http_listen_watch(int epoll_fd){
+    for (int i = 0; i < http_listenercounter; ++i)
+    {
+        struct http_listener* listener = &http_listeners[i];
+        if(listener->fd < 0)
+            continue;
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        if(http_worker_count() > 0 && !listener->steered)
+            event.events |= EPOLLEXCLUSIVE;
+        event.data.fd = listener->fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener->fd, &event);
+    }
+}
+
+/**************************************************************
+    Returns the listener with given fd, NULL if fd is no listener
+**************************************************************/
+struct http_listener* http_listener_get(int fd){
+    for (int i = 0; i < http_listenercounter; ++i)
+    {
+        if(http_listeners[i].fd == fd)
+            return &http_listeners[i];
+    }
+    return NULL;
+}
+
+/**************************************************************
+    Counts a closed connection of a listener
+**************************************************************/
+void http_listen_closed(struct http_conn* conn){
+    if(conn->listener != NULL)
+        conn->listener->connections--;
+    conn->listener = NULL;
+}
+
+/**************************************************************
+    Summery:
+
+    Writes one line per listener with its connection counts.
+    With workers the counts are those of the calling worker.
+
+    @PARAMS: buffer, size of buffer
+    @returns: length written
+**************************************************************/
+int http_listen_stats(char* buffer, size_t size){
+
+    size_t length = 0;
+    for (int i = 0; i < http_listenercounter && length < size; ++i)
+    {
+        struct http_listener* listener = &http_listeners[i];
+        length += snprintf(buffer+length, size-length, "listener %s%s backlog %d tuning %s connections %d accepted %ld\n", listener->address,
+            listener->tls != NULL ? " https" : "", listener->backlog > 0 ? listener->backlog : http_get_backlog(),
+            listener->addr.ss_family == AF_UNIX ? "-" : http_tuning.name, listener->connections, listener->accepted);
+    }
+    if(length == 0 && size > 0)
+        buffer[0] = 0;
+    return length < size ? length : size-1;
+}
@@ -0,0 +1,72 @@
+#ifndef __HTTP_LISTEN_H
+#define __HTTP_LISTEN_H
+
+#include "syshead.h"
+#include "http_conn.h"
+
+#include <openssl/ssl.h>
+
+#define NUMBER_OF_LISTENERS 16
+#define HTTP_LISTEN_MAX_OPTIONS 8
+
+struct http_listen_option
+{
+	int level;
+	int name;
+	int value;
+};
+
+/*
+    Socket tuning of TCP listeners, inherited by their accepted
+    sockets. 0 leaves the kernel default. See http_set_tuning.
+*/
+struct http_tuning
+{
+	const char* name;
+	int defer_accept; // TCP_DEFER_ACCEPT, seconds to wait for the first bytes before accept
+	int fastopen; // TCP_FASTOPEN, queue of pending Fast Open requests
+	int rcvbuf; // SO_RCVBUF, bytes
+	int sndbuf; // SO_SNDBUF, bytes
+	int nodelay; // TCP_NODELAY
+	int busy_poll; // SO_BUSY_POLL, us to busy poll the device queue on reads
+	int notsent_lowat; // TCP_NOTSENT_LOWAT, unsent bytes above which the socket is not writable
+};
+
+/*
+    A listening socket, TCP over IPv4 or IPv6 or a Unix domain
+    stream socket. All listeners are served by the same loop.
+*/
+struct http_listener
+{
+	char address[128]; // as given to http_listen
+	struct sockaddr_storage addr;
+	socklen_t addr_length;
+	int fd;
+	int backlog;
+	int steered; // opened once per worker, see http_worker.c
+	int logged; // tuning was printed, once for all sockets of a SO_REUSEPORT group
+	SSL_CTX* tls; // NULL for plain HTTP
+
+	struct http_listen_option options[HTTP_LISTEN_MAX_OPTIONS];
+	int optioncount;
+
+	// for stats, per process
+	long accepted;
+	int connections;
+};
+
+int http_listen(char* address, int backlog);
+int http_listen_option(int listener, int level, int name, int value);
+int http_set_tuning(char* profile);
+struct http_tuning* http_get_tuning();
+struct http_listener* http_listen_get(int listener);
+struct http_listener* http_listen_main();
+int http_listen_socket(struct http_listener* listener, int reuseport);
+void http_listen_open();
+void http_listen_watch(int epoll_fd);
+void http_listen_close(int remove);
+struct http_listener* http_listener_get(int fd);
+void http_listen_closed(struct http_conn* conn);
+int http_listen_stats(char* buffer, size_t size);
+
+#endif
@@ -0,0 +1,244 @@
+#include "http_params.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+    Key/value indexes for query strings, form bodies and cookies.
+
+    The raw string is scanned once, 16 bytes at a time with SSE2
+    where available, for the separator, '=', '%' and '+'. Bytes
+    in between are copied as runs into the decoded memory. Keys are
+    indexed in a small open addressing table, repeated keys are
+    chained so every value of a key can be listed.
+*/
+
+
+/**************************************************************
+    Summery:
+
+    Returns the first separator, '=', '%' or '+' at or after p.
+
+    @PARAMS: start, end of string, separator
+    @returns: pointer to special byte, end if none.
+**************************************************************/
+static const char* http_params_scan(const char* p, const char* end, char separator){
+#ifdef __SSE2__
+    const __m128i separators = _mm_set1_epi8(separator);
+    const __m128i equals = _mm_set1_epi8('=');
+    const __m128i percents = _mm_set1_epi8('%');
+    const __m128i pluses = _mm_set1_epi8('+');
+
+    while(end-p >= 16){
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, separators), _mm_cmpeq_epi8(chunk, equals)),
+                                    _mm_or_si128(_mm_cmpeq_epi8(chunk, percents), _mm_cmpeq_epi8(chunk, pluses)));
+        int mask = _mm_movemask_epi8(hits);
+        if(mask != 0)
+            return p+__builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    while(p < end && *p != separator && *p != '=' && *p != '%' && *p != '+')
+        p++;
+    return p;
+}
+
+/**************************************************************
+    Returns value of a hex digit, -1 if c is not one
+**************************************************************/
+static int http_params_hex(char c){
+    if(c >= '0' && c <= '9')
+        return c-'0';
+    if(c >= 'a' && c <= 'f')
+        return c-'a'+10;
+    if(c >= 'A' && c <= 'F')
+        return c-'A'+10;
+    return -1;
+}
+
+/**************************************************************
+    FNV-1a hash of a key
+**************************************************************/
+static unsigned int http_params_hash(const char* key){
+    unsigned int hash = 2166136261u;
+    while(*key){
+        hash ^= (unsigned char)*key++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**************************************************************
+    Summery:
+
+    Adds a decoded pair to the index. Empty keys are skipped.
+
+    @PARAMS: index, zero terminated key, zero terminated value
+    @returns: void
+**************************************************************/
+static void http_params_add(struct http_params* params, char* key, char* value){
+
+    if(key[0] == 0 || params->total == HTTP_MAX_PARAMS)
+        return;
+
+    struct http_param* entry = &params->entries[params->total];
+    entry->key = key;
+    entry->value = value;
+    entry->hash = http_params_hash(key);
+    entry->next = -1;
+
+    int slot = entry->hash & (HTTP_PARAMS_SLOTS-1);
+    while(params->slots[slot] != 0){
+        int index = params->slots[slot]-1;
+        if(params->entries[index].hash == entry->hash && strcmp(params->entries[index].key, key) == 0){
+            // repeated key, append to its chain
+            while(params->entries[index].next >= 0)
+                index = params->entries[index].next;
+            params->entries[index].next = params->total;
+            params->total++;
+            return;
+        }
+        slot = (slot+1) & (HTTP_PARAMS_SLOTS-1);
+    }
+
+    params->slots[slot] = params->total+1;
+    params->total++;
+}
+
+/**************************************************************
+    Summery:
+
+    Parses raw into the index. Query strings and form bodies use
+    '&' and are percent and '+' decoded, cookies use ';' and are
+    taken as they are with leading spaces trimmed from names.
+    Does nothing if the index has already been parsed.
+
+    @PARAMS: index, raw string (may be NULL), length, separator, decode
+    @returns: number of pairs indexed, -1 on error.
+**************************************************************/
+int http_params_parse(struct http_params* params, const char* raw, size_t length, char separator, int decode){
+
+    if(params->parsed)
+        return params->total;
+
+    params->parsed = 1;
+    params->total = 0;
+    memset(params->slots, 0, sizeof(params->slots));
+
+    if(raw == NULL || length == 0)
+        return 0;
+
+    // decoded text never grows, plus a terminator for each key and value
+    params->memory = malloc(length*2+2);
+    if(params->memory == NULL)
+        return -1;
+
+    char* out = params->memory;
+    char* key = out;
+    char* value = NULL;
+    const char* p = raw;
+    const char* end = raw+length;
+
+    if(!decode)
+        while(p < end && *p == ' ')
+            p++;
+
+    while(p < end){
+        const char* special = http_params_scan(p, end, separator);
+        memcpy(out, p, special-p);
+        out += special-p;
+        p = special;
+        if(p == end)
+            break;
+
+        char c = *p++;
+        if(c == separator){
+            *out++ = 0;
+            if(value == NULL)
+                value = out-1;
+            http_params_add(params, key, value);
+
+            key = out;
+            value = NULL;
+            if(!decode)
+                while(p < end && *p == ' ')
+                    p++;
+        } else if(c == '=' && value == NULL){
+            *out++ = 0;
+            value = out;
+        } else if(c == '%' && decode && end-p >= 2 && http_params_hex(p[0]) >= 0 && http_params_hex(p[1]) >= 0){
+            *out++ = (http_params_hex(p[0]) << 4) | http_params_hex(p[1]);
+            p += 2;
+        } else if(c == '+' && decode){
+            *out++ = ' ';
+        } else {
+            *out++ = c;
+        }
+    }
+
+    *out++ = 0;
+    if(value == NULL)
+        value = out-1;
+    http_params_add(params, key, value);
+
+    return params->total;
+}
+
+/**************************************************************
+    Summery:
+
+    Returns the first value of key.
+
+    @PARAMS: parsed index, key
+    @returns: decoded value, NULL if key is not present.
+**************************************************************/
+char* http_params_get(struct http_params* params, const char* key){
+    char* value = NULL;
+    http_params_get_all(params, key, &value, 1);
+    return value;
+}
+
+/**************************************************************
+    Summery:
+
+    Lists the values of a key that was given more than once,
+    in the order they appeared.
+
+    @PARAMS: parsed index, key, array for values, size of array
+    @returns: number of values stored in values.
+**************************************************************/
+int http_params_get_all(struct http_params* params, const char* key, char** values, int max){
+
+    if(params->total == 0)
+        return 0;
+
+    unsigned int hash = http_params_hash(key);
+    int slot = hash & (HTTP_PARAMS_SLOTS-1);
+
+    while(params->slots[slot] != 0){
+        int index = params->slots[slot]-1;
+        if(params->entries[index].hash == hash && strcmp(params->entries[index].key, key) == 0){
+            int total = 0;
+            for (; index >= 0 && total < max; index = params->entries[index].next)
+            {
+                values[total] = params->entries[index].value;
+                total++;
+            }
+            return total;
+        }
+        slot = (slot+1) & (HTTP_PARAMS_SLOTS-1);
+    }
+    return 0;
+}
+
+/**************************************************************
+    Frees the decoded memory, the index can be parsed again
+**************************************************************/
+void http_params_reset(struct http_params* params){
+    free(params->memory);
+    params->memory = NULL;
+    params->parsed = 0;
+    params->total = 0;
+}
@@ -0,0 +1,36 @@
+#ifndef __HTTP_PARAMS_H
+#define __HTTP_PARAMS_H
+
+#include "syshead.h"
+
+#define HTTP_MAX_PARAMS 64 // key/value pairs indexed per source, the rest is ignored
+#define HTTP_PARAMS_SLOTS 128 // hash slots, power of two above HTTP_MAX_PARAMS
+
+struct http_param
+{
+	char* key;
+	char* value;
+	unsigned int hash;
+	int next; // next entry with the same key, -1 if last
+};
+
+/*
+    Decoded key/value pairs of one source (query, form body or
+    cookies). Filled once per request on first lookup, the decoded
+    strings live in memory that is freed when the request is done.
+*/
+struct http_params
+{
+	int parsed;
+	int total;
+	struct http_param entries[HTTP_MAX_PARAMS];
+	short slots[HTTP_PARAMS_SLOTS]; // first entry of a key + 1, 0 if empty
+	char* memory;
+};
+
+int http_params_parse(struct http_params* params, const char* raw, size_t length, char separator, int decode);
+char* http_params_get(struct http_params* params, const char* key);
+int http_params_get_all(struct http_params* params, const char* key, char** values, int max);
+void http_params_reset(struct http_params* params);
+
+#endif
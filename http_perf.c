@@ -0,0 +1,326 @@
+#include "http_server.h"
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+/*
+    Hardware counter profiling
+
+    With http_set_perf every worker opens a group of perf_event
+    counters on itself: cycles, instructions, cache misses, branch
+    misses and the CPU time. Profiled requests read the group
+    around each phase (parse, route lookup, route function and the
+    writes of the response) and the differences are added to the
+    totals of the route, so the report shows IPC and misses per
+    request for every route and phase. HTTP/2 responses are sent
+    as frames of the session, their writes are not counted.
+
+    Kernel work such as sendmsg is only counted if the kernel lets
+    the process count it (perf_event_paranoid < 2), otherwise the
+    counters cover user space. Counters the CPU or the virtual
+    machine does not have are left out of the group and reported
+    as "-".
+
+    The report is returned by http_perf_report for an admin route
+    and written to perf-<pid>.txt when the worker stops.
+*/
+
+static const char* http_perf_phase_names[] = { "parse", "route", "handler", "send" };
+
+static const unsigned long long http_perf_configs[HTTP_PERF_COUNTERS][2] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+};
+
+static int http_perf_rate = 0; // profile 1 of rate requests, 0 is off
+static unsigned long http_perf_counter = 0;
+int http_perf_active = 0; // the current request is profiled
+
+static int http_perf_leader = -1;
+static int http_perf_fds[HTTP_PERF_COUNTERS];
+static int http_perf_slots[HTTP_PERF_COUNTERS]; // position in the group read, -1 if not available
+static int http_perf_slotcount = 0;
+static int http_perf_kernel = 0; // kernel work is counted
+
+static struct http_perf_route http_perf_routes[HTTP_PERF_MAX_ROUTES];
+static int http_perf_routecount = 0;
+
+// phases of the current request, added to its route once it is known
+static unsigned long long http_perf_pending[HTTP_PERF_PHASES][HTTP_PERF_COUNTERS];
+static int http_perf_current = -1;
+
+
+/**************************************************************
+    Summery:
+
+    Profiles 1 of rate requests with hardware counters. Must be
+    called before http_start.
+
+    @PARAMS: rate, 1 profiles every request, 0 turns profiling off
+    @returns: VOID
+**************************************************************/
+void http_set_perf(int rate){
+    http_perf_rate = rate < 0 ? 0 : rate;
+}
+
+/**************************************************************
+    Summery:
+
+    Opens one counter of the group.
+
+    @PARAMS: counter, group leader or -1, count kernel work
+    @returns: fd, -1 on error.
+**************************************************************/
+static int http_perf_open(int counter, int group, int kernel){
+
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = http_perf_configs[counter][0];
+    attr.config = http_perf_configs[counter][1];
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = !kernel;
+    attr.exclude_hv = 1;
+    attr.disabled = group == -1;
+
+    // this process on any CPU
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+}
+
+/**************************************************************
+    Opens the counter group of this worker, called by http_start
+**************************************************************/
+void http_perf_start(){
+    if(http_perf_rate == 0)
+        return;
+
+    // counting the kernel needs perf_event_paranoid < 2
+    http_perf_kernel = 1;
+    for (int i = 0; i < HTTP_PERF_COUNTERS; ++i)
+    {
+        http_perf_slots[i] = -1;
+        http_perf_fds[i] = http_perf_open(i, http_perf_leader, http_perf_kernel);
+        if(http_perf_fds[i] < 0 && errno == EACCES && http_perf_leader == -1){
+            http_perf_kernel = 0;
+            http_perf_fds[i] = http_perf_open(i, http_perf_leader, http_perf_kernel);
+        }
+        if(http_perf_fds[i] < 0)
+            continue;
+
+        if(http_perf_leader == -1)
+            http_perf_leader = http_perf_fds[i];
+        http_perf_slots[i] = http_perf_slotcount++;
+    }
+
+    if(http_perf_leader == -1){
+        printf(KRED "[ERROR] No performance counters: %s\n" KWHT, strerror(errno));
+        http_perf_rate = 0;
+        return;
+    }
+
+    ioctl(http_perf_leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    printf(KBLU "[STARTUP] Profiling 1 of %d requests with %d counters%s\n" KWHT, http_perf_rate, http_perf_slotcount,
+        http_perf_kernel ? "" : ", user space only");
+}
+
+/**************************************************************
+    Decides if the next request is profiled
+**************************************************************/
+void http_perf_sample(){
+    http_perf_active = http_perf_leader >= 0 && http_perf_counter++ % http_perf_rate == 0;
+    if(!http_perf_active)
+        return;
+    memset(http_perf_pending, 0, sizeof(http_perf_pending));
+    http_perf_current = -1;
+}
+
+/**************************************************************
+    Reads all counters of the group with one system call
+**************************************************************/
+void http_perf_read(struct http_perf_sample* sample){
+
+    unsigned long long values[1+HTTP_PERF_COUNTERS];
+    memset(sample, 0, sizeof(struct http_perf_sample));
+    if(read(http_perf_leader, values, sizeof(values)) < (ssize_t)(sizeof(unsigned long long)*(1+http_perf_slotcount)))
+        return;
+
+    for (int i = 0; i < HTTP_PERF_COUNTERS; ++i)
+    {
+        if(http_perf_slots[i] >= 0)
+            sample->values[i] = values[1+http_perf_slots[i]];
+    }
+}
+
+/**************************************************************
+    Summery:
+
+    Adds the counts since start to a phase of the current request.
+
+    @PARAMS: phase, counters read at the start of the phase
+    @returns: VOID
+**************************************************************/
+void http_perf_phase(int phase, struct http_perf_sample* start){
+    struct http_perf_sample end;
+    http_perf_read(&end);
+    for (int i = 0; i < HTTP_PERF_COUNTERS; ++i)
+        http_perf_pending[phase][i] += end.values[i]-start->values[i];
+}
+
+/**************************************************************
+    Summery:
+
+    Names the route of the current request, once it is found.
+    Routes past HTTP_PERF_MAX_ROUTES share the last entry.
+
+    @PARAMS: method, route
+    @returns: VOID
+**************************************************************/
+void http_perf_route(char* method, char* route){
+    if(!http_perf_active)
+        return;
+
+    char name[64];
+    snprintf(name, sizeof(name), "%s %s", method, route);
+
+    for (int i = 0; i < http_perf_routecount; ++i)
+    {
+        if(strcmp(http_perf_routes[i].name, name) == 0){
+            http_perf_current = i;
+            return;
+        }
+    }
+
+    if(http_perf_routecount == HTTP_PERF_MAX_ROUTES){
+        http_perf_current = HTTP_PERF_MAX_ROUTES-1;
+        strcpy(http_perf_routes[http_perf_current].name, "other");
+        return;
+    }
+
+    http_perf_current = http_perf_routecount++;
+    strcpy(http_perf_routes[http_perf_current].name, name);
+}
+
+/**************************************************************
+    Summery:
+
+    Adds the phases of the current request to its route. The
+    response is sent later, its writes are added by
+    http_perf_send to the route of the connection.
+
+    @PARAMS: connection
+    @returns: VOID
+**************************************************************/
+void http_perf_request(struct http_conn* conn){
+    if(!http_perf_active || http_perf_current < 0)
+        return;
+
+    struct http_perf_route* route = &http_perf_routes[http_perf_current];
+    route->requests++;
+    for (int phase = 0; phase < HTTP_PERF_PHASES; ++phase)
+    {
+        for (int i = 0; i < HTTP_PERF_COUNTERS; ++i)
+            route->totals[phase][i] += http_perf_pending[phase][i];
+    }
+
+    conn->perf_route = http_perf_current+1;
+    http_perf_active = 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Adds the counts of a write since start to the route of the
+    last profiled request on the connection.
+
+    @PARAMS: connection, counters read before the write
+    @returns: VOID
+**************************************************************/
+void http_perf_send(struct http_conn* conn, struct http_perf_sample* start){
+    struct http_perf_sample end;
+    http_perf_read(&end);
+
+    struct http_perf_route* route = &http_perf_routes[conn->perf_route-1];
+    for (int i = 0; i < HTTP_PERF_COUNTERS; ++i)
+        route->totals[HTTP_PERF_SEND][i] += end.values[i]-start->values[i];
+
+    // later writes belong to requests that were not profiled
+    if(conn->out_queued == 0)
+        conn->perf_route = 0;
+}
+
+/**************************************************************
+    Formats a per request average, "-" if the counter is missing
+**************************************************************/
+static int http_perf_average(char* buffer, size_t size, struct http_perf_route* route, int phase, int counter){
+    if(http_perf_slots[counter] < 0)
+        return snprintf(buffer, size, " %14s", "-");
+    return snprintf(buffer, size, " %14llu", route->totals[phase][counter]/route->requests);
+}
+
+/**************************************************************
+    Summery:
+
+    Writes per request averages of every route and phase.
+
+    @PARAMS: buffer, size of buffer
+    @returns: length written
+**************************************************************/
+int http_perf_report(char* buffer, size_t size){
+
+    size_t length = snprintf(buffer, size, "%-32s %-8s %8s %14s %14s %6s %14s %14s %14s\n", "route", "phase", "requests",
+        "cycles", "instructions", "IPC", "cache-misses", "branch-misses", "cpu-ns");
+
+    for (int i = 0; i < http_perf_routecount && length < size; ++i)
+    {
+        struct http_perf_route* route = &http_perf_routes[i];
+        if(route->requests == 0)
+            continue;
+
+        for (int phase = 0; phase < HTTP_PERF_PHASES && length < size; ++phase)
+        {
+            length += snprintf(buffer+length, size-length, "%-32s %-8s %8ld", route->name, http_perf_phase_names[phase], route->requests);
+
+            for (int counter = 0; counter <= HTTP_PERF_INSTRUCTIONS && length < size; ++counter)
+                length += http_perf_average(buffer+length, size-length, route, phase, counter);
+
+            unsigned long long cycles = route->totals[phase][HTTP_PERF_CYCLES];
+            if(length < size && http_perf_slots[HTTP_PERF_CYCLES] >= 0 && http_perf_slots[HTTP_PERF_INSTRUCTIONS] >= 0 && cycles > 0)
+                length += snprintf(buffer+length, size-length, " %6.2f", (double)route->totals[phase][HTTP_PERF_INSTRUCTIONS]/cycles);
+            else if(length < size)
+                length += snprintf(buffer+length, size-length, " %6s", "-");
+
+            for (int counter = HTTP_PERF_CACHE_MISSES; counter < HTTP_PERF_COUNTERS && length < size; ++counter)
+                length += http_perf_average(buffer+length, size-length, route, phase, counter);
+            if(length < size)
+                length += snprintf(buffer+length, size-length, "\n");
+        }
+    }
+    return length < size ? length : size-1;
+}
+
+/**************************************************************
+    Writes perf-<pid>.txt, called when the worker stops
+**************************************************************/
+void http_perf_stop(){
+    if(http_perf_leader < 0 || http_perf_routecount == 0)
+        return;
+
+    size_t size = 256+http_perf_routecount*HTTP_PERF_PHASES*160;
+    char* report = malloc(size);
+    if(report == NULL)
+        return;
+    int length = http_perf_report(report, size);
+
+    char name[64];
+    snprintf(name, sizeof(name), "perf-%ld.txt", (long)getpid());
+    FILE* out = fopen(name, "w");
+    if(out != NULL){
+        fwrite(report, 1, length, out);
+        fclose(out);
+        printf(KBLU "[PERF] Wrote %s\n" KWHT, name);
+    }
+    free(report);
+}
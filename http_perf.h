@@ -0,0 +1,57 @@
+#ifndef __HTTP_PERF_H
+#define __HTTP_PERF_H
+
+#include "syshead.h"
+#include "http_conn.h"
+
+#define HTTP_PERF_CYCLES 0
+#define HTTP_PERF_INSTRUCTIONS 1
+#define HTTP_PERF_CACHE_MISSES 2
+#define HTTP_PERF_BRANCH_MISSES 3
+#define HTTP_PERF_TASK_CLOCK 4 // ns on CPU, a software counter that is always available
+#define HTTP_PERF_COUNTERS 5
+
+#define HTTP_PERF_PARSE 0
+#define HTTP_PERF_ROUTE 1
+#define HTTP_PERF_HANDLER 2
+#define HTTP_PERF_SEND 3
+#define HTTP_PERF_PHASES 4
+
+#define HTTP_PERF_MAX_ROUTES 128
+
+struct http_perf_sample
+{
+	unsigned long long values[HTTP_PERF_COUNTERS];
+};
+
+/*
+    Counter totals of all profiled requests of one route.
+*/
+struct http_perf_route
+{
+	char name[64]; // method and route
+	long requests;
+	unsigned long long totals[HTTP_PERF_PHASES][HTTP_PERF_COUNTERS];
+};
+
+/*
+    Only profiled requests read counters, with profiling off every
+    site costs one test of http_perf_active.
+*/
+#define HTTP_PERF_START(sample) do { if(http_perf_active) http_perf_read(sample); } while(0)
+#define HTTP_PERF_END(phase, sample) do { if(http_perf_active) http_perf_phase(phase, sample); } while(0)
+
+extern int http_perf_active;
+
+void http_set_perf(int rate);
+void http_perf_start();
+void http_perf_sample();
+void http_perf_read(struct http_perf_sample* sample);
+void http_perf_phase(int phase, struct http_perf_sample* start);
+void http_perf_route(char* method, char* route);
+void http_perf_request(struct http_conn* conn);
+void http_perf_send(struct http_conn* conn, struct http_perf_sample* start);
+int http_perf_report(char* buffer, size_t size);
+void http_perf_stop();
+
+#endif
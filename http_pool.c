@@ -0,0 +1,264 @@
+#include "http_pool.h"
+#include <stdint.h>
+#include <sys/mman.h>
+
+/*
+    I/O buffer pool
+
+    Request input and coalesced response output live in buffers of
+    a few size classes (4KB to 64KB) cut from 2MB slabs. Buffers
+    are only held while a connection has bytes in flight, an idle
+    keep-alive connection holds none, so buffer memory follows the
+    amount of I/O and not the number of open connections.
+
+    Each class keeps its slabs with free buffers in a list. A slab
+    that becomes empty is kept as spare if the class has none,
+    with its pages given back to the kernel, otherwise unmapped.
+    Slabs are 2MB aligned, with http_set_pool(1) they are backed by
+    huge pages (MAP_HUGETLB, or transparent huge pages if none are
+    reserved), which saves TLB misses when many buffers are busy.
+
+    Buffers above 64KB, such as a large request body, are rare and
+    allocated with malloc. With workers every process has its own
+    pool, no locking is needed.
+*/
+
+static int http_pool_hugepages = 0;
+
+struct http_pool_slab* http_pool_partial[HTTP_POOL_CLASSES]; // slabs with free buffers
+int http_pool_spares[HTTP_POOL_CLASSES]; // empty slabs kept mapped
+
+// for stats
+long http_pool_slabs[HTTP_POOL_CLASSES];
+long http_pool_used[HTTP_POOL_CLASSES];
+long http_pool_large = 0;
+size_t http_pool_large_bytes = 0;
+
+
+/**************************************************************
+    Summery:
+
+    Backs pool slabs with huge pages. Must be called before
+    http_start.
+
+    @PARAMS: 1 to use huge pages
+    @returns: VOID
+**************************************************************/
+void http_set_pool(int hugepages){
+    http_pool_hugepages = hugepages;
+}
+
+static size_t http_pool_class_size(int class){
+    return (size_t)HTTP_POOL_MIN_SIZE << class;
+}
+
+/**************************************************************
+    Summery:
+
+    Maps a new slab for a size class. mmap only aligns to pages,
+    so twice the slab size is mapped and trimmed to an aligned
+    slab. Huge page mappings are aligned already.
+
+    @PARAMS: size class
+    @returns: slab, NULL on error.
+**************************************************************/
+static struct http_pool_slab* http_pool_map(int class){
+
+    char* memory = MAP_FAILED;
+    if(http_pool_hugepages)
+        memory = mmap(NULL, HTTP_POOL_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+    if(memory == MAP_FAILED){
+        char* area = mmap(NULL, 2*HTTP_POOL_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(area == MAP_FAILED)
+            return NULL;
+
+        memory = (char*)(((uintptr_t)area+HTTP_POOL_SLAB_SIZE-1) & ~((uintptr_t)HTTP_POOL_SLAB_SIZE-1));
+        if(memory > area)
+            munmap(area, memory-area);
+        if(area+2*HTTP_POOL_SLAB_SIZE > memory+HTTP_POOL_SLAB_SIZE)
+            munmap(memory+HTTP_POOL_SLAB_SIZE, area+2*HTTP_POOL_SLAB_SIZE-(memory+HTTP_POOL_SLAB_SIZE));
+
+        if(http_pool_hugepages)
+            madvise(memory, HTTP_POOL_SLAB_SIZE, MADV_HUGEPAGE);
+    }
+
+    struct http_pool_slab* slab = (struct http_pool_slab*)memory;
+    slab->class = class;
+    slab->used = 0;
+    slab->unused = 1;
+    slab->count = HTTP_POOL_SLAB_SIZE/http_pool_class_size(class);
+    slab->free = NULL;
+    slab->prev = NULL;
+    slab->next = NULL;
+
+    http_pool_slabs[class]++;
+    return slab;
+}
+
+static void http_pool_link(struct http_pool_slab* slab){
+    slab->prev = NULL;
+    slab->next = http_pool_partial[slab->class];
+    if(slab->next != NULL)
+        slab->next->prev = slab;
+    http_pool_partial[slab->class] = slab;
+}
+
+static void http_pool_unlink(struct http_pool_slab* slab){
+    if(slab->prev != NULL)
+        slab->prev->next = slab->next;
+    else
+        http_pool_partial[slab->class] = slab->next;
+    if(slab->next != NULL)
+        slab->next->prev = slab->prev;
+    slab->prev = NULL;
+    slab->next = NULL;
+}
+
+/**************************************************************
+    Summery:
+
+    Allocates a buffer of at least size bytes. Buffers are not
+    zeroed.
+
+    @PARAMS: size, capacity of the returned buffer (out)
+    @returns: buffer, NULL on error.
+**************************************************************/
+char* http_pool_alloc(size_t size, size_t* capacity){
+
+    if(size > HTTP_POOL_MAX_SIZE){
+        char* buffer = malloc(size);
+        if(buffer == NULL)
+            return NULL;
+        http_pool_large++;
+        http_pool_large_bytes += size;
+        *capacity = size;
+        return buffer;
+    }
+
+    int class = 0;
+    while(http_pool_class_size(class) < size)
+        class++;
+
+    struct http_pool_slab* slab = http_pool_partial[class];
+    if(slab == NULL){
+        slab = http_pool_map(class);
+        if(slab == NULL)
+            return NULL;
+        http_pool_link(slab);
+    } else if(slab->used == 0){
+        http_pool_spares[class]--;
+    }
+
+    char* buffer;
+    if(slab->free != NULL){
+        buffer = slab->free;
+        slab->free = *(char**)buffer;
+    } else {
+        // buffers are handed out in order first, so untouched pages stay unbacked
+        buffer = (char*)slab+slab->unused*http_pool_class_size(class);
+        slab->unused++;
+    }
+
+    slab->used++;
+    if(slab->free == NULL && slab->unused == slab->count)
+        http_pool_unlink(slab);
+
+    http_pool_used[class]++;
+    *capacity = http_pool_class_size(class);
+    return buffer;
+}
+
+/**************************************************************
+    Summery:
+
+    Returns a buffer to the pool.
+
+    @PARAMS: buffer, capacity returned by http_pool_alloc
+    @returns: VOID
+**************************************************************/
+void http_pool_free(char* buffer, size_t capacity){
+
+    if(buffer == NULL)
+        return;
+
+    if(capacity > HTTP_POOL_MAX_SIZE){
+        http_pool_large--;
+        http_pool_large_bytes -= capacity;
+        free(buffer);
+        return;
+    }
+
+    struct http_pool_slab* slab = (struct http_pool_slab*)((uintptr_t)buffer & ~((uintptr_t)HTTP_POOL_SLAB_SIZE-1));
+    int class = slab->class;
+
+    // a full slab was not in the list
+    if(slab->free == NULL && slab->unused == slab->count)
+        http_pool_link(slab);
+
+    *(char**)buffer = slab->free;
+    slab->free = buffer;
+    slab->used--;
+    http_pool_used[class]--;
+
+    if(slab->used > 0)
+        return;
+
+    if(http_pool_spares[class] > 0){
+        http_pool_unlink(slab);
+        http_pool_slabs[class]--;
+        munmap(slab, HTTP_POOL_SLAB_SIZE);
+        return;
+    }
+
+    // keep one empty slab per class, without its memory
+    size_t header = http_pool_class_size(class);
+    madvise((char*)slab+header, HTTP_POOL_SLAB_SIZE-header, MADV_DONTNEED);
+    slab->free = NULL;
+    slab->unused = 1;
+    http_pool_spares[class]++;
+}
+
+/**************************************************************
+    Summery:
+
+    Moves the first length bytes of a buffer into a buffer of at
+    least size bytes, like realloc. The old buffer is returned
+    to the pool.
+
+    @PARAMS: buffer (may be NULL), bytes to keep, its capacity, new size, new capacity (out)
+    @returns: new buffer, NULL on error, the old buffer is kept then.
+**************************************************************/
+char* http_pool_grow(char* buffer, size_t length, size_t capacity, size_t size, size_t* new_capacity){
+
+    char* grown = http_pool_alloc(size, new_capacity);
+    if(grown == NULL)
+        return NULL;
+
+    if(length > 0)
+        memcpy(grown, buffer, length);
+    http_pool_free(buffer, capacity);
+    return grown;
+}
+
+/**************************************************************
+    Summery:
+
+    Writes buffers in use and mapped slabs per size class.
+
+    @PARAMS: buffer, size of buffer
+    @returns: length written
+**************************************************************/
+int http_pool_stats(char* buffer, size_t size){
+
+    size_t length = 0;
+    for (int i = 0; i < HTTP_POOL_CLASSES && length < size; ++i)
+    {
+        length += snprintf(buffer+length, size-length, "pool %luKB used %ld slabs %ld\n",
+            (unsigned long)(http_pool_class_size(i)/1024), http_pool_used[i], http_pool_slabs[i]);
+    }
+    if(length < size)
+        length += snprintf(buffer+length, size-length, "pool large used %ld bytes %lu%s\n",
+            http_pool_large, (unsigned long)http_pool_large_bytes, http_pool_hugepages ? " hugepages" : "");
+    return length < size ? length : size-1;
+}
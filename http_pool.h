@@ -0,0 +1,34 @@
+#ifndef __HTTP_POOL_H
+#define __HTTP_POOL_H
+
+#include "syshead.h"
+
+#define HTTP_POOL_SLAB_SIZE (2*1024*1024) // 2MB, size and alignment of a slab, one huge page
+#define HTTP_POOL_MIN_SIZE 4096 // smallest size class, classes double up to HTTP_POOL_MAX_SIZE
+#define HTTP_POOL_MAX_SIZE 65536 // larger buffers are allocated with malloc
+#define HTTP_POOL_CLASSES 5
+
+/*
+    A slab holds buffers of one size class. The first buffer of
+    the slab is used for this header, so the slab of any buffer is
+    found by rounding its address down to the slab alignment.
+*/
+struct http_pool_slab
+{
+	int class;
+	int used; // buffers handed out
+	int unused; // index of the first buffer never handed out
+	int count; // buffers in the slab, including the header
+	char* free; // list of returned buffers, linked through their first bytes
+
+	struct http_pool_slab* prev; // slabs of the class with free buffers
+	struct http_pool_slab* next;
+};
+
+void http_set_pool(int hugepages);
+char* http_pool_alloc(size_t size, size_t* capacity);
+char* http_pool_grow(char* buffer, size_t length, size_t capacity, size_t size, size_t* new_capacity);
+void http_pool_free(char* buffer, size_t capacity);
+int http_pool_stats(char* buffer, size_t size);
+
+#endif
@@ -0,0 +1,724 @@
+#include "http_server.h"
+
+/*
+    Reverse proxy routes.
+
+    Requests below a proxy prefix are forwarded to one of the route's
+    upstreams as soon as their header is complete. Bodies are streamed
+    in both directions as they arrive, backpressure of one side pauses
+    reading on the other. Upstream connections are kept alive and
+    pooled per upstream, new exchanges go to the healthy upstream with
+    the fewest exchanges in flight. Upstreams that fail repeatedly
+    are skipped for a while (passive health checks).
+
+    Upstreams are given as "host:port", "[v6 address]:port" or
+    "unix:/path/to/socket".
+*/
+
+#define CHUNK_SIZE 0
+#define CHUNK_EXT 1
+#define CHUNK_DATA 2
+#define CHUNK_DATA_END 3
+#define CHUNK_TRAILER_START 4
+#define CHUNK_TRAILER_LINE 5
+#define CHUNK_DONE 6
+
+struct http_proxy* http_proxies[NUMBER_OF_PROXIES];
+int http_proxycounter = 0;
+
+
+/**************************************************************
+    Summery:
+
+    Parses an upstream address into a socket address.
+
+    @PARAMS: address string, result, result length
+    @returns: 0 on success, -1 on error.
+**************************************************************/
+static int http_upstream_parse(char* address, struct sockaddr_storage* sockaddr, socklen_t* length){
+
+    memset(sockaddr, 0, sizeof(struct sockaddr_storage));
+
+    if(strncmp(address, "unix:", 5) == 0){
+        struct sockaddr_un* un = (struct sockaddr_un*)sockaddr;
+        if(strlen(address+5) >= sizeof(un->sun_path))
+            return -1;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, address+5);
+        *length = sizeof(struct sockaddr_un);
+        return 0;
+    }
+
+    char host[64];
+    char* port = strrchr(address, ':');
+    if(port == NULL || port-address >= (long)sizeof(host))
+        return -1;
+
+    memcpy(host, address, port-address);
+    host[port-address] = 0;
+    port++;
+
+    if(host[0] == '['){
+        struct sockaddr_in6* in6 = (struct sockaddr_in6*)sockaddr;
+        host[strlen(host)-1] = 0;
+        if(inet_pton(AF_INET6, host+1, &in6->sin6_addr) != 1)
+            return -1;
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(atoi(port));
+        *length = sizeof(struct sockaddr_in6);
+        return 0;
+    }
+
+    struct sockaddr_in* in = (struct sockaddr_in*)sockaddr;
+    if(strcmp(host, "localhost") == 0)
+        strcpy(host, "127.0.0.1");
+    if(inet_pton(AF_INET, host, &in->sin_addr) != 1)
+        return -1;
+    in->sin_family = AF_INET;
+    in->sin_port = htons(atoi(port));
+    *length = sizeof(struct sockaddr_in);
+    return 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Forwards all requests whose path starts with prefix to given
+    upstream. Adding several upstreams to the same prefix balances
+    requests between them.
+
+    @PARAMS: path prefix, upstream address
+    @returns: number of total proxy routes, -1 on error
+**************************************************************/
+int http_addproxy(char* prefix, char* upstream){
+
+    struct http_proxy* proxy = NULL;
+    for (int i = 0; i < http_proxycounter; ++i)
+    {
+        if(strcmp(http_proxies[i]->prefix, prefix) == 0)
+            proxy = http_proxies[i];
+    }
+
+    if(proxy == NULL){
+        if(http_proxycounter == NUMBER_OF_PROXIES)
+            return -1;
+
+        proxy = calloc(1, sizeof(struct http_proxy));
+        proxy->prefix = prefix;
+        proxy->prefix_length = strlen(prefix);
+        http_proxies[http_proxycounter] = proxy;
+        http_proxycounter++;
+    }
+
+    if(proxy->total_upstreams == NUMBER_OF_UPSTREAMS)
+        return -1;
+
+    struct http_upstream* entry = calloc(1, sizeof(struct http_upstream));
+    entry->address = upstream;
+    if(http_upstream_parse(upstream, &entry->sockaddr, &entry->sockaddr_length) < 0){
+        printf(KRED "%s %s\n" KWHT, "[ERROR] Invalid upstream address", upstream);
+        free(entry);
+        return -1;
+    }
+
+    proxy->upstreams[proxy->total_upstreams] = entry;
+    proxy->total_upstreams++;
+
+    return http_proxycounter;
+}
+
+/**************************************************************
+    Summery:
+
+    Finds the proxy route with the longest prefix matching the
+    path in the request line.
+
+    @PARAMS: request buffer
+    @returns: proxy route, NULL if request is not proxied.
+**************************************************************/
+struct http_proxy* http_proxy_match(char* request){
+
+    if(http_proxycounter == 0)
+        return NULL;
+
+    char* path = strchr(request, ' ');
+    if(path == NULL)
+        return NULL;
+    path++;
+
+    struct http_proxy* match = NULL;
+    for (int i = 0; i < http_proxycounter; ++i)
+    {
+        struct http_proxy* proxy = http_proxies[i];
+        if(strncmp(path, proxy->prefix, proxy->prefix_length) == 0){
+            if(match == NULL || proxy->prefix_length > match->prefix_length)
+                match = proxy;
+        }
+    }
+    return match;
+}
+
+/**************************************************************
+    Summery:
+
+    Picks the healthy upstream with the fewest exchanges in
+    flight. If all are down the one coming back first is used.
+
+    @PARAMS: proxy route
+    @returns: upstream
+**************************************************************/
+static struct http_upstream* http_proxy_pick(struct http_proxy* proxy){
+
+    time_t now = time(NULL);
+    struct http_upstream* best = NULL;
+    struct http_upstream* fallback = NULL;
+
+    for (int i = 0; i < proxy->total_upstreams; ++i)
+    {
+        struct http_upstream* upstream = proxy->upstreams[i];
+        if(upstream->down_until > now){
+            if(fallback == NULL || upstream->down_until < fallback->down_until)
+                fallback = upstream;
+            continue;
+        }
+        if(best == NULL || upstream->active < best->active)
+            best = upstream;
+    }
+
+    return best != NULL ? best : fallback;
+}
+
+/**************************************************************
+    Records a failed exchange, marks upstream down if repeated
+**************************************************************/
+static void http_upstream_failed(struct http_upstream* upstream){
+    upstream->failures++;
+    if(upstream->failures >= HTTP_PROXY_MAX_FAILURES){
+        upstream->down_until = time(NULL)+HTTP_PROXY_DOWN_TIME;
+        if(upstream->failures == HTTP_PROXY_MAX_FAILURES)
+            printf(KRED "%s %s\n" KWHT, "[ERROR] Upstream marked down:", upstream->address);
+    }
+}
+
+/**************************************************************
+    Summery:
+
+    Returns an idle pooled connection to the upstream, or opens
+    a new non blocking one. Pooled connections the upstream has
+    closed in the meantime are discarded.
+
+    @PARAMS: upstream
+    @returns: upstream connection, NULL on error.
+**************************************************************/
+static struct http_conn* http_upstream_connect(struct http_upstream* upstream){
+
+    while(upstream->pooled > 0){
+        upstream->pooled--;
+        struct http_conn* conn = upstream->pool[upstream->pooled];
+        conn->proxy->pooled = 0;
+
+        char c;
+        if(recv(conn->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return conn;
+        http_close(conn);
+    }
+
+    int fd = socket(upstream->sockaddr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        return NULL;
+
+    if(connect(fd, (struct sockaddr *)&upstream->sockaddr, upstream->sockaddr_length) < 0 && errno != EINPROGRESS){
+        close(fd);
+        return NULL;
+    }
+
+    if(upstream->sockaddr.ss_family != AF_UNIX)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+
+    struct http_conn* conn = http_conn_new(fd, HTTP_CONN_UPSTREAM);
+    if(conn == NULL){
+        close(fd);
+        return NULL;
+    }
+
+    conn->proxy = calloc(1, sizeof(struct http_proxy_state));
+    conn->proxy->upstream = upstream;
+    http_watch(conn);
+
+    return conn;
+}
+
+/**************************************************************
+    Summery:
+
+    Returns 1 if the header line is hop-by-hop and must not be
+    forwarded. Besides the fixed ones these are the headers named
+    in the Connection header of the message. Framing headers are
+    kept, response bodies are forwarded as they are and request
+    bodies are only framed by Content-Length, see
+    http_header_length.
+
+    @PARAMS: header line, value of the Connection header or NULL, 1 for a request
+    @returns: 1 if hop-by-hop, else 0.
+**************************************************************/
+static int http_proxy_hop_header(char* line, char* connection, int request){
+
+    if(strncasecmp(line, "Connection:", 11) == 0
+        || strncasecmp(line, "Keep-Alive:", 11) == 0
+        || strncasecmp(line, "Proxy-Connection:", 17) == 0
+        || strncasecmp(line, "TE:", 3) == 0
+        || strncasecmp(line, "Upgrade:", 8) == 0)
+        return 1;
+
+    if(request && (strncasecmp(line, "Transfer-Encoding:", 18) == 0 || strncasecmp(line, "Trailer:", 8) == 0))
+        return 1;
+
+    size_t name = strcspn(line, ":\r\n");
+    if(connection == NULL || line[name] != ':' || strncasecmp(line, "Content-Length:", 15) == 0 || strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+        return 0;
+
+    // comma separated header names, up to the end of the line
+    char* token = connection;
+    while(*token != 0 && *token != '\r' && *token != '\n'){
+        token += strspn(token, " \t,");
+        size_t length = strcspn(token, " \t,\r\n");
+        if(length == name && strncasecmp(token, line, name) == 0)
+            return 1;
+        token += length;
+    }
+    return 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Queues the header lines of buffer on conn, without the
+    hop-by-hop headers and without the final empty line.
+
+    @PARAMS: connection, header buffer, header length, 1 for a request
+    @returns: void
+**************************************************************/
+static void http_proxy_copy_header(struct http_conn* conn, char* buffer, long header_length, int request){
+
+    char* line = buffer;
+    char* end = buffer+header_length-2;
+
+    // the first line is the request or status line
+    char* connection = NULL;
+    for (char* next = memchr(buffer, '\n', end-buffer); next != NULL && next+1 < end; next = memchr(next+1, '\n', end-next-1))
+    {
+        if(strncasecmp(next+1, "Connection:", 11) == 0){
+            connection = next+12;
+            break;
+        }
+    }
+
+    while(line < end){
+        char* next = memchr(line, '\n', end-line);
+        next = next != NULL ? next+1 : end;
+
+        if(line == buffer || !http_proxy_hop_header(line, connection, request))
+            http_conn_queue_buffer(conn, line, next-line);
+        line = next;
+    }
+}
+
+/**************************************************************
+    Summery:
+
+    Starts a proxied exchange for the request whose header is at
+    the start of the client buffer. The header is forwarded right
+    away, the body follows as it arrives.
+
+    @PARAMS: client connection, proxy route, header length, body length
+    @returns: 0 on success, -1 if client was answered with 502.
+**************************************************************/
+int http_proxy_start(struct http_conn* client, struct http_proxy* proxy, long header_length, long content_length){
+
+    struct http_upstream* upstream = http_proxy_pick(proxy);
+    struct http_conn* conn = upstream != NULL ? http_upstream_connect(upstream) : NULL;
+    if(conn == NULL){
+        if(upstream != NULL)
+            http_upstream_failed(upstream);
+        http_502(client->fd);
+        client->closing = 1;
+        return -1;
+    }
+
+    struct http_proxy_state* state = conn->proxy;
+    state->head_request = strncmp(client->in, "HEAD ", 5) == 0;
+    state->header_done = 0;
+    state->reusable = 1;
+    state->chunked = 0;
+    state->until_close = 0;
+    state->remaining = 0;
+    state->chunk_state = CHUNK_SIZE;
+
+    // same keep-alive semantics as http_parser, only an explicit keep-alive is kept open
+    char* end = client->in+header_length-2;
+    *end = 0;
+    char* connection = strcasestr(client->in, "\nConnection:");
+    if(connection != NULL){
+        char* line_end = strchr(connection+1, '\n');
+        if(line_end != NULL)
+            *line_end = 0;
+        client->keep_alive = strcasestr(connection, "keep-alive") != NULL;
+        if(line_end != NULL)
+            *line_end = '\n';
+    } else {
+        client->keep_alive = 0;
+    }
+    *end = '\r';
+
+    // request header without hop-by-hop headers
+    http_proxy_copy_header(conn, client->in, header_length, 1);
+
+    char client_ip[INET6_ADDRSTRLEN] = "unknown";
+    if(memcmp(client->addr, "\0\0\0\0\0\0\0\0\0\0\xff\xff", 12) == 0)
+        inet_ntop(AF_INET, client->addr+12, client_ip, sizeof(client_ip));
+    else
+        inet_ntop(AF_INET6, client->addr, client_ip, sizeof(client_ip));
+
+    char extra[INET6_ADDRSTRLEN+64];
+    sprintf(extra, "X-Forwarded-For: %s\r\nConnection: keep-alive\r\n\r\n", client_ip);
+    http_conn_queue_buffer(conn, extra, strlen(extra));
+
+    client->in_length -= header_length;
+    memmove(client->in, client->in+header_length, client->in_length);
+    client->body_remaining = content_length;
+    client->requests++;
+
+    client->peer = conn;
+    conn->peer = client;
+    upstream->active++;
+
+    if(http_write(conn) < 0)
+        return -1;
+
+    http_proxy_request_body(client);
+    return 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Forwards buffered request body bytes to the upstream. Reading
+    from the client pauses while the upstream is backed up, and
+    after the body until the response has been forwarded.
+
+    @PARAMS: client connection
+    @returns: void
+**************************************************************/
+void http_proxy_request_body(struct http_conn* client){
+
+    struct http_conn* conn = client->peer;
+
+    long length = client->in_length < (size_t)client->body_remaining ? (long)client->in_length : client->body_remaining;
+    if(length > 0){
+        http_conn_queue_buffer(conn, client->in, length);
+        client->in_length -= length;
+        memmove(client->in, client->in+length, client->in_length);
+        client->body_remaining -= length;
+    }
+
+    client->reading_paused = client->body_remaining == 0 || conn->out_queued >= http_get_highwater();
+
+    if(length > 0)
+        http_write(conn);
+}
+
+/**************************************************************
+    Summery:
+
+    Scans chunked transfer coding to find the end of a message.
+
+    @PARAMS: upstream state, data, length of data
+    @returns: number of bytes belonging to the message.
+**************************************************************/
+static long http_chunk_scan(struct http_proxy_state* state, char* data, long length){
+
+    long i = 0;
+    while(i < length && state->chunk_state != CHUNK_DONE){
+        char c = data[i];
+
+        switch(state->chunk_state){
+            case CHUNK_SIZE:
+                if(c >= '0' && c <= '9')
+                    state->remaining = state->remaining*16+(c-'0');
+                else if((c|0x20) >= 'a' && (c|0x20) <= 'f')
+                    state->remaining = state->remaining*16+((c|0x20)-'a'+10);
+                else if(c == ';')
+                    state->chunk_state = CHUNK_EXT;
+                else if(c == '\n')
+                    state->chunk_state = state->remaining > 0 ? CHUNK_DATA : CHUNK_TRAILER_START;
+                i++;
+                break;
+            case CHUNK_EXT:
+                if(c == '\n')
+                    state->chunk_state = state->remaining > 0 ? CHUNK_DATA : CHUNK_TRAILER_START;
+                i++;
+                break;
+            case CHUNK_DATA: {
+                long n = length-i < state->remaining ? length-i : state->remaining;
+                i += n;
+                state->remaining -= n;
+                if(state->remaining == 0)
+                    state->chunk_state = CHUNK_DATA_END;
+                break;
+            }
+            case CHUNK_DATA_END:
+                if(c == '\n'){
+                    state->chunk_state = CHUNK_SIZE;
+                    state->remaining = 0;
+                }
+                i++;
+                break;
+            case CHUNK_TRAILER_START:
+                if(c == '\n')
+                    state->chunk_state = CHUNK_DONE;
+                else if(c != '\r')
+                    state->chunk_state = CHUNK_TRAILER_LINE;
+                i++;
+                break;
+            case CHUNK_TRAILER_LINE:
+                if(c == '\n')
+                    state->chunk_state = CHUNK_TRAILER_START;
+                i++;
+                break;
+        }
+    }
+    return i;
+}
+
+/**************************************************************
+    Summery:
+
+    Ends the exchange after the full response was forwarded.
+    The upstream connection goes back to the pool if it can be
+    reused and the client continues with pipelined requests.
+
+    @PARAMS: upstream connection
+    @returns: void
+**************************************************************/
+static void http_proxy_finish(struct http_conn* conn){
+
+    struct http_proxy_state* state = conn->proxy;
+    struct http_upstream* upstream = state->upstream;
+    struct http_conn* client = conn->peer;
+
+    client->peer = NULL;
+    conn->peer = NULL;
+    upstream->active--;
+
+    // an unread request body can not be told apart from the next request
+    if(client->body_remaining > 0)
+        client->closing = 1;
+
+    if(state->reusable && conn->in_length == 0 && client->body_remaining == 0 && conn->out_head == NULL && upstream->pooled < HTTP_PROXY_POOL_SIZE){
+        upstream->pool[upstream->pooled] = conn;
+        upstream->pooled++;
+        state->pooled = 1;
+        conn->reading_paused = 0;
+        conn->last_active = time(NULL);
+        http_update_events(conn);
+    } else {
+        http_close(conn);
+    }
+
+    if(!client->keep_alive)
+        client->closing = 1;
+    client->reading_paused = 0;
+
+    http_process(client);
+    http_write(client);
+}
+
+/**************************************************************
+    Summery:
+
+    Parses the upstream response header once complete and forwards
+    it, then forwards body bytes as they arrive until the message
+    ends by Content-Length, chunked coding or connection close.
+
+    @PARAMS: upstream connection
+    @returns: void
+**************************************************************/
+void http_proxy_response(struct http_conn* conn){
+
+    struct http_proxy_state* state = conn->proxy;
+    struct http_conn* client = conn->peer;
+
+    // idle pooled connections are not expected to send anything
+    if(client == NULL){
+        http_close(conn);
+        return;
+    }
+
+    while(!state->header_done){
+
+        char* end = memmem(conn->in, conn->in_length, "\r\n\r\n", 4);
+        if(end == NULL){
+            if(conn->in_length >= HTTP_MAX_REQUEST_SIZE || (conn->in_length >= 5 && strncmp(conn->in, "HTTP/", 5) != 0))
+                http_close(conn);
+            return;
+        }
+
+        long header_length = end-conn->in+4;
+        if(strncmp(conn->in, "HTTP/", 5) != 0 || header_length < 12){
+            http_close(conn);
+            return;
+        }
+        int status = atoi(conn->in+9);
+
+        *end = 0;
+        char* content_length = strcasestr(conn->in, "\nContent-Length:");
+        char* transfer_encoding = strcasestr(conn->in, "\nTransfer-Encoding:");
+        char* connection = strcasestr(conn->in, "\nConnection:");
+        int chunked = transfer_encoding != NULL && strncasecmp(transfer_encoding+20+strspn(transfer_encoding+20, " "), "chunked", 7) == 0;
+        int upstream_close = connection != NULL && strncasecmp(connection+12+strspn(connection+12, " "), "close", 5) == 0;
+        long length = content_length != NULL ? strtol(content_length+16, NULL, 10) : -1;
+        *end = '\r';
+
+        // interim responses are forwarded and followed by the final one
+        if(status >= 100 && status < 200 && status != 101){
+            http_conn_queue_buffer(client, conn->in, header_length);
+            conn->in_length -= header_length;
+            memmove(conn->in, conn->in+header_length, conn->in_length);
+            continue;
+        }
+
+        state->header_done = 1;
+        state->upstream->failures = 0;
+        if(upstream_close)
+            state->reusable = 0;
+
+        if(state->head_request || status == 204 || status == 304){
+            state->remaining = 0;
+        } else if(chunked){
+            state->chunked = 1;
+        } else if(length >= 0){
+            state->remaining = length;
+        } else {
+            // body ends when the upstream closes, so must the client connection
+            state->until_close = 1;
+            state->reusable = 0;
+            client->keep_alive = 0;
+        }
+
+        http_proxy_copy_header(client, conn->in, header_length, 0);
+        if(client->keep_alive)
+            http_conn_queue_buffer(client, "Connection: keep-alive\r\n\r\n", 26);
+        else
+            http_conn_queue_buffer(client, "Connection: close\r\n\r\n", 21);
+
+        conn->in_length -= header_length;
+        memmove(conn->in, conn->in+header_length, conn->in_length);
+    }
+
+    long length;
+    int done = 0;
+    if(state->until_close){
+        length = conn->in_length;
+    } else if(state->chunked){
+        length = http_chunk_scan(state, conn->in, conn->in_length);
+        done = state->chunk_state == CHUNK_DONE;
+    } else {
+        length = conn->in_length < (size_t)state->remaining ? (long)conn->in_length : state->remaining;
+        state->remaining -= length;
+        done = state->remaining == 0;
+    }
+
+    http_conn_queue_buffer(client, conn->in, length);
+    conn->in_length -= length;
+    memmove(conn->in, conn->in+length, conn->in_length);
+
+    if(done){
+        http_proxy_finish(conn);
+        return;
+    }
+
+    conn->reading_paused = client->out_queued >= http_get_highwater();
+    http_update_events(conn);
+    http_write(client);
+}
+
+/**************************************************************
+    Summery:
+
+    Called when one side of an exchange has drained its output,
+    resumes reading on the other side.
+
+    @PARAMS: connection
+    @returns: void
+**************************************************************/
+void http_proxy_drained(struct http_conn* conn){
+
+    struct http_conn* peer = conn->peer;
+    if(!peer->reading_paused || conn->out_queued >= http_get_highwater())
+        return;
+
+    // the client stays paused after its body until the response is done
+    if(conn->kind == HTTP_CONN_UPSTREAM && peer->body_remaining == 0)
+        return;
+
+    peer->reading_paused = 0;
+    http_update_events(peer);
+}
+
+/**************************************************************
+    Summery:
+
+    Called before a connection that takes part in proxying is
+    closed. A failed upstream is answered with 502 to the client,
+    a closed client aborts its upstream connection. The other side
+    is never freed here, only marked for closing.
+
+    @PARAMS: connection
+    @returns: void
+**************************************************************/
+void http_proxy_closed(struct http_conn* conn){
+
+    if(conn->kind == HTTP_CONN_CLIENT){
+        struct http_conn* upstream = conn->peer;
+        conn->peer = NULL;
+        upstream->peer = NULL;
+        upstream->proxy->upstream->active--;
+        upstream->proxy->reusable = 0;
+        upstream->closing = 1;
+        http_update_events(upstream);
+        return;
+    }
+
+    struct http_proxy_state* state = conn->proxy;
+    struct http_upstream* upstream = state->upstream;
+
+    if(state->pooled){
+        for (int i = 0; i < upstream->pooled; ++i)
+        {
+            if(upstream->pool[i] == conn){
+                upstream->pooled--;
+                upstream->pool[i] = upstream->pool[upstream->pooled];
+                break;
+            }
+        }
+    }
+
+    struct http_conn* client = conn->peer;
+    if(client != NULL){
+        conn->peer = NULL;
+        client->peer = NULL;
+        upstream->active--;
+
+        if(!state->header_done){
+            http_upstream_failed(upstream);
+            http_502(client->fd);
+        }
+
+        // a response delimited by close is complete, anything else was cut short
+        client->closing = 1;
+        http_update_events(client);
+    }
+
+    free(state);
+    conn->proxy = NULL;
+}
@@ -0,0 +1,64 @@
+#ifndef __HTTP_PROXY_H
+#define __HTTP_PROXY_H
+
+#include "syshead.h"
+#include "http_conn.h"
+
+#define NUMBER_OF_PROXIES 16
+#define NUMBER_OF_UPSTREAMS 8 // per proxy route
+
+#define HTTP_PROXY_POOL_SIZE 32 // idle connections kept per upstream
+#define HTTP_PROXY_TIMEOUT 30 // seconds without progress before an upstream is given up
+#define HTTP_PROXY_MAX_FAILURES 3 // consecutive failures before an upstream is marked down
+#define HTTP_PROXY_DOWN_TIME 10 // seconds a failed upstream is skipped
+
+struct http_upstream
+{
+	char* address;
+	struct sockaddr_storage sockaddr;
+	socklen_t sockaddr_length;
+
+	int active; // exchanges in flight, used for least-connections
+	int failures;
+	time_t down_until;
+
+	struct http_conn* pool[HTTP_PROXY_POOL_SIZE]; // idle keep-alive connections
+	int pooled;
+};
+
+struct http_proxy
+{
+	char* prefix;
+	int prefix_length;
+	struct http_upstream* upstreams[NUMBER_OF_UPSTREAMS];
+	int total_upstreams;
+};
+
+/*
+    State of an upstream connection while it carries an exchange.
+*/
+struct http_proxy_state
+{
+	struct http_upstream* upstream;
+
+	int pooled;
+	int head_request;
+	int header_done;
+	int reusable;
+
+	// response body framing
+	int chunked;
+	int until_close;
+	long remaining;
+	int chunk_state;
+};
+
+int http_addproxy(char* prefix, char* upstream);
+struct http_proxy* http_proxy_match(char* request);
+int http_proxy_start(struct http_conn* client, struct http_proxy* proxy, long header_length, long content_length);
+void http_proxy_request_body(struct http_conn* client);
+void http_proxy_response(struct http_conn* upstream);
+void http_proxy_drained(struct http_conn* conn);
+void http_proxy_closed(struct http_conn* conn);
+
+#endif
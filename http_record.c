@@ -0,0 +1,154 @@
+#include "http_server.h"
+
+/*
+    Traffic capture
+
+    With http_set_record every byte received from clients is
+    written to <prefix>-<pid>.rec together with the time it was
+    received and the connection it belongs to, as well as the
+    opening and closing of connections. TLS connections are
+    recorded after decryption. Every worker writes its own file.
+
+    The capture is replayed against a server with the replay tool,
+    see replay.c, so changes can be measured with the real mix of
+    requests instead of a synthetic benchmark.
+
+    Records are written through a 256KB stdio buffer that is
+    flushed once a second, recording stops once the file reaches
+    the given limit.
+*/
+
+#define HTTP_RECORD_BUFFER (256*1024)
+
+static char* http_record_prefix = NULL;
+static size_t http_record_limit = 0;
+
+static FILE* http_record_file = NULL;
+static size_t http_record_written = 0;
+static unsigned int http_record_counter = 0;
+static time_t http_record_flushed = 0;
+
+
+/**************************************************************
+    Summery:
+
+    Records received traffic into <prefix>-<pid>.rec.
+
+    @PARAMS: file prefix, largest file size in bytes, 0 for no limit
+    @returns: VOID
+**************************************************************/
+void http_set_record(char* prefix, size_t limit){
+    http_record_prefix = prefix;
+    http_record_limit = limit;
+}
+
+/**************************************************************
+    Opens the capture file, called by each worker in http_start
+**************************************************************/
+void http_record_start(){
+    if(http_record_prefix == NULL)
+        return;
+
+    char name[PATH_MAX];
+    snprintf(name, sizeof(name), "%s-%ld.rec", http_record_prefix, (long)getpid());
+    http_record_file = fopen(name, "w");
+    if(http_record_file == NULL){
+        perror("record");
+        return;
+    }
+    setvbuf(http_record_file, NULL, _IOFBF, HTTP_RECORD_BUFFER);
+
+    fwrite(HTTP_RECORD_MAGIC, 1, 8, http_record_file);
+    http_record_written = 8;
+    printf(KBLU "[STARTUP] Recording traffic to %s\n" KWHT, name);
+}
+
+/**************************************************************
+    Summery:
+
+    Appends one record to the capture.
+
+    @PARAMS: type, connection id, data, length of data
+    @returns: VOID
+**************************************************************/
+static void http_record_write(int type, unsigned int conn, const char* data, size_t length){
+
+    if(http_record_file == NULL)
+        return;
+
+    if(http_record_limit > 0 && http_record_written+sizeof(struct http_record)+length > http_record_limit){
+        printf(KRED "[ERROR] Traffic capture reached %lu bytes, recording stopped.\n" KWHT, (unsigned long)http_record_written);
+        http_record_stop();
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    struct http_record record;
+    record.time = now.tv_sec*1000000ull+now.tv_nsec/1000;
+    record.conn = conn;
+    record.length = length;
+    record.type = type;
+
+    fwrite(&record, sizeof(record), 1, http_record_file);
+    if(length > 0)
+        fwrite(data, 1, length, http_record_file);
+    http_record_written += sizeof(record)+length;
+}
+
+/**************************************************************
+    Gives a new client connection its id in the capture
+**************************************************************/
+void http_record_accept(struct http_conn* conn){
+    if(http_record_file == NULL)
+        return;
+
+    conn->recorded = ++http_record_counter;
+    http_record_write(HTTP_RECORD_OPEN, conn->recorded, NULL, 0);
+}
+
+/**************************************************************
+    Summery:
+
+    Records bytes received on a connection.
+
+    @PARAMS: connection, data, length of data
+    @returns: VOID
+**************************************************************/
+void http_record_data(struct http_conn* conn, const char* data, size_t length){
+    if(conn->recorded == 0 || length == 0)
+        return;
+    http_record_write(HTTP_RECORD_DATA, conn->recorded, data, length);
+}
+
+void http_record_close(struct http_conn* conn){
+    if(conn->recorded == 0)
+        return;
+    http_record_write(HTTP_RECORD_CLOSE, conn->recorded, NULL, 0);
+    conn->recorded = 0;
+}
+
+/**************************************************************
+    Flushes the capture once a second, called by the event loop
+**************************************************************/
+void http_record_poll(){
+    if(http_record_file == NULL)
+        return;
+
+    time_t now = time(NULL);
+    if(now == http_record_flushed)
+        return;
+    http_record_flushed = now;
+    fflush(http_record_file);
+}
+
+/**************************************************************
+    Flushes and closes the capture
+**************************************************************/
+void http_record_stop(){
+    if(http_record_file == NULL)
+        return;
+    fclose(http_record_file);
+    http_record_file = NULL;
+}
@@ -0,0 +1,35 @@
+#ifndef __HTTP_RECORD_H
+#define __HTTP_RECORD_H
+
+#include "syshead.h"
+
+#define HTTP_RECORD_MAGIC "HTTPREC1" // first 8 bytes of a capture file
+
+#define HTTP_RECORD_OPEN 0
+#define HTTP_RECORD_DATA 1
+#define HTTP_RECORD_CLOSE 2
+
+/*
+    One entry of a capture file, data records are followed by
+    length bytes as received from the client. Written in host
+    byte order, replay on the same architecture.
+*/
+struct http_record
+{
+	unsigned long long time; // us, CLOCK_REALTIME so captures of several workers line up
+	unsigned int conn; // connection id, unique within the file
+	unsigned int length;
+	unsigned char type;
+} __attribute__((packed));
+
+struct http_conn;
+
+void http_set_record(char* prefix, size_t limit);
+void http_record_start();
+void http_record_accept(struct http_conn* conn);
+void http_record_data(struct http_conn* conn, const char* data, size_t length);
+void http_record_close(struct http_conn* conn);
+void http_record_poll();
+void http_record_stop();
+
+#endif
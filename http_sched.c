@@ -0,0 +1,179 @@
+#include "http_server.h"
+
+/*
+    Priority scheduling
+
+    Every route and folder has a priority class, set with
+    http_set_priority. A connection takes the class of the last
+    request routed on it. The event loop does not handle ready
+    connections in the order epoll reports them, they are queued
+    per class and taken with weighted fair queuing: each handled
+    event advances the virtual time of its class by 1/weight and
+    the class that is furthest behind goes next. Interactive routes
+    are handled first, bulk transfers still get their share.
+
+    Bulk connections send at most HTTP_SCHED_BULK_BUDGET bytes per
+    turn. Output is level triggered, so a bulk download that still
+    has room in its socket is reported again by the next epoll_wait
+    and other connections are handled in between. Handlers run to
+    completion, an expensive handler delays all classes.
+
+    The delay from epoll_wait returning until an event is handled
+    is measured per class and reported by http_sched_stats.
+*/
+
+#define HTTP_SCHED_SCALE 840 // virtual time of one event at weight 1
+
+static const char* http_sched_names[HTTP_PRIORITIES] = { "normal", "interactive", "bulk" };
+
+static struct http_sched_class http_sched_classes[HTTP_PRIORITIES] = {
+    [HTTP_PRIORITY_NORMAL] = { .weight = 4 },
+    [HTTP_PRIORITY_INTERACTIVE] = { .weight = 8 },
+    [HTTP_PRIORITY_BULK] = { .weight = 1 },
+};
+
+static unsigned long long http_sched_vtime = 0; // virtual time of the last handled event
+static int http_sched_queued = 0;
+static unsigned long long http_sched_ready = 0; // ns, when the queued events were reported
+
+
+/**************************************************************
+    CLOCK_MONOTONIC in ns
+**************************************************************/
+static unsigned long long http_sched_now(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1000000000ull+now.tv_nsec;
+}
+
+/**************************************************************
+    Summery:
+
+    Queues a ready connection in its priority class, called by
+    the event loop for every event of epoll_wait.
+
+    @PARAMS: connection, epoll events
+    @returns: VOID
+**************************************************************/
+void http_sched_add(struct http_conn* conn, int events){
+
+    if(http_sched_queued == 0)
+        http_sched_ready = http_sched_now();
+
+    struct http_sched_class* class = &http_sched_classes[conn->priority];
+
+    // a class that was idle starts at the current virtual time, it gets no credit for idling
+    if(class->head == class->tail && class->finish < http_sched_vtime)
+        class->finish = http_sched_vtime;
+
+    class->fds[class->tail % HTTP_SCHED_QUEUE] = conn->fd;
+    class->events[class->tail % HTTP_SCHED_QUEUE] = events;
+    class->tail++;
+    http_sched_queued++;
+}
+
+/**************************************************************
+    Summery:
+
+    Takes the next event, from the class with the earliest
+    virtual finish time.
+
+    @PARAMS: epoll events of the connection
+    @returns: fd of the connection, -1 once all events are handled.
+**************************************************************/
+int http_sched_next(int* events){
+
+    if(http_sched_queued == 0)
+        return -1;
+
+    struct http_sched_class* next = NULL;
+    for (int i = 0; i < HTTP_PRIORITIES; ++i)
+    {
+        struct http_sched_class* class = &http_sched_classes[i];
+        if(class->head != class->tail && (next == NULL || class->finish < next->finish))
+            next = class;
+    }
+
+    int fd = next->fds[next->head % HTTP_SCHED_QUEUE];
+    *events = next->events[next->head % HTTP_SCHED_QUEUE];
+    next->head++;
+    if(next->head == next->tail)
+        next->head = next->tail = 0;
+    http_sched_queued--;
+
+    http_sched_vtime = next->finish;
+    next->finish += HTTP_SCHED_SCALE/next->weight;
+
+    unsigned long long delay = http_sched_now()-http_sched_ready;
+    int bucket = 0;
+    for (unsigned long long us = delay/1000; us > 0 && bucket < HTTP_SCHED_BUCKETS-1; us >>= 1)
+        bucket++;
+    next->served++;
+    next->delay_total += delay;
+    next->buckets[bucket]++;
+    if(delay > next->delay_max)
+        next->delay_max = delay;
+
+    return fd;
+}
+
+/**************************************************************
+    Summery:
+
+    Bytes a connection may send in one turn, see http_conn_flush.
+
+    @PARAMS: connection
+    @returns: byte budget, 0 for no limit.
+**************************************************************/
+size_t http_sched_budget(struct http_conn* conn){
+    return conn->priority == HTTP_PRIORITY_BULK ? HTTP_SCHED_BULK_BUDGET : 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Upper bound of the queueing delay below which fraction of
+    the events of a class were handled.
+
+    @PARAMS: class, fraction such as 0.99
+    @returns: delay in us.
+**************************************************************/
+static unsigned long long http_sched_percentile(struct http_sched_class* class, double fraction){
+    unsigned long long count = 0;
+    for (int i = 0; i < HTTP_SCHED_BUCKETS; ++i)
+    {
+        count += class->buckets[i];
+        if(count >= class->served*fraction)
+            return i == 0 ? 1 : 1ull << i;
+    }
+    return 1ull << (HTTP_SCHED_BUCKETS-1);
+}
+
+/**************************************************************
+    Summery:
+
+    Writes the queueing delay of each priority class, the
+    percentiles are rounded up to a power of 2.
+
+    @PARAMS: buffer, size of buffer
+    @returns: length written
+**************************************************************/
+int http_sched_stats(char* buffer, size_t size){
+
+    size_t length = snprintf(buffer, size, "%-12s %6s %12s %10s %10s %10s %10s\n", "class", "weight", "events",
+        "avg-us", "p50-us", "p99-us", "max-us");
+
+    for (int i = 0; i < HTTP_PRIORITIES && length < size; ++i)
+    {
+        struct http_sched_class* class = &http_sched_classes[i];
+        if(class->served == 0){
+            length += snprintf(buffer+length, size-length, "%-12s %6d %12d %10s %10s %10s %10s\n", http_sched_names[i], class->weight, 0,
+                "-", "-", "-", "-");
+            continue;
+        }
+        length += snprintf(buffer+length, size-length, "%-12s %6d %12llu %10llu %10llu %10llu %10llu\n", http_sched_names[i], class->weight,
+            class->served, class->delay_total/class->served/1000, http_sched_percentile(class, 0.5),
+            http_sched_percentile(class, 0.99), class->delay_max/1000);
+    }
+    return length < size ? length : size-1;
+}
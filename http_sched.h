@@ -0,0 +1,41 @@
+#ifndef __HTTP_SCHED_H
+#define __HTTP_SCHED_H
+
+#include "syshead.h"
+#include "http_conn.h"
+
+#define HTTP_PRIORITY_NORMAL 0 // default of routes, folders and new connections
+#define HTTP_PRIORITY_INTERACTIVE 1
+#define HTTP_PRIORITY_BULK 2
+#define HTTP_PRIORITIES 3
+
+#define HTTP_SCHED_QUEUE 64 // events of one epoll_wait
+#define HTTP_SCHED_BULK_BUDGET (256*1024) // bytes a bulk connection may send per turn
+#define HTTP_SCHED_BUCKETS 24 // log2 of the queueing delay in us
+
+/*
+    Ready connections of one class, in the order epoll reported them.
+*/
+struct http_sched_class
+{
+	int weight;
+	unsigned long long finish; // virtual time the next event of the class finishes
+
+	int fds[HTTP_SCHED_QUEUE];
+	int events[HTTP_SCHED_QUEUE];
+	int head;
+	int tail;
+
+	// queueing delay from epoll_wait returning until the event is handled
+	unsigned long long served;
+	unsigned long long delay_total; // ns
+	unsigned long long delay_max; // ns
+	unsigned long long buckets[HTTP_SCHED_BUCKETS];
+};
+
+void http_sched_add(struct http_conn* conn, int events);
+int http_sched_next(int* events);
+size_t http_sched_budget(struct http_conn* conn);
+int http_sched_stats(char* buffer, size_t size);
+
+#endif
@@ -47,10 +47,20 @@ struct http_route* http_routes[NUMBER_OF_ROUTES]; // http_routes is a list of ad
 int http_routecounter = 0;
 
 char* http_folders[NUMBER_OF_FOLDERS]; // list of indexable folders
+int http_folder_priorities[NUMBER_OF_FOLDERS];
 int http_foldercount = 0;
 
 struct http_header header;// request header, will be filled by http_parser
 
+// decoded parameters of the request, filled on first lookup
+struct http_params http_query_params;
+struct http_params http_form_params;
+struct http_params http_fragment_params;
+struct http_params http_cookie_params;
+struct http_conn* http_current = NULL; // connection of the request that is being handled
+
+int http_epoll_fd = -1; // event loop
+
 
 
 
@@ -71,6 +81,8 @@ void http_free_routes(){
     Redirects request to given location
 **************************************************************/
 void http_redirect(char* location){
+    // 301 replies with Connection: Close
+    http_current->keep_alive = 0;
     http_301(http_client, location, http_response_header);
 }
 
@@ -190,6 +202,8 @@ int http_addroute(char* method, char* path, void (*f)()){
     route->method = method;
     route->route = path;
     route->http_routefunction = f;
+    route->priority = HTTP_PRIORITY_NORMAL;
+    route->coalesce = NULL;
 
     http_routes[http_routecounter] = route;
     http_routecounter++;
@@ -203,7 +217,8 @@ int http_addroute(char* method, char* path, void (*f)()){
 
     Adds a folder name to a list of indexable folders.
     If folder name is included in the route, all files inside 
-    the folder will be indexable.
+    the folder will be indexable. Served from the embedded bundle
+    if one was built for the folder with "make bundle".
 
     @PARAMS: name of folder
     @returns: number of folder, -1 on error.
@@ -216,10 +231,82 @@ int http_addfolder(char* folder){
 
     http_folders[http_foldercount] = folder;
     http_foldercount++;
+    http_bundle_mount(folder);
 
     return http_foldercount;
 }
 
+/**************************************************************
+    Summery: 
+
+    Sets the priority class of all routes and the folder with
+    the given path. Ready connections are handled in weighted
+    order of their class, bulk connections send a limited
+    amount per turn, see http_sched.c.
+
+    HTTP_PRIORITY_INTERACTIVE, HTTP_PRIORITY_NORMAL (default)
+    or HTTP_PRIORITY_BULK.
+
+    @PARAMS: path given to http_addroute or http_addfolder, class
+    @returns: number of routes and folders changed, -1 if none.
+**************************************************************/
+int http_set_priority(char* path, int priority){
+
+    if(priority < 0 || priority >= HTTP_PRIORITIES)
+        return -1;
+
+    int changed = 0;
+    for (int i = 0; i < http_routecounter; ++i)
+    {
+        if(strcmp(http_routes[i]->route, path) == 0){
+            http_routes[i]->priority = priority;
+            changed++;
+        }
+    }
+    for (int i = 0; i < http_foldercount; ++i)
+    {
+        if(strcmp(http_folders[i], path) == 0){
+            http_folder_priorities[i] = priority;
+            changed++;
+        }
+    }
+    return changed > 0 ? changed : -1;
+}
+
+/**************************************************************
+    Summery:
+
+    Runs the handler of a route once for identical requests that
+    are handled at the same time, the others are answered with a
+    copy of its response, see http_coalesce.c. Requests are
+    identical if method, path and the values named in key are.
+    Key is a comma separated list of parameters and headers,
+    headers end with ':' as in http_get_request_header, such as
+    "page,Accept-Language:". A request waits at most timeout ms
+    for another worker before it runs the handler itself. Only
+    GET and HEAD routes are coalesced.
+    Must be called before http_start.
+
+    @PARAMS: path given to http_addroute, key, timeout in ms, 0 for HTTP_COALESCE_TIMEOUT
+    @returns: number of routes changed, -1 if none.
+**************************************************************/
+int http_set_coalesce(char* path, char* key, int timeout){
+
+    int changed = 0;
+    for (int i = 0; i < http_routecounter; ++i)
+    {
+        if(strcmp(http_routes[i]->route, path) != 0)
+            continue;
+        // handlers of other methods such as POST change state and must run for every request
+        if(strcmp(http_routes[i]->method, "GET") == 0 || strcmp(http_routes[i]->method, "HEAD") == 0){
+            http_routes[i]->coalesce = key != NULL ? key : "";
+            http_routes[i]->coalesce_timeout = timeout > 0 ? timeout : HTTP_COALESCE_TIMEOUT;
+            changed++;
+        }
+    }
+    return changed > 0 ? changed : -1;
+}
+
 
 /**************************************************************
     Summery: 
@@ -235,11 +322,27 @@ int http_addfolder(char* folder){
 **************************************************************/
 void http_route_handler(){
 
+    struct http_conn* conn = http_current;
+    unsigned long long trace = HTTP_TRACE_START(conn);
+    struct http_perf_sample perf;
+    HTTP_PERF_START(&perf);
+
     for (int i = 0; i < http_routecounter; ++i)
     {
         // checks if both route and method is correct.
         if(((strcmp(header.route, http_routes[i]->route) == 0) && (strcmp(header.method, http_routes[i]->method) == 0)) || (strcmp(header.method, "HEAD") == 0)){
-            (*(http_routes[i]->http_routefunction))();
+            HTTP_TRACE_END(conn, HTTP_TRACE_ROUTE, trace);
+            HTTP_PERF_END(HTTP_PERF_ROUTE, &perf);
+            http_perf_route(header.method, http_routes[i]->route);
+            conn->priority = http_routes[i]->priority;
+            trace = HTTP_TRACE_START(conn);
+            HTTP_PERF_START(&perf);
+            if(http_routes[i]->coalesce != NULL && strcmp(header.method, http_routes[i]->method) == 0)
+                http_coalesce_handle(conn, http_routes[i]);
+            else
+                (*(http_routes[i]->http_routefunction))();
+            HTTP_TRACE_END(conn, HTTP_TRACE_HANDLER, trace);
+            HTTP_PERF_END(HTTP_PERF_HANDLER, &perf);
             return;
         }
     }
@@ -247,96 +350,108 @@ void http_route_handler(){
     for (int i = 0; i < http_foldercount; ++i)
     {
         if(strstr(header.route, http_folders[i]) != NULL && strcmp(header.method, "POST") != 0){
+            HTTP_TRACE_END(conn, HTTP_TRACE_ROUTE, trace);
+            HTTP_PERF_END(HTTP_PERF_ROUTE, &perf);
+            conn->priority = http_folder_priorities[i];
+            if(http_perf_active){
+                char folder[strlen(http_folders[i])+2];
+                sprintf(folder, "%s*", http_folders[i]);
+                http_perf_route(header.method, folder);
+            }
+            trace = HTTP_TRACE_START(conn);
+            HTTP_PERF_START(&perf);
+
+            // fingerprinted urls never change, plain asset paths are checked again soon
+            char* route = http_asset_resolve(header.route);
+            char* cache = http_asset_cache(header.route, route);
+            if(cache != NULL)
+                http_add_responseheader(cache);
+
+            if(http_bundle_send(http_current, route, header.method, http_response_header)){
+                HTTP_TRACE_END(conn, HTTP_TRACE_HANDLER, trace);
+                HTTP_PERF_END(HTTP_PERF_HANDLER, &perf);
+                return;
+            }
+
             // add . inforont of path
-            char file[strlen(header.route)+2];
+            char file[strlen(route)+2];
             char* dot = ".";
             strcpy(file, dot);
-            strcat(file, header.route);
-            file[strlen(header.route)+2] = 0;
+            strcat(file, route);
 
             http_sendfile(file);
+            HTTP_TRACE_END(conn, HTTP_TRACE_HANDLER, trace);
+            HTTP_PERF_END(HTTP_PERF_HANDLER, &perf);
             return;
         }
     }
+    HTTP_TRACE_END(conn, HTTP_TRACE_ROUTE, trace);
+    HTTP_PERF_END(HTTP_PERF_ROUTE, &perf);
+    http_perf_route(header.method, "(not found)");
     http_404(http_client);
 }
 /**************************************************************
     Summery: 
 
-    Parses query / fragment parameters and returns the value of
-    the selected variable from the request.
+    Returns the value of the selected variable from the request.
+    Query, form body and fragment are each parsed and decoded once
+    per request, on the first lookup. Values stay valid until the
+    route function returns.
     
     Modes:
-        0 = query
+        0 = query, then application/x-www-form-urlencoded body
         1 = fragment
 
     @PARAMS: name of variable, int as selected mode
     @returns: value of variable, NULL on error.
 **************************************************************/
 char* http_get_parameter(char* variable, int mode){
+    char* value = NULL;
+    http_get_parameters(variable, mode, &value, 1);
+    return value;
+}
 
-    char* parameter;
-    char* variable_name;
+/**************************************************************
+    Summery: 
 
-    if(!mode){
-        parameter = malloc(strlen(header.query)+1);
-        strcpy(parameter, header.query);
-    } else {
-        parameter = malloc(strlen(header.fragment)+1);
-        strcpy(parameter, header.fragment);
-    }
-    char* delimiter = "&";
+    Lists all values of a variable that is given more than once,
+    such as ?id=1&id=2. Modes as in http_get_parameter.
 
-    if(strstr(parameter, delimiter) != NULL){
-        char* parameter_tok = strtok(parameter, delimiter);
-        while(parameter_tok != NULL && (strstr(parameter_tok, variable) == NULL)){
-            parameter_tok = strtok(NULL, delimiter);
-        }
-        variable_name = strtok(parameter_tok, "=");
-    } else {
-        variable_name = strtok(header.query, "=");
-    }
-    if(variable_name != NULL && strcmp(variable, variable_name) == 0){
-        char* variable_value = strtok(NULL, "=");
-        free(parameter);
-        return variable_value;
+    @PARAMS: name of variable, mode, array for values, size of array
+    @returns: number of values found.
+**************************************************************/
+int http_get_parameters(char* variable, int mode, char** values, int max){
+
+    if(mode){
+        if(header.fragment != NULL)
+            http_params_parse(&http_fragment_params, header.fragment, strlen(header.fragment), '&', 1);
+        return http_params_get_all(&http_fragment_params, variable, values, max);
     }
-    free(parameter);
-    return NULL;
+
+    if(header.query != NULL)
+        http_params_parse(&http_query_params, header.query, strlen(header.query), '&', 1);
+    int total = http_params_get_all(&http_query_params, variable, values, max);
+
+    if(header.form != NULL)
+        http_params_parse(&http_form_params, header.form, strlen(header.form), '&', 1);
+    return total+http_params_get_all(&http_form_params, variable, values+total, max-total);
 }
 
 /**************************************************************
     Summery: 
 
     Looks to find cookie and returns its value.
+    The Cookie header is parsed once per request.
 
     @PARAMS: name of cookie
     @returns: value of cookie, NULL on error.
 **************************************************************/
 char* http_get_cookie(char* cookie_name){
-
-    char* cookies = malloc(strlen(header.cookies)+1);
-    strcpy(cookies, header.cookies);
-
-    if(header.cookies != NULL){
-        char* current_cookie = strtok(cookies, " ");
-        while(current_cookie != NULL && (strstr(current_cookie, cookie_name) == NULL)){
-            current_cookie = strtok(NULL, " ");
-        }
-
-        char* cookie = strtok(current_cookie, "=");
-        cookie = strtok(NULL, ";");
-
-        free(cookies);
-        return cookie;
-    }
-
-    free(cookies);
-    return NULL;
-
+    if(header.cookies != NULL)
+        http_params_parse(&http_cookie_params, header.cookies, strlen(header.cookies), ';', 0);
+    return http_params_get(&http_cookie_params, cookie_name);
 }
 
-
 /**************************************************************
     Summery: 
 
@@ -348,23 +463,20 @@ char* http_get_cookie(char* cookie_name){
 **************************************************************/
 char* http_get_request_header(char* header_name){
 
-    char* current_header;
+    int name_length = strlen(header_name);
 
     for (int i = 0; i < header.total_headers; ++i)
     {
-        // possible malloc nullbyte error
-        current_header = malloc(strlen(header.headers[i]));
-        memcpy(current_header, header.headers[i], strlen(header.headers[i]));
-        current_header[strlen(header.headers[i])] = 0;
-        char* current_header_name = strtok(current_header, " ");
-
-        if(current_header != NULL && strcmp(header_name, current_header_name) == 0){
-            char* header_value = strtok(NULL, " ");
-            free(current_header);
+        char* current_header = header.headers[i];
+
+        if(strncmp(current_header, header_name, name_length) == 0 && current_header[name_length] == ' '){
+            // value lives in the request buffer, strip trailing carriage return
+            char* header_value = current_header+name_length+1;
+            char* end = strchr(header_value, '\r');
+            if(end != NULL)
+                *end = 0;
             return header_value;
         }
-
-        free(current_header);
     }
 
     return NULL;
@@ -376,7 +488,9 @@ char* http_get_request_header(char* header_name){
 void intHandler(){
     printf("%s\n", "[CLOSING] Closing connection...");
     http_free_routes();
-    close(http_server_fd);
+    http_record_stop();
+    http_perf_stop();
+    http_listen_close(http_worker_count() == 0);
     printf(KRED "%s PID: %ld, PORT: %d!.\n" KWHT, "[CLOSING] Goodbye ", (long)getpid(), current_port);
     exit(0);
 }
@@ -385,8 +499,10 @@ void intHandler(){
     Summery: 
 
     Will return file with given filename. First it checks if file exists.
-    If not 404 will be returned. If it does exist the file will be loaded into
-    memory then added to the response header and send to client.
+    If not 404 will be returned. If it does exist the response header
+    is queued followed by the file itself, which is sent with sendfile()
+    once the client is ready to receive it. With http_set_files the
+    file is opened by an I/O thread and the response follows later.
 
 
     @PARAMS: name of file
@@ -394,89 +510,56 @@ void intHandler(){
 **************************************************************/
 void http_sendfile(char* file){
 
-    if(access(file, F_OK)) {
-        http_404(http_client);
-        return;
-    }
-
     // get file extension
-    char file_copy[strlen(file)+1];
-    strcpy(file_copy, file);
-    file_copy[strlen(file)+1] = 0;
-
-    char* file_ext = strtok(file_copy, ".");
-    file_ext = strtok(NULL, ".");
+    char* file_ext = strrchr(file, '.');
+    if(file_ext == NULL || strchr(file_ext, '/') != NULL){
+        file_ext = "";
+    } else {
+        file_ext++;
+    }
 
     char* content_type = find_content_type(file_ext);
     if(content_type == NULL){
         printf(KRED "%s %s PID: %ld, PORT: %d!.\n" KWHT, "[ERROR] Could not find file type for ", file_ext, (long)getpid(), current_port);
-        intHandler();
-        close(http_client);
-        exit(EXIT_FAILURE);
+        http_404(http_client);
+        return;
     }
 
     http_add_content_type(content_type);
 
-     // open reponse file
-    FILE *fp = fopen(file, "rb");
-    if ( NULL == fp ) {
-        perror("FILE");
-        intHandler();
-        close(http_client);
-        exit(EXIT_FAILURE);
-    }
-    int fd = fileno(fp);
-
-    // get file info
-    struct stat finfo;
-    int fs = fstat(fd, &finfo);
-    if(fs == -1){
-        perror("fstat");
-        exit(EXIT_FAILURE);
-    }
-    // get content size
-    int content_size = finfo.st_size;
-
-    // file length int to string hack
-    char filesizestr[(int)((ceil(log10(content_size))+1)*sizeof(char))];
-    sprintf(filesizestr, "%d", content_size);
-
-    // content buffer
-    char content[content_size];
-
-    // read file into content buffer
-    int readf = fread(content, content_size, 1, fp);
-    if(readf != 1){
-        exit(EXIT_FAILURE);
-    }
-
-    fclose(fp);
-
-    // allocate response buffer for content and reponse header
-    char buff[content_size+100+strlen(http_response_header)];
+    // allocate response buffer for reponse header
+    char buff[100+strlen(http_response_header)];
 
     //server response header HTTP format
     char *header_text = "HTTP/1.1 200 OK\n";
-    // add content length and content
     strcpy(buff, header_text);
     // add custom http_response_header
     strcat(buff, http_response_header);
-    // add content length header
-    if(strcmp(header.method, "HEAD") != 0){
-        strcat(buff, "Content-Length: ");
-        strcat(buff, filesizestr);
-    }
 
-    strcat(buff, "\n\n");
+    // Content-Length and the file are queued once the file is open, see http_files.c
+    http_files_send(http_current, file, buff, strcmp(header.method, "HEAD") == 0);
+}
 
-    // write header
-    write(http_client, buff, strlen(buff));
+/**************************************************************
+    Summery: 
 
-    // write content
-     if(strcmp(header.method, "HEAD") != 0){
-        write(http_client, content, content_size);
-    }
+    Renders a template as text/html response, see http_template.c.
+
+    @PARAMS: template with its values set
+    @returns: void
+**************************************************************/
+void http_sendtemplate(struct http_template_args* args){
+
+    http_add_content_type("text/html");
 
+    char buff[100+strlen(http_response_header)];
+    int length = sprintf(buff, "HTTP/1.1 200 OK\n%s", http_response_header);
+
+    if(http_template_render(http_current, args, buff, length) < 0)
+        http_current->closing = 1;
+
+    if(debug)
+        printf("%s\n", "[DEBUG] Template has been queued.");
 }
 
 /**************************************************************
@@ -488,7 +571,7 @@ void http_sendfile(char* file){
     @returns: void
 **************************************************************/
 void http_sendtext(char* text){
-    char buff[strlen(text)+100+strlen(http_response_header)];
+    char buff[100+strlen(http_response_header)];
 
     //server response header HTTP format
     char *header = "HTTP/1.1 200 OK\n";
@@ -499,24 +582,15 @@ void http_sendtext(char* text){
     // add custom http_response_header
     strcat(buff, http_response_header);
     // add content length header
-    strcat(buff, "Content-Length: ");
-
-
     int text_size = strlen(text);
+    sprintf(buff+strlen(buff), "Content-Length: %d\n\n", text_size);
 
-    // int to string hack
-    char size[(int)((ceil(log10(text_size))+1)*sizeof(char))];
-    sprintf(size, "%d", text_size);
+    // queue header and content
+    http_conn_queue_buffer(http_current, buff, strlen(buff));
+    http_conn_queue_buffer(http_current, text, text_size);
 
-    strcat(buff, size);
-    strcat(buff, "\n\n");
-
-    // add content
-    strcat(buff, text); // use memcpy instead
-
-    write(http_client, buff, strlen(buff));
     if(debug)
-        printf("%s\n", "[DEBUG] File has been sent.");
+        printf("%s\n", "[DEBUG] Text has been queued.");
 }
 
 /**************************************************************
@@ -545,10 +619,10 @@ void http_sendtext(char* text){
     rather than as metadata to be saved verbatim as part of the
     representation.
     
-    @PARAMS: request buffer
-    @returns: VOID
+    @PARAMS: request buffer, request content
+    @returns: 0 on success, -1 if request was rejected.
 **************************************************************/
-void http_parser(char* buffer, char* content){
+int http_parser(char* buffer, char* content){
     // get method
     char* get = strtok(buffer, " ");
     header.method = get;
@@ -604,16 +678,16 @@ void http_parser(char* buffer, char* content){
         A server MUST respond with a 400 (Bad Request) status code to any
         HTTP/1.1 request message that lacks a Host header field
     */
-    if(host == NULL){
+    if(host == NULL || uri == NULL){
         http_400(http_client);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     // handle potential keep alive header
     if(connection != NULL){
         char* connection_type = strtok(connection, " ");
         connection_type = strtok(NULL, " ");
-        if(strstr(connection_type, "keep-alive") != NULL){
+        if(connection_type != NULL && strstr(connection_type, "keep-alive") != NULL){
             http_add_responseheader("Connection: keep-alive");
             header.keep_alive = 1;
         }
@@ -623,11 +697,11 @@ void http_parser(char* buffer, char* content){
     if(content_type_raw != NULL){
         char* content_type = strtok(content_type_raw, " ");
         content_type = strtok(NULL, " ");
-        header.content_type = content_type;
+        header.content_type = content_type != NULL ? content_type : "";
 
             // if content type is from form, set content has parameters
         if(strstr(header.content_type, "application/x-www-form-urlencoded") != NULL){
-            header.query = content;
+            header.form = content;
         } else if(strstr(header.content_type, "multipart/form-data") != NULL){
             content_type = strtok(NULL, " ");
             char* boundary = strtok(content_type, "=");
@@ -638,10 +712,11 @@ void http_parser(char* buffer, char* content){
         header.content = content;
     }
 
-    // parse cookies
+    // parse cookies, value is the rest of the line
     if(cookies != NULL){
-        char* cookies_parsed = strtok(cookies, " ");
-        cookies_parsed = strtok(NULL, " ");
+        char* cookies_parsed = strchr(cookies, ':')+1;
+        cookies_parsed += strspn(cookies_parsed, " ");
+        cookies_parsed[strcspn(cookies_parsed, "\r")] = 0;
         header.cookies = cookies_parsed;
     } else {
         header.cookies = "";
@@ -669,37 +744,66 @@ void http_parser(char* buffer, char* content){
 
     header.route = uri;
 
+    return 0;
 }
 
 /**************************************************************
     Summery: 
 
-    Handles if a socket closes
+    Returns the length of the request header at the start of the
+    connection buffer and reads its Content-Length. Bodies are
+    only framed by Content-Length, a request with Transfer-Encoding
+    can not be told apart from the next one. With Content-Length
+    as well it could be framed differently by a proxy upstream.
 
-    @PARAMS: VOID
-    @returns: VOID
+    @PARAMS: connection, content length result
+    @returns: length of header, 0 if incomplete, -1 if invalid, HTTP_LENGTH_REQUIRED with Transfer-Encoding.
 **************************************************************/
-void sigpipe_handler()
-{
-    printf(KRED "[ERROR] HTTP client socket has closed unexpectedly!\n" KWHT);
-    // close connection
-    http_free_routes();
-    close(http_server_fd);
-    close(http_client);
-    if(debug)
-        printf(KMAG "%s PID: %ld, PORT %d!.\n" KWHT, "[DEBUG] Child process ended! - ", (long)getpid(), current_port);
-    exit(EXIT_FAILURE);
+long http_header_length(struct http_conn* conn, long* content_length){
+
+    *content_length = 0;
+
+    // idle connections have no input buffer
+    if(conn->in_length == 0)
+        return 0;
+    conn->in[conn->in_length] = 0;
+
+    char* end = strstr(conn->in, "\r\n\r\n");
+    if(end == NULL){
+        if(conn->in_length >= HTTP_MAX_REQUEST_SIZE)
+            return -1;
+        return 0;
+    }
+
+    long header_length = end-conn->in+4;
+
+    // look for Content-Length within the header only
+    *end = 0;
+    char* line = strcasestr(conn->in, "\nContent-Length:");
+    if(line != NULL){
+        *content_length = strtol(line+strlen("\nContent-Length:"), NULL, 10);
+    }
+    int chunked = strcasestr(conn->in, "\nTransfer-Encoding:") != NULL;
+    *end = '\r';
+
+    if(*content_length < 0 || (chunked && line != NULL))
+        return -1;
+    if(chunked)
+        return HTTP_LENGTH_REQUIRED;
+
+    return header_length;
 }
 
 /**************************************************************
     Summery: 
 
-    Handles a request. With connection keep-alive;
+    Handles a single request. The request buffer must be
+    zero terminated and will be modified by the parser.
 
-    @PARAMS: PORT,  set debugmode
+    @PARAMS: connection, request buffer
     @returns: VOID
 **************************************************************/
-void http_handle_request(char* buffer){
+void http_handle_request(struct http_conn* conn, char* buffer){
 
     //content header delimiter
     const char *delim = "\r\n\r\n";
@@ -708,83 +812,558 @@ void http_handle_request(char* buffer){
         printf(KYEL "%s\n" KWHT, buffer);
     }
 
+    // reset header
+    free(http_response_header);
+    http_setup_header();
+    memset(&header, 0, sizeof(header));
+
+    http_current = conn;
+    http_client = conn->fd;
+    current_port = conn->port;
+    conn->requests++;
+    http_worker_request();
+
     char* buffer_header = strstr(buffer, delim);
-    http_parser(buffer, buffer_header+strlen(delim));
+    unsigned long long trace = HTTP_TRACE_START(conn);
+    struct http_perf_sample perf;
+    http_perf_sample();
+    HTTP_PERF_START(&perf);
+    if(http_parser(buffer, buffer_header+strlen(delim)) < 0){
+        conn->keep_alive = 0;
+        return;
+    }
+    HTTP_TRACE_END(conn, HTTP_TRACE_PARSE, trace);
+    HTTP_PERF_END(HTTP_PERF_PARSE, &perf);
+    conn->keep_alive = header.keep_alive;
 
     if(debug)
         printf("%s\n", "--------- Running user defined functions --------");
 
     http_route_handler();
+    http_perf_request(conn);
 
     if(debug)
         printf("%s\n", "-------- Finished user defined functions --------");
 
-    // if keep alive
-    if(header.keep_alive == 1){
-        // a 32 empty request limit for keep alive
-        int empty_request_limit = 32;
-        while(empty_request_limit > 0){
+    // parameters are request local
+    http_params_reset(&http_query_params);
+    http_params_reset(&http_form_params);
+    http_params_reset(&http_fragment_params);
+    http_params_reset(&http_cookie_params);
+    http_session_reset();
+}
+
+/**************************************************************
+    Summery: 
+
+    Closes connection and frees its state
 
-            fd_set readSockSet;
-            struct timeval timeout;
-            FD_ZERO(&readSockSet);
-            FD_SET(http_client, &readSockSet);
+    @PARAMS: connection
+    @returns: VOID
+**************************************************************/
+void http_close(struct http_conn* conn){
+    if(debug)
+        printf(KMAG "%s FD: %d, PORT: %d!.\n" KWHT, "[DEBUG] Connection closed! - ", conn->fd, conn->port);
+    if(conn->peer != NULL || conn->proxy != NULL)
+        http_proxy_closed(conn);
+    if(conn->kind == HTTP_CONN_CLIENT)
+        http_release_connection(conn->addr);
+    if(conn->h2 != NULL)
+        http2_free(conn);
+    if(conn->ws != NULL)
+        websocket_closed(conn);
+    if(conn->tls != NULL)
+        http_tls_free(conn);
+    if(conn->pending){
+        http_files_cancel(conn);
+        http_coalesce_cancel(conn);
+    }
+    http_listen_closed(conn);
+    http_record_close(conn);
+    http_conn_free(conn);
+}
 
-            // wait for new connection for 8 seconds.
-            timeout.tv_sec = 8;
-            timeout.tv_usec = 0;
+/**************************************************************
+    Summery: 
 
-            int retval = select(FD_SETSIZE, &readSockSet, NULL, NULL, &timeout);
-            if(retval > 0){
-                // recv buffer
+    Registers a connection that was not accepted from the
+    listener, such as a proxy upstream, with the event loop.
 
-                char buffer2[HTTP_BUFFER_SIZE-1] = {0};
-                int valread = recv(http_client, buffer2, HTTP_BUFFER_SIZE, 0);
+    @PARAMS: connection
+    @returns: VOID
+**************************************************************/
+void http_watch(struct http_conn* conn){
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = conn->fd;
+    epoll_ctl(http_epoll_fd, EPOLL_CTL_ADD, conn->fd, &event);
+    conn->events = EPOLLIN;
+}
 
-                buffer2[HTTP_BUFFER_SIZE-2] = 0;
+/**************************************************************
+    Summery: 
 
-                if(valread == 0){
-                    usleep(250);
-                    empty_request_limit--;
-                    continue;
-                } else {
-                    // if buffer contains boundary, then add to header content
-                    if(strstr(buffer2, header.boundary) != NULL){
-                        header.content = buffer2;
-                        continue;
-                    }
-
-                    // reset header
-                    free(http_response_header);
-                    http_setup_header();
-                    header.total_headers = 0;
-                    printf(KGRN "%s\n" KWHT, "[CHILD] Handling new request!");
-
-                    // handle next request.
-                    http_handle_request(buffer2);
-                    return;
-                }
-            } else {
-                break;
-            }
+    Updates the epoll interest of a connection. Input is only
+    watched while reading is not paused, output only while
+    segments are queued.
+
+    @PARAMS: connection
+    @returns: VOID
+**************************************************************/
+void http_update_events(struct http_conn* conn){
+
+    int events = 0;
+    if(!conn->reading_paused && !conn->closing)
+        events |= EPOLLIN;
+    // closing connections are closed from http_write once drained
+    if(conn->out_head != NULL || (conn->closing && conn->peer == NULL && !conn->pending))
+        events |= EPOLLOUT;
+    if(conn->tls != NULL && conn->tls->want_write)
+        events |= EPOLLOUT;
+
+    if(events != conn->events){
+        struct epoll_event event;
+        event.events = events;
+        event.data.fd = conn->fd;
+        epoll_ctl(http_epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+        conn->events = events;
+    }
+}
+
+/**************************************************************
+    Summery: 
+
+    Handles all complete requests buffered on the connection.
+    Pipelined requests are only handled while less than the
+    high-water mark is queued for output, after that reading
+    is paused until the client has received enough.
+
+    @PARAMS: connection
+    @returns: VOID
+**************************************************************/
+void http_process(struct http_conn* conn){
+
+    // request body of a proxied exchange
+    if(conn->peer != NULL){
+        http_proxy_request_body(conn);
+        return;
+    }
+
+    if(conn->h2 != NULL){
+        http2_process(conn);
+        return;
+    }
+
+    if(conn->ws != NULL){
+        websocket_process(conn);
+        return;
+    }
+
+    // HTTP/2 with prior knowledge starts with the client preface
+    if(conn->requests == 0 && conn->in_length > 0 && conn->in[0] == 'P'){
+        int preface = http2_is_preface(conn);
+        if(preface < 0)
+            return;
+        if(preface > 0 && http2_start(conn) == 0){
+            http2_process(conn);
+            return;
         }
     }
-    // close connection
-    http_free_routes();
-    close(http_server_fd);
-    close(http_client);
-    if(debug)
-        printf(KMAG "%s PID: %ld, PORT: %d!.\n" KWHT, "[DEBUG] Child process ended! - ", (long)getpid(), current_port);
-    exit(0);
+
+    // a request waiting for its file or another worker is answered before the next one
+    while(!conn->closing && !conn->pending && conn->out_queued < http_get_highwater()){
+
+        long content_length;
+        long header_length = http_header_length(conn, &content_length);
+        if(header_length == 0)
+            break;
+
+        if(header_length == HTTP_LENGTH_REQUIRED){
+            http_411(conn->fd);
+            conn->closing = 1;
+            break;
+        }
+
+        if(header_length < 0){
+            http_400(conn->fd);
+            conn->closing = 1;
+            break;
+        }
+
+        // proxied requests are forwarded as soon as the header is complete
+        struct http_proxy* proxy = http_proxy_match(conn->in);
+
+        long length = header_length+content_length;
+        if(proxy == NULL && length > HTTP_MAX_REQUEST_SIZE){
+            http_400(conn->fd);
+            conn->closing = 1;
+            break;
+        }
+
+        if(proxy == NULL && (size_t)length > conn->in_length)
+            break;
+
+        // clients over their request rate are answered before any parsing
+        int retry_after = http_admit_request(conn->addr);
+        if(retry_after > 0){
+            http_503(conn->fd, retry_after);
+            conn->closing = 1;
+            break;
+        }
+
+        if(proxy != NULL){
+            http_proxy_start(conn, proxy, header_length, content_length);
+            return;
+        }
+
+        if(content_length == 0 && (websocket_upgrade(conn, header_length) || http2_upgrade(conn, header_length)))
+            return;
+
+        // coalesced requests may have to be handled again, see http_coalesce_park
+        if(http_coalesce_active())
+            http_coalesce_request(conn->in, length);
+
+        // terminate request, restore first byte of next pipelined request after
+        char next = conn->in[length];
+        conn->in[length] = 0;
+        http_handle_request(conn, conn->in);
+        conn->in[length] = next;
+
+        conn->in_length -= length;
+        memmove(conn->in, conn->in+length, conn->in_length);
+
+        if(!conn->keep_alive)
+            conn->closing = 1;
+    }
+
+    conn->reading_paused = conn->out_queued >= http_get_highwater() || conn->pending;
 }
 
+/**************************************************************
+    Summery: 
+
+    Sends queued output and closes the connection if it is done.
+
+    @PARAMS: connection
+    @returns: 0 if connection is still open, -1 if closed.
+**************************************************************/
+int http_write(struct http_conn* conn){
+
+    if(conn->tls != NULL && !conn->tls->established){
+        int ret = http_tls_handshake(conn);
+        if(ret < 0){
+            http_close(conn);
+            return -1;
+        }
+        if(ret == 0){
+            http_update_events(conn);
+            return 0;
+        }
+    }
+
+    size_t queued = conn->out_queued;
+    unsigned long long trace = HTTP_TRACE_START(conn);
+    struct http_perf_sample perf;
+    if(conn->perf_route)
+        http_perf_read(&perf);
+    conn->write_budget = http_sched_budget(conn);
+    int ret = http_conn_flush(conn);
+    HTTP_TRACE_END(conn, HTTP_TRACE_WRITE, trace);
+    if(conn->perf_route)
+        http_perf_send(conn, &perf);
+    if(ret < 0){
+        if(debug)
+            printf(KRED "[ERROR] HTTP client socket has closed unexpectedly!\n" KWHT);
+        http_close(conn);
+        return -1;
+    }
+
+    if(conn->out_queued != queued)
+        conn->last_active = time(NULL);
+
+    if(ret == 0 && conn->closing && conn->peer == NULL && !conn->pending){
+        http_close(conn);
+        return -1;
+    }
+
+    if(debug && ret > 0)
+        printf(KMAG "[DEBUG] FD: %d has %lu bytes queued, %lu queued in total.\n" KWHT, conn->fd, (unsigned long)conn->out_queued, (unsigned long)http_queued_bytes());
+
+    if(ret == 2){
+        // budget of this turn is used up, the next epoll_wait reports the connection again
+    } else if(conn->peer != NULL){
+        // proxied exchanges resume reading on the other side
+        http_proxy_drained(conn);
+    } else if(conn->h2 != NULL && conn->out_queued < http_get_highwater() && http2_send_data(conn) > 0){
+        // more DATA frames fit in the queue
+        return http_write(conn);
+    } else if(conn->kind == HTTP_CONN_CLIENT && conn->reading_paused && !conn->pending && conn->out_queued < http_get_highwater()){
+        // resume reading once the queue has drained below the high-water mark
+        http_process(conn);
+        return http_write(conn);
+    }
+
+    http_update_events(conn);
+    return 0;
+}
 
 /**************************************************************
     Summery: 
 
-    Creates tcp socket with given port and will set global variables.
-    After tcp socket is created it will accept clients then create a new chil process to handle request.
-    While parent process keeps accepting new clients.
+    Reads available bytes from client into the connection buffer
+    and handles all complete requests.
+
+    @PARAMS: connection
+    @returns: VOID
+**************************************************************/
+void http_read(struct http_conn* conn){
+
+    if(conn->tls != NULL && !conn->tls->established){
+        int ret = http_tls_handshake(conn);
+        if(ret < 0){
+            http_close(conn);
+            return;
+        }
+        if(ret == 0){
+            http_update_events(conn);
+            return;
+        }
+        conn->last_active = time(NULL);
+    }
+
+    // keep room for the terminating zero byte, TLS reads need room for a whole record
+    size_t headroom = conn->tls != NULL ? HTTP_TLS_RECORD_SIZE : 1;
+    if(conn->in_length+headroom >= conn->in_capacity){
+        size_t capacity = conn->in_capacity == 0 ? HTTP_BUFFER_SIZE : conn->in_capacity*2;
+        if(capacity > HTTP_MAX_REQUEST_SIZE+1)
+            capacity = HTTP_MAX_REQUEST_SIZE+1;
+
+        char* in = http_pool_grow(conn->in, conn->in_length, conn->in_capacity, capacity, &capacity);
+        if(in == NULL){
+            http_close(conn);
+            return;
+        }
+        conn->in = in;
+        conn->in_capacity = capacity;
+    }
+
+    ssize_t valread;
+    unsigned long long trace = HTTP_TRACE_START(conn);
+    if(conn->tls != NULL)
+        valread = http_tls_recv(conn, conn->in+conn->in_length, conn->in_capacity-conn->in_length-1);
+    else
+        valread = recv(conn->fd, conn->in+conn->in_length, conn->in_capacity-conn->in_length-1, 0);
+    HTTP_TRACE_END(conn, HTTP_TRACE_RECV, trace);
+    if(valread < 0){
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR){
+            // TLS may have to write before it can read again
+            if(conn->tls != NULL)
+                http_update_events(conn);
+            return;
+        }
+        http_close(conn);
+        return;
+    }
+
+    // upstream responses are forwarded to the client of the exchange
+    if(conn->kind == HTTP_CONN_UPSTREAM){
+        if(valread == 0){
+            http_close(conn);
+            return;
+        }
+        conn->in_length += valread;
+        conn->last_active = time(NULL);
+        http_proxy_response(conn);
+        return;
+    }
+
+    http_record_data(conn, conn->in+conn->in_length, valread);
+
+    // client closed its side, finish what has been received
+    if(valread == 0){
+        if(conn->requests == 0 && conn->in_length == 0)
+            printf("%s\n", "[ERROR] Empty request!");
+        conn->closing = 1;
+    }
+
+    conn->in_length += valread;
+    conn->last_active = time(NULL);
+
+    http_process(conn);
+
+    // idle connections give their input buffer back to the pool
+    if(conn->in_length == 0){
+        http_pool_free(conn->in, conn->in_capacity);
+        conn->in = NULL;
+        conn->in_capacity = 0;
+    }
+
+    if(http_write(conn) < 0)
+        return;
+
+    // a record only partly read fit in the buffer, its rest does not make the socket readable again
+    if(conn->tls != NULL && (conn->events & EPOLLIN) && http_tls_pending(conn))
+        http_read(conn);
+}
+
+/**************************************************************
+    Summery:
+
+    Answers a client over the admission limits with 503 and
+    closes it. Input still unread when the socket is closed makes
+    the kernel send a RST, which can discard the reply before the
+    client reads it, so the reply is followed by a FIN and the
+    request is read away first. TLS clients are closed without a
+    reply, they can not read one before the handshake.
+
+    @PARAMS: client socket, seconds for Retry-After, client of a TLS listener
+    @returns: VOID
+**************************************************************/
+static void http_shed(int client, int retry_after, int tls){
+
+    if(!tls){
+        http_503(client, retry_after);
+        shutdown(client, SHUT_WR);
+
+        char buffer[4096];
+        for (int i = 0; i < 16 && recv(client, buffer, sizeof(buffer), 0) > 0; ++i);
+    }
+    close(client);
+}
+
+/**************************************************************
+    Summery: 
+
+    Accepts all pending clients and registers them with the event
+    loop. Clients over the admission limits are answered with 503
+    and closed right away.
+
+    @PARAMS: listener
+    @returns: VOID
+**************************************************************/
+void http_accept(struct http_listener* listener){
+
+    for (int i = 0; i < HTTP_ACCEPT_BATCH; ++i)
+    {
+        struct sockaddr_storage client_addr;
+        socklen_t addrlen = sizeof(client_addr);
+
+        // the accept call itself is timed, sampling is decided once there is a connection
+        unsigned long long trace = http_trace_rate > 0 ? http_trace_now() : 0;
+
+        int client = accept4(listener->fd, (struct sockaddr *)&client_addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(client < 0){
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            return;
+        }
+
+        unsigned char addr[16];
+        http_addr_key((struct sockaddr *)&client_addr, addr);
+
+        int retry_after = http_admit_connection(addr);
+        if(retry_after > 0){
+            if(debug)
+                printf(KRED "%s FD: %d\n" KWHT, "[DEBUG] Connection shed, server is over its limits!", client);
+            http_shed(client, retry_after, listener->tls != NULL);
+            continue;
+        }
+
+        struct http_conn* conn = http_conn_new(client, HTTP_CONN_CLIENT);
+        if(conn == NULL){
+            http_release_connection(addr);
+            close(client);
+            continue;
+        }
+        memcpy(conn->addr, addr, 16);
+        // sin6_port is at the same offset, Unix socket clients have no port
+        conn->port = client_addr.ss_family == AF_UNIX ? 0 : ntohs(((struct sockaddr_in *)&client_addr)->sin_port);
+        conn->listener = listener;
+        listener->accepted++;
+        listener->connections++;
+
+        if(listener->tls != NULL && http_tls_accept(conn, listener->tls) < 0){
+            http_close(conn);
+            continue;
+        }
+        conn->events = EPOLLIN;
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = client;
+        epoll_ctl(http_epoll_fd, EPOLL_CTL_ADD, client, &event);
+
+        conn->traced = http_trace_sample();
+        HTTP_TRACE_END(conn, HTTP_TRACE_ACCEPT, trace);
+        http_record_accept(conn);
+
+        http_request_counter++;
+        http_worker_accepted(client);
+        if(debug)
+            printf(KGRN "%s FD: %d, PORT: %d\n" KWHT, "[DEBUG] Accepted new connection, waiting for request...", client, conn->port);
+    }
+}
+
+/**************************************************************
+    Summery: 
+
+    Closes connections that did not send a request within 3
+    seconds, or stayed idle for 8 seconds after a request.
+    Clients of a proxied exchange are left to the upstream side,
+    which is given HTTP_PROXY_TIMEOUT seconds.
+
+    Connections are collected first and closed after, as closing
+    one side of an exchange also affects the other.
+
+    @PARAMS: VOID
+    @returns: VOID
+**************************************************************/
+void http_timeouts(){
+    time_t now = time(NULL);
+    int expired[256];
+    int total;
+
+    do {
+        total = 0;
+        struct http_conn* conn = http_conn_first();
+        while(conn != NULL && total < 256){
+            int timeout = conn->requests == 0 ? 3 : 8;
+            if(conn->kind == HTTP_CONN_UPSTREAM)
+                timeout = HTTP_PROXY_TIMEOUT;
+
+            int idle = now-conn->last_active >= timeout;
+            // websockets stay open as long as the client answers pings
+            if(conn->ws != NULL)
+                idle = websocket_idle(conn, now);
+
+            if(idle && !(conn->kind == HTTP_CONN_CLIENT && conn->peer != NULL)){
+                if(conn->requests == 0 && conn->kind == HTTP_CONN_CLIENT)
+                    printf("%s FD: %d, PORT: %d\n", "[DEBUG] Incomming connection timed out!", conn->fd, conn->port);
+                expired[total] = conn->fd;
+                total++;
+            }
+            conn = conn->next;
+        }
+
+        for (int i = 0; i < total; ++i)
+        {
+            struct http_conn* expired_conn = http_conn_get(expired[i]);
+            if(expired_conn != NULL)
+                http_close(expired_conn);
+        }
+    } while(total == 256);
+}
+
+
+/**************************************************************
+    Summery: 
+
+    Opens the listener on given port and those added with
+    http_listen, and will set global variables. All clients are
+    served from a single epoll event loop. Sockets are non blocking, responses are queued
+    per connection and sent whenever the client is ready to receive.
     
     2.1.  Client/Server Messaging - rfc7230
     An HTTP "server" is a program
@@ -796,12 +1375,10 @@ void http_handle_request(char* buffer){
                                <   response
 
 
-    @PARAMS: PORT,  set debugmode
+    @PARAMS: PORT (0 to only use listeners of http_listen),  set debugmode
     @returns: VOID
 **************************************************************/
 void http_start(int PORT, int debugmode){
-    struct sockaddr_in address, client_addr;
-    client_addr.sin_port = 0;
 
     printf(KBLU "%s %d\n" KWHT, "[STARTUP] Starting HTTP server on port", PORT);
     debug = debugmode;
@@ -809,126 +1386,130 @@ void http_start(int PORT, int debugmode){
     if(debug)
         printf(KBLU "%s\n" KWHT, "[STARTUP] Debug mode is active");
 
-    
-    long valread;
-    int addrlen = sizeof(address);
-
-    /*server socket
-    AF_INET = IP address family
-    SOCK_STREAM = virtual circuit service.
-    */
-    if ((http_server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0)
-    {
-        //error handling
-        perror("FD socket");
-        exit(EXIT_FAILURE);
+    if(PORT > 0){
+        char address[16];
+        snprintf(address, sizeof(address), "%d", PORT);
+        struct http_listener* port_listener = http_listen_get(http_listen(address, 0));
+        if(port_listener == NULL)
+            exit(EXIT_FAILURE);
+        port_listener->steered = 1;
     }
 
-    printf(KBLU "%s\n" KWHT, "[STARTUP] TCP socket succesfully created.");
+    // shared state has to exist before workers are forked
+    http_session_start();
+    http_coalesce_start();
+    http_assets_start();
 
-    /*
-    The htons() function makes sure that numbers are stored in memory in network byte order, which is with the most significant byte first.
-    */
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons( PORT );
-    memset(address.sin_zero, '\0', sizeof(address.sin_zero));
+    // with workers the main listener is opened once per worker, the others are shared
+    struct http_listener* listener = http_listen_main();
+    if(listener != NULL && http_worker_count() > 0){
+        listener->steered = 1;
+        printf(KBLU "[STARTUP] Listening on %s%s\n" KWHT, listener->address, listener->tls != NULL ? " (HTTPS)" : "");
+    }
+    http_listen_open();
 
-    if (setsockopt(http_server_fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0)
-        exit(1);
+    // with workers only the worker processes return, each with its own listener
+    int worker_fd = http_workers_start(listener);
+    if(worker_fd >= 0)
+        listener->fd = worker_fd;
+    http_server_fd = listener != NULL ? listener->fd : -1;
+    http_record_start();
+    http_perf_start();
 
-    //bind server socket to sockaddr
-    if (bind(http_server_fd, (struct sockaddr *)&address, sizeof(struct sockaddr_in)) < 0)
+    if ((http_epoll_fd = epoll_create1(0)) < 0)
     {
-        //error handling
-        perror("Bind");
+        perror("epoll");
         exit(EXIT_FAILURE);
     }
 
-    //set socket to listen
-    if (listen(http_server_fd, 10) < 0)
-    {
-        //error handling
-        perror("listen");
-        exit(EXIT_FAILURE);
-    }
+    http_listen_watch(http_epoll_fd);
+    http_files_start(http_epoll_fd);
+    http_coalesce_watch(http_epoll_fd);
+
+    if(debug)
+        printf(KBLU "%s %d\n" KWHT, "[STARTUP] Listen backlog", http_get_backlog());
 
     printf(KBLU "%s\n" KWHT, "[STARTUP] Server now accepting requests...");
 
-    // signal handling
+    // signal handling, closed clients are reported as EPIPE by send(MSG_NOSIGNAL) / sendfile
     signal(SIGINT, intHandler);
-    signal(SIGPIPE,sigpipe_handler);
+    signal(SIGPIPE, SIG_IGN);
+    // workers are stopped with SIGTERM, captures are flushed on the way out
+    signal(SIGTERM, intHandler);
 
     // setup for response header;
     http_setup_header();
 
-    //listen loop
+    //event loop
+    struct epoll_event events[64];
     while(1)
     {
-        /*
-            Main to accept new clients
-        */
-        if ((http_client = accept(http_server_fd, (struct sockaddr *)&client_addr, (socklen_t*)&addrlen)) < 0)
-        {
-            //error handling
-            perror("accept");
+        // coalesced requests need to know if events were already pending, see http_coalesce_turn
+        int pending = http_coalesce_active() ? epoll_wait(http_epoll_fd, events, 64, 0) : 0;
+        int ready = pending != 0 ? pending : epoll_wait(http_epoll_fd, events, 64, http_coalesce_wait(1000));
+        if(ready < 0){
+            if(errno == EINTR)
+                continue;
+            perror("epoll_wait");
             intHandler();
-            exit(EXIT_FAILURE);
         }
+        http_coalesce_turn(pending > 0);
 
-        http_request_counter++;
-        if(fork() == 0){
-            current_port = client_addr.sin_port;
-            if(debug)
-                printf(KMAG "%s PID: %ld, PORT: %d!.\n" KWHT, "[DEBUG] Child process started! - ", (long)getpid(), current_port);
-
-            /*
-                Setup FD set with select to timeout socket that doesnt send anything.
-            */
+        // ready connections are queued by priority class, new clients are accepted right away
+        int files_ready = 0;
+        int coalesce_ready = 0;
+        for (int i = 0; i < ready; ++i)
+        {
+            int fd = events[i].data.fd;
+
+            struct http_conn* conn = http_conn_get(fd);
+            if(conn == NULL){
+                struct http_listener* listener = http_listener_get(fd);
+                if(listener != NULL)
+                    http_accept(listener);
+                else if(fd == http_files_fd())
+                    files_ready = 1;
+                else if(fd == http_coalesce_fd())
+                    coalesce_ready = 1;
+                continue;
+            }
+            http_sched_add(conn, events[i].events);
+        }
 
-            if(debug)
-                printf(KGRN "%s PID: %ld, PORT: %d\n" KWHT, "[DEBUG] Accepted new connection, waiting for request...",(long)getpid(), current_port);
-
-            // set FD sets
-            fd_set readSockSet;
-            struct timeval timeout;
-            FD_ZERO(&readSockSet);
-            FD_SET(http_client, &readSockSet);
-
-            // wait for request for 3 seconds.
-            timeout.tv_sec = 3;
-            timeout.tv_usec = 0;
-            // select for http_client
-            int retval = select(FD_SETSIZE, &readSockSet, NULL, NULL, &timeout);
-            if(retval > 0){
-
-                //prepare buffer and read from client
-                char buffer[HTTP_BUFFER_SIZE] = {0};
-                valread = recv(http_client, buffer, HTTP_BUFFER_SIZE-1, 0);
-                buffer[HTTP_BUFFER_SIZE-2] = 0;
-
-                // if empty request is recived close.
-                if(valread == 0){
-                    printf("%s\n", "[ERROR] Empty request!");
-                    close(http_client);
-                    intHandler();
-                }
+        int fd, ready_events;
+        while((fd = http_sched_next(&ready_events)) >= 0)
+        {
+            // may have been closed by an earlier event, such as the peer of a proxied exchange
+            struct http_conn* conn = http_conn_get(fd);
+            if(conn == NULL)
+                continue;
 
-                // send request to handle function
-                http_handle_request(buffer);
+            if(ready_events & EPOLLOUT){
+                if(http_write(conn) < 0)
+                    continue;
+            }
 
-            } else {
-                // if select timed out
-                printf("%s PID: %ld, PORT: %d\n", "[DEBUG] Incomming connection timed out!", (long)getpid(), current_port);
-                if(debug)
-                    printf(KMAG "%s PID: %ld, PORT %d!.\n" KWHT, "[DEBUG] Child process ended! - ", (long)getpid(), current_port);
-                close(http_client);
-                intHandler();
+            if(ready_events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+                if(conn->events & EPOLLIN){
+                    http_read(conn);
+                } else if(ready_events & (EPOLLHUP | EPOLLERR)){
+                    http_close(conn);
+                }
             }
-        } else {
-            close(http_client);
-            client_addr.sin_port = 0;
         }
 
+        // files opened by the I/O threads
+        if(files_ready)
+            http_files_complete();
+
+        // flights landed in other workers and parked requests past their deadline
+        http_coalesce_complete(coalesce_ready);
+
+        http_timeouts();
+        http_admission_sweep();
+        http_worker_update();
+        http_trace_poll();
+        http_session_sweep();
+        http_record_poll();
     }
-}
\ No newline at end of file
+}
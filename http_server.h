@@ -3,6 +3,26 @@
 
 #include "syshead.h"
 #include "http_status.h"
+#include "http_conn.h"
+#include "http_pool.h"
+#include "http_listen.h"
+#include "http_admission.h"
+#include "http_proxy.h"
+#include "http2.h"
+#include "websocket.h"
+#include "http_tls.h"
+#include "http_params.h"
+#include "http_bundle.h"
+#include "http_assets.h"
+#include "http_worker.h"
+#include "http_trace.h"
+#include "http_template.h"
+#include "http_session.h"
+#include "http_record.h"
+#include "http_perf.h"
+#include "http_sched.h"
+#include "http_files.h"
+#include "http_coalesce.h"
 #include "utils.h"
 
 #define NUMBER_OF_ROUTES 50
@@ -10,6 +30,7 @@
 #define NUMBER_OF_HEADERS 50
 
 #define HTTP_BUFFER_SIZE 8192 // 8KB
+#define HTTP_LENGTH_REQUIRED -2 // request body with Transfer-Encoding, see http_header_length
 
 
 struct http_header
@@ -20,6 +41,8 @@ struct http_header
 
 	char* query;
 
+	char* form; // application/x-www-form-urlencoded body
+
 	char* content_type;
 
 	char* content;
@@ -43,19 +66,41 @@ struct http_route
 	char* route;
 	char* method;
 	void (*http_routefunction)();
+	int priority; // HTTP_PRIORITY_*, see http_set_priority
+	char* coalesce; // key of http_set_coalesce, NULL if requests are not coalesced
+	int coalesce_timeout; // ms
 };
 
+extern struct http_route* http_routes[NUMBER_OF_ROUTES];
+extern int http_routecounter;
+extern char* http_default_header;
+extern char* http_response_header; // http_default_header and the headers added for the current request
 
 void http_redirect(char* location);
 int http_addfolder(char* folder);
 int http_add_responseheader(char* header);
 int http_add_cookie(char* cookie_name, char* cookie_value);
 int http_addroute(char* method, char* path, void (*f)());
+int http_set_priority(char* path, int priority);
+int http_set_coalesce(char* path, char* key, int timeout);
 void http_sendfile(char* file);
 void http_sendtext(char* text);
+void http_sendtemplate(struct http_template_args* args);
 void http_start(int port, int debugmode);
 char* http_get_request_header(char* header_name);
 char* http_get_cookie(char* cookie_name);
 char* http_get_parameter(char* variable, int mode);
+int http_get_parameters(char* variable, int mode, char** values, int max);
+
+// event loop, used by protocol modules
+extern int debug;
+extern struct http_conn* http_current;
+void http_setup_header();
+void http_handle_request(struct http_conn* conn, char* buffer);
+void http_process(struct http_conn* conn);
+int http_write(struct http_conn* conn);
+void http_close(struct http_conn* conn);
+void http_update_events(struct http_conn* conn);
+void http_watch(struct http_conn* conn);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,446 @@
+#include "http_server.h"
+#include <sys/mman.h>
+#include <sys/random.h>
+
+/*
+    Server side sessions
+
+    Sessions live in a fixed size hash table in a shared anonymous
+    mapping created before workers are forked, so every worker sees
+    the same sessions. The table is split into shards, each with
+    its own open addressing slots, a process shared robust mutex
+    for writers and a sequence counter readers check instead of
+    locking: a lookup is a copy out of shared memory, retried if a
+    writer was active.
+
+    The session id is 128 random bits in the "session" cookie.
+    A request copies its session once, on the first
+    http_session_get or http_session_set, and http_session_set
+    writes it back. Sessions expire ttl seconds after last use,
+    expired entries are removed by a sweep of one shard per second
+    from the event loop.
+*/
+
+static int http_session_capacity = 0;
+static int http_session_ttl = 0;
+
+struct http_session_store* http_sessions = NULL;
+
+// session of the current request
+static struct http_session_entry http_session_current;
+static int http_session_loaded = 0;
+
+
+/**************************************************************
+    Summery:
+
+    Enables sessions, must be called before http_start.
+
+    @PARAMS: max number of sessions, seconds a session lives after last use
+    @returns: VOID
+**************************************************************/
+void http_set_sessions(int capacity, int ttl){
+    http_session_capacity = capacity;
+    http_session_ttl = ttl;
+}
+
+/**************************************************************
+    Creates the shared table, called by http_start before workers
+    are forked.
+**************************************************************/
+void http_session_start(){
+
+    if(http_session_capacity <= 0)
+        return;
+
+    int per_shard = (http_session_capacity+HTTP_SESSION_SHARDS-1)/HTTP_SESSION_SHARDS;
+    size_t size = sizeof(struct http_session_store)+sizeof(struct http_session_entry)*per_shard*HTTP_SESSION_SHARDS;
+
+    http_sessions = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(http_sessions == MAP_FAILED){
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    http_sessions->ttl = http_session_ttl;
+
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    // a worker that dies holding a lock does not block the others
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+
+    struct http_session_entry* entries = (struct http_session_entry*)(http_sessions+1);
+    for (int i = 0; i < HTTP_SESSION_SHARDS; ++i)
+    {
+        struct http_session_shard* shard = &http_sessions->shards[i];
+        pthread_mutex_init(&shard->lock, &attributes);
+        shard->capacity = per_shard;
+        shard->entries = entries+i*per_shard;
+    }
+    pthread_mutexattr_destroy(&attributes);
+
+    printf(KBLU "[STARTUP] Sessions: %d, TTL %d seconds\n" KWHT, per_shard*HTTP_SESSION_SHARDS, http_session_ttl);
+}
+
+/**************************************************************
+    FNV-1a hash of a session id
+**************************************************************/
+static unsigned int http_session_hash(const char* id){
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < HTTP_SESSION_ID_LENGTH; ++i)
+    {
+        hash ^= (unsigned char)id[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**************************************************************
+    Summery:
+
+    Finds the slot of id, or the slot a new session with id
+    would use: the first free or expired slot of its probe
+    sequence, else the one expiring first.
+
+    @PARAMS: shard, id, hash of id, current time, set to 1 if id was found (out)
+    @returns: slot index
+**************************************************************/
+static int http_session_slot(struct http_session_shard* shard, const char* id, unsigned int hash, time_t now, int* found){
+
+    int start = (hash/HTTP_SESSION_SHARDS) % shard->capacity;
+    int reusable = -1;
+    int oldest = start;
+
+    *found = 0;
+    for (int n = 0; n < shard->capacity; ++n)
+    {
+        int i = (start+n) % shard->capacity;
+        struct http_session_entry* entry = &shard->entries[i];
+
+        if(entry->state == HTTP_SESSION_USED && memcmp(entry->id, id, HTTP_SESSION_ID_LENGTH) == 0){
+            *found = 1;
+            return i;
+        }
+        if(reusable < 0 && (entry->state != HTTP_SESSION_USED || entry->expires <= now))
+            reusable = i;
+        if(entry->state == HTTP_SESSION_EMPTY)
+            break;
+        if(entry->expires < shard->entries[oldest].expires)
+            oldest = i;
+    }
+    return reusable >= 0 ? reusable : oldest;
+}
+
+/**************************************************************
+    Summery:
+
+    Removes the session in slot. Lookups go on past deleted
+    slots, so a slot is only emptied if the next one is empty:
+    then no probe sequence continues through it, and the deleted
+    slots before it are emptied as well. Called with the lock held.
+
+    @PARAMS: shard, slot
+    @returns: VOID
+**************************************************************/
+static void http_session_remove(struct http_session_shard* shard, int slot){
+
+    shard->entries[slot].state = HTTP_SESSION_DELETED;
+    if(shard->entries[(slot+1) % shard->capacity].state != HTTP_SESSION_EMPTY)
+        return;
+
+    for (int n = 0; n < shard->capacity && shard->entries[slot].state == HTTP_SESSION_DELETED; ++n)
+    {
+        shard->entries[slot].state = HTTP_SESSION_EMPTY;
+        slot = (slot+shard->capacity-1) % shard->capacity;
+    }
+}
+
+/**************************************************************
+    Locks a shard for writing and makes readers retry
+**************************************************************/
+static void http_session_lock(struct http_session_shard* shard){
+    if(pthread_mutex_lock(&shard->lock) == EOWNERDEAD){
+        // previous owner died while writing, end its write
+        pthread_mutex_consistent(&shard->lock);
+        if(shard->sequence & 1)
+            __atomic_add_fetch(&shard->sequence, 1, __ATOMIC_RELEASE);
+    }
+    __atomic_add_fetch(&shard->sequence, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void http_session_unlock(struct http_session_shard* shard){
+    __atomic_add_fetch(&shard->sequence, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**************************************************************
+    Summery:
+
+    Copies session id out of the table without locking.
+
+    @PARAMS: id, entry to copy to
+    @returns: 1 if found and not expired, 0 otherwise.
+**************************************************************/
+static int http_session_read(const char* id, struct http_session_entry* out){
+
+    unsigned int hash = http_session_hash(id);
+    struct http_session_shard* shard = &http_sessions->shards[hash % HTTP_SESSION_SHARDS];
+    time_t now = time(NULL);
+    int found;
+
+    for (int spins = 0; ; ++spins){
+        unsigned int sequence = __atomic_load_n(&shard->sequence, __ATOMIC_ACQUIRE);
+        if(sequence & 1){
+            // a writer that died mid write leaves the sequence odd, locking recovers it
+            if(spins % 100000 == 99999){
+                http_session_lock(shard);
+                http_session_unlock(shard);
+            }
+            continue;
+        }
+
+        int slot = http_session_slot(shard, id, hash, now, &found);
+        if(found)
+            memcpy(out, &shard->entries[slot], sizeof(struct http_session_entry));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&shard->sequence, __ATOMIC_RELAXED) == sequence)
+            break;
+    }
+
+    return found && out->expires > now && out->length <= HTTP_SESSION_DATA_SIZE;
+}
+
+/**************************************************************
+    Summery:
+
+    Writes the session of the current request to the table.
+
+    @PARAMS: VOID
+    @returns: VOID
+**************************************************************/
+static void http_session_write(){
+
+    struct http_session_entry* current = &http_session_current;
+    unsigned int hash = http_session_hash(current->id);
+    struct http_session_shard* shard = &http_sessions->shards[hash % HTTP_SESSION_SHARDS];
+    int found;
+
+    http_session_lock(shard);
+
+    int slot = http_session_slot(shard, current->id, hash, time(NULL), &found);
+    struct http_session_entry* entry = &shard->entries[slot];
+    if(!found && entry->state == HTTP_SESSION_USED && entry->expires > time(NULL))
+        __atomic_add_fetch(&http_sessions->evicted, 1, __ATOMIC_RELAXED);
+    if(entry->state != HTTP_SESSION_USED)
+        __atomic_add_fetch(&http_sessions->sessions, 1, __ATOMIC_RELAXED);
+
+    memcpy(entry, current, sizeof(struct http_session_entry));
+
+    http_session_unlock(shard);
+}
+
+/**************************************************************
+    Summery:
+
+    Loads the session of the current request, once per request.
+    Sessions are extended when half of their lifetime is over.
+
+    @PARAMS: VOID
+    @returns: session, NULL if the request has none.
+**************************************************************/
+static struct http_session_entry* http_session_load(){
+
+    if(http_session_loaded)
+        return http_session_current.state == HTTP_SESSION_USED ? &http_session_current : NULL;
+
+    http_session_loaded = 1;
+    http_session_current.state = HTTP_SESSION_EMPTY;
+    if(http_sessions == NULL)
+        return NULL;
+
+    char* id = http_get_cookie(HTTP_SESSION_COOKIE);
+    if(id == NULL || strlen(id) != HTTP_SESSION_ID_LENGTH || !http_session_read(id, &http_session_current)){
+        http_session_current.state = HTTP_SESSION_EMPTY;
+        return NULL;
+    }
+
+    time_t now = time(NULL);
+    if(http_session_current.expires-now < http_sessions->ttl/2){
+        http_session_current.expires = now+http_sessions->ttl;
+        http_session_write();
+    }
+    return &http_session_current;
+}
+
+/**************************************************************
+    Summery:
+
+    Returns a value of the session of the current request.
+
+    @PARAMS: key
+    @returns: value valid until the request is done or the next
+    http_session_set, NULL if not set or there is no session.
+**************************************************************/
+char* http_session_get(char* key){
+
+    struct http_session_entry* session = http_session_load();
+    if(session == NULL)
+        return NULL;
+
+    char* p = session->data;
+    char* end = session->data+session->length;
+    while(p < end){
+        char* value = p+strlen(p)+1;
+        if(strcmp(p, key) == 0)
+            return value;
+        p = value+strlen(value)+1;
+    }
+    return NULL;
+}
+
+/**************************************************************
+    Summery:
+
+    Sets a value of the session of the current request. Starts
+    a session with a new session cookie if there is none.
+
+    @PARAMS: key, value
+    @returns: 0 on success, -1 on error.
+**************************************************************/
+int http_session_set(char* key, char* value){
+
+    if(http_sessions == NULL)
+        return -1;
+
+    struct http_session_entry* session = http_session_load();
+    if(session == NULL){
+        unsigned char random[HTTP_SESSION_ID_LENGTH/2];
+        if(getrandom(random, sizeof(random), 0) != sizeof(random))
+            return -1;
+
+        session = &http_session_current;
+        memset(session, 0, sizeof(struct http_session_entry));
+        for (size_t i = 0; i < sizeof(random); ++i)
+            sprintf(session->id+i*2, "%02x", random[i]);
+        session->state = HTTP_SESSION_USED;
+
+        char cookie[HTTP_SESSION_ID_LENGTH+64];
+        snprintf(cookie, sizeof(cookie), "%.*s; Path=/; Max-Age=%d; HttpOnly; SameSite=Lax", HTTP_SESSION_ID_LENGTH, session->id, http_sessions->ttl);
+        http_add_cookie(HTTP_SESSION_COOKIE, cookie);
+    }
+
+    // rebuild the pairs without key, then append the new pair
+    char data[HTTP_SESSION_DATA_SIZE];
+    size_t length = 0;
+    char* p = session->data;
+    char* end = session->data+session->length;
+    while(p < end){
+        char* old = p+strlen(p)+1;
+        char* next = old+strlen(old)+1;
+        if(strcmp(p, key) != 0){
+            memcpy(data+length, p, next-p);
+            length += next-p;
+        }
+        p = next;
+    }
+
+    size_t key_length = strlen(key)+1;
+    size_t value_length = strlen(value)+1;
+    if(length+key_length+value_length > HTTP_SESSION_DATA_SIZE)
+        return -1;
+    memcpy(data+length, key, key_length);
+    memcpy(data+length+key_length, value, value_length);
+    length += key_length+value_length;
+
+    memcpy(session->data, data, length);
+    session->length = length;
+    session->expires = time(NULL)+http_sessions->ttl;
+
+    http_session_write();
+    return 0;
+}
+
+/**************************************************************
+    Ends the session of the current request, such as on logout
+**************************************************************/
+void http_session_destroy(){
+
+    struct http_session_entry* session = http_session_load();
+    if(session == NULL)
+        return;
+
+    unsigned int hash = http_session_hash(session->id);
+    struct http_session_shard* shard = &http_sessions->shards[hash % HTTP_SESSION_SHARDS];
+    int found;
+
+    http_session_lock(shard);
+    int slot = http_session_slot(shard, session->id, hash, time(NULL), &found);
+    if(found){
+        http_session_remove(shard, slot);
+        __atomic_sub_fetch(&http_sessions->sessions, 1, __ATOMIC_RELAXED);
+    }
+    http_session_unlock(shard);
+
+    session->state = HTTP_SESSION_EMPTY;
+    http_add_cookie(HTTP_SESSION_COOKIE, "; Path=/; Max-Age=0");
+}
+
+/**************************************************************
+    Forgets the session of the request, called after each request
+**************************************************************/
+void http_session_reset(){
+    http_session_loaded = 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Removes expired sessions of one shard per second, shards
+    are taken in turn by all workers. A shard without sessions
+    is cleared so lookups stop at the first slot again.
+
+    @PARAMS: VOID
+    @returns: VOID
+**************************************************************/
+void http_session_sweep(){
+
+    static time_t last = 0;
+    time_t now = time(NULL);
+    if(http_sessions == NULL || now == last)
+        return;
+    last = now;
+
+    unsigned int index = __atomic_fetch_add(&http_sessions->sweep, 1, __ATOMIC_RELAXED) % HTTP_SESSION_SHARDS;
+    struct http_session_shard* shard = &http_sessions->shards[index];
+
+    http_session_lock(shard);
+
+    int used = 0;
+    for (int i = 0; i < shard->capacity; ++i)
+    {
+        struct http_session_entry* entry = &shard->entries[i];
+        if(entry->state != HTTP_SESSION_USED)
+            continue;
+        if(entry->expires <= now){
+            http_session_remove(shard, i);
+            __atomic_sub_fetch(&http_sessions->sessions, 1, __ATOMIC_RELAXED);
+        } else {
+            used++;
+        }
+    }
+    if(used == 0){
+        for (int i = 0; i < shard->capacity; ++i)
+            shard->entries[i].state = HTTP_SESSION_EMPTY;
+    }
+
+    http_session_unlock(shard);
+}
+
+/**************************************************************
+    Returns the number of live sessions in all workers
+**************************************************************/
+long http_session_count(){
+    return http_sessions != NULL ? http_sessions->sessions : 0;
+}
@@ -0,0 +1,58 @@
+#ifndef __HTTP_SESSION_H
+#define __HTTP_SESSION_H
+
+#include "syshead.h"
+#include <pthread.h>
+
+#define HTTP_SESSION_SHARDS 16
+#define HTTP_SESSION_ID_LENGTH 32 // hex of 128 random bits
+#define HTTP_SESSION_DATA_SIZE 480 // key and value pairs of one session
+#define HTTP_SESSION_COOKIE "session"
+
+#define HTTP_SESSION_EMPTY 0
+#define HTTP_SESSION_USED 1
+#define HTTP_SESSION_DELETED 2
+
+/*
+    One session, data holds "key\0value\0" pairs.
+*/
+struct http_session_entry
+{
+	char id[HTTP_SESSION_ID_LENGTH+1];
+	unsigned char state;
+	unsigned short length; // bytes used in data
+	time_t expires;
+	char data[HTTP_SESSION_DATA_SIZE];
+};
+
+/*
+    Writers take the lock, readers copy an entry without it and
+    retry if sequence was odd or changed while copying.
+*/
+struct http_session_shard
+{
+	pthread_mutex_t lock;
+	unsigned int sequence;
+	int capacity;
+	struct http_session_entry* entries;
+};
+
+struct http_session_store
+{
+	int ttl; // seconds
+	unsigned int sweep; // next shard to sweep
+	long sessions; // for stats
+	long evicted;
+	struct http_session_shard shards[HTTP_SESSION_SHARDS];
+};
+
+void http_set_sessions(int capacity, int ttl);
+void http_session_start();
+char* http_session_get(char* key);
+int http_session_set(char* key, char* value);
+void http_session_destroy();
+void http_session_reset();
+void http_session_sweep();
+long http_session_count();
+
+#endif
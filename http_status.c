@@ -1,5 +1,6 @@
 #include "utils.h"
 #include "syshead.h"
+#include "http_conn.h"
 
 
 // HTTP pre defined status replies
@@ -15,8 +16,8 @@
 **************************************************************/
 int http_400(int client){
     char *header = "HTTP/1.1 400 Bad Request \nContent-Type: text/html\nContent-Length: 16\n\n 400 Bad Request";
-    int w = write(client, header, strlen(header)+2);
-    if(w == 0){
+    int w = http_conn_send(client, header, strlen(header));
+    if(w < 0){
          printf(KRED "%s\n" KWHT, "[ERROR] 400 Response could not be sent!");
     } else {
         printf("%s\n", "[LOG] 400 Reponse was sent");
@@ -33,9 +34,9 @@ int http_400(int client){
     @returns: VOID
 **************************************************************/
 int http_404(int client){
-    char *header = "HTTP/1.1 404 Not Found\nContent-Type: text/html\nContent-Length: 13\n\n 404 Not found";
-    int w = write(client, header, strlen(header)+2);
-    if(w == 0){
+    char *header = "HTTP/1.1 404 Not Found\nContent-Type: text/html\nContent-Length: 14\n\n 404 Not found";
+    int w = http_conn_send(client, header, strlen(header));
+    if(w < 0){
          printf(KRED "%s\n" KWHT, "[ERROR] 404 Response could not be sent!");
     }
     printf("%s\n", "[LOG] 404 Response has been sent.");
@@ -43,6 +44,26 @@ int http_404(int client){
 }
 
 
+/**************************************************************
+    Summery: 
+
+    http_411 returns the 411 status code. It is sent for request
+    bodies with Transfer-Encoding, only Content-Length is read.
+
+    @PARAMS: client fd
+    @returns: VOID
+**************************************************************/
+int http_411(int client){
+    char *header = "HTTP/1.1 411 Length Required\nContent-Type: text/html\nContent-Length: 20\nConnection: close\n\n 411 Length Required";
+    int w = http_conn_send(client, header, strlen(header));
+    if(w < 0){
+         printf(KRED "%s\n" KWHT, "[ERROR] 411 Response could not be sent!");
+    }
+    printf("%s\n", "[LOG] 411 Response has been sent.");
+    return w;
+}
+
+
 /**************************************************************
     Summery: 
 
@@ -60,14 +81,57 @@ int http_301(int client, char* location, char* extra_headers){
 
     strcpy(header, pre_header);
     strcat(header, location);
+    strcat(header, "\n");
     strcat(header, extra_headers);
-    strcat(header, "\n\n");
-    header[header_length] = 0;
+    strcat(header, "\n");
+    header[header_length-1] = 0;
 
-    int w = write(client, header, strlen(header)+1);
-    if(w == 0){
+    int w = http_conn_send(client, header, strlen(header));
+    if(w < 0){
          printf(KRED "%s\n" KWHT, "[ERROR] 301 Response could not be sent!");
     }
     printf("%s %s\n", "[LOG] 301 Response. Client has been redirected too ", location);
     return w;
-}
\ No newline at end of file
+}
+/**************************************************************
+    Summery: 
+
+    http_503 returns the 503 status code. It is sent when the server
+    sheds load. Connections that were never admitted have no output
+    queue, the reply is then sent directly on the socket.
+
+    @PARAMS: client fd, seconds until client may retry
+    @returns: VOID
+**************************************************************/
+int http_503(int client, int retry_after){
+    char header[200];
+    sprintf(header, "HTTP/1.1 503 Service Unavailable\nRetry-After: %d\nContent-Type: text/html\nContent-Length: 24\nConnection: close\n\n 503 Service Unavailable", retry_after);
+
+    int w = http_conn_send(client, header, strlen(header));
+    if(w < 0){
+        w = send(client, header, strlen(header), MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+    if(w < 0){
+         printf(KRED "%s\n" KWHT, "[ERROR] 503 Response could not be sent!");
+    }
+    return w;
+}
+
+/**************************************************************
+    Summery: 
+
+    http_502 returns the 502 status code. It is sent when a proxy
+    upstream could not be reached or failed before responding.
+
+    @PARAMS: client fd
+    @returns: VOID
+**************************************************************/
+int http_502(int client){
+    char *header = "HTTP/1.1 502 Bad Gateway\nContent-Type: text/html\nContent-Length: 16\nConnection: close\n\n 502 Bad Gateway";
+    int w = http_conn_send(client, header, strlen(header));
+    if(w < 0){
+         printf(KRED "%s\n" KWHT, "[ERROR] 502 Response could not be sent!");
+    }
+    printf("%s\n", "[LOG] 502 Response has been sent.");
+    return w;
+}
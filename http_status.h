@@ -3,6 +3,9 @@
 
 int http_400(int client);
 int http_404(int client);
+int http_411(int client);
 int http_301(int client, char* location, char* extra_headers);
+int http_502(int client);
+int http_503(int client, int retry_after);
 
 #endif
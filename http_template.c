@@ -0,0 +1,466 @@
+#include "http_template.h"
+#include "utils.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+    HTML templates
+
+    A template is compiled once into a flat list of ops: literal
+    slices of the source, escaped or raw variables, and sections
+    that repeat over a list. Rendering runs the ops twice, first
+    to get the Content-Length, then to write the body straight
+    into the output queue of the connection: escaped values are
+    written in place with http_conn_reserve, long literals are
+    queued as static segments and sent from the template itself.
+
+        <ul>{{#users}}<li>{{.}}, {{emails}}</li>{{/users}}</ul>
+
+    HTML escaping finds the characters to replace 16 bytes at a
+    time with SSE2 where available.
+*/
+
+#define HTTP_TEMPLATE_DOT 255 // var of {{.}}
+
+struct http_template_frame
+{
+	int op; // SECTION op
+	int var;
+	int index;
+	int count;
+};
+
+
+/**************************************************************
+    Summery:
+
+    Returns the index of name in the template, adding it if new.
+
+    @PARAMS: template, name, length of name
+    @returns: index, -1 if there are too many names.
+**************************************************************/
+static int http_template_name(struct http_template* template, const char* name, size_t length){
+
+    if(length == 1 && name[0] == '.')
+        return HTTP_TEMPLATE_DOT;
+
+    for (int i = 0; i < template->namecount; ++i)
+    {
+        if(strlen(template->names[i]) == length && strncmp(template->names[i], name, length) == 0)
+            return i;
+    }
+
+    if(template->namecount == HTTP_TEMPLATE_MAX_VARS)
+        return -1;
+
+    template->names[template->namecount] = strndup(name, length);
+    return template->namecount++;
+}
+
+/**************************************************************
+    Frees a template that could not be compiled
+**************************************************************/
+static struct http_template* http_template_fail(struct http_template* template, const char* error){
+    printf(KRED "[ERROR] Template: %s\n" KWHT, error);
+    for (int i = 0; i < template->namecount; ++i)
+        free(template->names[i]);
+    free(template->ops);
+    free(template->source);
+    free(template);
+    return NULL;
+}
+
+/**************************************************************
+    Summery:
+
+    Compiles a template. {{name}} is replaced by the HTML escaped
+    value, {{{name}}} by the value as it is, {{#name}} ... {{/name}}
+    repeats for each item of a list and {{.}} is the current item.
+
+    @PARAMS: template source
+    @returns: template, NULL on error.
+**************************************************************/
+struct http_template* http_template_compile(const char* source){
+
+    struct http_template* template = calloc(1, sizeof(struct http_template));
+    if(template == NULL)
+        return NULL;
+
+    size_t length = strlen(source);
+    template->source = strdup(source);
+    // every tag is at least 4 bytes, plus one literal before each tag and one at the end
+    template->ops = calloc(length/2+2, sizeof(struct http_template_op));
+    if(template->source == NULL || template->ops == NULL)
+        return http_template_fail(template, "out of memory");
+
+    int stack[HTTP_TEMPLATE_MAX_DEPTH];
+    int depth = 0;
+
+    const char* p = template->source;
+    const char* end = template->source+length;
+
+    while(p < end){
+        const char* tag = strstr(p, "{{");
+        const char* literal_end = tag != NULL ? tag : end;
+
+        if(literal_end > p){
+            struct http_template_op* op = &template->ops[template->total++];
+            op->type = HTTP_TEMPLATE_LITERAL;
+            op->offset = p-template->source;
+            op->length = literal_end-p;
+        }
+        if(tag == NULL)
+            break;
+
+        int raw = tag[2] == '{';
+        const char* name = tag+(raw ? 3 : 2);
+        const char* close = strstr(name, raw ? "}}}" : "}}");
+        if(close == NULL)
+            return http_template_fail(template, "unclosed tag");
+        p = close+(raw ? 3 : 2);
+
+        int type = raw ? HTTP_TEMPLATE_RAW : HTTP_TEMPLATE_ESCAPE;
+        if(!raw && (*name == '#' || *name == '/')){
+            type = *name == '#' ? HTTP_TEMPLATE_SECTION : HTTP_TEMPLATE_END;
+            name++;
+        }
+
+        while(name < close && *name == ' ')
+            name++;
+        const char* name_end = close;
+        while(name_end > name && name_end[-1] == ' ')
+            name_end--;
+
+        int var = http_template_name(template, name, name_end-name);
+        if(var < 0)
+            return http_template_fail(template, "too many names");
+        if(var == HTTP_TEMPLATE_DOT && (type == HTTP_TEMPLATE_SECTION || depth == 0))
+            return http_template_fail(template, "{{.}} outside of a section");
+
+        struct http_template_op* op = &template->ops[template->total];
+        op->type = type;
+        op->var = var;
+
+        if(type == HTTP_TEMPLATE_SECTION){
+            if(depth == HTTP_TEMPLATE_MAX_DEPTH)
+                return http_template_fail(template, "sections nested too deep");
+            stack[depth++] = template->total;
+        } else if(type == HTTP_TEMPLATE_END){
+            if(depth == 0 || template->ops[stack[depth-1]].var != var)
+                return http_template_fail(template, "section end does not match");
+            depth--;
+            op->jump = stack[depth];
+            template->ops[stack[depth]].jump = template->total+1;
+        }
+        template->total++;
+    }
+
+    if(depth != 0)
+        return http_template_fail(template, "unclosed section");
+
+    return template;
+}
+
+/**************************************************************
+    Summery:
+
+    Compiles a template file, done once at startup.
+
+    @PARAMS: file name
+    @returns: template, NULL on error.
+**************************************************************/
+struct http_template* http_template_load(char* file){
+
+    FILE* fp = fopen(file, "r");
+    if(fp == NULL){
+        printf(KRED "%s %s\n" KWHT, "[ERROR] Could not open template", file);
+        return NULL;
+    }
+
+    char* source = NULL;
+    size_t size = 0;
+    ssize_t length = getdelim(&source, &size, '\0', fp);
+    fclose(fp);
+
+    struct http_template* template = length < 0 ? NULL : http_template_compile(source);
+    free(source);
+    return template;
+}
+
+/**************************************************************
+    Clears args before the values for a render are set
+**************************************************************/
+void http_template_args(struct http_template_args* args, struct http_template* template){
+    memset(args, 0, sizeof(struct http_template_args));
+    args->template = template;
+}
+
+/**************************************************************
+    Returns index of name in the template, -1 if not used
+**************************************************************/
+static int http_template_find(struct http_template* template, const char* name){
+    for (int i = 0; i < template->namecount; ++i)
+    {
+        if(strcmp(template->names[i], name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/**************************************************************
+    Summery:
+
+    Sets a string value. The value is not copied and must stay
+    valid until the template is rendered.
+
+    @PARAMS: args, name, value
+    @returns: 0 on success, -1 if the template does not use name.
+**************************************************************/
+int http_template_set(struct http_template_args* args, const char* name, const char* value){
+    int var = http_template_find(args->template, name);
+    if(var < 0)
+        return -1;
+    args->values[var].value = value;
+    args->values[var].items = NULL;
+    return 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Sets a list of strings, repeated by a section of name.
+
+    @PARAMS: args, name, items, number of items
+    @returns: 0 on success, -1 if the template does not use name.
+**************************************************************/
+int http_template_set_list(struct http_template_args* args, const char* name, const char* const* items, int count){
+    int var = http_template_find(args->template, name);
+    if(var < 0)
+        return -1;
+    args->values[var].items = items;
+    args->values[var].count = count;
+    args->values[var].value = NULL;
+    return 0;
+}
+
+/**************************************************************
+    Returns the first byte of p that has to be escaped, or end
+**************************************************************/
+static const char* http_template_scan(const char* p, const char* end){
+#ifdef __SSE2__
+    while(end-p >= 16){
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('&')), _mm_cmpeq_epi8(chunk, _mm_set1_epi8('<'))),
+                                    _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('>')), _mm_cmpeq_epi8(chunk, _mm_set1_epi8('"'))),
+                                                 _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\''))));
+        int mask = _mm_movemask_epi8(hits);
+        if(mask != 0)
+            return p+__builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    while(p < end && *p != '&' && *p != '<' && *p != '>' && *p != '"' && *p != '\'')
+        p++;
+    return p;
+}
+
+/**************************************************************
+    Summery:
+
+    Returns the length of value once HTML escaped. Characters
+    are counted 16 at a time from the compare masks.
+
+    @PARAMS: value, length of value
+    @returns: escaped length
+**************************************************************/
+static size_t http_template_escaped_length(const char* p, size_t length){
+
+    const char* end = p+length;
+    size_t extra = 0;
+#ifdef __SSE2__
+    while(end-p >= 16){
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        int amp = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('&')));
+        int tags = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('<')), _mm_cmpeq_epi8(chunk, _mm_set1_epi8('>'))));
+        int quot = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('"')));
+        int apos = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\'')));
+        extra += 4*__builtin_popcount(amp)+3*__builtin_popcount(tags)+5*__builtin_popcount(quot)+4*__builtin_popcount(apos);
+        p += 16;
+    }
+#endif
+    for (; p < end; ++p)
+    {
+        if(*p == '&' || *p == '\'')
+            extra += 4;
+        else if(*p == '<' || *p == '>')
+            extra += 3;
+        else if(*p == '"')
+            extra += 5;
+    }
+    return length+extra;
+}
+
+/**************************************************************
+    Writes value HTML escaped to out, returns end of output
+**************************************************************/
+static char* http_template_escape(char* out, const char* p, size_t length){
+    const char* end = p+length;
+    while(p < end){
+        const char* special = http_template_scan(p, end);
+        memcpy(out, p, special-p);
+        out += special-p;
+        if(special == end)
+            break;
+
+        const char* entity = *special == '&' ? "&amp;" : *special == '<' ? "&lt;" : *special == '>' ? "&gt;" : *special == '"' ? "&quot;" : "&#39;";
+        size_t entity_length = strlen(entity);
+        memcpy(out, entity, entity_length);
+        out += entity_length;
+        p = special+1;
+    }
+    return out;
+}
+
+/**************************************************************
+    Summery:
+
+    Returns the value of var at the current items of the open
+    sections, an empty string if it is not set.
+
+    @PARAMS: args, open sections, number of open sections, var
+    @returns: value
+**************************************************************/
+static const char* http_template_value(struct http_template_args* args, struct http_template_frame* stack, int depth, int var){
+
+    int index = depth > 0 ? stack[depth-1].index : 0;
+    if(var == HTTP_TEMPLATE_DOT)
+        var = stack[depth-1].var;
+
+    struct http_template_value* value = &args->values[var];
+    if(value->items != NULL)
+        return index < value->count && value->items[index] != NULL ? value->items[index] : "";
+    return value->value != NULL ? value->value : "";
+}
+
+/**************************************************************
+    Summery:
+
+    Runs the ops of a template. Without a connection only the
+    length of the output is computed.
+
+    @PARAMS: args, connection or NULL
+    @returns: length of output, -1 on error.
+**************************************************************/
+static long http_template_run(struct http_template_args* args, struct http_conn* conn){
+
+    struct http_template* template = args->template;
+    struct http_template_frame stack[HTTP_TEMPLATE_MAX_DEPTH];
+    int depth = 0;
+    long total = 0;
+
+    for (int i = 0; i < template->total; ++i)
+    {
+        struct http_template_op* op = &template->ops[i];
+        struct http_segment* tail = conn != NULL ? conn->out_tail : NULL;
+
+        if(op->type == HTTP_TEMPLATE_LITERAL){
+            total += op->length;
+            if(conn != NULL && op->length >= HTTP_TEMPLATE_STATIC_MIN && http_conn_queue_static(conn, template->source+op->offset, op->length) < 0)
+                return -1;
+            if(conn != NULL && op->length < HTTP_TEMPLATE_STATIC_MIN && http_conn_queue_buffer(conn, template->source+op->offset, op->length) < 0)
+                return -1;
+
+        } else if(op->type == HTTP_TEMPLATE_ESCAPE || op->type == HTTP_TEMPLATE_RAW){
+            const char* value = http_template_value(args, stack, depth, op->var);
+            size_t length = strlen(value);
+            size_t escaped = op->type == HTTP_TEMPLATE_ESCAPE ? http_template_escaped_length(value, length) : length;
+            total += escaped;
+
+            if(conn != NULL && escaped > 0){
+                char* out = http_conn_reserve(conn, escaped);
+                if(out == NULL)
+                    return -1;
+                if(op->type == HTTP_TEMPLATE_ESCAPE)
+                    http_template_escape(out, value, length);
+                else
+                    memcpy(out, value, length);
+                http_conn_commit(conn, escaped);
+            }
+
+        } else if(op->type == HTTP_TEMPLATE_SECTION){
+            struct http_template_value* value = &args->values[op->var];
+            int count = value->items != NULL ? value->count : (value->value != NULL && value->value[0] != 0);
+            if(count == 0){
+                i = op->jump-1;
+                continue;
+            }
+            stack[depth].op = i;
+            stack[depth].var = op->var;
+            stack[depth].index = 0;
+            stack[depth].count = count;
+            depth++;
+
+        } else if(op->type == HTTP_TEMPLATE_END){
+            struct http_template_frame* frame = &stack[depth-1];
+            if(++frame->index < frame->count)
+                i = frame->op;
+            else
+                depth--;
+        }
+
+        if(conn != NULL && conn->out_tail != tail)
+            template->allocations++;
+    }
+
+    return total;
+}
+
+/**************************************************************
+    Summery:
+
+    Renders a template as response body. The response header is
+    queued with a Content-Length followed by the body.
+
+    @PARAMS: connection, args, response header without Content-Length, length of header
+    @returns: length of body, -1 on error.
+**************************************************************/
+int http_template_render(struct http_conn* conn, struct http_template_args* args, const char* header, size_t header_length){
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    long length = http_template_run(args, NULL);
+
+    char content_length[64];
+    int line = sprintf(content_length, "Content-Length: %ld\n\n", length);
+    if(http_conn_queue_buffer(conn, header, header_length) < 0 || http_conn_queue_buffer(conn, content_length, line) < 0)
+        return -1;
+
+    if(http_template_run(args, conn) < 0)
+        return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    struct http_template* template = args->template;
+    template->renders++;
+    template->render_ns += (end.tv_sec-start.tv_sec)*1000000000L+(end.tv_nsec-start.tv_nsec);
+    template->bytes += length;
+    return length;
+}
+
+/**************************************************************
+    Summery:
+
+    Writes render count, mean render time, mean body size and
+    mean allocations per render of a template.
+
+    @PARAMS: template, buffer, size of buffer
+    @returns: length written
+**************************************************************/
+int http_template_stats(struct http_template* template, char* buffer, size_t size){
+    long renders = template->renders > 0 ? template->renders : 1;
+    return snprintf(buffer, size, "renders %ld ns %ld bytes %ld allocations %.2f\n",
+        template->renders, template->render_ns/renders, template->bytes/renders, (double)template->allocations/renders);
+}
@@ -0,0 +1,71 @@
+#ifndef __HTTP_TEMPLATE_H
+#define __HTTP_TEMPLATE_H
+
+#include "syshead.h"
+#include "http_conn.h"
+
+#define HTTP_TEMPLATE_MAX_VARS 32 // distinct names per template
+#define HTTP_TEMPLATE_MAX_DEPTH 8 // nested sections
+#define HTTP_TEMPLATE_STATIC_MIN 512 // longer literals are queued without copying
+
+#define HTTP_TEMPLATE_LITERAL 0
+#define HTTP_TEMPLATE_ESCAPE 1 // {{name}}
+#define HTTP_TEMPLATE_RAW 2 // {{{name}}}
+#define HTTP_TEMPLATE_SECTION 3 // {{#name}}
+#define HTTP_TEMPLATE_END 4 // {{/name}}
+
+struct http_template_op
+{
+	unsigned char type;
+	unsigned char var; // index into names, {{.}} is the innermost section
+	unsigned int offset; // literal slice of the source
+	unsigned int length;
+	unsigned int jump; // SECTION: op after its END, END: its SECTION
+};
+
+/*
+    A compiled template. The source is kept for the literal
+    slices, ops are executed in order by http_template_render.
+*/
+struct http_template
+{
+	char* source;
+	struct http_template_op* ops;
+	int total;
+	char* names[HTTP_TEMPLATE_MAX_VARS];
+	int namecount;
+
+	// for stats
+	long renders;
+	long render_ns;
+	long bytes;
+	long allocations; // output segments allocated
+};
+
+/*
+    A value is a string or a list of count strings. A section
+    repeats once per item of its list, or once if a string is set,
+    and lists used inside it are read at the current item.
+*/
+struct http_template_value
+{
+	const char* const* items;
+	const char* value;
+	int count;
+};
+
+struct http_template_args
+{
+	struct http_template* template;
+	struct http_template_value values[HTTP_TEMPLATE_MAX_VARS];
+};
+
+struct http_template* http_template_compile(const char* source);
+struct http_template* http_template_load(char* file);
+void http_template_args(struct http_template_args* args, struct http_template* template);
+int http_template_set(struct http_template_args* args, const char* name, const char* value);
+int http_template_set_list(struct http_template_args* args, const char* name, const char* const* items, int count);
+int http_template_render(struct http_conn* conn, struct http_template_args* args, const char* header, size_t header_length);
+int http_template_stats(struct http_template* template, char* buffer, size_t size);
+
+#endif
@@ -0,0 +1,299 @@
+#include "http_server.h"
+
+/*
+    HTTPS listeners
+
+    Any listener can serve HTTPS, see http_listen_tls. The
+    handshake is done in user space by OpenSSL. With
+    SSL_OP_ENABLE_KTLS OpenSSL hands the record keys to the kernel
+    (setsockopt SOL_TLS) once the handshake is done, after that the
+    socket is written with plain sendmsg() and sendfile(), so static
+    files are still sent zero-copy.
+
+    If the kernel has no TLS support (tls module missing, cipher not
+    supported) records are encrypted in user space with SSL_write
+    and file content is read into a staging buffer first.
+
+    Handshakes per second can be measured with
+        openssl s_time -connect localhost:8443 -new
+    and bulk throughput with curl -k -o /dev/null on a large file.
+*/
+
+long http_tls_handshakes = 0; // for stats
+long http_tls_kernel = 0; // handshakes that continued with kernel TLS
+
+// ALPN, HTTP/2 is preferred when the client offers it
+static const unsigned char http_tls_protocols[] = "\x02h2\x08http/1.1";
+
+
+/**************************************************************
+    Summery:
+
+    Selects the application protocol offered by the client.
+
+    @PARAMS: see SSL_CTX_set_alpn_select_cb
+    @returns: SSL_TLSEXT_ERR_OK or SSL_TLSEXT_ERR_NOACK
+**************************************************************/
+static int http_tls_alpn(SSL* ssl, const unsigned char** out, unsigned char* outlen, const unsigned char* in, unsigned int inlen, void* arg){
+    (void)ssl;
+    (void)arg;
+    unsigned char* selected;
+    if(SSL_select_next_proto(&selected, outlen, http_tls_protocols, sizeof(http_tls_protocols)-1, in, inlen) != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/**************************************************************
+    Summery:
+
+    Serves HTTPS on a listener added with http_listen.
+
+    @PARAMS: listener number, certificate chain file, private key file (PEM)
+    @returns: 0 on success, -1 on error.
+**************************************************************/
+int http_listen_tls(int listener, char* certificate, char* key){
+
+    struct http_listener* entry = http_listen_get(listener);
+    if(entry == NULL || entry->tls != NULL)
+        return -1;
+
+    SSL_CTX* context = SSL_CTX_new(TLS_server_method());
+    if(context == NULL)
+        return -1;
+
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+    SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+    // idle connections give their record buffers back
+    SSL_CTX_set_mode(context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+    SSL_CTX_set_alpn_select_cb(context, http_tls_alpn, NULL);
+
+    if(SSL_CTX_use_certificate_chain_file(context, certificate) <= 0 || SSL_CTX_use_PrivateKey_file(context, key, SSL_FILETYPE_PEM) <= 0
+        || SSL_CTX_check_private_key(context) <= 0){
+        printf(KRED "%s %s, %s\n" KWHT, "[ERROR] Could not load TLS certificate", certificate, key);
+        ERR_print_errors_fp(stdout);
+        SSL_CTX_free(context);
+        return -1;
+    }
+
+    entry->tls = context;
+    return 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Adds an HTTPS listener on given port, opened by http_start.
+
+    @PARAMS: port, certificate chain file, private key file (PEM)
+    @returns: listener number, -1 on error.
+**************************************************************/
+int http_addtls(int port, char* certificate, char* key){
+
+    char address[16];
+    snprintf(address, sizeof(address), "%d", port);
+
+    int listener = http_listen(address, 0);
+    if(listener < 0 || http_listen_tls(listener, certificate, key) < 0)
+        return -1;
+    return listener;
+}
+
+/**************************************************************
+    Summery:
+
+    Attaches TLS state to a newly accepted connection, the
+    handshake is driven by http_tls_handshake.
+
+    @PARAMS: connection, context of the listener
+    @returns: 0 on success, -1 on error.
+**************************************************************/
+int http_tls_accept(struct http_conn* conn, SSL_CTX* context){
+
+    struct http_tls* tls = calloc(1, sizeof(struct http_tls));
+    if(tls == NULL)
+        return -1;
+
+    tls->ssl = SSL_new(context);
+    if(tls->ssl == NULL || SSL_set_fd(tls->ssl, conn->fd) != 1){
+        SSL_free(tls->ssl);
+        free(tls);
+        return -1;
+    }
+    SSL_set_accept_state(tls->ssl);
+
+    conn->tls = tls;
+    return 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Maps an OpenSSL result to the errno convention of recv/send.
+    Waiting for the socket is reported as EAGAIN.
+
+    @PARAMS: connection, return value of the SSL call
+    @returns: -1 with errno set, 0 on end of stream.
+**************************************************************/
+static int http_tls_error(struct http_conn* conn, int ret){
+
+    int error = SSL_get_error(conn->tls->ssl, ret);
+    conn->tls->want_write = error == SSL_ERROR_WANT_WRITE;
+
+    if(error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE){
+        errno = EAGAIN;
+        return -1;
+    }
+
+    // peer closed, with or without close_notify
+    if(error == SSL_ERROR_ZERO_RETURN || (error == SSL_ERROR_SYSCALL && errno == 0))
+        return 0;
+
+    if(debug && error == SSL_ERROR_SSL)
+        ERR_print_errors_fp(stdout);
+    ERR_clear_error();
+
+    if(error != SSL_ERROR_SYSCALL)
+        errno = EPROTO;
+    return -1;
+}
+
+/**************************************************************
+    Summery:
+
+    Continues the handshake. Once it is done the connection
+    switches to HTTP/2 if negotiated with ALPN.
+
+    @PARAMS: connection
+    @returns: 1 when done, 0 if waiting for the socket, -1 on error.
+**************************************************************/
+int http_tls_handshake(struct http_conn* conn){
+
+    struct http_tls* tls = conn->tls;
+
+    int ret = SSL_do_handshake(tls->ssl);
+    if(ret != 1){
+        if(http_tls_error(conn, ret) < 0 && errno == EAGAIN)
+            return 0;
+        if(debug)
+            printf(KRED "%s FD: %d\n" KWHT, "[DEBUG] TLS handshake failed!", conn->fd);
+        return -1;
+    }
+
+    tls->established = 1;
+    tls->want_write = 0;
+    tls->kernel_send = BIO_get_ktls_send(SSL_get_wbio(tls->ssl));
+
+    http_tls_handshakes++;
+    if(tls->kernel_send)
+        http_tls_kernel++;
+
+    const unsigned char* protocol;
+    unsigned int protocol_length;
+    SSL_get0_alpn_selected(tls->ssl, &protocol, &protocol_length);
+
+    if(debug)
+        printf(KMAG "[DEBUG] FD: %d %s %s, %s encryption, %.*s\n" KWHT, conn->fd, SSL_get_version(tls->ssl), SSL_get_cipher_name(tls->ssl),
+            tls->kernel_send ? "kernel" : "user space", protocol_length, protocol_length > 0 ? (const char*)protocol : "");
+
+    if(protocol_length == 2 && memcmp(protocol, "h2", 2) == 0 && http2_start(conn) < 0)
+        return -1;
+
+    return 1;
+}
+
+/**************************************************************
+    Summery:
+
+    Reads decrypted bytes, same return values as recv().
+
+    @PARAMS: connection, buffer, size of buffer
+    @returns: bytes read, 0 on end of stream, -1 with errno set.
+**************************************************************/
+ssize_t http_tls_recv(struct http_conn* conn, char* buffer, size_t length){
+    int ret = SSL_read(conn->tls->ssl, buffer, length > INT_MAX ? INT_MAX : (int)length);
+    if(ret > 0){
+        conn->tls->want_write = 0;
+        return ret;
+    }
+    return http_tls_error(conn, ret);
+}
+
+/**************************************************************
+    1 if OpenSSL holds decrypted bytes not yet read
+**************************************************************/
+int http_tls_pending(struct http_conn* conn){
+    return SSL_pending(conn->tls->ssl) > 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Sends the output queue through SSL_write, used when the
+    kernel does not encrypt. Segments are gathered into one
+    record sized staging buffer, file content is read with pread.
+    A write that has to wait is retried with the same bytes, as
+    OpenSSL requires, since the queue is only advanced on success.
+    Stops after about conn->write_budget bytes if a budget is set.
+
+    @PARAMS: connection
+    @returns: 0 when drained, 1 if output is pending, 2 if the budget is used up, -1 on error.
+**************************************************************/
+int http_tls_flush(struct http_conn* conn){
+
+    static char staging[HTTP_TLS_RECORD_SIZE];
+
+    size_t total = 0;
+    while(conn->out_head != NULL){
+
+        // the rest is sent on the next turn, records stay whole so a retried write is unchanged
+        if(conn->write_budget > 0 && total >= conn->write_budget)
+            return 2;
+
+        size_t length = 0;
+        for (struct http_segment* segment = conn->out_head; segment != NULL && length < sizeof(staging); segment = segment->next)
+        {
+            size_t space = sizeof(staging)-length;
+
+            if(segment->type == HTTP_SEGMENT_FILE){
+                size_t part = segment->length < space ? segment->length : space;
+                ssize_t got = pread(segment->fd, staging+length, part, segment->file_offset);
+                if(got <= 0)
+                    return -1;
+                length += got;
+                if((size_t)got < part)
+                    break;
+            } else {
+                size_t left = segment->length-segment->offset;
+                size_t part = left < space ? left : space;
+                memcpy(staging+length, segment->data+segment->offset, part);
+                length += part;
+            }
+        }
+
+        int ret = SSL_write(conn->tls->ssl, staging, length);
+        if(ret <= 0){
+            if(http_tls_error(conn, ret) < 0 && errno == EAGAIN)
+                return 1;
+            return -1;
+        }
+
+        conn->tls->want_write = 0;
+        http_conn_consume(conn, ret);
+        total += ret;
+    }
+
+    return 0;
+}
+
+/**************************************************************
+    Frees the TLS state, sends close_notify if possible
+**************************************************************/
+void http_tls_free(struct http_conn* conn){
+    if(conn->tls->established)
+        SSL_shutdown(conn->tls->ssl);
+    ERR_clear_error();
+    SSL_free(conn->tls->ssl);
+    free(conn->tls);
+    conn->tls = NULL;
+}
@@ -0,0 +1,36 @@
+#ifndef __HTTP_TLS_H
+#define __HTTP_TLS_H
+
+#include "syshead.h"
+#include "http_conn.h"
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define HTTP_TLS_RECORD_SIZE 16384 // largest TLS record payload
+
+/*
+    TLS state of a client connection. Once the handshake is done
+    and the kernel accepted the keys, kernel_send is set and the
+    socket takes plaintext, so queued output is sent by the regular
+    sendmsg/sendfile path and encrypted by the kernel.
+*/
+struct http_tls
+{
+	SSL* ssl;
+	int established;
+	int kernel_send;
+	int want_write; // the TLS library waits for the socket to become writable
+};
+
+int http_addtls(int port, char* certificate, char* key);
+int http_listen_tls(int listener, char* certificate, char* key);
+
+int http_tls_accept(struct http_conn* conn, SSL_CTX* context);
+int http_tls_handshake(struct http_conn* conn);
+ssize_t http_tls_recv(struct http_conn* conn, char* buffer, size_t length);
+int http_tls_pending(struct http_conn* conn);
+int http_tls_flush(struct http_conn* conn);
+void http_tls_free(struct http_conn* conn);
+
+#endif
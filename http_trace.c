@@ -0,0 +1,137 @@
+#include "http_server.h"
+
+/*
+    Request phase tracing
+
+    Sampled connections record a span for each phase: accept, recv,
+    http_parser, route lookup, the route function and writes to the
+    socket. Spans go to a fixed ring that overwrites the oldest,
+    every worker process has its own.
+
+    The ring is written as Chrome trace JSON, one "complete" event
+    per span with the fd as thread, so chrome://tracing or Perfetto
+    shows every connection as a row. It is returned by
+    http_trace_json for an admin route, and written to
+    trace-<pid>.json when the worker gets SIGUSR2.
+*/
+
+static const char* http_trace_names[] = { "accept", "recv", "parse", "route", "handler", "write" };
+
+static struct http_span http_trace_ring[HTTP_TRACE_SPANS];
+static unsigned long http_trace_total = 0;
+
+int http_trace_rate = 0; // trace 1 of rate connections, 0 is off
+static unsigned long http_trace_counter = 0;
+
+static volatile sig_atomic_t http_trace_dump = 0;
+
+
+/**************************************************************
+    Marks the ring for dumping, handler of SIGUSR2
+**************************************************************/
+static void http_trace_signal(int signal){
+    (void)signal;
+    http_trace_dump = 1;
+}
+
+/**************************************************************
+    Summery:
+
+    Enables tracing of 1 in rate connections.
+
+    @PARAMS: rate, 1 traces every connection, 0 turns tracing off
+    @returns: VOID
+**************************************************************/
+void http_set_trace(int rate){
+    http_trace_rate = rate < 0 ? 0 : rate;
+    if(http_trace_rate > 0)
+        signal(SIGUSR2, http_trace_signal);
+}
+
+/**************************************************************
+    Decides if a new connection is traced
+**************************************************************/
+int http_trace_sample(){
+    return http_trace_rate > 0 && http_trace_counter++ % http_trace_rate == 0;
+}
+
+unsigned long long http_trace_now(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1000000000ull+now.tv_nsec;
+}
+
+/**************************************************************
+    Summery:
+
+    Records a phase that started at start and ends now.
+
+    @PARAMS: connection, phase, start from http_trace_now
+    @returns: VOID
+**************************************************************/
+void http_trace_span(struct http_conn* conn, int phase, unsigned long long start){
+    struct http_span* span = &http_trace_ring[http_trace_total & (HTTP_TRACE_SPANS-1)];
+    span->start = start;
+    span->duration = http_trace_now()-start;
+    span->fd = conn->fd;
+    span->request = conn->requests;
+    span->phase = phase;
+    http_trace_total++;
+}
+
+/**************************************************************
+    Writes the ring as Chrome trace JSON, oldest span first
+**************************************************************/
+static void http_trace_write(FILE* out){
+
+    unsigned long first = http_trace_total > HTTP_TRACE_SPANS ? http_trace_total-HTTP_TRACE_SPANS : 0;
+    long pid = (long)getpid();
+
+    fprintf(out, "{\"traceEvents\":[");
+    for (unsigned long i = first; i < http_trace_total; ++i)
+    {
+        struct http_span* span = &http_trace_ring[i & (HTTP_TRACE_SPANS-1)];
+        fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%ld,\"tid\":%d,\"args\":{\"request\":%u}}",
+            i == first ? "" : ",", http_trace_names[span->phase], span->start/1000.0, span->duration/1000.0, pid, span->fd, span->request);
+    }
+    fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+}
+
+/**************************************************************
+    Summery:
+
+    Returns the ring as Chrome trace JSON.
+
+    @PARAMS: length of the returned text (out)
+    @returns: text to be freed by the caller, NULL on error.
+**************************************************************/
+char* http_trace_json(size_t* length){
+    char* json = NULL;
+    FILE* out = open_memstream(&json, length);
+    if(out == NULL)
+        return NULL;
+    http_trace_write(out);
+    fclose(out);
+    return json;
+}
+
+/**************************************************************
+    Writes trace-<pid>.json if SIGUSR2 was received, called by
+    the event loop.
+**************************************************************/
+void http_trace_poll(){
+    if(!http_trace_dump)
+        return;
+    http_trace_dump = 0;
+
+    char name[64];
+    snprintf(name, sizeof(name), "trace-%ld.json", (long)getpid());
+    FILE* out = fopen(name, "w");
+    if(out == NULL){
+        perror("trace");
+        return;
+    }
+    http_trace_write(out);
+    fclose(out);
+    printf(KBLU "[TRACE] Wrote %s\n" KWHT, name);
+}
@@ -0,0 +1,44 @@
+#ifndef __HTTP_TRACE_H
+#define __HTTP_TRACE_H
+
+#include "syshead.h"
+#include "http_conn.h"
+
+#define HTTP_TRACE_SPANS 65536 // spans kept per worker, must be a power of two
+
+#define HTTP_TRACE_ACCEPT 0
+#define HTTP_TRACE_RECV 1
+#define HTTP_TRACE_PARSE 2
+#define HTTP_TRACE_ROUTE 3
+#define HTTP_TRACE_HANDLER 4
+#define HTTP_TRACE_WRITE 5
+
+/*
+    One timed phase of a traced connection.
+*/
+struct http_span
+{
+	unsigned long long start; // ns, CLOCK_MONOTONIC
+	unsigned int duration; // ns
+	int fd;
+	unsigned int request; // number of the request on the connection
+	unsigned int phase;
+};
+
+/*
+    Phases are only timed on sampled connections, so with tracing
+    off every site costs one test of conn->traced.
+*/
+#define HTTP_TRACE_START(conn) ((conn)->traced ? http_trace_now() : 0)
+#define HTTP_TRACE_END(conn, phase, start) do { if((conn)->traced) http_trace_span(conn, phase, start); } while(0)
+
+extern int http_trace_rate;
+
+void http_set_trace(int rate);
+int http_trace_sample();
+unsigned long long http_trace_now();
+void http_trace_span(struct http_conn* conn, int phase, unsigned long long start);
+char* http_trace_json(size_t* length);
+void http_trace_poll();
+
+#endif
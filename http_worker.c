@@ -0,0 +1,311 @@
+#include "http_server.h"
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+
+/*
+    Worker processes
+
+    With http_set_workers the server forks one process per worker,
+    each running its own event loop. Every worker owns a listener
+    in a SO_REUSEPORT group, so the kernel spreads connections
+    without a shared accept queue.
+
+    When pinned, worker i runs on the i-th CPU the server may use
+    and a classic BPF program on the group returns the worker of
+    the CPU that received the connection (SKF_AD_CPU), so packets,
+    accept and request handling stay on one core. SO_INCOMING_CPU
+    is set on each listener as well, older kernels use it as a hint
+    when no program is attached. Memory is allocated after the fork
+    with the MPOL_LOCAL policy, so connection tables and buffers
+    live on the node of the worker.
+
+    The parent only supervises: it restarts workers that exit and
+    stops them on SIGINT. Limits such as max connections apply
+    per worker.
+*/
+
+static int http_worker_total = 0;
+static int http_worker_pin = 0;
+
+struct http_worker* http_workers = NULL; // shared by all workers
+struct http_worker* http_worker_self = NULL; // NULL without workers
+
+static volatile sig_atomic_t http_worker_stopping = 0;
+
+
+/**************************************************************
+    Summery:
+
+    Runs the server in count worker processes, optionally
+    pinned to one CPU each. Must be called before http_start.
+
+    @PARAMS: number of workers (0 for a single process), pin to CPUs
+    @returns: VOID
+**************************************************************/
+void http_set_workers(int count, int pin){
+    if(count > HTTP_MAX_WORKERS)
+        count = HTTP_MAX_WORKERS;
+    http_worker_total = count < 0 ? 0 : count;
+    http_worker_pin = pin;
+}
+
+int http_worker_count(){
+    return http_worker_total;
+}
+
+/**************************************************************
+    Index of this worker, 0 without workers
+**************************************************************/
+int http_worker_index(){
+    return http_worker_self != NULL ? http_worker_self-http_workers : 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Attaches the steering program to the listener group. The
+    program loads the CPU that processed the packet and returns
+    the index of the listener of that CPU's worker. CPUs without
+    a worker fall back to cpu % workers.
+
+    @PARAMS: any listener of the group
+    @returns: 0 on success, -1 on error.
+**************************************************************/
+static int http_worker_steer(int fd){
+
+    struct sock_filter code[2*HTTP_MAX_WORKERS+3];
+    int length = 0;
+
+    code[length++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (int i = 0; i < http_worker_total; ++i)
+    {
+        code[length++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, http_workers[i].cpu, 0, 1);
+        code[length++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+    }
+    code[length++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, http_worker_total);
+    code[length++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+    struct sock_fprog program = { .len = length, .filter = code };
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program));
+}
+
+/**************************************************************
+    Summery:
+
+    Continues as worker i after the fork: pins it, makes further
+    allocations node local and closes the other listeners.
+
+    @PARAMS: worker index
+    @returns: listener fd of the worker
+**************************************************************/
+static int http_worker_run(int index){
+
+    http_worker_self = &http_workers[index];
+    http_worker_self->pid = getpid();
+
+    // stop with the supervisor
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+    if(http_worker_self->cpu >= 0){
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(http_worker_self->cpu, &set);
+        if(sched_setaffinity(0, sizeof(set), &set) < 0)
+            perror("sched_setaffinity");
+        // not fatal, fails without NUMA support
+        syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0);
+    }
+
+    for (int i = 0; i < http_worker_total; ++i)
+    {
+        if(i != index && http_workers[i].fd >= 0)
+            close(http_workers[i].fd);
+    }
+
+    printf(KBLU "[STARTUP] Worker %d PID: %ld, CPU: %d\n" KWHT, index, (long)getpid(), http_worker_self->cpu);
+    return http_worker_self->fd;
+}
+
+/**************************************************************
+    Signal handler of the supervisor
+**************************************************************/
+static void http_worker_stop(int signal){
+    (void)signal;
+    http_worker_stopping = 1;
+}
+
+/**************************************************************
+    Summery:
+
+    Opens the listener group, forks the workers and supervises
+    them. Only workers return from this function. Without a
+    TCP listener the workers only share the other listeners.
+
+    @PARAMS: listener to open once per worker, may be NULL
+    @returns: listener fd of the worker, -1 if workers are not used.
+**************************************************************/
+int http_workers_start(struct http_listener* listener){
+
+    if(http_worker_total == 0)
+        return -1;
+
+    http_workers = mmap(NULL, sizeof(struct http_worker)*HTTP_MAX_WORKERS, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(http_workers == MAP_FAILED){
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+
+    // one pinned worker per CPU, more would share a CPU and never be steered to
+    if(http_worker_pin && http_worker_total > CPU_COUNT(&allowed)){
+        http_worker_total = CPU_COUNT(&allowed);
+        printf(KRED "[ERROR] Only %d CPUs to pin workers to.\n" KWHT, http_worker_total);
+    }
+
+    // listeners join the group in order, so listener i has index i in it
+    int cpu = -1;
+    for (int i = 0; i < http_worker_total; ++i)
+    {
+        struct http_worker* worker = &http_workers[i];
+        worker->cpu = -1;
+        if(http_worker_pin){
+            do {
+                cpu = (cpu+1) % CPU_SETSIZE;
+            } while(!CPU_ISSET(cpu, &allowed));
+            worker->cpu = cpu;
+        }
+
+        worker->fd = listener != NULL ? http_listen_socket(listener, 1) : -1;
+        if(worker->fd >= 0 && worker->cpu >= 0)
+            setsockopt(worker->fd, SOL_SOCKET, SO_INCOMING_CPU, &worker->cpu, sizeof(int));
+    }
+
+    if(http_worker_pin && listener != NULL && http_worker_steer(http_workers[0].fd) < 0)
+        perror("SO_ATTACH_REUSEPORT_CBPF");
+
+    printf(KBLU "[STARTUP] Starting %d workers%s\n" KWHT, http_worker_total, http_worker_pin ? " pinned to CPUs" : "");
+    fflush(stdout);
+
+    // no SA_RESTART, so the signal interrupts wait()
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = http_worker_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    for (int i = 0; i < http_worker_total; ++i)
+    {
+        pid_t pid = fork();
+        if(pid == 0){
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTERM, SIG_DFL);
+            return http_worker_run(i);
+        }
+        http_workers[i].pid = pid;
+    }
+
+    while(!http_worker_stopping){
+        int status;
+        pid_t pid = wait(&status);
+        if(pid < 0){
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (int i = 0; i < http_worker_total && !http_worker_stopping; ++i)
+        {
+            if(http_workers[i].pid != pid)
+                continue;
+
+            printf(KRED "[ERROR] Worker %d PID: %ld exited, restarting.\n" KWHT, i, (long)pid);
+            fflush(stdout);
+            http_workers[i].restarts++;
+
+            pid = fork();
+            if(pid == 0){
+                signal(SIGINT, SIG_DFL);
+                signal(SIGTERM, SIG_DFL);
+                return http_worker_run(i);
+            }
+            http_workers[i].pid = pid;
+            break;
+        }
+    }
+
+    for (int i = 0; i < http_worker_total; ++i)
+        kill(http_workers[i].pid, SIGTERM);
+    while(wait(NULL) > 0);
+    http_listen_close(1);
+
+    printf(KRED "%s PID: %ld!.\n" KWHT, "[CLOSING] Workers stopped", (long)getpid());
+    exit(0);
+}
+
+/**************************************************************
+    Summery:
+
+    Counts an accepted connection, and whether it arrived on
+    the CPU of the worker.
+
+    @PARAMS: accepted socket
+    @returns: VOID
+**************************************************************/
+void http_worker_accepted(int fd){
+    if(http_worker_self == NULL)
+        return;
+
+    http_worker_self->accepted++;
+
+    int cpu;
+    socklen_t length = sizeof(cpu);
+    if(http_worker_self->cpu >= 0 && getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &length) == 0 && cpu == http_worker_self->cpu)
+        http_worker_self->local++;
+}
+
+void http_worker_request(){
+    if(http_worker_self != NULL)
+        http_worker_self->requests++;
+}
+
+/**************************************************************
+    Publishes the current load, called once per loop iteration
+**************************************************************/
+void http_worker_update(){
+    if(http_worker_self == NULL)
+        return;
+    http_worker_self->connections = http_conn_count();
+    http_worker_self->queued = http_queued_bytes();
+}
+
+/**************************************************************
+    Summery:
+
+    Writes one line per worker with its load, so imbalance
+    between workers is visible.
+
+    @PARAMS: buffer, size of buffer
+    @returns: length written
+**************************************************************/
+int http_worker_stats(char* buffer, size_t size){
+
+    if(http_workers == NULL)
+        return snprintf(buffer, size, "workers 0\n");
+
+    size_t length = 0;
+    for (int i = 0; i < http_worker_total && length < size; ++i)
+    {
+        struct http_worker* worker = &http_workers[i];
+        length += snprintf(buffer+length, size-length, "worker %d pid %ld cpu %d connections %d accepted %ld local %ld requests %ld queued %zu restarts %d\n",
+            i, (long)worker->pid, worker->cpu, worker->connections, worker->accepted, worker->local, worker->requests, worker->queued, worker->restarts);
+    }
+    return length < size ? length : size-1;
+}
@@ -0,0 +1,36 @@
+#ifndef __HTTP_WORKER_H
+#define __HTTP_WORKER_H
+
+#include "syshead.h"
+#include "http_listen.h"
+
+#define HTTP_MAX_WORKERS 64
+
+/*
+    Per worker load, kept in memory shared by all workers so any
+    of them can report the whole group. Only the worker itself
+    writes its entry.
+*/
+struct http_worker
+{
+	pid_t pid;
+	int cpu; // -1 if not pinned
+	int fd; // listener of the worker in the SO_REUSEPORT group
+	long accepted;
+	long local; // accepted connections whose packets arrived on cpu
+	long requests;
+	int connections; // open client connections
+	size_t queued; // bytes waiting in output queues
+	int restarts;
+};
+
+void http_set_workers(int count, int pin);
+int http_worker_count();
+int http_worker_index();
+int http_workers_start(struct http_listener* listener);
+void http_worker_accepted(int fd);
+void http_worker_request();
+void http_worker_update();
+int http_worker_stats(char* buffer, size_t size);
+
+#endif
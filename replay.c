@@ -0,0 +1,824 @@
+#include "http_record.h"
+#include <netdb.h>
+
+/*
+    Replays traffic captured with http_set_record, see http_record.c.
+    Used by "make replay":
+
+        ./replay [-s speed] [-c connections] [-f] host:port capture-*.rec
+
+    Connections are opened and their bytes are sent at the recorded
+    times, divided by speed, so -s 1 is the original pace and -s 10
+    ten times faster. Captures of several workers are merged by time.
+    Every recorded chunk is sent as it was received, which keeps
+    split headers and pipelined requests as they were.
+
+    With -s 0 timing is ignored and the capture runs as fast as the
+    server answers: the next chunk of a connection is sent once all
+    complete requests before it are answered, with at most -c
+    connections open at once (default 64).
+
+    Responses are parsed to time every request from the moment its
+    last byte is sent to the end of its response. Connections that
+    switch to HTTP/2 or WebSocket are replayed without timing.
+    The first response of each connection is also timed from the
+    connect, which includes the handshake, so runs against servers
+    with different tuning profiles (see http_set_tuning) can be
+    compared. -f connects with TCP Fast Open.
+*/
+
+#define REPLAY_IDLE_TIMEOUT 10 // seconds without progress before giving up
+
+#define REPLAY_WAITING 0
+#define REPLAY_CONNECTING 1
+#define REPLAY_OPEN 2
+#define REPLAY_DONE 3
+
+#define RESPONSE_HEADER 0
+#define RESPONSE_BODY 1
+#define RESPONSE_CHUNK_SIZE 2
+#define RESPONSE_CHUNK_DATA 3
+#define RESPONSE_CHUNK_END 4
+#define RESPONSE_TRAILER 5
+#define RESPONSE_UNTIL_CLOSE 6
+#define RESPONSE_IGNORED 7
+
+struct replay_chunk
+{
+    unsigned long long time; // us since the start of the capture
+    size_t end; // offset in data after this chunk
+    int close;
+};
+
+struct replay_conn
+{
+    // recorded
+    unsigned long long open_time;
+    char* data;
+    size_t length;
+    size_t capacity;
+    struct replay_chunk* chunks;
+    int chunkcount;
+    int chunkcapacity;
+
+    // complete requests found in data, timing stops after the last
+    size_t* ends;
+    char* head; // request was HEAD
+    int requestcount;
+    int timed; // requests are followed, see replay_requests
+
+    // replay state
+    int fd;
+    int state;
+    int chunk; // next chunk to release
+    size_t released; // bytes that may be sent
+    size_t sent;
+    int close_pending;
+    int requests_sent;
+    int answered;
+    unsigned long long* sent_times;
+
+    // response parser
+    char* in;
+    size_t in_length;
+    size_t in_capacity;
+    int response_state;
+    int status;
+    size_t remaining;
+    unsigned long long received; // time of the last response bytes
+    unsigned long long connected; // time of the connect call
+};
+
+struct replay_latencies
+{
+    unsigned long long* values; // us
+    long count;
+    long capacity;
+};
+
+static struct replay_conn* conns = NULL;
+static int conncount = 0;
+static int conncapacity = 0;
+
+// connections in order of their events, for timed replay
+struct replay_event
+{
+    unsigned long long time;
+    int conn;
+    int chunk; // -1 opens the connection
+};
+static struct replay_event* events = NULL;
+static int eventcount = 0;
+
+static struct sockaddr_storage target;
+static socklen_t target_length;
+static int epoll_fd;
+
+static int fastopen = 0;
+
+// results
+static struct replay_latencies latencies; // request to response
+static struct replay_latencies firsts; // connect to first response
+static long statuses[6];
+static long errors = 0;
+static unsigned long long bytes_sent = 0;
+static unsigned long long bytes_received = 0;
+static int open_conns = 0;
+static int done_conns = 0;
+
+
+static unsigned long long replay_now(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1000000ull+now.tv_nsec/1000;
+}
+
+static void* replay_grow(void* array, int* capacity, int needed, size_t size){
+    if(needed <= *capacity)
+        return array;
+    int grown = *capacity == 0 ? 16 : *capacity*2;
+    while(grown < needed)
+        grown *= 2;
+    array = realloc(array, grown*size);
+    if(array == NULL){
+        fprintf(stderr, "[ERROR] Out of memory\n");
+        exit(1);
+    }
+    *capacity = grown;
+    return array;
+}
+
+/**************************************************************
+    Summery:
+
+    Reads a capture file and appends its connections. Connection
+    ids are only unique within one file.
+
+    @PARAMS: path
+    @returns: 0 on success, -1 on error.
+**************************************************************/
+static int replay_load(char* path){
+
+    FILE* file = fopen(path, "r");
+    if(file == NULL){
+        perror(path);
+        return -1;
+    }
+
+    char magic[8];
+    if(fread(magic, 1, 8, file) != 8 || memcmp(magic, HTTP_RECORD_MAGIC, 8) != 0){
+        fprintf(stderr, "[ERROR] %s is not a traffic capture\n", path);
+        fclose(file);
+        return -1;
+    }
+
+    // capture id to index in conns
+    int* ids = NULL;
+    int idcapacity = 0;
+
+    struct http_record record;
+    while(fread(&record, sizeof(record), 1, file) == 1){
+
+        if(record.conn >= (unsigned int)idcapacity){
+            int old = idcapacity;
+            ids = replay_grow(ids, &idcapacity, record.conn+1, sizeof(int));
+            for (int i = old; i < idcapacity; ++i)
+                ids[i] = -1;
+        }
+
+        if(record.type == HTTP_RECORD_OPEN){
+            conns = replay_grow(conns, &conncapacity, conncount+1, sizeof(struct replay_conn));
+            memset(&conns[conncount], 0, sizeof(struct replay_conn));
+            conns[conncount].open_time = record.time;
+            conns[conncount].fd = -1;
+            ids[record.conn] = conncount++;
+            continue;
+        }
+
+        // connections opened before the capture started are skipped
+        struct replay_conn* conn = ids[record.conn] >= 0 ? &conns[ids[record.conn]] : NULL;
+
+        if(conn != NULL && record.length > 0){
+            if(conn->length+record.length > conn->capacity){
+                conn->capacity = (conn->length+record.length)*2;
+                conn->data = realloc(conn->data, conn->capacity);
+            }
+        }
+        if(record.length > 0){
+            if(conn != NULL){
+                if(fread(conn->data+conn->length, 1, record.length, file) != record.length)
+                    break;
+            } else if(fseek(file, record.length, SEEK_CUR) != 0){
+                break;
+            }
+        }
+        if(conn == NULL)
+            continue;
+
+        conn->chunks = replay_grow(conn->chunks, &conn->chunkcapacity, conn->chunkcount+1, sizeof(struct replay_chunk));
+        struct replay_chunk* chunk = &conn->chunks[conn->chunkcount++];
+        conn->length += record.length;
+        chunk->time = record.time;
+        chunk->end = conn->length;
+        chunk->close = record.type == HTTP_RECORD_CLOSE;
+    }
+
+    free(ids);
+    fclose(file);
+    return 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Finds the complete requests in the recorded bytes of a
+    connection. Timing stops at anything that is not a plain
+    HTTP/1 request: the HTTP/2 preface, a protocol upgrade or a
+    chunked request body.
+
+    @PARAMS: connection
+    @returns: VOID
+**************************************************************/
+static void replay_requests(struct replay_conn* conn){
+
+    int capacity = 0;
+    int head_capacity = 0;
+    size_t position = 0;
+    conn->timed = 1;
+
+    while(position < conn->length){
+        char* start = conn->data+position;
+        char* end = memmem(start, conn->length-position, "\r\n\r\n", 4);
+        if(end == NULL)
+            break;
+
+        size_t header = end-start+4;
+        if(strncmp(start, "PRI * HTTP/2.0", 14) == 0){
+            conn->timed = 0;
+            break;
+        }
+
+        char* copy = strndup(start, header);
+        char* length_line = strcasestr(copy, "\ncontent-length:");
+        long body = length_line != NULL ? atol(length_line+16) : 0;
+        int upgrade = strcasestr(copy, "\nupgrade:") != NULL;
+        int chunked = strcasestr(copy, "\ntransfer-encoding:") != NULL;
+        free(copy);
+
+        if(chunked || body < 0){
+            conn->timed = 0;
+            break;
+        }
+        if(position+header+body > conn->length)
+            break;
+
+        int index = conn->requestcount;
+        conn->ends = replay_grow(conn->ends, &capacity, index+1, sizeof(size_t));
+        conn->head = replay_grow(conn->head, &head_capacity, index+1, sizeof(char));
+        conn->head[index] = strncmp(start, "HEAD ", 5) == 0;
+        position += header+body;
+        conn->ends[index] = position;
+        conn->requestcount++;
+
+        if(upgrade){
+            // the answer to the upgrade is timed, what follows is not HTTP/1
+            conn->timed = 0;
+            break;
+        }
+    }
+
+    conn->sent_times = calloc(conn->requestcount+1, sizeof(unsigned long long));
+}
+
+static int replay_event_compare(const void* a, const void* b){
+    const struct replay_event* first = a;
+    const struct replay_event* second = b;
+    if(first->time != second->time)
+        return first->time < second->time ? -1 : 1;
+    if(first->conn != second->conn)
+        return first->conn-second->conn;
+    return first->chunk-second->chunk;
+}
+
+/**************************************************************
+    Sorts opens and chunks of all connections by time
+**************************************************************/
+static void replay_schedule(unsigned long long start){
+
+    int capacity = 0;
+    for (int i = 0; i < conncount; ++i)
+    {
+        events = replay_grow(events, &capacity, eventcount+conns[i].chunkcount+1, sizeof(struct replay_event));
+        events[eventcount++] = (struct replay_event){ conns[i].open_time-start, i, -1 };
+        for (int j = 0; j < conns[i].chunkcount; ++j)
+            events[eventcount++] = (struct replay_event){ conns[i].chunks[j].time-start, i, j };
+    }
+    qsort(events, eventcount, sizeof(struct replay_event), replay_event_compare);
+}
+
+static void replay_latency(struct replay_latencies* set, unsigned long long latency){
+    if(set->count == set->capacity){
+        set->capacity = set->capacity == 0 ? 4096 : set->capacity*2;
+        set->values = realloc(set->values, set->capacity*sizeof(unsigned long long));
+    }
+    set->values[set->count++] = latency;
+}
+
+/**************************************************************
+    Closes a connection, unanswered requests count as errors
+**************************************************************/
+static void replay_finish(struct replay_conn* conn, int failed){
+    if(conn->state == REPLAY_DONE)
+        return;
+
+    if(conn->fd >= 0){
+        close(conn->fd);
+        open_conns--;
+    }
+    conn->fd = -1;
+    conn->state = REPLAY_DONE;
+    done_conns++;
+
+    if(conn->answered < conn->requests_sent)
+        errors += conn->requests_sent-conn->answered;
+    if(failed && conn->requests_sent == conn->answered)
+        errors++;
+
+    free(conn->in);
+    conn->in = NULL;
+}
+
+static void replay_watch(struct replay_conn* conn, int op){
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP;
+    if(conn->state == REPLAY_CONNECTING || conn->sent < conn->released)
+        event.events |= EPOLLOUT;
+    event.data.u32 = conn-conns;
+    epoll_ctl(epoll_fd, op, conn->fd, &event);
+}
+
+static void replay_open(struct replay_conn* conn){
+    conn->fd = socket(target.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(conn->fd < 0){
+        perror("socket");
+        exit(1);
+    }
+    if(target.ss_family != AF_UNIX)
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+    // connect returns at once, the first bytes sent go with the SYN if the server gave a cookie before
+    if(fastopen && target.ss_family != AF_UNIX)
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &(int){1}, sizeof(int));
+
+    open_conns++;
+    conn->state = REPLAY_CONNECTING;
+    conn->connected = replay_now();
+    if(connect(conn->fd, (struct sockaddr*)&target, target_length) < 0 && errno != EINPROGRESS){
+        replay_finish(conn, 1);
+        return;
+    }
+    replay_watch(conn, EPOLL_CTL_ADD);
+}
+
+/**************************************************************
+    Summery:
+
+    Sends released bytes, and half closes the connection once
+    the recorded close is reached.
+
+    @PARAMS: connection
+    @returns: VOID
+**************************************************************/
+static void replay_send(struct replay_conn* conn){
+
+    if(conn->state != REPLAY_OPEN)
+        return;
+
+    while(conn->sent < conn->released){
+        ssize_t sent = send(conn->fd, conn->data+conn->sent, conn->released-conn->sent, MSG_NOSIGNAL);
+        if(sent < 0){
+            // EINPROGRESS while a Fast Open connect without data in the SYN completes
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS)
+                break;
+            replay_finish(conn, 1);
+            return;
+        }
+        conn->sent += sent;
+        bytes_sent += sent;
+    }
+
+    unsigned long long now = replay_now();
+    while(conn->requests_sent < conn->requestcount && conn->ends[conn->requests_sent] <= conn->sent)
+        conn->sent_times[conn->requests_sent++] = now;
+
+    if(conn->close_pending && conn->sent == conn->released){
+        shutdown(conn->fd, SHUT_WR);
+        conn->close_pending = 0;
+    }
+    replay_watch(conn, EPOLL_CTL_MOD);
+}
+
+/**************************************************************
+    Allows the next recorded chunk of a connection to be sent
+**************************************************************/
+static void replay_release(struct replay_conn* conn){
+    struct replay_chunk* chunk = &conn->chunks[conn->chunk++];
+    conn->released = chunk->end;
+    if(chunk->close)
+        conn->close_pending = 1;
+    replay_send(conn);
+}
+
+/**************************************************************
+    Summery:
+
+    Finds the end of a response header, lines may end with LF
+    or CRLF.
+
+    @PARAMS: data, length
+    @returns: length of the header, 0 if incomplete.
+**************************************************************/
+static size_t replay_header_end(char* data, size_t length){
+    for (size_t i = 0; i+1 < length; ++i)
+    {
+        if(data[i] != '\n')
+            continue;
+        if(data[i+1] == '\n')
+            return i+2;
+        if(data[i+1] == '\r' && i+2 < length && data[i+2] == '\n')
+            return i+3;
+    }
+    return 0;
+}
+
+static void replay_answered(struct replay_conn* conn, int status){
+    unsigned long long now = replay_now();
+    if(conn->answered < conn->requests_sent)
+        replay_latency(&latencies, now-conn->sent_times[conn->answered]);
+    if(conn->answered == 0)
+        replay_latency(&firsts, now-conn->connected);
+    statuses[status/100 < 6 ? status/100 : 0]++;
+    conn->answered++;
+    conn->response_state = RESPONSE_HEADER;
+}
+
+/**************************************************************
+    Summery:
+
+    Parses received responses, every complete response answers
+    the oldest request sent.
+
+    @PARAMS: connection
+    @returns: VOID
+**************************************************************/
+static void replay_responses(struct replay_conn* conn){
+
+    size_t position = 0;
+
+    while(position < conn->in_length){
+        char* data = conn->in+position;
+        size_t available = conn->in_length-position;
+
+        if(conn->response_state == RESPONSE_IGNORED || conn->response_state == RESPONSE_UNTIL_CLOSE){
+            position = conn->in_length;
+            break;
+        }
+
+        if(conn->response_state == RESPONSE_HEADER){
+            size_t header = replay_header_end(data, available);
+            if(header == 0)
+                break;
+            if(strncmp(data, "HTTP/1.", 7) != 0 || header < 12){
+                conn->response_state = RESPONSE_IGNORED;
+                continue;
+            }
+
+            char* copy = strndup(data, header);
+            conn->status = atoi(copy+9);
+            char* length_line = strcasestr(copy, "\ncontent-length:");
+            int chunked = strcasestr(copy, "\ntransfer-encoding:") != NULL && strcasestr(copy, "chunked") != NULL;
+            long length = length_line != NULL ? atol(length_line+16) : -1;
+            free(copy);
+            position += header;
+
+            if(conn->status >= 100 && conn->status < 200 && conn->status != 101)
+                continue;
+
+            int head = conn->answered < conn->requestcount && conn->head[conn->answered];
+            if(conn->status == 101){
+                replay_answered(conn, conn->status);
+                conn->response_state = RESPONSE_IGNORED;
+            } else if(head || conn->status == 204 || conn->status == 304 || length == 0){
+                replay_answered(conn, conn->status);
+            } else if(chunked){
+                conn->response_state = RESPONSE_CHUNK_SIZE;
+            } else if(length > 0){
+                conn->response_state = RESPONSE_BODY;
+                conn->remaining = length;
+            } else {
+                conn->response_state = RESPONSE_UNTIL_CLOSE;
+            }
+            continue;
+        }
+
+        if(conn->response_state == RESPONSE_BODY || conn->response_state == RESPONSE_CHUNK_DATA){
+            size_t part = available < conn->remaining ? available : conn->remaining;
+            position += part;
+            conn->remaining -= part;
+            if(conn->remaining > 0)
+                break;
+            if(conn->response_state == RESPONSE_BODY)
+                replay_answered(conn, conn->status);
+            else
+                conn->response_state = RESPONSE_CHUNK_END;
+            continue;
+        }
+
+        // chunked coding, line based
+        char* line_end = memchr(data, '\n', available);
+        if(line_end == NULL)
+            break;
+        size_t line = line_end-data+1;
+        position += line;
+
+        if(conn->response_state == RESPONSE_CHUNK_SIZE){
+            conn->remaining = strtoul(data, NULL, 16);
+            conn->response_state = conn->remaining == 0 ? RESPONSE_TRAILER : RESPONSE_CHUNK_DATA;
+        } else if(conn->response_state == RESPONSE_CHUNK_END){
+            conn->response_state = RESPONSE_CHUNK_SIZE;
+        } else if(conn->response_state == RESPONSE_TRAILER && (line == 1 || (line == 2 && data[0] == '\r'))){
+            replay_answered(conn, conn->status);
+        }
+    }
+
+    conn->in_length -= position;
+    memmove(conn->in, conn->in+position, conn->in_length);
+}
+
+/**************************************************************
+    Reads responses, the connection is done when the server closes
+**************************************************************/
+static void replay_receive(struct replay_conn* conn){
+
+    while(conn->state == REPLAY_OPEN){
+        if(conn->in_capacity-conn->in_length < 16384){
+            conn->in_capacity = conn->in_capacity == 0 ? 65536 : conn->in_capacity*2;
+            conn->in = realloc(conn->in, conn->in_capacity);
+        }
+
+        ssize_t received = recv(conn->fd, conn->in+conn->in_length, conn->in_capacity-conn->in_length, 0);
+        if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if(received <= 0){
+            // a response delimited by the close is complete now
+            if(conn->response_state == RESPONSE_UNTIL_CLOSE)
+                replay_answered(conn, 200);
+            replay_finish(conn, received < 0);
+            return;
+        }
+
+        bytes_received += received;
+        conn->in_length += received;
+        conn->received = replay_now();
+        replay_responses(conn);
+    }
+}
+
+/**************************************************************
+    Summery:
+
+    Closes a connection that has sent its whole recording and got
+    all answers. The server would keep it open until its idle
+    timeout. Responses to requests that are not timed are given a
+    second without new bytes.
+
+    @PARAMS: connection, current time
+    @returns: VOID
+**************************************************************/
+static void replay_check(struct replay_conn* conn, unsigned long long now){
+
+    if(conn->state != REPLAY_OPEN || conn->chunk < conn->chunkcount || conn->sent < conn->released)
+        return;
+    // after a recorded close the server closes
+    if(conn->chunkcount > 0 && conn->chunks[conn->chunkcount-1].close)
+        return;
+
+    if(conn->timed){
+        if(conn->answered >= conn->requests_sent && conn->response_state == RESPONSE_HEADER && conn->in_length == 0)
+            replay_finish(conn, 0);
+    } else if(now-conn->received > 1000000){
+        replay_finish(conn, 0);
+    }
+}
+
+static int replay_compare(const void* a, const void* b){
+    unsigned long long first = *(const unsigned long long*)a;
+    unsigned long long second = *(const unsigned long long*)b;
+    return first < second ? -1 : first > second;
+}
+
+static unsigned long long replay_percentile(struct replay_latencies* set, double percentile){
+    long index = (long)(percentile/100.0*(set->count-1)+0.5);
+    return set->values[index];
+}
+
+/**************************************************************
+    Prints min, percentiles and max of a sorted set
+**************************************************************/
+static void replay_report(char* label, struct replay_latencies* set){
+    if(set->count == 0)
+        return;
+    qsort(set->values, set->count, sizeof(unsigned long long), replay_compare);
+    printf("%s us: min %llu, p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, max %llu\n", label, set->values[0], replay_percentile(set, 50),
+        replay_percentile(set, 90), replay_percentile(set, 99), replay_percentile(set, 99.9), set->values[set->count-1]);
+}
+
+/**************************************************************
+    Parses host:port, [v6]:port or unix:/path into target
+**************************************************************/
+static int replay_target(char* address){
+
+    memset(&target, 0, sizeof(target));
+    if(strncmp(address, "unix:", 5) == 0){
+        struct sockaddr_un* un = (struct sockaddr_un*)&target;
+        un->sun_family = AF_UNIX;
+        snprintf(un->sun_path, sizeof(un->sun_path), "%s", address+5);
+        target_length = sizeof(struct sockaddr_un);
+        return 0;
+    }
+
+    char host[256];
+    char* port = strrchr(address, ':');
+    if(port == NULL || port == address || (size_t)(port-address) >= sizeof(host))
+        return -1;
+    size_t length = port-address;
+    memcpy(host, address, length);
+    host[length] = 0;
+    if(host[0] == '[' && host[length-1] == ']'){
+        memmove(host, host+1, length-2);
+        host[length-2] = 0;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* result;
+    if(getaddrinfo(host, port+1, &hints, &result) != 0)
+        return -1;
+    memcpy(&target, result->ai_addr, result->ai_addrlen);
+    target_length = result->ai_addrlen;
+    freeaddrinfo(result);
+    return 0;
+}
+
+int main(int argc, char* argv[]){
+
+    double speed = 1;
+    int concurrency = 64;
+
+    int option;
+    while((option = getopt(argc, argv, "s:c:f")) != -1){
+        if(option == 's')
+            speed = atof(optarg);
+        else if(option == 'c')
+            concurrency = atoi(optarg);
+        else if(option == 'f')
+            fastopen = 1;
+        else
+            optind = argc;
+    }
+
+    if(argc-optind < 2 || speed < 0 || concurrency < 1){
+        fprintf(stderr, "Usage: %s [-s speed, 0 for flat out] [-c connections] [-f, TCP Fast Open] host:port capture.rec...\n", argv[0]);
+        return 1;
+    }
+
+    if(replay_target(argv[optind]) < 0){
+        fprintf(stderr, "[ERROR] Invalid target %s\n", argv[optind]);
+        return 1;
+    }
+
+    for (int i = optind+1; i < argc; ++i)
+    {
+        if(replay_load(argv[i]) < 0)
+            return 1;
+    }
+    if(conncount == 0){
+        fprintf(stderr, "[ERROR] No connections in capture\n");
+        return 1;
+    }
+
+    unsigned long long capture_start = conns[0].open_time;
+    for (int i = 0; i < conncount; ++i)
+    {
+        replay_requests(&conns[i]);
+        if(conns[i].open_time < capture_start)
+            capture_start = conns[i].open_time;
+    }
+    // connections are started in the order they were opened
+    if(speed > 0)
+        replay_schedule(capture_start);
+
+    epoll_fd = epoll_create1(0);
+    signal(SIGPIPE, SIG_IGN);
+
+    unsigned long long start = replay_now();
+    unsigned long long last_progress = start;
+    unsigned long long last_check = start;
+    int next_event = 0;
+    int next_conn = 0;
+    struct epoll_event ready[256];
+
+    while(done_conns < conncount){
+
+        unsigned long long now = replay_now();
+        int timeout = 1000;
+
+        if(speed > 0){
+            while(next_event < eventcount){
+                struct replay_event* event = &events[next_event];
+                unsigned long long due = start+(unsigned long long)(event->time/speed);
+                if(due > now){
+                    timeout = (due-now+999)/1000;
+                    break;
+                }
+                struct replay_conn* conn = &conns[event->conn];
+                if(event->chunk < 0)
+                    replay_open(conn);
+                else if(conn->state != REPLAY_DONE)
+                    replay_release(conn);
+                next_event++;
+            }
+        } else {
+            while(open_conns < concurrency && next_conn < conncount)
+                replay_open(&conns[next_conn++]);
+        }
+
+        int count = epoll_wait(epoll_fd, ready, 256, timeout);
+        if(count < 0 && errno != EINTR){
+            perror("epoll_wait");
+            return 1;
+        }
+
+        now = replay_now();
+        if(count > 0)
+            last_progress = now;
+
+        for (int i = 0; i < count; ++i)
+        {
+            struct replay_conn* conn = &conns[ready[i].data.u32];
+            if(conn->state == REPLAY_DONE)
+                continue;
+
+            if(conn->state == REPLAY_CONNECTING && (ready[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))){
+                int error = 0;
+                socklen_t length = sizeof(error);
+                getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+                if(error != 0){
+                    replay_finish(conn, 1);
+                    continue;
+                }
+                conn->state = REPLAY_OPEN;
+                replay_send(conn);
+            }
+
+            if(ready[i].events & EPOLLOUT)
+                replay_send(conn);
+            if(ready[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                replay_receive(conn);
+            if(conn->state != REPLAY_OPEN)
+                continue;
+
+            // flat out, the next chunk follows once everything before it is answered
+            while(speed == 0 && conn->state == REPLAY_OPEN && conn->sent == conn->released && conn->chunk < conn->chunkcount
+                && (!conn->timed || conn->answered == conn->requests_sent))
+                replay_release(conn);
+            replay_check(conn, now);
+        }
+
+        // connections without timing are checked once a second
+        if(now-last_check > 1000000){
+            last_check = now;
+            for (int i = 0; i < conncount; ++i)
+                replay_check(&conns[i], now);
+        }
+
+        if(now-last_progress > REPLAY_IDLE_TIMEOUT*1000000ull){
+            fprintf(stderr, "[ERROR] No progress for %d seconds, stopping.\n", REPLAY_IDLE_TIMEOUT);
+            for (int i = 0; i < conncount; ++i)
+                replay_finish(&conns[i], 1);
+        }
+    }
+
+    double seconds = (replay_now()-start)/1000000.0;
+    long responses = statuses[1]+statuses[2]+statuses[3]+statuses[4]+statuses[5];
+
+    printf("connections %d, responses %ld, errors %ld\n", conncount, responses, errors);
+    printf("duration %.2f s, %.1f responses/s, sent %.2f MB, received %.2f MB, %.2f MB/s\n", seconds, responses/seconds,
+        bytes_sent/1e6, bytes_received/1e6, bytes_received/1e6/seconds);
+    printf("status 1xx %ld, 2xx %ld, 3xx %ld, 4xx %ld, 5xx %ld\n", statuses[1], statuses[2], statuses[3], statuses[4], statuses[5]);
+
+    replay_report("latency", &latencies);
+    replay_report("first response", &firsts);
+
+    return errors > 0;
+}
@@ -22,10 +22,9 @@ void login(){
     char* username = http_get_parameter("username", 0);
     char* password = http_get_parameter("password", 0);
 
-    if(strcmp(username, "joe") == 0 && strcmp(password, "123") == 0){
-
-
-        http_add_cookie("login", "true");
+    if(username != NULL && password != NULL && strcmp(username, "joe") == 0 && strcmp(password, "123") == 0){
+        // kept server side, shared by all workers
+        http_session_set("user", username);
 
         http_redirect("/?success=1");
         return;
@@ -34,14 +33,161 @@ void login(){
     http_redirect("/?success=0");
 }
 
+// user of the session started by login
+void me(){
+    char* user = http_session_get("user");
+    http_sendtext(user != NULL ? user : "not logged in");
+}
+
+// chat example, every text message is sent to all sockets of the route
+void chat(struct websocket* ws, int opcode, char* data, size_t length){
+    if(opcode != WEBSOCKET_TEXT){
+        websocket_close(ws, WEBSOCKET_POLICY_VIOLATION);
+        return;
+    }
+    websocket_broadcast("/chat", opcode, data, length);
+}
+
+// template example, compiled once in main
+struct http_template* hello_template;
+void hello(){
+    static const char* const topics[] = { "epoll", "sendfile", "<templates>" };
+
+    char* name = http_get_parameter("name", 0);
+
+    struct http_template_args args;
+    http_template_args(&args, hello_template);
+    http_template_set(&args, "name", name != NULL ? name : "world");
+    // fingerprinted, cached by the browser until the file changes
+    http_template_set(&args, "icon", http_asset_url("/www/favicon.ico"));
+    http_template_set_list(&args, "topics", topics, 3);
+    http_sendtemplate(&args);
+}
+
+// load of each worker, see http_set_workers
+void workers(){
+    char stats[4096];
+    http_worker_stats(stats, sizeof(stats));
+    http_sendtext(stats);
+}
+
+// connections per listener, see http_listen
+void listeners(){
+    char stats[2048];
+    http_listen_stats(stats, sizeof(stats));
+    http_sendtext(stats);
+}
+
+// I/O buffers in use per size class, see http_pool.c
+void pool(){
+    char stats[1024];
+    http_pool_stats(stats, sizeof(stats));
+    http_sendtext(stats);
+}
+
+// hardware counters per route and phase, see http_set_perf
+void perf(){
+    char report[16384];
+    http_perf_report(report, sizeof(report));
+    http_sendtext(report);
+}
+
+// queueing delay per priority class, see http_set_priority
+void sched(){
+    char stats[1024];
+    http_sched_stats(stats, sizeof(stats));
+    http_sendtext(stats);
+}
+
+// descriptor cache and read ahead, see http_set_files
+void files(){
+    char stats[512];
+    http_files_stats(stats, sizeof(stats));
+    http_sendtext(stats);
+}
+
+// requests answered with the response of an identical request, see http_set_coalesce
+void coalesce(){
+    char stats[512];
+    http_coalesce_stats(stats, sizeof(stats));
+    http_sendtext(stats);
+}
+
+// phases of traced connections as Chrome trace JSON, see http_set_trace
+void trace(){
+    size_t length;
+    char* json = http_trace_json(&length);
+    http_sendtext(json != NULL ? json : "");
+    free(json);
+}
+
 int main()
 {
 
     http_addroute("GET", "/", &home);
     http_addroute("POST", "/login", &login);
     http_addroute("GET", "/text", &text);
+    http_addroute("GET", "/me", &me);
     http_addroute("GET", "/favicon.ico", &favicon);
+    hello_template = http_template_compile("<link rel=\"icon\" href=\"{{icon}}\"><h1>Hello {{name}}</h1><ul>{{#topics}}<li>{{.}}</li>{{/topics}}</ul>");
+    http_addroute("GET", "/hello", &hello);
+    http_addroute("GET", "/workers", &workers);
+    http_addroute("GET", "/trace", &trace);
+    http_addroute("GET", "/listeners", &listeners);
+    http_addroute("GET", "/pool", &pool);
+    http_addroute("GET", "/perf", &perf);
+    http_addroute("GET", "/sched", &sched);
+    http_addroute("GET", "/files", &files);
+    http_addroute("GET", "/coalesce", &coalesce);
     http_addfolder("/");
+    // files of www get fingerprinted URLs that are cached forever, see http_asset_url
+    http_set_assets("/www");
+
+    // short requests go before downloads, which send 256KB per turn
+    // http_set_priority("/text", HTTP_PRIORITY_INTERACTIVE);
+    // http_set_priority("/", HTTP_PRIORITY_BULK);
+
+    // identical /hello requests handled at the same time share one response,
+    // workers wait up to 500ms for the one running it
+    // http_set_coalesce("/hello", "name,Accept-Language:", 500);
+
+    // open files and read cold ones on 4 I/O threads, keeping 1024 descriptors
+    // http_set_files(4, 1024);
+
+    http_addwebsocket("/chat", NULL, &chat, NULL);
+
+    // forward /api to a local backend, several upstreams are balanced
+    // http_addproxy("/api", "127.0.0.1:9000");
+    // http_addproxy("/api", "unix:/tmp/backend.sock");
+
+    // HTTPS on 8443, "make cert" creates a self signed test certificate
+    // http_addtls(8443, "cert.pem", "key.pem");
+
+    // local clients skip TCP over a Unix socket, IPv6 clients get their own listener
+    // http_listen("unix:/tmp/httpserver.sock", 0);
+    // http_listen("[::1]:8082", 0);
+
+    // socket tuning of TCP listeners, "default", "latency" or "throughput"
+    // HTTP_TUNING=latency ./server to compare profiles with the replay tool
+    http_set_tuning(getenv("HTTP_TUNING"));
+
+    // up to 4096 sessions shared by all workers, expiring after an hour without use
+    http_set_sessions(4096, 3600);
+
+    // trace 1 of 100 connections, "kill -USR2" writes trace-<pid>.json
+    // http_set_trace(100);
+
+    // record received traffic to capture-<pid>.rec, up to 64MB, "make replay" builds the replay tool
+    // http_set_record("capture", 64*1024*1024);
+
+    // I/O buffers on huge pages
+    // http_set_pool(1);
+
+    // read cycles, instructions and misses around the phases of 1 in 10 requests, written to perf-<pid>.txt on exit
+    // http_set_perf(10);
+
+    // one worker per CPU, connections are steered to the worker of the CPU they arrive on
+    // http_set_workers(4, 1);
 
     // http_start(PORT, DEBUG)
     http_start(8081, 1);
@@ -1,3 +1,6 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <sys/socket.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -8,3 +11,12 @@
 #include <math.h>
 #include <signal.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
@@ -12,4 +12,146 @@ char* find_content_type(char* file_ext){
         return "text/plain";
     }
     return NULL;
-}
\ No newline at end of file
+}
+/*
+    Decodes base64, both the standard and the URL safe alphabet.
+    Padding is optional. Returns number of bytes written, -1 on error.
+*/
+int base64_decode(const char* in, size_t length, unsigned char* out){
+    unsigned int bits = 0;
+    int count = 0;
+    int written = 0;
+
+    for (size_t i = 0; i < length; ++i)
+    {
+        char c = in[i];
+        int value;
+        if(c >= 'A' && c <= 'Z')
+            value = c-'A';
+        else if(c >= 'a' && c <= 'z')
+            value = c-'a'+26;
+        else if(c >= '0' && c <= '9')
+            value = c-'0'+52;
+        else if(c == '+' || c == '-')
+            value = 62;
+        else if(c == '/' || c == '_')
+            value = 63;
+        else if(c == '=')
+            break;
+        else
+            return -1;
+
+        bits = (bits << 6) | value;
+        count += 6;
+        if(count >= 8){
+            count -= 8;
+            out[written] = (bits >> count) & 0xff;
+            written++;
+        }
+    }
+    return written;
+}
+/*
+    Encodes base64 with padding, out needs room for 4*((length+2)/3)+1
+    bytes. Returns length of the zero terminated output.
+*/
+int base64_encode(const unsigned char* in, size_t length, char* out){
+    const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    int written = 0;
+
+    for (size_t i = 0; i < length; i += 3)
+    {
+        unsigned int bits = in[i] << 16;
+        if(i+1 < length)
+            bits |= in[i+1] << 8;
+        if(i+2 < length)
+            bits |= in[i+2];
+
+        out[written++] = alphabet[(bits >> 18) & 0x3f];
+        out[written++] = alphabet[(bits >> 12) & 0x3f];
+        out[written++] = i+1 < length ? alphabet[(bits >> 6) & 0x3f] : '=';
+        out[written++] = i+2 < length ? alphabet[bits & 0x3f] : '=';
+    }
+    out[written] = 0;
+    return written;
+}
+
+static unsigned int sha1_rotate(unsigned int value, int bits){
+    return (value << bits) | (value >> (32-bits));
+}
+
+/*
+    Processes one 64 byte block
+*/
+static void sha1_block(unsigned int state[5], const unsigned char* block){
+    unsigned int w[80];
+    for (int i = 0; i < 16; ++i)
+        w[i] = ((unsigned int)block[i*4] << 24) | (block[i*4+1] << 16) | (block[i*4+2] << 8) | block[i*4+3];
+    for (int i = 16; i < 80; ++i)
+        w[i] = sha1_rotate(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+    unsigned int a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    for (int i = 0; i < 80; ++i)
+    {
+        unsigned int f, k;
+        if(i < 20){
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        } else if(i < 40){
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if(i < 60){
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        unsigned int temp = sha1_rotate(a, 5)+f+e+k+w[i];
+        e = d;
+        d = c;
+        c = sha1_rotate(b, 30);
+        b = a;
+        a = temp;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+/*
+    SHA-1 digest (RFC 3174), used for the WebSocket handshake.
+*/
+void sha1(const unsigned char* data, size_t length, unsigned char digest[20]){
+    unsigned int state[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+
+    size_t offset = 0;
+    for (; offset+64 <= length; offset += 64)
+        sha1_block(state, data+offset);
+
+    // last block with padding and message length in bits
+    unsigned char block[128];
+    size_t rest = length-offset;
+    memset(block, 0, sizeof(block));
+    memcpy(block, data+offset, rest);
+    block[rest] = 0x80;
+
+    size_t blocks = rest+9 > 64 ? 2 : 1;
+    unsigned long long bits = (unsigned long long)length*8;
+    for (int i = 0; i < 8; ++i)
+        block[blocks*64-1-i] = (bits >> (i*8)) & 0xff;
+
+    for (size_t i = 0; i < blocks; ++i)
+        sha1_block(state, block+i*64);
+
+    for (int i = 0; i < 5; ++i)
+    {
+        digest[i*4] = (state[i] >> 24) & 0xff;
+        digest[i*4+1] = (state[i] >> 16) & 0xff;
+        digest[i*4+2] = (state[i] >> 8) & 0xff;
+        digest[i*4+3] = state[i] & 0xff;
+    }
+}
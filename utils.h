@@ -1,6 +1,8 @@
 #ifndef __UTILS_H
 #define __UTILS_H
 
+#include <stddef.h>
+
 // colors
 #define KNRM  "\x1B[0m"
 #define KRED  "\x1B[31m"
@@ -13,5 +15,8 @@
 
 
 char* find_content_type(char* file_ext);
+int base64_decode(const char* in, size_t length, unsigned char* out);
+int base64_encode(const unsigned char* in, size_t length, char* out);
+void sha1(const unsigned char* data, size_t length, unsigned char digest[20]);
 
 #endif
\ No newline at end of file
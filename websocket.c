@@ -0,0 +1,514 @@
+#include "http_server.h"
+
+/*
+    WebSocket connections
+    https://datatracker.ietf.org/doc/html/rfc6455
+
+    A GET request to a websocket route with "Upgrade: websocket" is
+    answered with 101 and the connection stays in the event loop,
+    now parsing frames instead of requests. Messages are handed to
+    the route callbacks, sends are queued on the connection output
+    queue like any response.
+
+    Broadcasts encode the frame once into a shared buffer that is
+    queued on every socket of the route without copying.
+*/
+
+struct websocket_route websocket_routes[NUMBER_OF_WEBSOCKETS];
+int websocket_routecounter = 0;
+
+
+/**************************************************************
+    Summery:
+
+    Adds a websocket route. Any callback may be NULL.
+    on_message receives complete messages, fragments are joined,
+    data is zero terminated.
+
+    @PARAMS: path, open callback, message callback, close callback
+    @returns: number of websocket routes, -1 on error.
+**************************************************************/
+int http_addwebsocket(char* path, void (*on_open)(struct websocket* ws), void (*on_message)(struct websocket* ws, int opcode, char* data, size_t length), void (*on_close)(struct websocket* ws)){
+
+    if(websocket_routecounter == NUMBER_OF_WEBSOCKETS)
+        return -1;
+
+    struct websocket_route* route = &websocket_routes[websocket_routecounter];
+    route->path = path;
+    route->on_open = on_open;
+    route->on_message = on_message;
+    route->on_close = on_close;
+    route->sockets = NULL;
+    route->total = 0;
+
+    websocket_routecounter++;
+    return websocket_routecounter;
+}
+
+/**************************************************************
+    Returns websocket route of given path, NULL if none
+**************************************************************/
+static struct websocket_route* websocket_find_route(const char* path, size_t length){
+    for (int i = 0; i < websocket_routecounter; ++i)
+    {
+        if(strlen(websocket_routes[i].path) == length && strncmp(websocket_routes[i].path, path, length) == 0)
+            return &websocket_routes[i];
+    }
+    return NULL;
+}
+
+/**************************************************************
+    Summery:
+
+    Writes a frame header. Server frames are never masked.
+
+    @PARAMS: output (10 bytes), opcode, payload length
+    @returns: header length.
+**************************************************************/
+static int websocket_frame_header(unsigned char* out, int opcode, size_t length){
+    out[0] = 0x80 | opcode;
+    if(length < 126){
+        out[1] = length;
+        return 2;
+    }
+    if(length <= 0xffff){
+        out[1] = 126;
+        out[2] = (length >> 8) & 0xff;
+        out[3] = length & 0xff;
+        return 4;
+    }
+    out[1] = 127;
+    for (int i = 0; i < 8; ++i)
+        out[2+i] = ((unsigned long long)length >> ((7-i)*8)) & 0xff;
+    return 10;
+}
+
+/**************************************************************
+    Summery:
+
+    Sends queued output right away, so sends to sockets other than
+    the one being handled do not wait for the next loop iteration.
+    Slow consumers with too much output queued are disconnected.
+
+    @PARAMS: connection
+    @returns: void
+**************************************************************/
+static void websocket_flush(struct http_conn* conn){
+    if(http_conn_flush(conn) < 0)
+        conn->closing = 1;
+    http_update_events(conn);
+}
+
+/**************************************************************
+    Summery:
+
+    Sends a message as a single frame.
+
+    @PARAMS: websocket, opcode, data, length of data
+    @returns: bytes queued, -1 on error.
+**************************************************************/
+int websocket_send(struct websocket* ws, int opcode, const char* data, size_t length){
+
+    if(ws->close_sent || ws->conn->closing)
+        return -1;
+
+    if(ws->conn->out_queued > WEBSOCKET_MAX_QUEUED){
+        websocket_close(ws, WEBSOCKET_POLICY_VIOLATION);
+        return -1;
+    }
+
+    unsigned char header[10];
+    int header_length = websocket_frame_header(header, opcode, length);
+    http_conn_queue_buffer(ws->conn, (char*)header, header_length);
+    http_conn_queue_buffer(ws->conn, data, length);
+
+    websocket_flush(ws->conn);
+    return length;
+}
+
+/**************************************************************
+    Summery:
+
+    Sends a message to every open socket of a websocket route.
+    The frame is encoded once and shared by all sockets.
+
+    @PARAMS: path of route, opcode, data, length of data
+    @returns: number of sockets the message was queued on, -1 on error.
+**************************************************************/
+int websocket_broadcast(char* path, int opcode, const char* data, size_t length){
+
+    struct websocket_route* route = websocket_find_route(path, strlen(path));
+    if(route == NULL)
+        return -1;
+
+    unsigned char header[10];
+    int header_length = websocket_frame_header(header, opcode, length);
+
+    struct http_shared* frame = http_shared_new(header_length+length);
+    if(frame == NULL)
+        return -1;
+    memcpy(frame->data, header, header_length);
+    memcpy(frame->data+header_length, data, length);
+
+    int total = 0;
+    struct websocket* ws = route->sockets;
+    while(ws != NULL){
+        struct websocket* next = ws->next;
+
+        if(!ws->close_sent && !ws->conn->closing){
+            if(ws->conn->out_queued > WEBSOCKET_MAX_QUEUED){
+                websocket_close(ws, WEBSOCKET_POLICY_VIOLATION);
+            } else {
+                http_conn_queue_shared(ws->conn, frame);
+                websocket_flush(ws->conn);
+                total++;
+            }
+        }
+        ws = next;
+    }
+
+    http_shared_release(frame);
+    return total;
+}
+
+/**************************************************************
+    Summery:
+
+    Sends a close frame with given status code, the connection is
+    closed once it has been sent.
+
+    @PARAMS: websocket, close code
+    @returns: void
+**************************************************************/
+void websocket_close(struct websocket* ws, int code){
+
+    if(ws->close_sent)
+        return;
+
+    unsigned char frame[4];
+    frame[0] = 0x80 | WEBSOCKET_CLOSE;
+    frame[1] = 2;
+    frame[2] = (code >> 8) & 0xff;
+    frame[3] = code & 0xff;
+    http_conn_queue_buffer(ws->conn, (char*)frame, 4);
+
+    ws->close_sent = 1;
+    ws->conn->closing = 1;
+    websocket_flush(ws->conn);
+}
+
+/**************************************************************
+    Summery:
+
+    Completes the opening handshake if the request at the start
+    of the buffer is a GET to a websocket route with
+    "Upgrade: websocket". Other requests are left to the
+    regular handlers.
+
+    @PARAMS: connection, length of request header
+    @returns: 1 if upgraded, else 0.
+**************************************************************/
+int websocket_upgrade(struct http_conn* conn, long header_length){
+
+    if(websocket_routecounter == 0 || strncmp(conn->in, "GET ", 4) != 0)
+        return 0;
+
+    char* path = conn->in+4;
+    size_t path_length = strcspn(path, " ?\r\n");
+    struct websocket_route* route = websocket_find_route(path, path_length);
+    if(route == NULL)
+        return 0;
+
+    char* end = conn->in+header_length-2;
+    *end = 0;
+
+    char* upgrade = strcasestr(conn->in, "\nUpgrade:");
+    char* key = strcasestr(conn->in, "\nSec-WebSocket-Key:");
+    char* version = strcasestr(conn->in, "\nSec-WebSocket-Version:");
+
+    int websocket = upgrade != NULL && strncasecmp(upgrade+9+strspn(upgrade+9, " "), "websocket", 9) == 0;
+
+    // accept key is the SHA-1 of the client key and the protocol GUID
+    char accept[32];
+    int valid = 0;
+    if(websocket && key != NULL && version != NULL && atoi(version+23) == 13){
+        char* value = key+19+strspn(key+19, " ");
+        size_t value_length = strcspn(value, " \r\n");
+
+        if(value_length > 0 && value_length <= 64){
+            unsigned char input[64+sizeof(WEBSOCKET_GUID)];
+            memcpy(input, value, value_length);
+            memcpy(input+value_length, WEBSOCKET_GUID, strlen(WEBSOCKET_GUID));
+
+            unsigned char digest[20];
+            sha1(input, value_length+strlen(WEBSOCKET_GUID), digest);
+            base64_encode(digest, 20, accept);
+            valid = 1;
+        }
+    }
+    *end = '\r';
+
+    if(!websocket)
+        return 0;
+
+    if(!valid){
+        http_400(conn->fd);
+        conn->closing = 1;
+        return 1;
+    }
+
+    char response[160];
+    int length = snprintf(response, sizeof(response), "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept);
+    http_conn_queue_buffer(conn, response, length);
+
+    struct websocket* ws = calloc(1, sizeof(struct websocket));
+    if(ws == NULL){
+        conn->closing = 1;
+        return 1;
+    }
+    ws->conn = conn;
+    ws->route = route;
+    ws->last_received = time(NULL);
+    ws->last_ping = ws->last_received;
+
+    ws->next = route->sockets;
+    if(route->sockets != NULL)
+        route->sockets->prev = ws;
+    route->sockets = ws;
+    route->total++;
+
+    conn->ws = ws;
+    conn->requests++;
+    conn->in_length -= header_length;
+    memmove(conn->in, conn->in+header_length, conn->in_length);
+
+    if(debug)
+        printf(KMAG "[DEBUG] FD: %d upgraded to WebSocket on %s, %d open.\n" KWHT, conn->fd, route->path, route->total);
+
+    if(route->on_open != NULL)
+        route->on_open(ws);
+
+    websocket_process(conn);
+    return 1;
+}
+
+/**************************************************************
+    Summery:
+
+    Hands a complete message to the route callback. The byte after
+    the message is zero terminated for the callback and restored.
+
+    @PARAMS: websocket, opcode, data, length
+    @returns: void
+**************************************************************/
+static void websocket_deliver(struct websocket* ws, int opcode, char* data, size_t length){
+    if(ws->route->on_message == NULL)
+        return;
+
+    char next = data[length];
+    data[length] = 0;
+    ws->route->on_message(ws, opcode, data, length);
+    data[length] = next;
+}
+
+/**************************************************************
+    Summery:
+
+    Handles one unmasked frame.
+
+    @PARAMS: websocket, final fragment, opcode, payload, payload length
+    @returns: 0 on success, -1 if the connection is closing.
+**************************************************************/
+static int websocket_frame(struct websocket* ws, int fin, int opcode, char* payload, size_t length){
+
+    // control frames may arrive between fragments of a message
+    if(opcode & 0x8){
+        if(!fin || length > 125){
+            websocket_close(ws, WEBSOCKET_PROTOCOL_ERROR);
+            return -1;
+        }
+
+        switch(opcode){
+            case WEBSOCKET_PING:
+                websocket_send(ws, WEBSOCKET_PONG, payload, length);
+                return 0;
+            case WEBSOCKET_PONG:
+                return 0;
+            case WEBSOCKET_CLOSE:
+                websocket_close(ws, length >= 2 ? ((unsigned char)payload[0] << 8) | (unsigned char)payload[1] : WEBSOCKET_NORMAL);
+                return -1;
+            default:
+                websocket_close(ws, WEBSOCKET_PROTOCOL_ERROR);
+                return -1;
+        }
+    }
+
+    if(opcode == WEBSOCKET_CONTINUATION){
+        if(ws->message_opcode == 0){
+            websocket_close(ws, WEBSOCKET_PROTOCOL_ERROR);
+            return -1;
+        }
+    } else if(opcode == WEBSOCKET_TEXT || opcode == WEBSOCKET_BINARY){
+        if(ws->message_opcode != 0){
+            websocket_close(ws, WEBSOCKET_PROTOCOL_ERROR);
+            return -1;
+        }
+
+        // unfragmented messages are handed over from the input buffer
+        if(fin){
+            websocket_deliver(ws, opcode, payload, length);
+            return 0;
+        }
+        ws->message_opcode = opcode;
+    } else {
+        websocket_close(ws, WEBSOCKET_PROTOCOL_ERROR);
+        return -1;
+    }
+
+    if(ws->message_length+length > WEBSOCKET_MAX_MESSAGE){
+        websocket_close(ws, WEBSOCKET_TOO_BIG);
+        return -1;
+    }
+
+    // keep room for the terminating zero byte
+    char* message = realloc(ws->message, ws->message_length+length+1);
+    if(message == NULL){
+        websocket_close(ws, WEBSOCKET_TOO_BIG);
+        return -1;
+    }
+    memcpy(message+ws->message_length, payload, length);
+    ws->message = message;
+    ws->message_length += length;
+
+    if(fin){
+        websocket_deliver(ws, ws->message_opcode, ws->message, ws->message_length);
+        free(ws->message);
+        ws->message = NULL;
+        ws->message_length = 0;
+        ws->message_opcode = 0;
+    }
+    return 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Handles all complete frames buffered on the connection.
+    Client frames must be masked, they are unmasked in place.
+
+    @PARAMS: connection
+    @returns: void
+**************************************************************/
+void websocket_process(struct http_conn* conn){
+
+    struct websocket* ws = conn->ws;
+    size_t offset = 0;
+
+    ws->last_received = time(NULL);
+
+    while(!conn->closing && conn->in_length-offset >= 2){
+
+        unsigned char* frame = (unsigned char*)conn->in+offset;
+        size_t available = conn->in_length-offset;
+
+        int fin = frame[0] & 0x80;
+        int opcode = frame[0] & 0x0f;
+        unsigned long long length = frame[1] & 0x7f;
+        size_t header = 2;
+
+        if(length == 126){
+            if(available < 4)
+                break;
+            length = (frame[2] << 8) | frame[3];
+            header = 4;
+        } else if(length == 127){
+            if(available < 10)
+                break;
+            length = 0;
+            for (int i = 0; i < 8; ++i)
+                length = (length << 8) | frame[2+i];
+            header = 10;
+        }
+
+        // no extensions are negotiated, reserved bits must be clear
+        if((frame[0] & 0x70) || !(frame[1] & 0x80)){
+            websocket_close(ws, WEBSOCKET_PROTOCOL_ERROR);
+            break;
+        }
+        if(length > WEBSOCKET_MAX_MESSAGE){
+            websocket_close(ws, WEBSOCKET_TOO_BIG);
+            break;
+        }
+        if(available < header+4+length)
+            break;
+
+        unsigned char* mask = frame+header;
+        char* payload = (char*)frame+header+4;
+        for (size_t i = 0; i < length; ++i)
+            payload[i] ^= mask[i & 3];
+
+        offset += header+4+length;
+        if(websocket_frame(ws, fin, opcode, payload, length) < 0)
+            break;
+    }
+
+    conn->in_length -= offset;
+    memmove(conn->in, conn->in+offset, conn->in_length);
+
+    conn->reading_paused = conn->out_queued >= http_get_highwater();
+}
+
+/**************************************************************
+    Summery:
+
+    Pings sockets that have been silent for WEBSOCKET_PING_INTERVAL
+    and reports those silent for WEBSOCKET_TIMEOUT as expired.
+    Called from the timeout sweep.
+
+    @PARAMS: connection, current time
+    @returns: 1 if connection should be closed, else 0.
+**************************************************************/
+int websocket_idle(struct http_conn* conn, time_t now){
+
+    struct websocket* ws = conn->ws;
+    if(now-ws->last_received >= WEBSOCKET_TIMEOUT)
+        return 1;
+
+    if(now-ws->last_received >= WEBSOCKET_PING_INTERVAL && now-ws->last_ping >= WEBSOCKET_PING_INTERVAL){
+        ws->last_ping = now;
+        websocket_send(ws, WEBSOCKET_PING, NULL, 0);
+    }
+    return 0;
+}
+
+/**************************************************************
+    Summery:
+
+    Frees the websocket state of a connection that is being
+    closed and runs the close callback.
+
+    @PARAMS: connection
+    @returns: void
+**************************************************************/
+void websocket_closed(struct http_conn* conn){
+
+    struct websocket* ws = conn->ws;
+    struct websocket_route* route = ws->route;
+
+    // nothing can be sent anymore, also not from the callback
+    ws->close_sent = 1;
+    if(route->on_close != NULL)
+        route->on_close(ws);
+
+    if(ws->prev != NULL)
+        ws->prev->next = ws->next;
+    else
+        route->sockets = ws->next;
+    if(ws->next != NULL)
+        ws->next->prev = ws->prev;
+    route->total--;
+
+    free(ws->message);
+    free(ws);
+    conn->ws = NULL;
+}
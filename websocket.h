@@ -0,0 +1,76 @@
+#ifndef __WEBSOCKET_H
+#define __WEBSOCKET_H
+
+#include "syshead.h"
+#include "http_conn.h"
+
+#define NUMBER_OF_WEBSOCKETS 16 // websocket routes
+#define WEBSOCKET_PING_INTERVAL 30 // seconds of silence before the server pings
+#define WEBSOCKET_TIMEOUT 75 // seconds of silence before the connection is closed
+#define WEBSOCKET_MAX_MESSAGE (512*1024) // largest message, fragments included
+#define WEBSOCKET_MAX_QUEUED (4*1024*1024) // slow consumers above this are disconnected
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+// opcodes
+#define WEBSOCKET_CONTINUATION 0x0
+#define WEBSOCKET_TEXT 0x1
+#define WEBSOCKET_BINARY 0x2
+#define WEBSOCKET_CLOSE 0x8
+#define WEBSOCKET_PING 0x9
+#define WEBSOCKET_PONG 0xa
+
+// close codes
+#define WEBSOCKET_NORMAL 1000
+#define WEBSOCKET_GOING_AWAY 1001
+#define WEBSOCKET_PROTOCOL_ERROR 1002
+#define WEBSOCKET_POLICY_VIOLATION 1008
+#define WEBSOCKET_TOO_BIG 1009
+
+struct websocket;
+
+struct websocket_route
+{
+	char* path;
+	void (*on_open)(struct websocket* ws);
+	void (*on_message)(struct websocket* ws, int opcode, char* data, size_t length);
+	void (*on_close)(struct websocket* ws);
+
+	struct websocket* sockets; // open sockets, for broadcasts
+	int total;
+};
+
+/*
+    State of an upgraded connection. Kept small, an idle socket
+    costs this struct, its http_conn and an empty input buffer.
+*/
+struct websocket
+{
+	struct http_conn* conn;
+	struct websocket_route* route;
+	void* data; // free for the application
+
+	// fragmented message being assembled
+	char* message;
+	size_t message_length;
+	int message_opcode;
+
+	int close_sent;
+	time_t last_received;
+	time_t last_ping;
+
+	struct websocket* prev;
+	struct websocket* next;
+};
+
+int http_addwebsocket(char* path, void (*on_open)(struct websocket* ws), void (*on_message)(struct websocket* ws, int opcode, char* data, size_t length), void (*on_close)(struct websocket* ws));
+int websocket_send(struct websocket* ws, int opcode, const char* data, size_t length);
+int websocket_broadcast(char* path, int opcode, const char* data, size_t length);
+void websocket_close(struct websocket* ws, int code);
+
+int websocket_upgrade(struct http_conn* conn, long header_length);
+void websocket_process(struct http_conn* conn);
+int websocket_idle(struct http_conn* conn, time_t now);
+void websocket_closed(struct http_conn* conn);
+
+#endif